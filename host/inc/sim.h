@@ -0,0 +1,43 @@
+#ifndef _SIM_H
+#define _SIM_H
+
+#include "stm32g4xx_hal.h"
+
+// Statistics of the data sent to the host over the simulated USB CDC
+struct sim_usb_stats
+{
+    uint64_t bytes;         // Bytes sent to host
+    uint32_t transfers;     // Number of CDC transfers
+    uint32_t lines;         // Number of CR terminated responses and binary records
+    uint32_t bells;         // Number of BELL (error) responses
+    uint32_t hash;          // FNV-1a hash of the whole stream
+};
+
+// Statistics of the simulated CAN bus
+struct sim_fdcan_stats
+{
+    uint32_t rx_frames;     // Frames stored in one of the Rx FIFOs
+    uint32_t rx_lost;       // Frames lost on Rx FIFO overflow
+    uint32_t tx_frames;     // Frames transmitted from the Tx FIFO
+    uint32_t tx_evt_lost;   // Tx events lost on Tx event FIFO overflow
+};
+
+// Prototypes
+void sim_init(void);
+uint64_t sim_get_time_ns(void);
+uint64_t sim_get_cycles(void);
+uint8_t sim_nvic_is_enabled(IRQn_Type IRQn);
+
+HAL_StatusTypeDef sim_fdcan_inject(FDCAN_RxHeaderTypeDef *header, uint8_t *data);
+HAL_StatusTypeDef sim_fdcan_inject_tx_event(FDCAN_TxEventFifoTypeDef *event);
+uint32_t sim_fdcan_get_rx_free_level(uint32_t fifo);
+uint32_t sim_fdcan_bus_step(void);
+void sim_fdcan_clear_stats(void);
+struct sim_fdcan_stats sim_fdcan_get_stats(void);
+
+uint32_t sim_usb_receive(const uint8_t *data, uint32_t len);
+uint8_t sim_usb_is_rx_empty(void);
+void sim_usb_clear_stats(void);
+struct sim_usb_stats sim_usb_get_stats(void);
+
+#endif // _SIM_H
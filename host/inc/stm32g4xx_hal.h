@@ -0,0 +1,27 @@
+#ifndef _HOST_STM32G4XX_HAL_H
+#define _HOST_STM32G4XX_HAL_H
+
+//
+// Host build: use the real HAL types and constants, but point the peripherals
+// accessed directly by the firmware to simulated register blocks in RAM.
+//
+
+#include_next "stm32g4xx_hal.h"
+
+// Simulated register blocks (see sim_hal.c)
+extern RCC_TypeDef sim_rcc;
+extern FDCAN_GlobalTypeDef sim_fdcan1;
+extern TIM_TypeDef sim_tim3;
+
+#undef RCC
+#define RCC         (&sim_rcc)
+#undef FDCAN1
+#define FDCAN1      (&sim_fdcan1)
+#undef TIM3
+#define TIM3        (&sim_tim3)
+
+// Interrupt flags are write 1 to clear on the hardware, but plain RAM here
+#undef __HAL_FDCAN_CLEAR_FLAG
+#define __HAL_FDCAN_CLEAR_FLAG(__HANDLE__, __FLAG__)    (((__HANDLE__)->Instance->IR) &= ~(__FLAG__))
+
+#endif // _HOST_STM32G4XX_HAL_H
@@ -0,0 +1,689 @@
+//
+// bench: push synthetic frames through the slcan (or gs_usb) pipeline on the host
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "stm32g4xx_hal.h"
+#include "buffer.h"
+#include "can.h"
+#include "cyclic.h"
+#include "error.h"
+#include "led.h"
+#include "nvm.h"
+#include "slcan.h"
+#include "sim.h"
+#include "timebase.h"
+#include "timesync.h"
+#ifdef GS_USB
+#include "gs_usb.h"
+#endif
+
+#define BENCH_DEFAULT_FRAMES    1000000
+#define BENCH_DRAIN_LOOPS       1000        /* Give up when no progress in this many loops */
+#define BENCH_TX_STAGE_SIZE     4096        /* Host side staging buffer for commands */
+#define BENCH_FMT_FRAMES        4096        /* Distinct frames in the formatter benchmark */
+#define BENCH_TX_WINDOW         32          /* Frames in flight before waiting for a response */
+#define BENCH_TX_WINDOW_FULL    128         /* Same to fill the can tx queue, below the 256 echo ids */
+
+#ifdef GS_USB
+#define BENCH_FORMAT(buf, header, data, time_us)    gs_usb_parse_rx_frame(buf, header, data)
+#else
+#define BENCH_FORMAT(buf, header, data, time_us)    slcan_parse_rx_frame(buf, header, data, time_us)
+#endif
+
+// Direction of the traffic
+enum bench_direction
+{
+    BENCH_RX = 0,   // Bus -> host
+    BENCH_TX,       // Host -> bus (loopback)
+    BENCH_MIX,      // Both, a frame from the bus with each frame from the host
+};
+
+// Workload definition
+struct bench_workload
+{
+    const char *name;
+    enum bench_direction dir;
+    const char *setup;          // slcan commands to configure the device
+    uint32_t id_type;
+    uint32_t fd_format;
+    uint32_t brs;
+    uint8_t dlc;                // Data length code 0-F
+    uint8_t lines;              // Number of CR terminated responses per frame
+    uint8_t deterministic;      // Output stream does not depend on time
+    uint8_t burst;              // Receive: frames arriving at once in every this many loops, 0 to keep the Rx FIFO full
+    const char *command;        // Transmit: send this command instead of random frames
+    uint8_t batch;              // Transmit: frames in a batch command with a single ack, 0 for a command per frame
+    uint8_t hold;               // Transmit: the bus only sends while the can tx queue is full
+};
+
+// Time from queuing to sending of each priority class in a transmit workload
+struct bench_residency
+{
+    uint8_t valid;
+    uint32_t ave_us[BUF_CAN_TX_PRIO_CLASSES];
+    uint32_t max_us[BUF_CAN_TX_PRIO_CLASSES];
+};
+
+// Time spent in each stage of the main loop
+struct bench_stage
+{
+    uint64_t can_ns;
+    uint64_t buf_ns;
+    uint64_t loops;
+};
+
+// Workloads
+static const struct bench_workload bench_workloads[] =
+{
+#ifdef GS_USB
+    // Set up with control requests, responses are host frames
+    {"gs-rx-std-8",  BENCH_RX, NULL, FDCAN_STANDARD_ID, FDCAN_CLASSIC_CAN, FDCAN_BRS_OFF, 0x8, 1, 1},
+    {"gs-rx-ext-64", BENCH_RX, NULL, FDCAN_EXTENDED_ID, FDCAN_FD_CAN,      FDCAN_BRS_ON,  0xF, 1, 1},
+    {"gs-tx-std-8",  BENCH_TX, NULL, FDCAN_STANDARD_ID, FDCAN_CLASSIC_CAN, FDCAN_BRS_OFF, 0x8, 2, 1},
+    {"gs-tx-ext-64", BENCH_TX, NULL, FDCAN_EXTENDED_ID, FDCAN_FD_CAN,      FDCAN_BRS_ON,  0xF, 2, 1},
+    // The can tx queue kept full, the host frames wait on the bulk endpoint instead of being dropped
+    {"gs-tx-full-64", BENCH_TX, NULL, FDCAN_EXTENDED_ID, FDCAN_FD_CAN,     FDCAN_BRS_ON,  0xF, 2, 1, 0, NULL, 0, 1},
+#else
+    {"rx-std-8",     BENCH_RX, "C\rZ0\rO\r",    FDCAN_STANDARD_ID, FDCAN_CLASSIC_CAN, FDCAN_BRS_OFF, 0x8, 1, 1},
+    {"rx-ext-64",    BENCH_RX, "C\rZ0\rO\r",    FDCAN_EXTENDED_ID, FDCAN_FD_CAN,      FDCAN_BRS_ON,  0xF, 1, 1},
+    {"rx-ext-64-ts", BENCH_RX, "C\rz2011\rO\r", FDCAN_EXTENDED_ID, FDCAN_FD_CAN,      FDCAN_BRS_ON,  0xF, 1, 0},
+    {"rx-ext-64-tsn", BENCH_RX, "C\rz3011\rO\r", FDCAN_EXTENDED_ID, FDCAN_FD_CAN,     FDCAN_BRS_ON,  0xF, 1, 0},
+    {"rx-std-8-burst", BENCH_RX, "C\rZ0\rO\r",  FDCAN_STANDARD_ID, FDCAN_CLASSIC_CAN, FDCAN_BRS_OFF, 0x8, 1, 1, 16},
+    {"tx-std-8",     BENCH_TX, "C\rz0003\r=\r", FDCAN_STANDARD_ID, FDCAN_CLASSIC_CAN, FDCAN_BRS_OFF, 0x8, 3, 1},
+    {"tx-ext-64",    BENCH_TX, "C\rz0002\r=\r", FDCAN_EXTENDED_ID, FDCAN_FD_CAN,      FDCAN_BRS_ON,  0xF, 2, 1},
+    // Acked when queued, only the flow control keeps the host from overrunning the can tx queue
+    {"tx-std-8-flow", BENCH_TX, "C\rz0000\r=\r", FDCAN_STANDARD_ID, FDCAN_CLASSIC_CAN, FDCAN_BRS_OFF, 0x8, 1, 1},
+    // Same with 16 frames in a batch command, no line per frame but one ack per batch
+    {"tx-std-8-batch", BENCH_TX, "C\rz0000\r=\r", FDCAN_STANDARD_ID, FDCAN_CLASSIC_CAN, FDCAN_BRS_OFF, 0x8, 0, 1, 0, NULL, 16},
+    // Same with the can tx queue kept full of the largest entries, a frame is only taken when one is sent
+    {"tx-ext-64-full", BENCH_TX, "C\rz0000\r=\r", FDCAN_EXTENDED_ID, FDCAN_FD_CAN,      FDCAN_BRS_ON,  0xF, 1, 1, 0, NULL, 0, 1},
+    {"rx-std-8-bin",     BENCH_RX, "C\rZ0\rH1\rO\r",    FDCAN_STANDARD_ID, FDCAN_CLASSIC_CAN, FDCAN_BRS_OFF, 0x8, 1, 1},
+    {"rx-ext-64-ts-bin", BENCH_RX, "C\rz2011\rH1\rO\r", FDCAN_EXTENDED_ID, FDCAN_FD_CAN,      FDCAN_BRS_ON,  0xF, 1, 0},
+    {"tx-ext-64-bin",    BENCH_TX, "C\rz0002\rH1\r=\r", FDCAN_EXTENDED_ID, FDCAN_FD_CAN,      FDCAN_BRS_ON,  0xF, 2, 1},
+    // USB CDC only like test/cdc_speed_test_rx.py, the response is much longer than the command
+    {"cdc-v",            BENCH_TX, "C\r",               FDCAN_STANDARD_ID, FDCAN_CLASSIC_CAN, FDCAN_BRS_OFF, 0x0, 1, 1, 0, "v\r"},
+    // Short commands packed several per packet, buf_proc fr/s is the rate of the command parser
+    {"cmd-blank",        BENCH_TX, "C\r",               FDCAN_STANDARD_ID, FDCAN_CLASSIC_CAN, FDCAN_BRS_OFF, 0x0, 1, 1, 0, "\r"},
+    {"cmd-tx-std-0",     BENCH_TX, "C\rz0002\rH0\r=\r", FDCAN_STANDARD_ID, FDCAN_CLASSIC_CAN, FDCAN_BRS_OFF, 0x0, 2, 1},
+    // Bus traffic with fire-and-forget transmission, the quiet one has no reply to the transmit commands
+    {"mix-std-8",        BENCH_MIX, "C\rz0001\r=\r", FDCAN_STANDARD_ID, FDCAN_CLASSIC_CAN, FDCAN_BRS_OFF, 0x8, 3, 1},
+    {"mix-std-8-quiet",  BENCH_MIX, "C\rz0021\r=\r", FDCAN_STANDARD_ID, FDCAN_CLASSIC_CAN, FDCAN_BRS_OFF, 0x8, 2, 1},
+    // Frames in priority order, compare the residency time with tx-std-8. Last as the order is kept by C.
+    {"tx-std-8-prio",    BENCH_TX, "C\rJ1\rz0003\rH0\r=\r", FDCAN_STANDARD_ID, FDCAN_CLASSIC_CAN, FDCAN_BRS_OFF, 0x8, 3, 1},
+#endif
+};
+
+// Formatter benchmark cases (slcan_parse_rx_frame or gs_usb_parse_rx_frame only)
+static const struct bench_workload bench_fmt_workloads[] =
+{
+#ifdef GS_USB
+    {"gs-fmt-std-8",  BENCH_RX, NULL, FDCAN_STANDARD_ID, FDCAN_CLASSIC_CAN, FDCAN_BRS_OFF, 0x8, 1, 1},
+    {"gs-fmt-ext-64", BENCH_RX, NULL, FDCAN_EXTENDED_ID, FDCAN_FD_CAN,      FDCAN_BRS_ON,  0xF, 1, 1},
+#else
+    {"fmt-std-8",     BENCH_RX, NULL, FDCAN_STANDARD_ID, FDCAN_CLASSIC_CAN, FDCAN_BRS_OFF, 0x8, 1, 1},
+    {"fmt-ext-64",    BENCH_RX, NULL, FDCAN_EXTENDED_ID, FDCAN_FD_CAN,      FDCAN_BRS_ON,  0xF, 1, 1},
+    {"fmt-ext-64-ts", BENCH_RX, NULL, FDCAN_EXTENDED_ID, FDCAN_FD_CAN,      FDCAN_BRS_ON,  0xF, 1, 0},
+#endif
+};
+
+// Tx events without a queued frame, set up like a transmit workload with Tx event reports
+static const struct bench_workload bench_stray_workloads[] =
+{
+#ifdef GS_USB
+    {"gs-tx-stray",   BENCH_TX, NULL, FDCAN_STANDARD_ID, FDCAN_CLASSIC_CAN, FDCAN_BRS_OFF, 0x8, 2, 1},
+#else
+    {"tx-stray",      BENCH_TX, "C\rz0002\r=\r",     FDCAN_STANDARD_ID, FDCAN_CLASSIC_CAN, FDCAN_BRS_OFF, 0x8, 2, 1},
+    {"tx-stray-prio", BENCH_TX, "C\rJ1\rz0002\r=\r", FDCAN_STANDARD_ID, FDCAN_CLASSIC_CAN, FDCAN_BRS_OFF, 0x8, 2, 1},
+#endif
+};
+
+static const uint8_t bench_dlc_to_bytes[16] = {0, 1, 2, 3, 4, 5, 6, 7, 8, 12, 16, 20, 24, 32, 48, 64};
+static const char bench_hex[] = "0123456789ABCDEF";
+
+// Private variables
+static uint32_t bench_rand_state;
+static uint32_t bench_echo_id;
+
+// Private methods
+static uint32_t bench_rand(void);
+static void bench_loop(struct bench_stage *stage);
+#ifdef GS_USB
+static HAL_StatusTypeDef bench_gs_usb_start(const struct bench_workload *wl);
+#else
+static void bench_command(const char *cmd);
+#endif
+static void bench_make_frame(const struct bench_workload *wl, FDCAN_RxHeaderTypeDef *header, uint8_t *data);
+static uint32_t bench_make_command(const struct bench_workload *wl, char *buf);
+#ifndef GS_USB
+static uint32_t bench_make_batch(const struct bench_workload *wl, char *buf, uint32_t frames);
+#endif
+static uint8_t bench_run(const struct bench_workload *wl, uint32_t frames);
+static void bench_run_fmt(const struct bench_workload *wl, uint32_t frames);
+static uint8_t bench_run_stray(const struct bench_workload *wl);
+
+int main(int argc, char *argv[])
+{
+    uint32_t frames = BENCH_DEFAULT_FRAMES;
+    const char *only = NULL;
+    uint8_t failed = 0;
+    static struct bench_residency residency[sizeof(bench_workloads) / sizeof(bench_workloads[0])];
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-n") == 0 && i + 1 < argc)
+            frames = (uint32_t)strtoul(argv[++i], NULL, 0);
+        else if (argv[i][0] != '-')
+            only = argv[i];
+        else
+        {
+            fprintf(stderr, "usage: %s [-n frames] [workload]\n", argv[0]);
+            return 2;
+        }
+    }
+
+    // Initialize like main() does on the device
+    sim_init();
+    timebase_init();
+    timesync_init();
+    led_init();
+    buf_init();
+    can_init();
+    nvm_init();
+    cyclic_init();
+
+    printf("%-16s %9s %9s %12s %12s %12s %10s %10s %9s  %s\n", "workload", "frames", "loops/fr",
+           "total fr/s", "can_proc fr/s", "buf_proc fr/s", "in kB/s", "out kB/s", "out B/fr", "result");
+
+    for (uint32_t i = 0; i < sizeof(bench_workloads) / sizeof(bench_workloads[0]); i++)
+    {
+        if (only != NULL && strcmp(only, bench_workloads[i].name) != 0) continue;
+        if (bench_run(&bench_workloads[i], frames) != 0) failed = 1;
+
+        // Taken before the next workload opens the channel again
+        if (bench_workloads[i].dir != BENCH_RX)
+        {
+            residency[i].valid = 1;
+            for (uint8_t j = 0; j < BUF_CAN_TX_PRIO_CLASSES; j++)
+            {
+                residency[i].ave_us[j] = buf_get_can_tx_residency_ave_us(j);
+                residency[i].max_us[j] = buf_get_can_tx_residency_max_us(j);
+            }
+        }
+    }
+
+    printf("\n%-16s %9s %12s %12s  %s\n", "format", "frames", "cycles/fr", "ns/fr", "result");
+
+    for (uint32_t i = 0; i < sizeof(bench_fmt_workloads) / sizeof(bench_fmt_workloads[0]); i++)
+    {
+        if (only != NULL && strcmp(only, bench_fmt_workloads[i].name) != 0) continue;
+        bench_run_fmt(&bench_fmt_workloads[i], frames);
+    }
+
+    printf("\n%-16s  %s\n", "stray event", "result");
+
+    for (uint32_t i = 0; i < sizeof(bench_stray_workloads) / sizeof(bench_stray_workloads[0]); i++)
+    {
+        if (only != NULL && strcmp(only, bench_stray_workloads[i].name) != 0) continue;
+        if (bench_run_stray(&bench_stray_workloads[i]) != 0) failed = 1;
+    }
+
+    printf("\n%-16s %23s %23s\n", "residency", "ave us by class 0-3", "max us by class 0-3");
+
+    for (uint32_t i = 0; i < sizeof(bench_workloads) / sizeof(bench_workloads[0]); i++)
+    {
+        if (!residency[i].valid) continue;
+        printf("%-16s %5u %5u %5u %5u %5u %5u %5u %5u\n", bench_workloads[i].name,
+               residency[i].ave_us[0], residency[i].ave_us[1], residency[i].ave_us[2], residency[i].ave_us[3],
+               residency[i].max_us[0], residency[i].max_us[1], residency[i].max_us[2], residency[i].max_us[3]);
+    }
+
+    return failed;
+}
+
+// Pseudo random numbers (xorshift32)
+uint32_t bench_rand(void)
+{
+    bench_rand_state ^= bench_rand_state << 13;
+    bench_rand_state ^= bench_rand_state >> 17;
+    bench_rand_state ^= bench_rand_state << 5;
+    return bench_rand_state;
+}
+
+// One pass of the device main loop, with the time spent in each stage
+void bench_loop(struct bench_stage *stage)
+{
+    uint64_t t0 = sim_get_time_ns();
+    led_process();
+    can_process();
+    timesync_process();
+#ifndef GS_USB
+    cyclic_process();
+#endif
+    uint64_t t1 = sim_get_time_ns();
+    buf_process();
+    uint64_t t2 = sim_get_time_ns();
+
+    if (stage != NULL)
+    {
+        stage->can_ns += t1 - t0;
+        stage->buf_ns += t2 - t1;
+        stage->loops++;
+    }
+}
+
+#ifndef GS_USB
+// Send slcan commands and process them
+void bench_command(const char *cmd)
+{
+    uint32_t len = strlen(cmd);
+    uint32_t done = 0;
+
+    while (done < len || !sim_usb_is_rx_empty())
+    {
+        done += sim_usb_receive((const uint8_t *)&cmd[done], len - done);
+        bench_loop(NULL);
+    }
+    for (uint8_t i = 0; i < 4; i++) bench_loop(NULL);
+}
+#endif
+
+#ifdef GS_USB
+// Configure and start the channel with control requests like the Linux driver
+// does for "ip link set can0 up type can bitrate 500000 dbitrate 2000000 fd on"
+HAL_StatusTypeDef bench_gs_usb_start(const struct bench_workload *wl)
+{
+    struct gs_device_bittiming nominal = {35, 35, 9, 8, 4};
+    struct gs_device_bittiming data = {15, 15, 9, 8, 2};
+    struct gs_device_mode mode = {GS_CAN_MODE_RESET, 0};
+    uint32_t host_format = 0x0000BEEF;
+    uint8_t buf[GS_USB_CTRL_BUF_SIZE];
+
+    if (gs_usb_set_ctrl_data(GS_USB_BREQ_HOST_FORMAT, 1, (uint8_t *)&host_format, sizeof(host_format)) != HAL_OK) return HAL_ERROR;
+    if (gs_usb_get_ctrl_data(GS_USB_BREQ_DEVICE_CONFIG, 1, buf, sizeof(buf)) != sizeof(struct gs_device_config)) return HAL_ERROR;
+    if (gs_usb_get_ctrl_data(GS_USB_BREQ_BT_CONST_EXT, 0, buf, sizeof(buf)) != sizeof(struct gs_device_bt_const_ext)) return HAL_ERROR;
+    if (gs_usb_set_ctrl_data(GS_USB_BREQ_MODE, 0, (uint8_t *)&mode, sizeof(mode)) != HAL_OK) return HAL_ERROR;
+    if (gs_usb_set_ctrl_data(GS_USB_BREQ_BITTIMING, 0, (uint8_t *)&nominal, sizeof(nominal)) != HAL_OK) return HAL_ERROR;
+    if (gs_usb_set_ctrl_data(GS_USB_BREQ_DATA_BITTIMING, 0, (uint8_t *)&data, sizeof(data)) != HAL_OK) return HAL_ERROR;
+
+    // Transmit workloads loop back internally
+    mode.mode = GS_CAN_MODE_START;
+    mode.flags = GS_CAN_MODE_FD;
+    if (wl->dir == BENCH_TX) mode.flags |= GS_CAN_MODE_LOOP_BACK | GS_CAN_MODE_LISTEN_ONLY;
+    if (gs_usb_set_ctrl_data(GS_USB_BREQ_MODE, 0, (uint8_t *)&mode, sizeof(mode)) != HAL_OK) return HAL_ERROR;
+
+    for (uint8_t i = 0; i < 4; i++) bench_loop(NULL);
+    return HAL_OK;
+}
+#endif
+
+// Make a random frame received from the bus
+void bench_make_frame(const struct bench_workload *wl, FDCAN_RxHeaderTypeDef *header, uint8_t *data)
+{
+    header->IdType = wl->id_type;
+    header->Identifier = bench_rand() & (wl->id_type == FDCAN_STANDARD_ID ? 0x7FF : 0x1FFFFFFF);
+    header->RxFrameType = FDCAN_DATA_FRAME;
+    header->DataLength = (uint32_t)wl->dlc << 16;
+    header->ErrorStateIndicator = FDCAN_ESI_ACTIVE;
+    header->BitRateSwitch = wl->brs;
+    header->FDFormat = wl->fd_format;
+
+    for (uint8_t i = 0; i < bench_dlc_to_bytes[wl->dlc]; i += 4)
+    {
+        uint32_t val = bench_rand();
+        memcpy(&data[i], &val, 4);
+    }
+}
+
+// Make a random transmit command (a host frame with GS_USB), return the length
+uint32_t bench_make_command(const struct bench_workload *wl, char *buf)
+{
+    FDCAN_RxHeaderTypeDef header;
+    uint8_t data[CAN_MAX_DATALEN];
+    uint32_t idx = 0;
+
+    if (wl->command != NULL)
+    {
+        strcpy(buf, wl->command);
+        return strlen(wl->command);
+    }
+
+    bench_make_frame(wl, &header, data);
+
+#ifdef GS_USB
+    struct gs_host_frame host_frame = {0};
+    uint32_t len = GS_USB_HOST_FRAME_CLASSIC_LEN;
+
+    host_frame.echo_id = bench_echo_id++ & 0xFF;
+    host_frame.can_id = header.Identifier;
+    if (wl->id_type == FDCAN_EXTENDED_ID) host_frame.can_id |= GS_CAN_EFF_FLAG;
+    host_frame.can_dlc = wl->dlc;
+    if (wl->fd_format == FDCAN_FD_CAN)
+    {
+        host_frame.flags = GS_CAN_FLAG_FD;
+        if (wl->brs == FDCAN_BRS_ON) host_frame.flags |= GS_CAN_FLAG_BRS;
+        len = GS_USB_HOST_FRAME_FD_LEN;
+    }
+    memcpy(host_frame.data, data, bench_dlc_to_bytes[wl->dlc]);
+    memcpy(buf, &host_frame, len);
+
+    return len;
+#endif
+
+    if (wl->fd_format == FDCAN_CLASSIC_CAN) buf[idx] = 't';
+    else if (wl->brs == FDCAN_BRS_ON) buf[idx] = 'b';
+    else buf[idx] = 'd';
+    if (wl->id_type == FDCAN_EXTENDED_ID) buf[idx] -= 32;
+    idx++;
+
+    for (int8_t shift = (wl->id_type == FDCAN_EXTENDED_ID ? 28 : 8); shift >= 0; shift -= 4)
+        buf[idx++] = bench_hex[(header.Identifier >> shift) & 0xF];
+
+    buf[idx++] = bench_hex[wl->dlc];
+    for (uint8_t i = 0; i < bench_dlc_to_bytes[wl->dlc]; i++)
+    {
+        buf[idx++] = bench_hex[data[i] >> 4];
+        buf[idx++] = bench_hex[data[i] & 0xF];
+    }
+    buf[idx++] = '\r';
+
+    return idx;
+}
+
+#ifndef GS_USB
+// Make a batch command of random frames, return the length
+uint32_t bench_make_batch(const struct bench_workload *wl, char *buf, uint32_t frames)
+{
+    uint32_t idx = 0;
+
+    buf[idx++] = 'G';
+    for (uint32_t i = 0; i < frames; i++)
+        idx += bench_make_command(wl, &buf[idx]) - 1;   // Without CR
+    buf[idx++] = '\r';
+
+    return idx;
+}
+#endif
+
+// Run a workload, print the result and return 0 if there is no loss
+uint8_t bench_run(const struct bench_workload *wl, uint32_t frames)
+{
+    struct bench_stage stage = {0};
+    uint64_t bytes_in = 0;
+    uint32_t sent = 0;
+    uint32_t idle = 0;
+    uint32_t last_lines = 0;
+    uint32_t last_tx = 0;
+
+    bench_rand_state = 0x12345678;
+    bench_echo_id = 0;
+#ifdef GS_USB
+    if (bench_gs_usb_start(wl) != HAL_OK)
+    {
+        printf("%-16s setup FAIL\n", wl->name);
+        return 1;
+    }
+#else
+    bench_command(wl->setup);
+#endif
+    sim_usb_clear_stats();
+    sim_fdcan_clear_stats();
+
+    uint64_t expected = (uint64_t)frames * wl->lines;
+    if (wl->batch > 0)
+        expected += (frames + wl->batch - 1) / wl->batch;
+    uint64_t start_ns = sim_get_time_ns();
+
+    if (wl->dir == BENCH_RX)
+    {
+        FDCAN_RxHeaderTypeDef header;
+        uint8_t data[CAN_MAX_DATALEN];
+
+        while (sent < frames)
+        {
+            if (wl->burst == 0)
+            {
+                // Keep the Rx FIFO filled without overflowing it or the Rx ring behind it
+                while (sent < frames && sim_fdcan_get_rx_free_level(FDCAN_RX_FIFO0) > 0 && !can_is_rx_ring_full())
+                {
+                    bench_make_frame(wl, &header, data);
+                    if (sim_fdcan_inject(&header, data) != HAL_OK) break;
+                    sent++;
+                }
+            }
+            else if (stage.loops % wl->burst == 0)
+            {
+                // Back to back frames, one per loop on average, lost if the device can't take them
+                for (uint8_t i = 0; i < wl->burst && sent < frames; i++)
+                {
+                    bench_make_frame(wl, &header, data);
+                    sim_fdcan_inject(&header, data);
+                    sent++;
+                }
+            }
+            bench_loop(&stage);
+        }
+    }
+    else
+    {
+        static char cmd_buf[BENCH_TX_STAGE_SIZE];
+        uint32_t window = wl->hold ? BENCH_TX_WINDOW_FULL : BENCH_TX_WINDOW;
+        uint32_t cmd_len = 0;
+        uint32_t cmd_done = 0;
+        uint32_t rx_sent = 0;
+        FDCAN_RxHeaderTypeDef header;
+        uint8_t data[CAN_MAX_DATALEN];
+
+        while (sent < frames || cmd_done < cmd_len)
+        {
+            // Refill the host side staging buffer, like a host waiting for
+            // responses so that the transmit queue of the device never overflows
+            if (cmd_done == cmd_len)
+            {
+                // Lines of a batch are the reports of its frames and one ack
+                uint32_t acked = (wl->batch > 0) ? sim_usb_get_stats().lines * wl->batch / (wl->lines * wl->batch + 1)
+                                                 : sim_usb_get_stats().lines / wl->lines;
+                cmd_len = 0;
+                cmd_done = 0;
+#ifndef GS_USB
+                if (wl->batch > 0)
+                {
+                    while (sent < frames && sent - acked < window && cmd_len + SLCAN_BATCH_MTU < BENCH_TX_STAGE_SIZE)
+                    {
+                        uint32_t batch = (frames - sent < wl->batch) ? frames - sent : wl->batch;
+                        cmd_len += bench_make_batch(wl, &cmd_buf[cmd_len], batch);
+                        sent += batch;
+                    }
+                }
+#endif
+                while (sent < frames && sent - acked < window && cmd_len + SLCAN_MTU < BENCH_TX_STAGE_SIZE)
+                {
+                    cmd_len += bench_make_command(wl, &cmd_buf[cmd_len]);
+                    sent++;
+                }
+                bytes_in += cmd_len;
+            }
+
+            // Frames from the bus at the pace of the frames from the host
+            while (wl->dir == BENCH_MIX && rx_sent < sent && sim_fdcan_get_rx_free_level(FDCAN_RX_FIFO0) > 0)
+            {
+                bench_make_frame(wl, &header, data);
+                if (sim_fdcan_inject(&header, data) != HAL_OK) break;
+                rx_sent++;
+            }
+
+            cmd_done += sim_usb_receive((uint8_t *)&cmd_buf[cmd_done], cmd_len - cmd_done);
+            if (!wl->hold || !buf_has_can_dest()) sim_fdcan_bus_step();
+            bench_loop(&stage);
+        }
+
+        // Rest of the frames from the bus
+        while (wl->dir == BENCH_MIX && rx_sent < frames)
+        {
+            while (rx_sent < frames && sim_fdcan_get_rx_free_level(FDCAN_RX_FIFO0) > 0)
+            {
+                bench_make_frame(wl, &header, data);
+                if (sim_fdcan_inject(&header, data) != HAL_OK) break;
+                rx_sent++;
+            }
+            sim_fdcan_bus_step();
+            bench_loop(&stage);
+        }
+    }
+
+    // Drain the pipeline, frames acked when queued may still be waiting in the can tx queue
+    uint32_t tx_expected = (wl->dir != BENCH_RX && wl->command == NULL) ? frames : 0;
+    while ((sim_usb_get_stats().lines + sim_usb_get_stats().bells < expected || sim_fdcan_get_stats().tx_frames < tx_expected)
+           && idle < BENCH_DRAIN_LOOPS)
+    {
+        sim_fdcan_bus_step();
+        bench_loop(&stage);
+
+        if (sim_usb_get_stats().lines == last_lines && sim_fdcan_get_stats().tx_frames == last_tx) idle++;
+        else idle = 0;
+        last_lines = sim_usb_get_stats().lines;
+        last_tx = sim_fdcan_get_stats().tx_frames;
+    }
+
+    uint64_t total_ns = sim_get_time_ns() - start_ns;
+    struct sim_usb_stats usb = sim_usb_get_stats();
+    struct sim_fdcan_stats bus = sim_fdcan_get_stats();
+    uint32_t err_reg = error_get_register();
+
+    // Check for loss
+    char result[64];
+    uint8_t failed = 1;
+    if (usb.bells > 0)
+        snprintf(result, sizeof(result), "FAIL %u BELL", usb.bells);
+    else if (usb.lines != expected)
+        snprintf(result, sizeof(result), "FAIL %u/%llu lines rxl=%u tel=%u tx=%u rx=%u", usb.lines, (unsigned long long)expected, bus.rx_lost, bus.tx_evt_lost, bus.tx_frames, bus.rx_frames);
+    else if (bus.tx_frames != tx_expected)
+        snprintf(result, sizeof(result), "FAIL %u/%u frames sent", bus.tx_frames, frames);
+    else if (bus.rx_lost > 0 || bus.tx_evt_lost > 0 || err_reg != 0)
+        snprintf(result, sizeof(result), "FAIL err=%03X", (unsigned)err_reg);
+    else
+    {
+        if (wl->deterministic)
+            snprintf(result, sizeof(result), "ok hash=%08X", usb.hash);
+        else
+            snprintf(result, sizeof(result), "ok");
+        failed = 0;
+    }
+
+    printf("%-16s %9u %9.2f %12.0f %12.0f %12.0f %10.0f %10.0f %9.1f  %s\n", wl->name, frames,
+           (double)stage.loops / frames,
+           frames * 1e9 / total_ns,
+           stage.can_ns ? frames * 1e9 / stage.can_ns : 0.0,
+           stage.buf_ns ? frames * 1e9 / stage.buf_ns : 0.0,
+           bytes_in * 1e6 / total_ns,
+           usb.bytes * 1e6 / total_ns,
+           (double)usb.bytes / frames,
+           result);
+
+    return failed;
+}
+
+// Measure the cycles spent formatting received frames into slcan messages
+void bench_run_fmt(const struct bench_workload *wl, uint32_t frames)
+{
+    static FDCAN_RxHeaderTypeDef headers[BENCH_FMT_FRAMES];
+    static uint8_t data[BENCH_FMT_FRAMES][CAN_MAX_DATALEN];
+    uint8_t buf[SLCAN_MTU];
+    uint32_t hash = 2166136261UL;
+
+#ifndef GS_USB
+    bench_command("C\rH0\r");
+#endif
+    bench_rand_state = 0x12345678;
+    for (uint32_t i = 0; i < BENCH_FMT_FRAMES; i++)
+        bench_make_frame(wl, &headers[i], data[i]);
+
+    enum slcan_timestamp_mode ts_mode = slcan_get_timestamp_mode();
+    uint16_t report_reg = slcan_get_report_register();
+    slcan_set_timestamp_mode(wl->deterministic ? SLCAN_TIMESTAMP_OFF : SLCAN_TIMESTAMP_MICRO);
+    slcan_set_report_register(1);
+
+    uint64_t start_cyc = sim_get_cycles();
+    uint64_t start_ns = sim_get_time_ns();
+    for (uint32_t i = 0; i < frames; i++)
+    {
+        int32_t len = BENCH_FORMAT(buf, &headers[i % BENCH_FMT_FRAMES], data[i % BENCH_FMT_FRAMES], i);
+        hash = (hash ^ buf[len - 2]) * 16777619UL;
+    }
+    uint64_t total_cyc = sim_get_cycles() - start_cyc;
+    uint64_t total_ns = sim_get_time_ns() - start_ns;
+
+    // Hash the complete output of the distinct frames to detect behavior changes
+    for (uint32_t i = 0; i < BENCH_FMT_FRAMES && wl->deterministic; i++)
+    {
+        int32_t len = BENCH_FORMAT(buf, &headers[i], data[i], i);
+        for (int32_t j = 0; j < len; j++)
+            hash = (hash ^ buf[j]) * 16777619UL;
+    }
+
+    slcan_set_timestamp_mode(ts_mode);
+    slcan_set_report_register(report_reg);
+
+    char result[32];
+    if (wl->deterministic)
+        snprintf(result, sizeof(result), "hash=%08X", hash);
+    else
+        snprintf(result, sizeof(result), "-");
+
+    printf("%-16s %9u %12.1f %12.1f  %s\n", wl->name, frames,
+           (double)total_cyc / frames, (double)total_ns / frames, result);
+}
+
+// Feed a Tx event with a marker no queued frame waits for, e.g. left over from a cleared queue.
+// It must be skipped with ERR_CAN_TXFAIL, not reported with the data of another frame.
+uint8_t bench_run_stray(const struct bench_workload *wl)
+{
+    FDCAN_TxEventFifoTypeDef event = {0};
+    uint8_t failed = 1;
+    const char *result;
+
+#ifdef GS_USB
+    if (bench_gs_usb_start(wl) != HAL_OK)
+    {
+        printf("%-16s  setup FAIL\n", wl->name);
+        return 1;
+    }
+#else
+    bench_command(wl->setup);
+#endif
+    sim_usb_clear_stats();
+    error_clear();
+
+    event.Identifier = 0x123;
+    event.IdType = wl->id_type;
+    event.TxFrameType = FDCAN_DATA_FRAME;
+    event.DataLength = (uint32_t)wl->dlc << 16;
+    event.BitRateSwitch = wl->brs;
+    event.FDFormat = wl->fd_format;
+    event.EventType = FDCAN_TX_EVENT;
+    event.MessageMarker = 5;
+
+    if (sim_fdcan_inject_tx_event(&event) != HAL_OK)
+    {
+        printf("%-16s  inject FAIL\n", wl->name);
+        return 1;
+    }
+    for (uint8_t i = 0; i < 4; i++) bench_loop(NULL);
+
+    if (sim_usb_get_stats().lines != 0)
+        result = "FAIL reported";
+    else if (!error_occurred(ERR_CAN_TXFAIL))
+        result = "FAIL no error";
+    else
+    {
+        result = "ok";
+        failed = 0;
+    }
+
+    printf("%-16s  %s\n", wl->name, result);
+    error_clear();
+
+    return failed;
+}
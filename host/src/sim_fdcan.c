@@ -0,0 +1,551 @@
+//
+// sim_fdcan: host stand-in for the HAL FDCAN driver with a simple bus model
+//
+
+#include <string.h>
+#include "stm32g4xx_hal.h"
+#include "can.h"
+#include "sim.h"
+
+// Message RAM layout of the STM32G4 (see RM0440)
+#define SIM_FDCAN_STD_FLT_NBR       28
+#define SIM_FDCAN_EXT_FLT_NBR       8
+#define SIM_FDCAN_RX_FIFO_LEN       3
+#define SIM_FDCAN_TX_FIFO_LEN       3
+#define SIM_FDCAN_TX_EVT_LEN        3
+#define SIM_FDCAN_DATA_LEN          64
+
+#define SIM_FDCAN_REJECT            0xFF
+
+// Rx FIFO element
+struct sim_fdcan_rx_fifo
+{
+    FDCAN_RxHeaderTypeDef header[SIM_FDCAN_RX_FIFO_LEN];
+    uint8_t data[SIM_FDCAN_RX_FIFO_LEN][SIM_FDCAN_DATA_LEN];
+    uint32_t get;
+    uint32_t fill;
+};
+
+// Tx FIFO
+struct sim_fdcan_tx_fifo
+{
+    FDCAN_TxHeaderTypeDef header[SIM_FDCAN_TX_FIFO_LEN];
+    uint8_t data[SIM_FDCAN_TX_FIFO_LEN][SIM_FDCAN_DATA_LEN];
+    uint32_t get;
+    uint32_t fill;
+};
+
+// Tx event FIFO
+struct sim_fdcan_tx_evt_fifo
+{
+    FDCAN_TxEventFifoTypeDef event[SIM_FDCAN_TX_EVT_LEN];
+    uint32_t get;
+    uint32_t fill;
+};
+
+// Private variables
+static FDCAN_HandleTypeDef *sim_fdcan_handle = NULL;
+static uint8_t sim_fdcan_started = 0;
+static FDCAN_FilterTypeDef sim_fdcan_std_filter[SIM_FDCAN_STD_FLT_NBR];
+static FDCAN_FilterTypeDef sim_fdcan_ext_filter[SIM_FDCAN_EXT_FLT_NBR];
+static uint32_t sim_fdcan_non_matching_std = FDCAN_ACCEPT_IN_RX_FIFO0;
+static uint32_t sim_fdcan_non_matching_ext = FDCAN_ACCEPT_IN_RX_FIFO0;
+static uint32_t sim_fdcan_reject_remote_std = FDCAN_FILTER_REMOTE;
+static uint32_t sim_fdcan_reject_remote_ext = FDCAN_FILTER_REMOTE;
+static struct sim_fdcan_rx_fifo sim_fdcan_rx_fifo[2];
+static struct sim_fdcan_tx_fifo sim_fdcan_tx_fifo;
+static struct sim_fdcan_tx_evt_fifo sim_fdcan_tx_evt_fifo;
+static struct sim_fdcan_stats sim_fdcan_stats = {0};
+
+static const uint8_t sim_fdcan_dlc_to_bytes[16] = {0, 1, 2, 3, 4, 5, 6, 7, 8, 12, 16, 20, 24, 32, 48, 64};
+
+// Private methods
+static uint8_t sim_fdcan_filter_match(FDCAN_FilterTypeDef *filter, uint32_t id);
+static uint8_t sim_fdcan_select_fifo(FDCAN_RxHeaderTypeDef *header);
+static HAL_StatusTypeDef sim_fdcan_store_rx(FDCAN_RxHeaderTypeDef *header, uint8_t *data);
+static void sim_fdcan_reset_fifos(void);
+static void sim_fdcan_update_tx_status(void);
+static uint32_t sim_fdcan_get_tx_priority(FDCAN_TxHeaderTypeDef *header);
+static uint32_t sim_fdcan_get_line1_its(void);
+static void sim_fdcan_raise(uint32_t flags);
+
+HAL_StatusTypeDef HAL_FDCAN_Init(FDCAN_HandleTypeDef *hfdcan)
+{
+    if (hfdcan->Init.StdFiltersNbr > SIM_FDCAN_STD_FLT_NBR) return HAL_ERROR;
+    if (hfdcan->Init.ExtFiltersNbr > SIM_FDCAN_EXT_FLT_NBR) return HAL_ERROR;
+
+    sim_fdcan_handle = hfdcan;
+    sim_fdcan_started = 0;
+    memset(sim_fdcan_std_filter, 0, sizeof(sim_fdcan_std_filter));
+    memset(sim_fdcan_ext_filter, 0, sizeof(sim_fdcan_ext_filter));
+    sim_fdcan_non_matching_std = FDCAN_ACCEPT_IN_RX_FIFO0;
+    sim_fdcan_non_matching_ext = FDCAN_ACCEPT_IN_RX_FIFO0;
+    sim_fdcan_reset_fifos();
+
+    // Interrupt configuration is cleared by the peripheral reset before the init
+    sim_fdcan1.IE = 0;
+    sim_fdcan1.ILS = 0;
+    sim_fdcan1.ILE = 0;
+
+    hfdcan->State = HAL_FDCAN_STATE_READY;
+    hfdcan->ErrorCode = HAL_FDCAN_ERROR_NONE;
+    return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_FDCAN_DeInit(FDCAN_HandleTypeDef *hfdcan)
+{
+    sim_fdcan_started = 0;
+    hfdcan->State = HAL_FDCAN_STATE_RESET;
+    return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_FDCAN_Start(FDCAN_HandleTypeDef *hfdcan)
+{
+    if (hfdcan->State != HAL_FDCAN_STATE_READY) return HAL_ERROR;
+
+    sim_fdcan_reset_fifos();
+    sim_fdcan_started = 1;
+    hfdcan->State = HAL_FDCAN_STATE_BUSY;
+    return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_FDCAN_Stop(FDCAN_HandleTypeDef *hfdcan)
+{
+    sim_fdcan_started = 0;
+    hfdcan->State = HAL_FDCAN_STATE_READY;
+    return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_FDCAN_ConfigFilter(FDCAN_HandleTypeDef *hfdcan, FDCAN_FilterTypeDef *sFilterConfig)
+{
+    if (sFilterConfig->IdType == FDCAN_STANDARD_ID)
+    {
+        if (sFilterConfig->FilterIndex >= hfdcan->Init.StdFiltersNbr) return HAL_ERROR;
+        sim_fdcan_std_filter[sFilterConfig->FilterIndex] = *sFilterConfig;
+    }
+    else
+    {
+        if (sFilterConfig->FilterIndex >= hfdcan->Init.ExtFiltersNbr) return HAL_ERROR;
+        sim_fdcan_ext_filter[sFilterConfig->FilterIndex] = *sFilterConfig;
+    }
+    return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_FDCAN_ConfigGlobalFilter(FDCAN_HandleTypeDef *hfdcan, uint32_t NonMatchingStd, uint32_t NonMatchingExt,
+                                               uint32_t RejectRemoteStd, uint32_t RejectRemoteExt)
+{
+    sim_fdcan_non_matching_std = NonMatchingStd;
+    sim_fdcan_non_matching_ext = NonMatchingExt;
+    sim_fdcan_reject_remote_std = RejectRemoteStd;
+    sim_fdcan_reject_remote_ext = RejectRemoteExt;
+    return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_FDCAN_ConfigTimestampCounter(FDCAN_HandleTypeDef *hfdcan, uint32_t TimestampPrescaler)
+{
+    return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_FDCAN_EnableTimestampCounter(FDCAN_HandleTypeDef *hfdcan, uint32_t TimestampOperation)
+{
+    return HAL_OK;
+}
+
+uint16_t HAL_FDCAN_GetTimestampCounter(FDCAN_HandleTypeDef *hfdcan)
+{
+    sim_get_time_ns();
+    return (uint16_t)sim_tim3.CNT;
+}
+
+HAL_StatusTypeDef HAL_FDCAN_ConfigTxDelayCompensation(FDCAN_HandleTypeDef *hfdcan, uint32_t TdcOffset, uint32_t TdcFilter)
+{
+    return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_FDCAN_EnableTxDelayCompensation(FDCAN_HandleTypeDef *hfdcan)
+{
+    return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_FDCAN_DisableTxDelayCompensation(FDCAN_HandleTypeDef *hfdcan)
+{
+    return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_FDCAN_ConfigInterruptLines(FDCAN_HandleTypeDef *hfdcan, uint32_t ITList, uint32_t InterruptLine)
+{
+    if (InterruptLine == FDCAN_INTERRUPT_LINE0)
+        sim_fdcan1.ILS &= ~ITList;
+    else
+        sim_fdcan1.ILS |= ITList;
+    return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_FDCAN_ActivateNotification(FDCAN_HandleTypeDef *hfdcan, uint32_t ActiveITs, uint32_t BufferIndexes)
+{
+    uint32_t line1_its = sim_fdcan_get_line1_its();
+
+    if (hfdcan->State != HAL_FDCAN_STATE_READY && hfdcan->State != HAL_FDCAN_STATE_BUSY) return HAL_ERROR;
+
+    if (ActiveITs & ~line1_its) sim_fdcan1.ILE |= FDCAN_INTERRUPT_LINE0;
+    if (ActiveITs & line1_its) sim_fdcan1.ILE |= FDCAN_INTERRUPT_LINE1;
+    sim_fdcan1.IE |= ActiveITs;
+    return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_FDCAN_AddMessageToTxFifoQ(FDCAN_HandleTypeDef *hfdcan, FDCAN_TxHeaderTypeDef *pTxHeader, uint8_t *pTxData)
+{
+    if (!sim_fdcan_started || sim_fdcan_tx_fifo.fill >= SIM_FDCAN_TX_FIFO_LEN)
+    {
+        hfdcan->ErrorCode |= HAL_FDCAN_ERROR_FIFO_FULL;
+        return HAL_ERROR;
+    }
+
+    uint32_t put = (sim_fdcan_tx_fifo.get + sim_fdcan_tx_fifo.fill) % SIM_FDCAN_TX_FIFO_LEN;
+    sim_fdcan_tx_fifo.header[put] = *pTxHeader;
+    memcpy(sim_fdcan_tx_fifo.data[put], pTxData, sim_fdcan_dlc_to_bytes[(pTxHeader->DataLength >> 16) & 0xF]);
+    sim_fdcan_tx_fifo.fill++;
+    sim_fdcan_update_tx_status();
+    return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_FDCAN_GetRxMessage(FDCAN_HandleTypeDef *hfdcan, uint32_t RxLocation, FDCAN_RxHeaderTypeDef *pRxHeader, uint8_t *pRxData)
+{
+    struct sim_fdcan_rx_fifo *fifo = &sim_fdcan_rx_fifo[RxLocation == FDCAN_RX_FIFO0 ? 0 : 1];
+
+    if (fifo->fill == 0)
+    {
+        hfdcan->ErrorCode |= HAL_FDCAN_ERROR_FIFO_EMPTY;
+        return HAL_ERROR;
+    }
+
+    *pRxHeader = fifo->header[fifo->get];
+    memcpy(pRxData, fifo->data[fifo->get], sim_fdcan_dlc_to_bytes[(pRxHeader->DataLength >> 16) & 0xF]);
+    fifo->get = (fifo->get + 1) % SIM_FDCAN_RX_FIFO_LEN;
+    fifo->fill--;
+    return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_FDCAN_GetTxEvent(FDCAN_HandleTypeDef *hfdcan, FDCAN_TxEventFifoTypeDef *pTxEvent)
+{
+    if (sim_fdcan_tx_evt_fifo.fill == 0)
+    {
+        hfdcan->ErrorCode |= HAL_FDCAN_ERROR_FIFO_EMPTY;
+        return HAL_ERROR;
+    }
+
+    *pTxEvent = sim_fdcan_tx_evt_fifo.event[sim_fdcan_tx_evt_fifo.get];
+    sim_fdcan_tx_evt_fifo.get = (sim_fdcan_tx_evt_fifo.get + 1) % SIM_FDCAN_TX_EVT_LEN;
+    sim_fdcan_tx_evt_fifo.fill--;
+    return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_FDCAN_GetProtocolStatus(FDCAN_HandleTypeDef *hfdcan, FDCAN_ProtocolStatusTypeDef *ProtocolStatus)
+{
+    memset(ProtocolStatus, 0, sizeof(FDCAN_ProtocolStatusTypeDef));
+    ProtocolStatus->LastErrorCode = FDCAN_PROTOCOL_ERROR_NONE;
+    ProtocolStatus->DataLastErrorCode = FDCAN_PROTOCOL_ERROR_NONE;
+    return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_FDCAN_GetErrorCounters(FDCAN_HandleTypeDef *hfdcan, FDCAN_ErrorCountersTypeDef *ErrorCounters)
+{
+    memset(ErrorCounters, 0, sizeof(FDCAN_ErrorCountersTypeDef));
+    return HAL_OK;
+}
+
+uint32_t HAL_FDCAN_GetRxFifoFillLevel(FDCAN_HandleTypeDef *hfdcan, uint32_t RxFifo)
+{
+    return sim_fdcan_rx_fifo[RxFifo == FDCAN_RX_FIFO0 ? 0 : 1].fill;
+}
+
+uint32_t HAL_FDCAN_GetTxFifoFreeLevel(FDCAN_HandleTypeDef *hfdcan)
+{
+    return sim_fdcan1.TXFQS & FDCAN_TXFQS_TFFL;
+}
+
+// Receive a frame from the simulated bus (passes the acceptance filter like the hardware)
+HAL_StatusTypeDef sim_fdcan_inject(FDCAN_RxHeaderTypeDef *header, uint8_t *data)
+{
+    if (!sim_fdcan_started) return HAL_ERROR;
+
+    FDCAN_RxHeaderTypeDef rx_header = *header;
+    sim_get_time_ns();
+    rx_header.RxTimestamp = sim_tim3.CNT;
+
+    return sim_fdcan_store_rx(&rx_header, data);
+}
+
+// Store a Tx event of no frame from the Tx FIFO, like one left over from a frame that was removed from the queue
+HAL_StatusTypeDef sim_fdcan_inject_tx_event(FDCAN_TxEventFifoTypeDef *event)
+{
+    if (!sim_fdcan_started || sim_fdcan_tx_evt_fifo.fill >= SIM_FDCAN_TX_EVT_LEN) return HAL_ERROR;
+
+    uint32_t put = (sim_fdcan_tx_evt_fifo.get + sim_fdcan_tx_evt_fifo.fill) % SIM_FDCAN_TX_EVT_LEN;
+    sim_fdcan_tx_evt_fifo.event[put] = *event;
+    sim_get_time_ns();
+    sim_fdcan_tx_evt_fifo.event[put].TxTimestamp = sim_tim3.CNT;
+    sim_fdcan_tx_evt_fifo.fill++;
+    sim_fdcan_raise(FDCAN_IR_TEFN);
+
+    return HAL_OK;
+}
+
+// Return the number of free elements in the Rx FIFO
+uint32_t sim_fdcan_get_rx_free_level(uint32_t fifo)
+{
+    return SIM_FDCAN_RX_FIFO_LEN - sim_fdcan_rx_fifo[fifo == FDCAN_RX_FIFO0 ? 0 : 1].fill;
+}
+
+// Send the oldest pending frame in the Tx FIFO on the simulated bus, return the number of frames sent.
+// One frame per call models a bus that is as fast as one pass of the main loop.
+uint32_t sim_fdcan_bus_step(void)
+{
+    uint32_t sent = 0;
+
+    if (!sim_fdcan_started || sim_fdcan_handle == NULL) return 0;
+    if (sim_fdcan_handle->Init.Mode == FDCAN_MODE_BUS_MONITORING) return 0;
+
+    if (sim_fdcan_tx_fifo.fill > 0)
+    {
+        // The queue operation sends the highest priority frame, move it to the get index
+        if (sim_fdcan_handle->Init.TxFifoQueueMode == FDCAN_TX_QUEUE_OPERATION)
+        {
+            uint32_t best = sim_fdcan_tx_fifo.get;
+            for (uint32_t i = 1; i < sim_fdcan_tx_fifo.fill; i++)
+            {
+                uint32_t idx = (sim_fdcan_tx_fifo.get + i) % SIM_FDCAN_TX_FIFO_LEN;
+                if (sim_fdcan_get_tx_priority(&sim_fdcan_tx_fifo.header[idx]) < sim_fdcan_get_tx_priority(&sim_fdcan_tx_fifo.header[best]))
+                    best = idx;
+            }
+            if (best != sim_fdcan_tx_fifo.get)
+            {
+                FDCAN_TxHeaderTypeDef header = sim_fdcan_tx_fifo.header[best];
+                uint8_t data[SIM_FDCAN_DATA_LEN];
+                memcpy(data, sim_fdcan_tx_fifo.data[best], SIM_FDCAN_DATA_LEN);
+                sim_fdcan_tx_fifo.header[best] = sim_fdcan_tx_fifo.header[sim_fdcan_tx_fifo.get];
+                memcpy(sim_fdcan_tx_fifo.data[best], sim_fdcan_tx_fifo.data[sim_fdcan_tx_fifo.get], SIM_FDCAN_DATA_LEN);
+                sim_fdcan_tx_fifo.header[sim_fdcan_tx_fifo.get] = header;
+                memcpy(sim_fdcan_tx_fifo.data[sim_fdcan_tx_fifo.get], data, SIM_FDCAN_DATA_LEN);
+            }
+        }
+
+        FDCAN_TxHeaderTypeDef *tx_header = &sim_fdcan_tx_fifo.header[sim_fdcan_tx_fifo.get];
+        uint8_t *tx_data = sim_fdcan_tx_fifo.data[sim_fdcan_tx_fifo.get];
+
+        sim_get_time_ns();
+
+        // Store Tx event
+        if (tx_header->TxEventFifoControl == FDCAN_STORE_TX_EVENTS)
+        {
+            if (sim_fdcan_tx_evt_fifo.fill < SIM_FDCAN_TX_EVT_LEN)
+            {
+                uint32_t put = (sim_fdcan_tx_evt_fifo.get + sim_fdcan_tx_evt_fifo.fill) % SIM_FDCAN_TX_EVT_LEN;
+                FDCAN_TxEventFifoTypeDef *event = &sim_fdcan_tx_evt_fifo.event[put];
+
+                event->Identifier = tx_header->Identifier;
+                event->IdType = tx_header->IdType;
+                event->TxFrameType = tx_header->TxFrameType;
+                event->DataLength = tx_header->DataLength;
+                event->ErrorStateIndicator = tx_header->ErrorStateIndicator;
+                event->BitRateSwitch = tx_header->BitRateSwitch;
+                event->FDFormat = tx_header->FDFormat;
+                event->TxTimestamp = sim_tim3.CNT;
+                event->MessageMarker = tx_header->MessageMarker;
+                event->EventType = FDCAN_TX_EVENT;
+                sim_fdcan_tx_evt_fifo.fill++;
+                sim_fdcan_raise(FDCAN_IR_TEFN);
+            }
+            else
+            {
+                sim_fdcan_stats.tx_evt_lost++;
+                sim_fdcan_raise(FDCAN_IR_TEFL);
+            }
+        }
+
+        // Receive own frame in loopback mode
+        if (sim_fdcan_handle->Init.Mode == FDCAN_MODE_INTERNAL_LOOPBACK ||
+            sim_fdcan_handle->Init.Mode == FDCAN_MODE_EXTERNAL_LOOPBACK)
+        {
+            FDCAN_RxHeaderTypeDef rx_header = {0};
+            rx_header.Identifier = tx_header->Identifier;
+            rx_header.IdType = tx_header->IdType;
+            rx_header.RxFrameType = tx_header->TxFrameType;
+            rx_header.DataLength = tx_header->DataLength;
+            rx_header.ErrorStateIndicator = tx_header->ErrorStateIndicator;
+            rx_header.BitRateSwitch = tx_header->BitRateSwitch;
+            rx_header.FDFormat = tx_header->FDFormat;
+            rx_header.RxTimestamp = sim_tim3.CNT;
+            sim_fdcan_store_rx(&rx_header, tx_data);
+        }
+
+        sim_fdcan_tx_fifo.get = (sim_fdcan_tx_fifo.get + 1) % SIM_FDCAN_TX_FIFO_LEN;
+        sim_fdcan_tx_fifo.fill--;
+        sim_fdcan_update_tx_status();
+        sim_fdcan_stats.tx_frames++;
+        sent++;
+    }
+
+    return sent;
+}
+
+// Clear the bus statistics
+void sim_fdcan_clear_stats(void)
+{
+    memset(&sim_fdcan_stats, 0, sizeof(sim_fdcan_stats));
+}
+
+// Return the bus statistics
+struct sim_fdcan_stats sim_fdcan_get_stats(void)
+{
+    return sim_fdcan_stats;
+}
+
+// Check if the identifier matches a filter element
+uint8_t sim_fdcan_filter_match(FDCAN_FilterTypeDef *filter, uint32_t id)
+{
+    switch (filter->FilterType)
+    {
+    case FDCAN_FILTER_RANGE:
+    case FDCAN_FILTER_RANGE_NO_EIDM:
+        return (filter->FilterID1 <= id && id <= filter->FilterID2);
+    case FDCAN_FILTER_DUAL:
+        return (id == filter->FilterID1 || id == filter->FilterID2);
+    case FDCAN_FILTER_MASK:
+        return ((id & filter->FilterID2) == (filter->FilterID1 & filter->FilterID2));
+    default:
+        return 0;
+    }
+}
+
+// Run the acceptance filter, return the Rx FIFO index (0 or 1) or SIM_FDCAN_REJECT
+uint8_t sim_fdcan_select_fifo(FDCAN_RxHeaderTypeDef *header)
+{
+    FDCAN_FilterTypeDef *filter = sim_fdcan_std_filter;
+    uint32_t filter_nbr = sim_fdcan_handle->Init.StdFiltersNbr;
+    uint32_t non_matching = sim_fdcan_non_matching_std;
+    uint32_t reject_remote = sim_fdcan_reject_remote_std;
+
+    if (header->IdType == FDCAN_EXTENDED_ID)
+    {
+        filter = sim_fdcan_ext_filter;
+        filter_nbr = sim_fdcan_handle->Init.ExtFiltersNbr;
+        non_matching = sim_fdcan_non_matching_ext;
+        reject_remote = sim_fdcan_reject_remote_ext;
+    }
+
+    if (header->RxFrameType == FDCAN_REMOTE_FRAME && reject_remote == FDCAN_REJECT_REMOTE)
+        return SIM_FDCAN_REJECT;
+
+    for (uint32_t i = 0; i < filter_nbr; i++)
+    {
+        if (filter[i].FilterConfig == FDCAN_FILTER_DISABLE) continue;
+        if (!sim_fdcan_filter_match(&filter[i], header->Identifier)) continue;
+
+        header->FilterIndex = i;
+        header->IsFilterMatchingFrame = 0;
+        switch (filter[i].FilterConfig)
+        {
+        case FDCAN_FILTER_TO_RXFIFO0:
+        case FDCAN_FILTER_TO_RXFIFO0_HP:
+            return 0;
+        case FDCAN_FILTER_TO_RXFIFO1:
+        case FDCAN_FILTER_TO_RXFIFO1_HP:
+            return 1;
+        default:
+            return SIM_FDCAN_REJECT;
+        }
+    }
+
+    header->IsFilterMatchingFrame = 1;
+    if (non_matching == FDCAN_ACCEPT_IN_RX_FIFO0) return 0;
+    if (non_matching == FDCAN_ACCEPT_IN_RX_FIFO1) return 1;
+    return SIM_FDCAN_REJECT;
+}
+
+// Store a received frame in the Rx FIFO selected by the filter
+HAL_StatusTypeDef sim_fdcan_store_rx(FDCAN_RxHeaderTypeDef *header, uint8_t *data)
+{
+    uint8_t fifo_idx = sim_fdcan_select_fifo(header);
+    if (fifo_idx == SIM_FDCAN_REJECT) return HAL_ERROR;
+
+    struct sim_fdcan_rx_fifo *fifo = &sim_fdcan_rx_fifo[fifo_idx];
+    if (fifo->fill >= SIM_FDCAN_RX_FIFO_LEN)
+    {
+        // Blocking mode: the new message is lost
+        sim_fdcan_stats.rx_lost++;
+        sim_fdcan_raise((fifo_idx == 0) ? FDCAN_IR_RF0L : FDCAN_IR_RF1L);
+        return HAL_BUSY;
+    }
+
+    uint32_t put = (fifo->get + fifo->fill) % SIM_FDCAN_RX_FIFO_LEN;
+    fifo->header[put] = *header;
+    memcpy(fifo->data[put], data, sim_fdcan_dlc_to_bytes[(header->DataLength >> 16) & 0xF]);
+    fifo->fill++;
+    sim_fdcan_stats.rx_frames++;
+    sim_fdcan_raise((fifo_idx == 0) ? FDCAN_IR_RF0N : FDCAN_IR_RF1N);
+    return HAL_OK;
+}
+
+// Empty all message RAM FIFOs and clear the interrupt flags
+void sim_fdcan_reset_fifos(void)
+{
+    memset(sim_fdcan_rx_fifo, 0, sizeof(sim_fdcan_rx_fifo));
+    memset(&sim_fdcan_tx_fifo, 0, sizeof(sim_fdcan_tx_fifo));
+    memset(&sim_fdcan_tx_evt_fifo, 0, sizeof(sim_fdcan_tx_evt_fifo));
+    sim_fdcan1.IR = 0;
+    sim_fdcan_update_tx_status();
+}
+
+// Update the free level and the full flag of the Tx FIFO/queue, the free level reads 0 in the queue operation
+void sim_fdcan_update_tx_status(void)
+{
+    uint32_t free_level = SIM_FDCAN_TX_FIFO_LEN - sim_fdcan_tx_fifo.fill;
+
+    sim_fdcan1.TXFQS = 0;
+    if (sim_fdcan_handle == NULL || sim_fdcan_handle->Init.TxFifoQueueMode != FDCAN_TX_QUEUE_OPERATION)
+        sim_fdcan1.TXFQS |= free_level;
+    if (free_level == 0)
+        sim_fdcan1.TXFQS |= FDCAN_TXFQS_TFQF;
+}
+
+// Return the bits of a frame in the order of arbitration, lower value wins
+uint32_t sim_fdcan_get_tx_priority(FDCAN_TxHeaderTypeDef *header)
+{
+    uint32_t remote = (header->TxFrameType == FDCAN_REMOTE_FRAME) ? 1 : 0;
+
+    // Base ID, RTR or SRR, IDE, ID extension and RTR
+    if (header->IdType == FDCAN_EXTENDED_ID)
+        return ((header->Identifier >> 18) << 21) | (3 << 19) | ((header->Identifier & 0x3FFFF) << 1) | remote;
+    return (header->Identifier << 21) | (remote << 20);
+}
+
+// Return the interrupts assigned to line 1 by the groups in ILS
+uint32_t sim_fdcan_get_line1_its(void)
+{
+    uint32_t its = 0;
+
+    if (sim_fdcan1.ILS & FDCAN_IT_GROUP_RX_FIFO0) its |= FDCAN_IT_LIST_RX_FIFO0;
+    if (sim_fdcan1.ILS & FDCAN_IT_GROUP_RX_FIFO1) its |= FDCAN_IT_LIST_RX_FIFO1;
+    if (sim_fdcan1.ILS & FDCAN_IT_GROUP_SMSG) its |= FDCAN_IT_LIST_SMSG;
+    if (sim_fdcan1.ILS & FDCAN_IT_GROUP_TX_FIFO_ERROR) its |= FDCAN_IT_LIST_TX_FIFO_ERROR;
+    if (sim_fdcan1.ILS & FDCAN_IT_GROUP_MISC) its |= FDCAN_IT_LIST_MISC;
+    if (sim_fdcan1.ILS & FDCAN_IT_GROUP_BIT_LINE_ERROR) its |= FDCAN_IT_LIST_BIT_LINE_ERROR;
+    if (sim_fdcan1.ILS & FDCAN_IT_GROUP_PROTOCOL_ERROR) its |= FDCAN_IT_LIST_PROTOCOL_ERROR;
+    return its;
+}
+
+// Set interrupt flags and run the handler of an enabled line right away, as if it
+// preempted the main loop at the moment of the bus event
+void sim_fdcan_raise(uint32_t flags)
+{
+    sim_fdcan1.IR |= flags;
+
+    uint32_t pending = sim_fdcan1.IR & sim_fdcan1.IE;
+    uint32_t line1_its = sim_fdcan_get_line1_its();
+
+    if ((pending & ~line1_its) && (sim_fdcan1.ILE & FDCAN_INTERRUPT_LINE0) && sim_nvic_is_enabled(FDCAN1_IT0_IRQn))
+        can_irq_rx_handler();
+    if ((pending & line1_its) && (sim_fdcan1.ILE & FDCAN_INTERRUPT_LINE1) && sim_nvic_is_enabled(FDCAN1_IT1_IRQn))
+        can_irq_err_handler();
+}
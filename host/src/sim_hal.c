@@ -0,0 +1,173 @@
+//
+// sim_hal: host stand-in for the core HAL, system and nvm functions
+//
+
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+#include "stm32g4xx_hal.h"
+#include "nvm.h"
+#include "system.h"
+#include "timebase.h"
+#include "timesync.h"
+#include "sim.h"
+
+// Simulated register blocks
+RCC_TypeDef sim_rcc = {0};
+FDCAN_GlobalTypeDef sim_fdcan1 = {0};
+TIM_TypeDef sim_tim3 = {0};
+
+// Private variables
+static struct timespec sim_start_time;
+static uint8_t sim_nvic_enabled[FPU_IRQn + 1] = {0};
+static uint64_t sim_tim3_overflows = 0;
+static uint64_t sim_tim3_start_ns = 0;     // Time of the last update event, the count starts from zero
+static uint64_t sim_usb_frames = 0;
+
+// Reset the simulated time base
+void sim_init(void)
+{
+    clock_gettime(CLOCK_MONOTONIC, &sim_start_time);
+    sim_tim3.CNT = 0;
+    sim_tim3.SR = 0;
+    sim_tim3.PSC = 159;     // 1MHz as set up by system_init()
+    sim_tim3.EGR = 0;
+    sim_tim3_overflows = 0;
+    sim_tim3_start_ns = 0;
+    sim_usb_frames = 0;
+}
+
+// Return nano seconds since sim_init(), also keeps the TIM3 counter (160MHz / (PSC + 1)) running
+// and runs its update interrupt on each overflow and the USB start of frame every 1ms
+uint64_t sim_get_time_ns(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    uint64_t time_ns = (uint64_t)(now.tv_sec - sim_start_time.tv_sec) * 1000000000;
+    time_ns = time_ns + now.tv_nsec - sim_start_time.tv_nsec;
+
+    // An update event written by the firmware loads the prescaler and clears the count
+    if (sim_tim3.EGR & TIM_EGR_UG)
+    {
+        sim_tim3.EGR = 0;
+        sim_tim3_start_ns = time_ns;
+        sim_tim3_overflows = 0;
+    }
+
+    uint64_t ticks = (time_ns - sim_tim3_start_ns) * 160 / 1000 / (sim_tim3.PSC + 1);
+    sim_tim3.CNT = (uint32_t)ticks & 0xFFFF;
+    while (sim_tim3_overflows < (ticks >> 16))
+    {
+        sim_tim3_overflows++;
+        sim_tim3.SR |= TIM_SR_UIF;
+        if (sim_nvic_is_enabled(TIM3_IRQn))
+            timebase_irq_handler();
+    }
+
+    // The host clock is the same as the device clock, so there is no drift
+    while (sim_usb_frames < time_ns / 1000000)
+    {
+        sim_usb_frames++;
+        timesync_irq_sof_handler((uint16_t)sim_usb_frames & (TIMESYNC_FRAME_NUM - 1));
+    }
+    return time_ns;
+}
+
+// Return a free running cycle counter, the host counterpart of DWT->CYCCNT
+uint64_t sim_get_cycles(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return sim_get_time_ns();
+#endif
+}
+
+// System tick in milli seconds
+uint32_t HAL_GetTick(void)
+{
+    return (uint32_t)(sim_get_time_ns() / 1000000);
+}
+
+void HAL_Delay(uint32_t Delay)
+{
+    uint32_t tickstart = HAL_GetTick();
+    while ((HAL_GetTick() - tickstart) < Delay)
+        ;
+}
+
+void HAL_GPIO_Init(GPIO_TypeDef *GPIOx, GPIO_InitTypeDef *GPIO_Init)
+{
+}
+
+void HAL_GPIO_WritePin(GPIO_TypeDef *GPIOx, uint16_t GPIO_Pin, GPIO_PinState PinState)
+{
+}
+
+// The NVIC only keeps the enable state, see sim_nvic_is_enabled()
+void HAL_NVIC_SetPriority(IRQn_Type IRQn, uint32_t PreemptPriority, uint32_t SubPriority)
+{
+}
+
+void HAL_NVIC_EnableIRQ(IRQn_Type IRQn)
+{
+    sim_nvic_enabled[IRQn] = 1;
+}
+
+void HAL_NVIC_DisableIRQ(IRQn_Type IRQn)
+{
+    sim_nvic_enabled[IRQn] = 0;
+}
+
+// Return 1 if the peripheral interrupt is enabled in the NVIC
+uint8_t sim_nvic_is_enabled(IRQn_Type IRQn)
+{
+    return sim_nvic_enabled[IRQn];
+}
+
+// Interrupts do not preempt the firmware: USB callbacks run in the main loop context
+// and the FDCAN handlers run inside the simulated bus events (see sim_fdcan.c)
+void system_irq_disable(void)
+{
+}
+
+void system_irq_enable(void)
+{
+}
+
+// No flash on the host: nothing is stored
+void nvm_init(void)
+{
+}
+
+HAL_StatusTypeDef nvm_get_serial_number(uint16_t *num)
+{
+    return HAL_ERROR;
+}
+
+HAL_StatusTypeDef nvm_update_serial_number(uint16_t num)
+{
+    return HAL_ERROR;
+}
+
+HAL_StatusTypeDef nvm_apply_startup_cfg(void)
+{
+    return HAL_ERROR;
+}
+
+HAL_StatusTypeDef nvm_update_startup_cfg(uint8_t mode)
+{
+    return HAL_ERROR;
+}
+
+HAL_StatusTypeDef nvm_apply_flush_policy(void)
+{
+    return HAL_ERROR;
+}
+
+HAL_StatusTypeDef nvm_update_flush_policy(uint8_t mode, uint16_t value)
+{
+    return HAL_OK;
+}
@@ -0,0 +1,150 @@
+//
+// sim_usb: host stand-in for the USB CDC interface, or the gs_usb class when built with GS_USB
+//
+
+#include <string.h>
+#include "usbd_cdc_if.h"
+#include "buffer.h"
+#include "sim.h"
+#ifdef GS_USB
+#include "gs_usb.h"
+#include "usbd_gs_usb.h"
+#endif
+
+#define SIM_USB_FNV_OFFSET  2166136261UL
+#define SIM_USB_FNV_PRIME   16777619UL
+
+// Private variables
+static struct sim_usb_stats sim_usb_stats = {0, 0, 0, 0, SIM_USB_FNV_OFFSET};
+static uint8_t sim_usb_record_state = 0;    // 1: expecting length byte of a binary record
+static uint32_t sim_usb_record_left = 0;    // Bytes left in the current binary record
+
+#ifdef GS_USB
+static uint32_t sim_usb_xfer_left = 0;      // Bytes left in the current host to device transfer
+
+// Send host frames to the host, one transfer per frame like the device.
+// The simulated host reads without delay.
+uint8_t GS_USB_Transmit_FS(uint8_t* Buf, uint16_t Len)
+{
+    uint32_t hash = sim_usb_stats.hash;
+    uint32_t done = 0;
+
+    while (done < Len)
+    {
+        uint32_t frame_len = gs_usb_get_frame_len(&Buf[done], Len - done);
+        for (uint32_t i = done; i < done + frame_len; i++)
+            hash = (hash ^ Buf[i]) * SIM_USB_FNV_PRIME;
+        done += frame_len;
+        sim_usb_stats.lines++;
+        sim_usb_stats.transfers++;
+    }
+
+    sim_usb_stats.hash = hash;
+    sim_usb_stats.bytes += Len;
+
+    return USBD_OK;
+}
+
+uint8_t GS_USB_Transmit_Busy_FS(void)
+{
+    return 0;
+}
+
+// Nothing to resume, sim_usb_receive() stops by itself on a full buffer
+void GS_USB_Resume_Receive_FS(void)
+{
+}
+#else
+// Send data to the host. The simulated host reads without delay, so the
+// transfer is complete when this returns.
+uint8_t CDC_Transmit_FS(uint8_t* Buf, uint16_t Len)
+{
+    uint32_t hash = sim_usb_stats.hash;
+
+    for (uint16_t i = 0; i < Len; i++)
+    {
+        // Binary records start with a byte with bit 7 set, followed by the record length
+        if (sim_usb_record_left > 0)
+        {
+            if (--sim_usb_record_left == 0) sim_usb_stats.lines++;
+        }
+        else if (sim_usb_record_state)
+        {
+            sim_usb_record_state = 0;
+            sim_usb_record_left = Buf[i] > 2 ? Buf[i] - 2 : 0;
+            if (sim_usb_record_left == 0) sim_usb_stats.lines++;
+        }
+        else if (Buf[i] & 0x80) sim_usb_record_state = 1;
+        else if (Buf[i] == '\r') sim_usb_stats.lines++;
+        else if (Buf[i] == '\a') sim_usb_stats.bells++;
+        hash = (hash ^ Buf[i]) * SIM_USB_FNV_PRIME;
+    }
+
+    sim_usb_stats.hash = hash;
+    sim_usb_stats.bytes += Len;
+    sim_usb_stats.transfers++;
+
+    return USBD_OK;
+}
+
+uint8_t CDC_Transmit_Busy_FS(void)
+{
+    return 0;
+}
+
+// Nothing to resume, sim_usb_receive() stops by itself on a full buffer
+void CDC_Resume_Receive_FS(void)
+{
+}
+#endif
+
+// Receive data from the host in packets of CDC_DATA_FS_MAX_PACKET_SIZE like
+// CDC_Receive_FS(), and stop (NAK) at the same point when the buffer is full.
+// With GS_USB each host frame in the data is a transfer ending with a short packet.
+// Return the number of bytes accepted.
+uint32_t sim_usb_receive(const uint8_t *data, uint32_t len)
+{
+    uint32_t done = 0;
+
+    while (done < len)
+    {
+        uint32_t new_head = (buf_cdc_rx.head + 1) % BUF_CDC_RX_NUM_BUFS;
+        if (new_head == buf_cdc_rx.tail) break;
+
+        uint32_t pkt_len = len - done;
+        if (pkt_len > BUF_CDC_RX_BUF_SIZE) pkt_len = BUF_CDC_RX_BUF_SIZE;
+#ifdef GS_USB
+        if (sim_usb_xfer_left == 0) sim_usb_xfer_left = gs_usb_get_frame_len((uint8_t *)&data[done], len - done);
+        if (pkt_len > sim_usb_xfer_left) pkt_len = sim_usb_xfer_left;
+        sim_usb_xfer_left -= pkt_len;
+#endif
+
+        memcpy((uint8_t *)buf_cdc_rx.data[buf_cdc_rx.head], &data[done], pkt_len);
+        buf_cdc_rx.msglen[buf_cdc_rx.head] = pkt_len;
+        buf_cdc_rx.head = new_head;
+        done += pkt_len;
+    }
+
+    return done;
+}
+
+// Return 1 if all received packets are processed
+uint8_t sim_usb_is_rx_empty(void)
+{
+    return (buf_cdc_rx.head == buf_cdc_rx.tail);
+}
+
+// Clear the stream statistics
+void sim_usb_clear_stats(void)
+{
+    memset(&sim_usb_stats, 0, sizeof(sim_usb_stats));
+    sim_usb_stats.hash = SIM_USB_FNV_OFFSET;
+    sim_usb_record_state = 0;
+    sim_usb_record_left = 0;
+}
+
+// Return the stream statistics
+struct sim_usb_stats sim_usb_get_stats(void)
+{
+    return sim_usb_stats;
+}
@@ -9,11 +9,28 @@
 #define BUF_CDC_RX_BUF_SIZE CDC_DATA_FS_MAX_PACKET_SIZE // Size of RX buffer item
 
 // CDC transmit buffering
-#define BUF_CDC_TX_NUM_BUFS 3
-#define BUF_CDC_TX_BUF_SIZE 4096 // Set to 64 * 64 for max single packet size
+#define BUF_CDC_TX_BUF_SIZE 4096 // Byte ring, the largest contiguous span is sent in one transfer
+
+// CDC transmit flush policy limits
+#define BUF_CDC_FLUSH_BYTES_MAX (BUF_CDC_TX_BUF_SIZE / 2)   // Larger thresholds could stall the reservation of a report
+#define BUF_CDC_FLUSH_TIME_MAX  (50000)  // us, must stay below the 16 bit range of the time
+#define BUF_CDC_FLUSH_HOLD_MAX  (10000)  // us, data below the byte threshold is sent after this time
 
 // CAN transmit buffering
-#define BUF_CAN_TXQUEUE_LEN 64   // Number of buffers allocated
+#define BUF_CAN_TX_BUF_SIZE 6400 // Byte ring of packed frames, the size of the former 64 slots of header and 64 data bytes
+#define BUF_CAN_TX_WAIT_TIMEOUT 100 // ms, frames are rejected when the full queue does not move for this time
+#define BUF_CAN_TX_INFLIGHT_LEN 64  // Frames waiting for the Tx event in priority order, more than the controller and the event ring hold
+#define BUF_CAN_TX_PRIO_CLASSES 4   // Classes of the residency time by the two MSBs of the base ID
+
+// Flush policy of the cdc transmit buffer
+enum buf_flush_mode
+{
+    BUF_FLUSH_IMMEDIATE = 0,    /* Send as soon as the endpoint is idle */
+    BUF_FLUSH_BYTES,            /* Send when the given number of bytes is pending */
+    BUF_FLUSH_TIME,             /* Send when the oldest pending byte is older than the given us */
+
+    BUF_FLUSH_INVALID
+};
 
 // Receive buffering: circular buffer FIFO
 struct buf_cdc_rx
@@ -24,13 +41,14 @@ struct buf_cdc_rx
 	uint32_t tail;
 };
 
-// Transmit buffering: triple buffers
+// Transmit buffering: byte ring, reports are written in contiguous spans
 struct buf_cdc_tx
 {
-	uint8_t data[BUF_CDC_TX_NUM_BUFS][BUF_CDC_TX_BUF_SIZE];
-	uint32_t msglen[BUF_CDC_TX_NUM_BUFS];
-	uint32_t head;
-	uint32_t tail;
+	uint8_t data[BUF_CDC_TX_BUF_SIZE];
+	uint32_t head;      // Next byte to write
+	uint32_t tail;      // First byte not sent yet
+	uint32_t wrap;      // End of data before the head wrapped around, valid while head < tail
+	uint32_t send_len;  // Bytes from tail in the current transfer
 };
 
 // Public variables
@@ -41,14 +59,28 @@ extern volatile struct buf_cdc_rx buf_cdc_rx;
 void buf_init(void);
 void buf_process(void);
 
+uint32_t buf_get_cdc_rx_free(void);
 void buf_enqueue_cdc(uint8_t* buf, uint16_t len);
-uint8_t *buf_get_cdc_dest(void);
+uint8_t buf_has_cdc_dest(uint32_t len);
+uint8_t *buf_reserve_cdc_dest(uint32_t len);
 void buf_comit_cdc_dest(uint32_t len);
+HAL_StatusTypeDef buf_set_flush_policy(enum buf_flush_mode mode, uint16_t value);
+enum buf_flush_mode buf_get_flush_mode(void);
+uint16_t buf_get_flush_value(void);
 
+uint8_t buf_wait_can_dest(void);
+uint8_t buf_wait_can_batch(void);
+uint8_t buf_has_can_dest(void);
+uint8_t buf_has_can_batch_dest(uint32_t frames, uint32_t bytes);
 FDCAN_TxHeaderTypeDef *buf_get_can_dest_header(void);
 uint8_t *buf_get_can_dest_data(void);
 HAL_StatusTypeDef buf_comit_can_dest(void);
-uint8_t *buf_dequeue_can_tx_data(void);
+void buf_begin_can_batch(void);
+void buf_end_can_batch(void);
+void buf_cancel_can_batch(void);
+uint8_t *buf_dequeue_can_tx_data(FDCAN_TxEventFifoTypeDef *tx_event, uint64_t time_ticks);
 void buf_clear_can_buffer(void);
+uint32_t buf_get_can_tx_residency_ave_us(uint8_t prio_class);
+uint32_t buf_get_can_tx_residency_max_us(uint8_t prio_class);
 
 #endif
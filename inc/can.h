@@ -37,6 +37,88 @@ enum can_bus_state
     BUS_OPENED
 };
 
+// Order of the frames from the host on the bus
+enum can_tx_order
+{
+    CAN_TX_ORDER_FIFO = 0,      // As sent by the host
+    CAN_TX_ORDER_PRIORITY,      // Highest priority (lowest ID) first, as in arbitration
+
+    CAN_TX_ORDER_INVALID,
+};
+
+// Type of an entry of the filter list
+enum can_filter_type
+{
+    CAN_FILTER_OFF = 0,         // Entry not in use
+    CAN_FILTER_MASK,            // ID1 is the code, ID2 is the mask (1: the bit is compared)
+    CAN_FILTER_RANGE,           // From ID1 to ID2
+    CAN_FILTER_DUAL,            // ID1 or ID2
+
+    CAN_FILTER_INVALID,
+};
+
+// Filter list in the message RAM, one element of each ID type is kept for the frames not accepted
+#define CAN_FILTER_STD_NUM              (27)    // 28 standard filter elements
+#define CAN_FILTER_EXT_NUM              (7)     // 8 extended filter elements
+
+// Bitmap of the standard IDs accepted in software, one bit per ID
+#define CAN_FILTER_BITMAP_WORDS         (2048 / 32)
+
+// Hash set of the extended IDs checked in software
+#define CAN_FILTER_HASH_BITS            (9)
+#define CAN_FILTER_HASH_SLOTS           (1 << CAN_FILTER_HASH_BITS)   // Open addressing with linear probing
+#define CAN_FILTER_HASH_ENTRIES         (256)   // Kept at half of the slots for short probes
+
+// Use of the hash set
+enum can_filter_hash_mode
+{
+    CAN_FILTER_HASH_OFF = 0,
+    CAN_FILTER_HASH_ALLOW,      // Only the extended IDs in the set are reported
+    CAN_FILTER_HASH_DENY,       // The extended IDs in the set are not reported
+
+    CAN_FILTER_HASH_INVALID,
+};
+
+// Statistics of the hash set
+struct can_filter_hash_stats
+{
+    uint32_t entries;
+    uint32_t max_probes;        // Longest probe sequence to find an entry
+    uint32_t frames;            // Frames checked since the mode was set or the channel was opened
+    uint32_t probes;            // Slots read for the frames above
+    uint32_t rejected;
+};
+
+// Payload filter rules checked before the frame is reported
+#define CAN_FILTER_DATA_NUM             (8)
+#define CAN_FILTER_DATA_LEN             (8)     // Bytes compared from the start of the payload at most
+
+// Rule of the payload filter, a frame of a matching ID is reported only if the data of any rule matches
+struct can_data_filter
+{
+    uint32_t id_type;           // FDCAN_STANDARD_ID or FDCAN_EXTENDED_ID
+    uint32_t id;
+    uint32_t id_mask;           // Bits set are compared
+    uint8_t len;                // Bytes compared, the frames shorter do not match
+    uint8_t mask[CAN_FILTER_DATA_LEN];
+    uint8_t value[CAN_FILTER_DATA_LEN];
+    uint8_t active;
+};
+
+// Change-only reporting, the frames with the same payload as the last report of the ID are suppressed
+#define CAN_CHANGE_BITS                 (7)
+#define CAN_CHANGE_SLOTS                (1 << CAN_CHANGE_BITS)    // Open addressing with linear probing
+#define CAN_CHANGE_IDS                  (96)    // IDs tracked, the frames of the other IDs are always reported
+
+// Statistics of the change-only reporting
+struct can_change_stats
+{
+    uint32_t ids;
+    uint32_t suppressed;        // Frames not reported since the mode was set or the channel was opened
+    uint32_t keepalive;         // Frames reported with an unchanged payload
+    uint32_t untracked;         // Frames reported as the table was full
+};
+
 // Structure for CAN bus error state
 struct can_error_state
 {
@@ -64,6 +146,8 @@ void can_init(void);
 HAL_StatusTypeDef can_enable(void);
 HAL_StatusTypeDef can_disable(void);
 void can_process(void);
+void can_irq_rx_handler(void);
+void can_irq_err_handler(void);
 
 // Bit rate functions
 HAL_StatusTypeDef can_set_bitrate(enum can_bitrate bitrate);
@@ -82,19 +166,50 @@ uint32_t can_get_filter_std_code(void);
 uint32_t can_get_filter_std_mask(void);
 uint32_t can_get_filter_ext_code(void);
 uint32_t can_get_filter_ext_mask(void);
+HAL_StatusTypeDef can_set_filter_entry(uint32_t id_type, uint8_t idx, enum can_filter_type type, uint32_t id1, uint32_t id2);
+HAL_StatusTypeDef can_get_filter_entry(uint32_t id_type, uint8_t idx, enum can_filter_type *type, uint32_t *id1, uint32_t *id2);
+uint32_t can_get_filter_entry_mask(uint32_t id_type);
+HAL_StatusTypeDef can_set_filter_bitmap_state(FunctionalState state);
+FunctionalState can_is_filter_bitmap_enabled(void);
+HAL_StatusTypeDef can_set_filter_bitmap_range(uint32_t from, uint32_t to, uint8_t accept);
+HAL_StatusTypeDef can_set_filter_bitmap_word(uint8_t idx, uint32_t word);
+uint32_t can_get_filter_bitmap_word(uint8_t idx);
+uint32_t can_get_filter_bitmap_ids(void);
+uint32_t can_get_filter_bitmap_rejected(void);
+HAL_StatusTypeDef can_set_filter_hash_mode(enum can_filter_hash_mode mode);
+enum can_filter_hash_mode can_get_filter_hash_mode(void);
+HAL_StatusTypeDef can_add_filter_hash_entry(uint32_t id, uint8_t pgn_only);
+HAL_StatusTypeDef can_remove_filter_hash_entry(uint32_t id, uint8_t pgn_only);
+void can_clear_filter_hash(void);
+struct can_filter_hash_stats can_get_filter_hash_stats(void);
+HAL_StatusTypeDef can_set_filter_data_rule(uint8_t idx, struct can_data_filter *rule);
+HAL_StatusTypeDef can_remove_filter_data_rule(uint8_t idx);
+const struct can_data_filter *can_get_filter_data_rule(uint8_t idx);
+uint8_t can_get_filter_data_mask(void);
+uint32_t can_get_filter_data_rejected(void);
+void can_set_change_only(FunctionalState state, uint16_t keepalive_ms, uint16_t keepalive_frames);
+FunctionalState can_is_change_only_enabled(void);
+void can_get_change_only_keepalive(uint16_t *keepalive_ms, uint16_t *keepalive_frames);
+struct can_change_stats can_get_change_only_stats(void);
 
 // CAN mode and status
 HAL_StatusTypeDef can_set_mode(uint32_t mode);
 HAL_StatusTypeDef can_set_auto_retransmit(FunctionalState state);
+HAL_StatusTypeDef can_set_tx_order(enum can_tx_order order);
+enum can_tx_order can_get_tx_order(void);
 enum can_bus_state can_get_bus_state(void);
 struct can_error_state can_get_error_state(void);
 FunctionalState can_is_tx_enabled(void);
+uint8_t can_is_tx_queue_full(void);
+uint8_t can_is_rx_ring_full(void);
 uint32_t can_get_bus_load_ppm(void);
 
 // Cycle time functions
 void can_clear_cycle_time(void);
 uint32_t can_get_cycle_ave_time_ns(void);
 uint32_t can_get_cycle_max_time_ns(void);
+uint32_t can_get_frames_max_per_pass(void);
+uint32_t can_get_frames_ave_per_pass(void);
 
 FDCAN_HandleTypeDef *can_get_handle(void);
 
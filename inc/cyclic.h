@@ -0,0 +1,37 @@
+#ifndef _CYCLIC_H
+#define _CYCLIC_H
+
+#define CYCLIC_ENTRY_NUM        (16)            /* Entries of the table, one hex digit in the commands */
+#define CYCLIC_PERIOD_MIN_US    (100)           /* Shortest period, a few frames on the bus at 1Mbps */
+#define CYCLIC_PERIOD_MAX_US    (0x7FFFFFFF)    /* Must stay in half of the 32 bit time range */
+#define CYCLIC_MARKER_BASE      (0xF0)          /* Message marker of the entry 0, the host frames use 0 */
+
+// Periodic frame transmitted by the device
+struct cyclic_entry
+{
+    FDCAN_TxHeaderTypeDef header;
+    uint8_t data[64];
+    uint32_t period_us;
+    uint32_t phase_us;          // Offset of the first frame from the start of the schedule
+    uint32_t next_us;           // Time to queue the next frame
+    uint32_t last_tx_us;        // Time the previous frame was sent on the bus
+    uint32_t frames;            // Frames sent on the bus
+    uint32_t periods;           // Periods measured for the jitter
+    int32_t jitter_min_us;      // Difference of the achieved period from the nominal
+    int32_t jitter_max_us;
+    uint8_t timed;              // Set once a frame was sent since the schedule started
+    uint8_t active;
+};
+
+// Prototypes
+void cyclic_init(void);
+void cyclic_process(void);
+void cyclic_process_tx_event(FDCAN_TxEventFifoTypeDef *tx_event, uint64_t time_ticks);
+
+HAL_StatusTypeDef cyclic_set_entry(uint8_t idx, FDCAN_TxHeaderTypeDef *header, uint8_t *data, uint32_t period_us, uint32_t phase_us);
+HAL_StatusTypeDef cyclic_remove_entry(uint8_t idx);
+HAL_StatusTypeDef cyclic_update_data(uint8_t idx, uint8_t *data, uint8_t len);
+const struct cyclic_entry *cyclic_get_entry(uint8_t idx);
+uint16_t cyclic_get_entry_mask(void);
+
+#endif // _CYCLIC_H
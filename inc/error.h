@@ -7,7 +7,6 @@ enum error_flag
     ERR_CAN_RXFAIL = 0,
     ERR_CAN_TXFAIL,
     ERR_FULLBUF_CANTX,
-    ERR_FULLBUF_USBRX,
     ERR_FULLBUF_USBTX,
     ERR_CAN_BUS_ERR,
     ERR_CAN_WARNING,
@@ -0,0 +1,180 @@
+#ifndef _GS_USB_H
+#define _GS_USB_H
+
+//
+// gs_usb: protocol of the Linux gs_usb driver (candleLight compatible)
+//
+
+#include "can.h"
+
+// Vendor requests (bRequest), wValue is the channel number
+enum gs_usb_breq
+{
+    GS_USB_BREQ_HOST_FORMAT = 0,
+    GS_USB_BREQ_BITTIMING,
+    GS_USB_BREQ_MODE,
+    GS_USB_BREQ_BERR,
+    GS_USB_BREQ_BT_CONST,
+    GS_USB_BREQ_DEVICE_CONFIG,
+    GS_USB_BREQ_TIMESTAMP,
+    GS_USB_BREQ_IDENTIFY,
+    GS_USB_BREQ_GET_USER_ID,
+    GS_USB_BREQ_SET_USER_ID,
+    GS_USB_BREQ_DATA_BITTIMING,
+    GS_USB_BREQ_BT_CONST_EXT,
+    GS_USB_BREQ_SET_TERMINATION,
+    GS_USB_BREQ_GET_TERMINATION,
+    GS_USB_BREQ_GET_STATE,
+};
+
+// Mode of GS_USB_BREQ_MODE
+enum gs_can_mode
+{
+    GS_CAN_MODE_RESET = 0,
+    GS_CAN_MODE_START,
+};
+
+// CAN state of GS_USB_BREQ_GET_STATE
+enum gs_can_state
+{
+    GS_CAN_STATE_ERROR_ACTIVE = 0,
+    GS_CAN_STATE_ERROR_WARNING,
+    GS_CAN_STATE_ERROR_PASSIVE,
+    GS_CAN_STATE_BUS_OFF,
+    GS_CAN_STATE_STOPPED,
+    GS_CAN_STATE_SLEEPING,
+};
+
+// Mode flags of GS_USB_BREQ_MODE, also used as feature bits
+#define GS_CAN_MODE_LISTEN_ONLY         (1 << 0)
+#define GS_CAN_MODE_LOOP_BACK           (1 << 1)
+#define GS_CAN_MODE_TRIPLE_SAMPLE       (1 << 2)
+#define GS_CAN_MODE_ONE_SHOT            (1 << 3)
+#define GS_CAN_MODE_HW_TIMESTAMP        (1 << 4)
+#define GS_CAN_MODE_FD                  (1 << 8)
+
+// Feature bits only
+#define GS_CAN_FEATURE_BT_CONST_EXT     (1 << 10)
+#define GS_CAN_FEATURE_GET_STATE        (1 << 13)
+
+// Flags in can_id of a host frame
+#define GS_CAN_EFF_FLAG                 0x80000000UL
+#define GS_CAN_RTR_FLAG                 0x40000000UL
+#define GS_CAN_ERR_FLAG                 0x20000000UL
+
+// Flags of a host frame
+#define GS_CAN_FLAG_OVERFLOW            (1 << 0)
+#define GS_CAN_FLAG_FD                  (1 << 1)
+#define GS_CAN_FLAG_BRS                 (1 << 2)
+#define GS_CAN_FLAG_ESI                 (1 << 3)
+
+// Echo ID of frames received from the bus
+#define GS_USB_ECHO_ID_RX               0xFFFFFFFFUL
+
+// Host frame sizes in bytes
+#define GS_USB_HOST_FRAME_HEADER_LEN    (12)
+#define GS_USB_HOST_FRAME_CLASSIC_LEN   (GS_USB_HOST_FRAME_HEADER_LEN + 8)
+#define GS_USB_HOST_FRAME_FD_LEN        (GS_USB_HOST_FRAME_HEADER_LEN + CAN_MAX_DATALEN)
+#define GS_USB_HOST_FRAME_MAX_LEN       (GS_USB_HOST_FRAME_FD_LEN + 4)  /* with timestamp */
+
+// Max packet size of the bulk endpoints, a shorter packet ends a transfer
+#define GS_USB_MAX_PACKET_SIZE          (64)
+
+// Frame exchanged over the bulk endpoints, one per USB transfer
+struct gs_host_frame
+{
+    uint32_t echo_id;
+    uint32_t can_id;
+    uint8_t can_dlc;
+    uint8_t channel;
+    uint8_t flags;
+    uint8_t reserved;
+    uint8_t data[CAN_MAX_DATALEN];
+};
+
+// GS_USB_BREQ_DEVICE_CONFIG
+struct gs_device_config
+{
+    uint8_t reserved1;
+    uint8_t reserved2;
+    uint8_t reserved3;
+    uint8_t icount;         // Number of channels minus one
+    uint32_t sw_version;
+    uint32_t hw_version;
+};
+
+// GS_USB_BREQ_MODE
+struct gs_device_mode
+{
+    uint32_t mode;
+    uint32_t flags;
+};
+
+// GS_USB_BREQ_BITTIMING and GS_USB_BREQ_DATA_BITTIMING
+struct gs_device_bittiming
+{
+    uint32_t prop_seg;
+    uint32_t phase_seg1;
+    uint32_t phase_seg2;
+    uint32_t sjw;
+    uint32_t brp;
+};
+
+// GS_USB_BREQ_BT_CONST
+struct gs_device_bt_const
+{
+    uint32_t feature;
+    uint32_t fclk_can;
+    uint32_t tseg1_min;
+    uint32_t tseg1_max;
+    uint32_t tseg2_min;
+    uint32_t tseg2_max;
+    uint32_t sjw_max;
+    uint32_t brp_min;
+    uint32_t brp_max;
+    uint32_t brp_inc;
+};
+
+// GS_USB_BREQ_BT_CONST_EXT
+struct gs_device_bt_const_ext
+{
+    uint32_t feature;
+    uint32_t fclk_can;
+    uint32_t tseg1_min;
+    uint32_t tseg1_max;
+    uint32_t tseg2_min;
+    uint32_t tseg2_max;
+    uint32_t sjw_max;
+    uint32_t brp_min;
+    uint32_t brp_max;
+    uint32_t brp_inc;
+    uint32_t dtseg1_min;
+    uint32_t dtseg1_max;
+    uint32_t dtseg2_min;
+    uint32_t dtseg2_max;
+    uint32_t dsjw_max;
+    uint32_t dbrp_min;
+    uint32_t dbrp_max;
+    uint32_t dbrp_inc;
+};
+
+// GS_USB_BREQ_GET_STATE
+struct gs_device_state
+{
+    uint32_t state;
+    uint32_t rxerr;
+    uint32_t txerr;
+};
+
+// Largest data stage of a control request
+#define GS_USB_CTRL_BUF_SIZE            (sizeof(struct gs_device_bt_const_ext))
+
+// Prototypes
+int32_t gs_usb_parse_rx_frame(uint8_t *buf, FDCAN_RxHeaderTypeDef *frame_header, uint8_t *frame_data);
+int32_t gs_usb_parse_tx_event(uint8_t *buf, FDCAN_TxEventFifoTypeDef *tx_event, uint8_t *frame_data);
+void gs_usb_parse_packet(uint8_t *buf, uint32_t len);
+uint32_t gs_usb_get_frame_len(uint8_t *buf, uint32_t len);
+int32_t gs_usb_get_ctrl_data(uint8_t breq, uint16_t channel, uint8_t *buf, uint16_t len);
+HAL_StatusTypeDef gs_usb_set_ctrl_data(uint8_t breq, uint16_t channel, uint8_t *buf, uint16_t len);
+
+#endif // _GS_USB_H
@@ -4,6 +4,8 @@
 // Prototypes
 void USB_IRQHandler(void);
 void SysTick_Handler(void);
+void FDCAN1_IT0_IRQHandler(void);
+void FDCAN1_IT1_IRQHandler(void);
 
 #endif 
 
@@ -9,4 +9,7 @@ HAL_StatusTypeDef nvm_update_serial_number(uint16_t num);
 HAL_StatusTypeDef nvm_apply_startup_cfg(void);
 HAL_StatusTypeDef nvm_update_startup_cfg(uint8_t mode);
 
+HAL_StatusTypeDef nvm_apply_flush_policy(void);
+HAL_StatusTypeDef nvm_update_flush_policy(uint8_t mode, uint16_t value);
+
 #endif // _NVM_H
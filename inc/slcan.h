@@ -7,10 +7,21 @@ enum slcan_timestamp_mode
     SLCAN_TIMESTAMP_OFF = 0,
     SLCAN_TIMESTAMP_MILLI,
     SLCAN_TIMESTAMP_MICRO,
+    SLCAN_TIMESTAMP_NANO,
+    SLCAN_TIMESTAMP_SYNC,
 
     SLCAN_TIMESTAMP_INVALID
 };
 
+// Frame report format
+enum slcan_frame_format
+{
+    SLCAN_FORMAT_ASCII = 0,
+    SLCAN_FORMAT_BINARY,
+
+    SLCAN_FORMAT_INVALID
+};
+
 // Startup mode
 enum slcan_auto_startup_mode
 {
@@ -22,14 +33,16 @@ enum slcan_auto_startup_mode
 };
 
 // Maximum rx buffer len
-#define SLCAN_MTU           (1 + 138 + 8 + 1 + 1 + 16) 
-                            /* tx z/Z plus frame 138 plus timestamp 8 plus ESI plus \r plus some padding */
+#define SLCAN_MTU           (1 + 138 + 16 + 1 + 1 + 8)
+                            /* tx z/Z plus frame 138 plus timestamp 16 plus ESI plus \r plus some padding */
+#define SLCAN_BATCH_MTU     (512)   /* Batch of transmit commands in one line, at least 3 FD frames with 64 bytes */
 #define SLCAN_STD_ID_LEN    (3)
 #define SLCAN_EXT_ID_LEN    (8)
 
 // Prototypes
-int32_t slcan_parse_rx_frame(uint8_t *buf, FDCAN_RxHeaderTypeDef *frame_header, uint8_t *frame_data);
-int32_t slcan_parse_tx_event(uint8_t *buf, FDCAN_TxEventFifoTypeDef *tx_event, uint8_t *frame_data);
+int32_t slcan_parse_rx_frame(uint8_t *buf, FDCAN_RxHeaderTypeDef *frame_header, uint8_t *frame_data, uint64_t time_ticks);
+int32_t slcan_parse_tx_event(uint8_t *buf, FDCAN_TxEventFifoTypeDef *tx_event, uint8_t *frame_data, uint64_t time_ticks);
+uint32_t slcan_parse_packet(uint8_t *buf, uint32_t len);
 void slcan_parse_str(uint8_t *buf, uint8_t len);
 void slcan_set_timestamp_mode(enum slcan_timestamp_mode mode);
 void slcan_set_report_register(uint16_t reg);
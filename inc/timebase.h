@@ -0,0 +1,24 @@
+#ifndef _TIMEBASE_H
+#define _TIMEBASE_H
+
+// Resolution of the time stamp counter TIM3
+enum timebase_resolution
+{
+    TIMEBASE_RES_MICRO = 0,     // 1MHz, the 16 bit count wraps around in 65ms
+    TIMEBASE_RES_SUB_MICRO,     // 16MHz (62.5ns), the 16 bit count wraps around in 4ms
+
+    TIMEBASE_RES_INVALID
+};
+
+// Prototypes
+void timebase_init(void);
+void timebase_irq_handler(void);
+HAL_StatusTypeDef timebase_set_resolution(enum timebase_resolution res);
+enum timebase_resolution timebase_get_resolution(void);
+uint64_t timebase_get_ticks(void);
+uint64_t timebase_extend_ticks(uint16_t cnt);
+uint64_t timebase_ticks_to_us(uint64_t ticks);
+uint64_t timebase_ticks_to_ns(uint64_t ticks);
+uint64_t timebase_get_us(void);
+
+#endif // _TIMEBASE_H
@@ -0,0 +1,16 @@
+#ifndef _TIMESYNC_H
+#define _TIMESYNC_H
+
+#define TIMESYNC_FRAME_NUM      (2048)      /* USB frame number is 11 bits */
+
+// Prototypes
+void timesync_init(void);
+void timesync_irq_sof_handler(uint16_t frame);
+void timesync_process(void);
+
+HAL_StatusTypeDef timesync_set_epoch(uint16_t frame, uint64_t host_us);
+HAL_StatusTypeDef timesync_get_sof(uint16_t *frame, uint64_t *sync_us);
+int32_t timesync_get_drift_ppb(void);
+uint64_t timesync_ticks_to_us(uint64_t ticks);
+
+#endif // _TIMESYNC_H
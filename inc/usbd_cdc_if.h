@@ -7,5 +7,7 @@ extern USBD_CDC_ItfTypeDef USBD_Interface_fops_FS;
 
 // Prototypes
 uint8_t CDC_Transmit_FS(uint8_t* Buf, uint16_t Len);
+uint8_t CDC_Transmit_Busy_FS(void);
+void CDC_Resume_Receive_FS(void);
 
 #endif
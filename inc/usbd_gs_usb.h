@@ -0,0 +1,34 @@
+#ifndef __USBD_GS_USB_H__
+#define __USBD_GS_USB_H__
+
+#include "usbd_ioreq.h"
+#include "gs_usb.h"
+
+// Endpoints, same as candleLight
+#define GS_USB_IN_EP                    0x81U
+#define GS_USB_OUT_EP                   0x02U
+
+#define USB_GS_USB_CONFIG_DESC_SIZ      32U
+
+// Class state
+typedef struct
+{
+    uint32_t ctrl_data[(GS_USB_CTRL_BUF_SIZE + 3) / 4];    // Data stage of control requests
+    uint8_t ctrl_breq;                                      // Pending host to device request, 0xFF if none
+    uint16_t ctrl_channel;
+    uint16_t ctrl_len;
+    uint8_t *rx_buf;                                        // Packet buffer of the OUT endpoint
+    uint8_t *tx_buf;                                        // Host frames not sent yet
+    uint32_t tx_len;
+    volatile uint8_t tx_state;                              // 1 while transmitting
+    uint8_t rx_stopped;                                     // 1 while the host gets NAK on a full receive buffer
+} USBD_GS_USB_HandleTypeDef;
+
+extern USBD_ClassTypeDef USBD_GS_USB;
+
+// Prototypes
+uint8_t GS_USB_Transmit_FS(uint8_t* Buf, uint16_t Len);
+uint8_t GS_USB_Transmit_Busy_FS(void);
+void GS_USB_Resume_Receive_FS(void);
+
+#endif // __USBD_GS_USB_H__
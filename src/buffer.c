@@ -7,16 +7,45 @@
 #include "error.h"
 #include "slcan.h"
 #include "system.h"
+#include "timebase.h"
+#ifdef GS_USB
+#include "gs_usb.h"
+#include "usbd_gs_usb.h"
+#endif
+
+// Flags of a packed CAN TX frame
+#define BUF_CAN_TX_FLAG_EXT_ID  (1 << 0)
+#define BUF_CAN_TX_FLAG_REMOTE  (1 << 1)
+#define BUF_CAN_TX_FLAG_FD      (1 << 2)
+#define BUF_CAN_TX_FLAG_BRS     (1 << 3)
+#define BUF_CAN_TX_FLAG_ESI     (1 << 4)
+#define BUF_CAN_TX_FLAG_EVENT   (1 << 5)
+#define BUF_CAN_TX_FLAG_DONE    (1 << 6)    // Sent in priority order, the room is freed once the older frames are done
+
+#define BUF_CAN_TX_INFLIGHT_FREE    0xFFFF
+
+// Packed CAN TX frame, entries are a multiple of 8 bytes so that an end marker always fits
+// The size is within the first 8 bytes for the end marker, and the smallest entry is 16 bytes.
+struct buf_can_tx_frame
+{
+    uint32_t identifier;
+    uint8_t flags;          // BUF_CAN_TX_FLAG_*
+    uint8_t dlc;            // DLC code
+    uint8_t marker;         // Message marker, returned in the Tx event
+    uint8_t size;           // Size of the entry with data, 0 marks the end of data before the ring wrapped around
+    uint32_t commit_us;     // Time in us when the frame was queued, for the residency time
+    uint8_t data[];         // Data bytes, none for a remote frame
+};
 
-// Cirbuf structure for CAN TX frames
+#define BUF_CAN_TX_FRAME_MAX    ((sizeof(struct buf_can_tx_frame) + CAN_MAX_DATALEN + 7) & ~7)   // Largest entry
+
+// Byte ring of packed CAN TX frames, a frame is reserved with room for the largest data
 struct buf_can_tx
 {
-    FDCAN_TxHeaderTypeDef header[BUF_CAN_TXQUEUE_LEN];  // Header buffer
-    uint8_t data[BUF_CAN_TXQUEUE_LEN][CAN_MAX_DATALEN]; // Data buffer
-    uint16_t head;                              // Head pointer
-    uint16_t send;                              // Send pointer
-    uint16_t tail;                              // Tail pointer
-    uint8_t full;                               // Set this when we are full, clear when the tail moves one.
+    uint32_t data[BUF_CAN_TX_BUF_SIZE / 4];     // Frames, word aligned
+    uint32_t head;                              // Next byte to write
+    uint32_t send;                              // First frame not given to the controller yet
+    uint32_t tail;                              // First frame waiting for its Tx event
 };
 
 // Public variables
@@ -25,57 +54,87 @@ volatile struct buf_cdc_rx buf_cdc_rx = {0};
 
 // Private variables
 static struct buf_can_tx buf_can_tx = {0};
-static uint8_t slcan_str[SLCAN_MTU];
-static uint8_t slcan_str_index = 0;
+static FDCAN_TxHeaderTypeDef buf_can_tx_dest_header;   // Header of the frame being written, packed on commit
+static struct buf_can_tx_frame *buf_can_tx_dest = NULL; // Frame being written
+static enum buf_flush_mode buf_flush_mode = BUF_FLUSH_IMMEDIATE;
+static uint16_t buf_flush_value = 0;
+static uint8_t buf_flush_holding = 0;       // Set while data is waiting for the flush policy
+static uint8_t buf_flush_due = 0;           // Set when the held data should be sent
+static uint16_t buf_flush_hold_start = 0;   // Time in us when the oldest held data was written, lower 16 bits
+static uint8_t buf_can_tx_waiting = 0;      // Set while the host waits for room in the can tx queue
+static uint32_t buf_can_tx_wait_start = 0;  // Tick when the wait started
+static uint8_t buf_can_tx_batching = 0;     // Set while the frames of a batch are queued
+static uint32_t buf_can_tx_batch_head = 0;  // Head before the batch, the frames are removed up to here on cancel
+static uint16_t buf_can_tx_heap[BUF_CAN_TX_BUF_SIZE / 16];   // Frames not given to the controller in priority order, binary heap of positions
+static uint32_t buf_can_tx_heap_len = 0;
+static uint16_t buf_can_tx_inflight[BUF_CAN_TX_INFLIGHT_LEN];   // Position of the frame by the message marker in priority order
+static uint8_t buf_can_tx_inflight_next = 0;
+static uint32_t buf_can_tx_residency_ave_us[BUF_CAN_TX_PRIO_CLASSES] = {0};
+static uint32_t buf_can_tx_residency_max_us[BUF_CAN_TX_PRIO_CLASSES] = {0};
+#ifndef GS_USB
+static uint32_t buf_cdc_rx_pos = 0;         // Bytes of the tail packet already parsed
+#endif
 
 // Private prototypes
+static uint8_t *buf_find_cdc_dest(uint32_t len);
+static struct buf_can_tx_frame *buf_find_can_dest(void);
+static struct buf_can_tx_frame *buf_get_can_tx_frame(uint32_t *pos);
+static HAL_StatusTypeDef buf_send_can_tx_frame(struct buf_can_tx_frame *frame, uint8_t marker);
+static void buf_send_can_tx_priority(void);
+static uint32_t buf_get_can_tx_priority(struct buf_can_tx_frame *frame);
+static uint8_t buf_is_can_tx_before(uint16_t pos_a, uint16_t pos_b);
+static void buf_push_can_tx_heap(uint16_t pos);
+static uint16_t buf_pop_can_tx_heap(void);
+static void buf_release_can_tx_frames(void);
+static void buf_update_can_tx_residency(uint32_t pos, uint32_t time_us);
+static uint8_t buf_wait_can_room(uint8_t has_room);
+static uint8_t buf_is_flush_due(void);
 
 // Initializes
 void buf_init(void)
 {
     buf_cdc_rx.head = 0;
     buf_cdc_rx.tail = 0;
+#ifndef GS_USB
+    buf_cdc_rx_pos = 0;
+#endif
 
-    buf_cdc_tx.head = 1;
-    buf_cdc_tx.msglen[buf_cdc_tx.head] = 0;
+    buf_cdc_tx.head = 0;
     buf_cdc_tx.tail = 0;
-    buf_cdc_tx.msglen[buf_cdc_tx.tail] = 0;
+    buf_cdc_tx.wrap = 0;
+    buf_cdc_tx.send_len = 0;
+    buf_flush_holding = 0;
+    buf_flush_due = 0;
 
-    buf_can_tx.head = 0;
-    buf_can_tx.send = 0;
-    buf_can_tx.tail = 0;
-    buf_can_tx.full = 0;
+    buf_clear_can_buffer();
+    buf_can_tx_waiting = 0;
 }
 
 // Process
 void buf_process(void)
 {
-    // Process cdc receive buffer
+    // Process cdc receive buffer, all pending packets in one pass
     system_irq_disable();
     uint32_t tmp_head = buf_cdc_rx.head;
     system_irq_enable();
-    if (buf_cdc_rx.tail != tmp_head)
-    {
-        //  Process one whole buffer
-        for (uint32_t i = 0; i < buf_cdc_rx.msglen[buf_cdc_rx.tail]; i++)
-	    {
-            if (buf_cdc_rx.data[buf_cdc_rx.tail][i] == '\r')
-            {
-                slcan_parse_str(slcan_str, slcan_str_index);
-                slcan_str_index = 0;
-            }
-            else
-            {
-                // Check for overflow of buffer
-                if (slcan_str_index >= SLCAN_MTU)
-                {
-                    // TODO: Return here and discard this CDC buffer?
-                    slcan_str_index = 0;
-                }
-
-                slcan_str[slcan_str_index++] = buf_cdc_rx.data[buf_cdc_rx.tail][i];
-            }
-        }
+    while (buf_cdc_rx.tail != tmp_head)
+    {
+#ifdef GS_USB
+        // Leave the packet in the buffer while the host waits for room, without a timeout as the
+        // host stops the channel with a control request. A frame taken here is never dropped silently.
+        if (can_is_tx_enabled() == ENABLE && !buf_has_can_dest())
+            break;
+
+        // Process one packet of a host frame
+        gs_usb_parse_packet((uint8_t *)buf_cdc_rx.data[buf_cdc_rx.tail], buf_cdc_rx.msglen[buf_cdc_rx.tail]);
+#else
+        // Process the commands in the packet, keep the rest if the replies do not fit
+        buf_cdc_rx_pos += slcan_parse_packet((uint8_t *)&buf_cdc_rx.data[buf_cdc_rx.tail][buf_cdc_rx_pos],
+                                             buf_cdc_rx.msglen[buf_cdc_rx.tail] - buf_cdc_rx_pos);
+        if (buf_cdc_rx_pos < buf_cdc_rx.msglen[buf_cdc_rx.tail])
+            break;
+        buf_cdc_rx_pos = 0;
+#endif
 
         // Move on to next buffer
         system_irq_disable();
@@ -83,105 +142,230 @@ void buf_process(void)
         system_irq_enable();
     }
 
+    // Listen to the host again if it was stopped (NAK) on a full buffer
+    system_irq_disable();
+#ifdef GS_USB
+    GS_USB_Resume_Receive_FS();
+#else
+    CDC_Resume_Receive_FS();
+#endif
+    system_irq_enable();
+
     // Process cdc transmit buffer
-    uint32_t new_head = (buf_cdc_tx.head + 1UL) % BUF_CDC_TX_NUM_BUFS;
-    if (new_head != buf_cdc_tx.tail)
+    system_irq_disable();
+#ifdef GS_USB
+    if (buf_cdc_tx.send_len > 0 && !GS_USB_Transmit_Busy_FS())
+#else
+    if (buf_cdc_tx.send_len > 0 && !CDC_Transmit_Busy_FS())
+#endif
     {
-        if (0 < buf_cdc_tx.msglen[buf_cdc_tx.head])
-        {
-            buf_cdc_tx.head = new_head;
-            buf_cdc_tx.msglen[new_head] = 0;
-        }
+        // Previous transfer is complete, release its span
+        buf_cdc_tx.tail += buf_cdc_tx.send_len;
+        buf_cdc_tx.send_len = 0;
     }
-    system_irq_disable();
-    uint32_t new_tail = (buf_cdc_tx.tail + 1UL) % BUF_CDC_TX_NUM_BUFS;
-    if (new_tail != buf_cdc_tx.head)
+    if (buf_flush_holding && !buf_flush_due)
+    {
+        // Checked even while a transfer is running, the 16 bit time must not wrap around
+        buf_flush_due = buf_is_flush_due();
+    }
+    if (buf_cdc_tx.send_len == 0 && buf_cdc_tx.tail != buf_cdc_tx.head
+        && (buf_flush_mode == BUF_FLUSH_IMMEDIATE || buf_flush_due))
     {
-        if (CDC_Transmit_FS((uint8_t *)buf_cdc_tx.data[new_tail], buf_cdc_tx.msglen[new_tail]) == USBD_OK)
+        // Continue at the start of the ring if the head has wrapped around
+        if (buf_cdc_tx.head < buf_cdc_tx.tail && buf_cdc_tx.tail == buf_cdc_tx.wrap)
+            buf_cdc_tx.tail = 0;
+
+        // Send the largest contiguous span
+        uint32_t len = (buf_cdc_tx.head < buf_cdc_tx.tail ? buf_cdc_tx.wrap : buf_cdc_tx.head) - buf_cdc_tx.tail;
+#ifdef GS_USB
+        if (len > 0 && GS_USB_Transmit_FS((uint8_t *)&buf_cdc_tx.data[buf_cdc_tx.tail], len) == USBD_OK)
+#else
+        if (len > 0 && CDC_Transmit_FS((uint8_t *)&buf_cdc_tx.data[buf_cdc_tx.tail], len) == USBD_OK)
+#endif
         {
-            buf_cdc_tx.tail = new_tail;
+            buf_cdc_tx.send_len = len;
+
+            // The data after the wrap around is still held, and as old as the data just sent
+            buf_flush_holding = (buf_cdc_tx.head < buf_cdc_tx.tail);
+            buf_flush_due = buf_flush_holding;
         }
     }
     system_irq_enable();
 
 
     // Process can transmit buffer
-    while ((buf_can_tx.send != buf_can_tx.head || buf_can_tx.full) && (HAL_FDCAN_GetTxFifoFreeLevel(can_get_handle()) > 0))
+    if (can_get_tx_order() == CAN_TX_ORDER_PRIORITY)
     {
-        HAL_StatusTypeDef status;
-
-        // Transmit can frame
-        status = HAL_FDCAN_AddMessageToTxFifoQ(can_get_handle(), 
-                                               &buf_can_tx.header[buf_can_tx.send], 
-                                               buf_can_tx.data[buf_can_tx.send]);
+        buf_send_can_tx_priority();
+        return;
+    }
 
-        buf_can_tx.send = (buf_can_tx.send + 1) % BUF_CAN_TXQUEUE_LEN;
+    while (buf_can_tx.send != buf_can_tx.head && !can_is_tx_queue_full())
+    {
+        struct buf_can_tx_frame *frame = buf_get_can_tx_frame(&buf_can_tx.send);
 
-        // This drops the packet if it fails (no retry). Failure is unlikely
-        // since we check if there is a TX mailbox free.
-        if (status != HAL_OK)
-        {
-            error_assert(ERR_CAN_TXFAIL);
-        }
+        buf_send_can_tx_frame(frame, frame->marker);
+        buf_can_tx.send += frame->size;
     }
 }
 
+// Get the number of free packet buffers in the cdc receive buffer
+uint32_t buf_get_cdc_rx_free(void)
+{
+    // One buffer is kept free to tell a full buffer from an empty one
+    return (buf_cdc_rx.tail + BUF_CDC_RX_NUM_BUFS - buf_cdc_rx.head - 1) % BUF_CDC_RX_NUM_BUFS;
+}
+
 // Enqueue data for transmission over USB CDC to host (copy and comit = slow)
 void buf_enqueue_cdc(uint8_t* buf, uint16_t len)
 {
-    if (BUF_CDC_TX_BUF_SIZE - len < buf_cdc_tx.msglen[buf_cdc_tx.head])
-    {
-        
-        error_assert(ERR_FULLBUF_USBTX);    // The data does not fit in the buffer
-    }
-    else
+    uint8_t *dest = buf_reserve_cdc_dest(len);
+
+    if (dest != NULL)
     {
         // Copy data
-        memcpy((uint8_t *)&buf_cdc_tx.data[buf_cdc_tx.head][buf_cdc_tx.msglen[buf_cdc_tx.head]], buf, len);
-        buf_cdc_tx.msglen[buf_cdc_tx.head] += len;
+        memcpy(dest, buf, len);
+        buf_comit_cdc_dest(len);
     }
 }
 
-// Get destination pointer of cdc buffer (Start position of write access)
-uint8_t *buf_get_cdc_dest(void)
+// Check if a contiguous span of len bytes is free in the cdc buffer
+uint8_t buf_has_cdc_dest(uint32_t len)
 {
-    if (BUF_CDC_TX_BUF_SIZE - SLCAN_MTU < buf_cdc_tx.msglen[buf_cdc_tx.head])
+    return (buf_find_cdc_dest(len) != NULL);
+}
+
+// Reserve a contiguous span of len bytes in the cdc buffer, return the start position of write access
+uint8_t *buf_reserve_cdc_dest(uint32_t len)
+{
+    uint8_t *dest = buf_find_cdc_dest(len);
+
+    if (dest == NULL)
     {
         error_assert(ERR_FULLBUF_USBTX);        // The data will not fit in the buffer
         return NULL;
     }
 
-    return (uint8_t *)&buf_cdc_tx.data[buf_cdc_tx.head][buf_cdc_tx.msglen[buf_cdc_tx.head]];
+    // Wrap around, the data from tail to the old head is sent first
+    if (dest == buf_cdc_tx.data && buf_cdc_tx.head != 0)
+    {
+        buf_cdc_tx.wrap = buf_cdc_tx.head;
+        buf_cdc_tx.head = 0;
+    }
+
+    return dest;
 }
 
-// Send the data bytes in destination area over USB CDC to host
+// Send the data bytes in the reserved span over USB CDC to host
 void buf_comit_cdc_dest(uint32_t len)
 {
-    buf_cdc_tx.msglen[buf_cdc_tx.head] += len;
+    buf_cdc_tx.head += len;
+
+    // Start the coalescing window at the oldest data not sent yet
+    if (buf_flush_mode != BUF_FLUSH_IMMEDIATE && !buf_flush_holding)
+    {
+        buf_flush_holding = 1;
+        buf_flush_due = 0;
+        buf_flush_hold_start = (uint16_t)timebase_get_us();
+    }
 }
 
-// Get destination pointer of can tx frame header
+// Set the flush policy of the cdc transmit buffer, value is bytes or us depending on the mode
+HAL_StatusTypeDef buf_set_flush_policy(enum buf_flush_mode mode, uint16_t value)
+{
+    if (mode == BUF_FLUSH_IMMEDIATE)
+    {
+        value = 0;
+    }
+    else if (mode == BUF_FLUSH_BYTES)
+    {
+        if (value == 0 || BUF_CDC_FLUSH_BYTES_MAX < value) return HAL_ERROR;
+    }
+    else if (mode == BUF_FLUSH_TIME)
+    {
+        if (value == 0 || BUF_CDC_FLUSH_TIME_MAX < value) return HAL_ERROR;
+    }
+    else
+    {
+        return HAL_ERROR;
+    }
+
+    buf_flush_mode = mode;
+    buf_flush_value = value;
+
+    // Do not keep the data held under the old policy
+    buf_flush_due = buf_flush_holding;
+
+    return HAL_OK;
+}
+
+// Get the flush mode of the cdc transmit buffer
+enum buf_flush_mode buf_get_flush_mode(void)
+{
+    return buf_flush_mode;
+}
+
+// Get the byte or time threshold of the flush mode
+uint16_t buf_get_flush_value(void)
+{
+    return buf_flush_value;
+}
+
+// Check if a frame from the host should wait for room in the can tx queue
+// The host is held back (NAK) instead of losing the frame, unless the queue stops moving, e.g. without ACK on the bus.
+uint8_t buf_wait_can_dest(void)
+{
+    return buf_wait_can_room(buf_find_can_dest() != NULL);
+}
+
+// Check if a batch of frames from the host should wait for room in the can tx queue, after it did not fit
+uint8_t buf_wait_can_batch(void)
+{
+    return buf_wait_can_room(0);
+}
+
+// Check if the can tx queue has room for a frame, without asserting an error
+uint8_t buf_has_can_dest(void)
+{
+    return (buf_find_can_dest() != NULL);
+}
+
+// Check if the can tx queue has room for a batch of frames with the data bytes in total
+// The frames are rounded up to 8 bytes, and the room at the end of the ring may be skipped when they wrap around.
+uint8_t buf_has_can_batch_dest(uint32_t frames, uint32_t bytes)
+{
+    uint32_t head = buf_can_tx.head;
+    uint32_t tail = buf_can_tx.tail;
+    uint32_t used = (head >= tail) ? head - tail : head + BUF_CAN_TX_BUF_SIZE - tail;
+    uint32_t need = frames * (sizeof(struct buf_can_tx_frame) + 7) + bytes + 2 * BUF_CAN_TX_FRAME_MAX;
+
+    return (BUF_CAN_TX_BUF_SIZE - 1 - used >= need);
+}
+
+// Get destination pointer of can tx frame header, it is packed into the queue on commit
 FDCAN_TxHeaderTypeDef *buf_get_can_dest_header(void)
 {
-    if (buf_can_tx.full)
+    buf_can_tx_dest = buf_find_can_dest();
+    if (buf_can_tx_dest == NULL)
     {
         error_assert(ERR_FULLBUF_CANTX);
         return NULL;
     }
 
-    return &buf_can_tx.header[buf_can_tx.head];
+    return &buf_can_tx_dest_header;
 }
 
-// Get destination pointer of can tx frame data bytes
+// Get destination pointer of can tx frame data bytes, room for the largest data is reserved
 uint8_t *buf_get_can_dest_data(void)
 {
-    if (buf_can_tx.full)
+    buf_can_tx_dest = buf_find_can_dest();
+    if (buf_can_tx_dest == NULL)
     {
         error_assert(ERR_FULLBUF_CANTX);
         return NULL;
     }
 
-    return buf_can_tx.data[buf_can_tx.head];
+    return buf_can_tx_dest->data;
 }
 
 // Send the message in destination slot on the CAN bus.
@@ -190,15 +374,42 @@ HAL_StatusTypeDef buf_comit_can_dest(void)
     if (can_is_tx_enabled() == ENABLE)
     {
         // If the queue is full
-        if (buf_can_tx.full)
+        if (buf_can_tx_dest == NULL)
         {
             error_assert(ERR_FULLBUF_CANTX);
             return HAL_ERROR;
         }
 
+        // Pack the header in front of the data, the entry takes only the data bytes of the frame
+        FDCAN_TxHeaderTypeDef *header = &buf_can_tx_dest_header;
+        struct buf_can_tx_frame *frame = buf_can_tx_dest;
+        uint8_t flags = 0;
+        if (header->IdType == FDCAN_EXTENDED_ID) flags |= BUF_CAN_TX_FLAG_EXT_ID;
+        if (header->TxFrameType == FDCAN_REMOTE_FRAME) flags |= BUF_CAN_TX_FLAG_REMOTE;
+        if (header->FDFormat == FDCAN_FD_CAN) flags |= BUF_CAN_TX_FLAG_FD;
+        if (header->BitRateSwitch == FDCAN_BRS_ON) flags |= BUF_CAN_TX_FLAG_BRS;
+        if (header->ErrorStateIndicator == FDCAN_ESI_PASSIVE) flags |= BUF_CAN_TX_FLAG_ESI;
+        if (header->TxEventFifoControl == FDCAN_STORE_TX_EVENTS) flags |= BUF_CAN_TX_FLAG_EVENT;
+
+        uint32_t bytes = (flags & BUF_CAN_TX_FLAG_REMOTE) ? 0 : (uint8_t)hal_dlc_code_to_bytes(header->DataLength);
+        frame->identifier = header->Identifier;
+        frame->flags = flags;
+        frame->dlc = (header->DataLength >> 16) & 0xF;
+        frame->marker = header->MessageMarker;
+        frame->size = (sizeof(struct buf_can_tx_frame) + bytes + 7) & ~7;
+        frame->commit_us = (uint32_t)timebase_get_us();
+
+        // Mark the end of data if the frame went to the start of the ring
+        uint32_t pos = (uint8_t *)frame - (uint8_t *)buf_can_tx.data;
+        if (pos < buf_can_tx.head && buf_can_tx.head < BUF_CAN_TX_BUF_SIZE)
+            ((struct buf_can_tx_frame *)((uint8_t *)buf_can_tx.data + buf_can_tx.head))->size = 0;
+
         // Increment the head pointer
-        buf_can_tx.head = (buf_can_tx.head + 1) % BUF_CAN_TXQUEUE_LEN;
-        if (buf_can_tx.head == buf_can_tx.tail) buf_can_tx.full = 1;
+        buf_can_tx.head = pos + frame->size;
+        buf_can_tx_dest = NULL;
+
+        if (can_get_tx_order() == CAN_TX_ORDER_PRIORITY && !buf_can_tx_batching)
+            buf_push_can_tx_heap(pos);
     }
     else
     {
@@ -208,21 +419,373 @@ HAL_StatusTypeDef buf_comit_can_dest(void)
     return HAL_OK;
 }
 
+// Start queuing the frames of a batch, they are not sent until the end of the batch
+void buf_begin_can_batch(void)
+{
+    // Let the empty queue start over at the beginning first, the batch is removed up to the head
+    buf_find_can_dest();
+    buf_can_tx_batch_head = buf_can_tx.head;
+    buf_can_tx_batching = 1;
+}
+
+// Send the frames of the batch
+void buf_end_can_batch(void)
+{
+    if (can_get_tx_order() == CAN_TX_ORDER_PRIORITY)
+    {
+        uint32_t pos = buf_can_tx_batch_head;
+        while (pos != buf_can_tx.head)
+        {
+            struct buf_can_tx_frame *frame = buf_get_can_tx_frame(&pos);
+            buf_push_can_tx_heap(pos);
+            pos += frame->size;
+        }
+    }
+
+    buf_can_tx_batching = 0;
+    buf_can_tx_waiting = 0;
+}
+
+// Remove the frames of the batch, none of them is sent
+void buf_cancel_can_batch(void)
+{
+    buf_can_tx.head = buf_can_tx_batch_head;
+    buf_can_tx_dest = NULL;
+    buf_can_tx_batching = 0;
+}
+
 // Dequeue data bytes from the can tx buffer (Delete one frame)
-uint8_t *buf_dequeue_can_tx_data(void)
+// Tx events come in the order the frames were given to the controller, so the tail is the frame of the event.
+// In priority order, the message marker tells the frame and the one from the host is put back in the event.
+// Return NULL if no frame waits for the event, e.g. the queue was cleared or the marker is stray.
+uint8_t *buf_dequeue_can_tx_data(FDCAN_TxEventFifoTypeDef *tx_event, uint64_t time_ticks)
 {
-    uint32_t tmp_tail = buf_can_tx.tail;
+    struct buf_can_tx_frame *frame;
+    uint32_t pos;
 
-    buf_can_tx.tail = (buf_can_tx.tail + 1) % BUF_CAN_TXQUEUE_LEN;
-    buf_can_tx.full = 0;
+    if (can_get_tx_order() == CAN_TX_ORDER_PRIORITY)
+    {
+        if (tx_event->MessageMarker >= BUF_CAN_TX_INFLIGHT_LEN || buf_can_tx_inflight[tx_event->MessageMarker] == BUF_CAN_TX_INFLIGHT_FREE)
+            return NULL;
 
-    return buf_can_tx.data[tmp_tail];
+        pos = buf_can_tx_inflight[tx_event->MessageMarker];
+        buf_can_tx_inflight[tx_event->MessageMarker] = BUF_CAN_TX_INFLIGHT_FREE;
+        frame = (struct buf_can_tx_frame *)((uint8_t *)buf_can_tx.data + pos);
+        tx_event->MessageMarker = frame->marker;
+        buf_update_can_tx_residency(pos, (uint32_t)timebase_ticks_to_us(time_ticks));
+
+        // The data stays until the next frame is queued
+        frame->flags |= BUF_CAN_TX_FLAG_DONE;
+        buf_release_can_tx_frames();
+
+        return frame->data;
+    }
+
+    if (buf_can_tx.tail == buf_can_tx.send)
+        return NULL;
+
+    frame = buf_get_can_tx_frame(&buf_can_tx.tail);
+    pos = buf_can_tx.tail;
+    buf_can_tx.tail += frame->size;
+    buf_update_can_tx_residency(pos, (uint32_t)timebase_ticks_to_us(time_ticks));
+
+    return frame->data;
+}
+
+// Get the average time from queuing to sending of the frames in a priority class
+uint32_t buf_get_can_tx_residency_ave_us(uint8_t prio_class)
+{
+    if (prio_class >= BUF_CAN_TX_PRIO_CLASSES) return 0;
+    return buf_can_tx_residency_ave_us[prio_class];
+}
+
+// Get the longest time from queuing to sending of the frames in a priority class
+uint32_t buf_get_can_tx_residency_max_us(uint8_t prio_class)
+{
+    if (prio_class >= BUF_CAN_TX_PRIO_CLASSES) return 0;
+    return buf_can_tx_residency_max_us[prio_class];
+}
+
+// Find room for a frame with the largest data at the head, one byte is kept free to tell a full ring from an empty one
+struct buf_can_tx_frame *buf_find_can_dest(void)
+{
+    uint32_t head = buf_can_tx.head;
+    uint32_t tail = buf_can_tx.tail;
+    uint8_t *data = (uint8_t *)buf_can_tx.data;
+
+    if (head < tail)
+    {
+        if (tail - head > BUF_CAN_TX_FRAME_MAX) return (struct buf_can_tx_frame *)&data[head];
+    }
+    else
+    {
+        if (head == tail && head != 0)
+        {
+            // Empty, start over at the beginning
+            buf_can_tx.head = 0;
+            buf_can_tx.send = 0;
+            buf_can_tx.tail = 0;
+            return (struct buf_can_tx_frame *)data;
+        }
+        if (BUF_CAN_TX_BUF_SIZE - head >= BUF_CAN_TX_FRAME_MAX) return (struct buf_can_tx_frame *)&data[head];
+        if (tail > BUF_CAN_TX_FRAME_MAX) return (struct buf_can_tx_frame *)data;
+    }
+
+    return NULL;
+}
+
+// Get the frame at a read position of the can tx buffer, the position moves to the start at the end of data
+struct buf_can_tx_frame *buf_get_can_tx_frame(uint32_t *pos)
+{
+    if (*pos == BUF_CAN_TX_BUF_SIZE || ((struct buf_can_tx_frame *)((uint8_t *)buf_can_tx.data + *pos))->size == 0)
+        *pos = 0;
+
+    return (struct buf_can_tx_frame *)((uint8_t *)buf_can_tx.data + *pos);
+}
+
+// Give a frame to the controller with the message marker returned in the Tx event
+HAL_StatusTypeDef buf_send_can_tx_frame(struct buf_can_tx_frame *frame, uint8_t marker)
+{
+    HAL_StatusTypeDef status;
+    FDCAN_TxHeaderTypeDef header;
+
+    // Unpack the header
+    header.Identifier = frame->identifier;
+    header.IdType = (frame->flags & BUF_CAN_TX_FLAG_EXT_ID) ? FDCAN_EXTENDED_ID : FDCAN_STANDARD_ID;
+    header.TxFrameType = (frame->flags & BUF_CAN_TX_FLAG_REMOTE) ? FDCAN_REMOTE_FRAME : FDCAN_DATA_FRAME;
+    header.DataLength = (uint32_t)frame->dlc << 16;
+    header.ErrorStateIndicator = (frame->flags & BUF_CAN_TX_FLAG_ESI) ? FDCAN_ESI_PASSIVE : FDCAN_ESI_ACTIVE;
+    header.BitRateSwitch = (frame->flags & BUF_CAN_TX_FLAG_BRS) ? FDCAN_BRS_ON : FDCAN_BRS_OFF;
+    header.FDFormat = (frame->flags & BUF_CAN_TX_FLAG_FD) ? FDCAN_FD_CAN : FDCAN_CLASSIC_CAN;
+    header.TxEventFifoControl = (frame->flags & BUF_CAN_TX_FLAG_EVENT) ? FDCAN_STORE_TX_EVENTS : FDCAN_NO_TX_EVENTS;
+    header.MessageMarker = marker;
+
+    // Transmit can frame. The data of a remote frame is not sent, the reserved room keeps the read in the ring.
+    status = HAL_FDCAN_AddMessageToTxFifoQ(can_get_handle(), &header, frame->data);
+
+    // This drops the packet if it fails (no retry). Failure is unlikely
+    // since we check if there is a TX mailbox free.
+    if (status != HAL_OK)
+    {
+        error_assert(ERR_CAN_TXFAIL);
+    }
+
+    return status;
+}
+
+// Give the frames to the controller in priority order, the controller also sends them in priority order (Tx queue)
+void buf_send_can_tx_priority(void)
+{
+    while (buf_can_tx_heap_len > 0 && !can_is_tx_queue_full())
+    {
+        uint32_t pos = buf_can_tx_heap[0];
+        struct buf_can_tx_frame *frame = (struct buf_can_tx_frame *)((uint8_t *)buf_can_tx.data + pos);
+        uint32_t priority = buf_get_can_tx_priority(frame);
+
+        // The controller sends frames of the same priority by the buffer index, not in the order given.
+        // Wait until the previous one is sent to keep the order of the host.
+        for (uint32_t i = 0; i < BUF_CAN_TX_INFLIGHT_LEN; i++)
+        {
+            if (buf_can_tx_inflight[i] == BUF_CAN_TX_INFLIGHT_FREE) continue;
+            if (buf_get_can_tx_priority((struct buf_can_tx_frame *)((uint8_t *)buf_can_tx.data + buf_can_tx_inflight[i])) == priority) return;
+        }
+
+        // The marker is used by the frame of an old event not processed yet
+        if ((frame->flags & BUF_CAN_TX_FLAG_EVENT) && buf_can_tx_inflight[buf_can_tx_inflight_next] != BUF_CAN_TX_INFLIGHT_FREE) return;
+
+        buf_pop_can_tx_heap();
+
+        if (buf_send_can_tx_frame(frame, buf_can_tx_inflight_next) == HAL_OK && (frame->flags & BUF_CAN_TX_FLAG_EVENT))
+        {
+            buf_can_tx_inflight[buf_can_tx_inflight_next] = pos;
+            buf_can_tx_inflight_next = (buf_can_tx_inflight_next + 1) % BUF_CAN_TX_INFLIGHT_LEN;
+        }
+        else
+        {
+            // No event comes for this frame
+            frame->flags |= BUF_CAN_TX_FLAG_DONE;
+            buf_release_can_tx_frames();
+        }
+    }
+}
+
+// Get the bits of a frame in the order of arbitration, a lower value wins
+uint32_t buf_get_can_tx_priority(struct buf_can_tx_frame *frame)
+{
+    uint32_t remote = (frame->flags & BUF_CAN_TX_FLAG_REMOTE) ? 1 : 0;
+
+    // Base ID, RTR or SRR, IDE, ID extension and RTR
+    if (frame->flags & BUF_CAN_TX_FLAG_EXT_ID)
+        return ((frame->identifier >> 18) << 21) | (3 << 19) | ((frame->identifier & 0x3FFFF) << 1) | remote;
+    return (frame->identifier << 21) | (remote << 20);
+}
+
+// Check if the frame at pos_a goes to the bus before the one at pos_b
+uint8_t buf_is_can_tx_before(uint16_t pos_a, uint16_t pos_b)
+{
+    uint32_t priority_a = buf_get_can_tx_priority((struct buf_can_tx_frame *)((uint8_t *)buf_can_tx.data + pos_a));
+    uint32_t priority_b = buf_get_can_tx_priority((struct buf_can_tx_frame *)((uint8_t *)buf_can_tx.data + pos_b));
+
+    if (priority_a != priority_b)
+        return (priority_a < priority_b);
+
+    // Same priority in the order of the host, the older frame is closer to the tail
+    return ((pos_a + BUF_CAN_TX_BUF_SIZE - buf_can_tx.tail) % BUF_CAN_TX_BUF_SIZE <
+            (pos_b + BUF_CAN_TX_BUF_SIZE - buf_can_tx.tail) % BUF_CAN_TX_BUF_SIZE);
+}
+
+// Add a frame to the priority heap
+void buf_push_can_tx_heap(uint16_t pos)
+{
+    uint32_t i = buf_can_tx_heap_len++;
+
+    while (i > 0)
+    {
+        uint32_t parent = (i - 1) / 2;
+        if (!buf_is_can_tx_before(pos, buf_can_tx_heap[parent])) break;
+        buf_can_tx_heap[i] = buf_can_tx_heap[parent];
+        i = parent;
+    }
+    buf_can_tx_heap[i] = pos;
+}
+
+// Take the frame with the highest priority from the heap
+uint16_t buf_pop_can_tx_heap(void)
+{
+    uint16_t top = buf_can_tx_heap[0];
+    uint16_t last = buf_can_tx_heap[--buf_can_tx_heap_len];
+    uint32_t i = 0;
+
+    while (2 * i + 1 < buf_can_tx_heap_len)
+    {
+        uint32_t child = 2 * i + 1;
+        if (child + 1 < buf_can_tx_heap_len && buf_is_can_tx_before(buf_can_tx_heap[child + 1], buf_can_tx_heap[child])) child++;
+        if (!buf_is_can_tx_before(buf_can_tx_heap[child], last)) break;
+        buf_can_tx_heap[i] = buf_can_tx_heap[child];
+        i = child;
+    }
+    buf_can_tx_heap[i] = last;
+
+    return top;
+}
+
+// Free the room of the sent frames from the tail, up to the oldest frame not sent yet
+void buf_release_can_tx_frames(void)
+{
+    while (buf_can_tx.tail != buf_can_tx.head)
+    {
+        uint32_t pos = buf_can_tx.tail;
+        struct buf_can_tx_frame *frame = buf_get_can_tx_frame(&pos);
+
+        if (!(frame->flags & BUF_CAN_TX_FLAG_DONE)) break;
+        buf_can_tx.tail = pos + frame->size;
+    }
+}
+
+// Update the residency time of the priority class with a frame sent at the time in us
+void buf_update_can_tx_residency(uint32_t pos, uint32_t time_us)
+{
+    struct buf_can_tx_frame *frame = (struct buf_can_tx_frame *)((uint8_t *)buf_can_tx.data + pos);
+    uint32_t prio_class = buf_get_can_tx_priority(frame) >> 30;
+    uint32_t residency_us = time_us - frame->commit_us;
+
+    if (buf_can_tx_residency_max_us[prio_class] < residency_us)
+        buf_can_tx_residency_max_us[prio_class] = residency_us;
+
+    if (buf_can_tx_residency_ave_us[prio_class] == 0)
+        buf_can_tx_residency_ave_us[prio_class] = residency_us;    // First frame after clear
+    else
+        buf_can_tx_residency_ave_us[prio_class] = (uint32_t)(((uint64_t)buf_can_tx_residency_ave_us[prio_class] * 15 + residency_us) >> 4);
+}
+
+// Wait for room in the can tx queue up to the timeout, from the first call without room
+uint8_t buf_wait_can_room(uint8_t has_room)
+{
+    if (can_is_tx_enabled() != ENABLE || has_room)
+    {
+        buf_can_tx_waiting = 0;
+        return 0;
+    }
+
+    if (!buf_can_tx_waiting)
+    {
+        buf_can_tx_waiting = 1;
+        buf_can_tx_wait_start = HAL_GetTick();
+    }
+
+    // Reject the frames as before once timed out, so that a close command can get through
+    return (HAL_GetTick() - buf_can_tx_wait_start < BUF_CAN_TX_WAIT_TIMEOUT);
+}
+
+// Find a free contiguous span of len bytes, one byte is kept free to tell a full ring from an empty one
+uint8_t *buf_find_cdc_dest(uint32_t len)
+{
+    uint32_t head = buf_cdc_tx.head;
+    uint32_t tail = buf_cdc_tx.tail;
+
+    if (head < tail)
+    {
+        if (tail - head > len) return (uint8_t *)&buf_cdc_tx.data[head];
+    }
+    else
+    {
+        if (head == tail && buf_cdc_tx.send_len == 0 && head != 0)
+        {
+            // Empty, start over at the beginning
+            buf_cdc_tx.head = 0;
+            buf_cdc_tx.tail = 0;
+            return (uint8_t *)buf_cdc_tx.data;
+        }
+        if (BUF_CDC_TX_BUF_SIZE - head >= len) return (uint8_t *)&buf_cdc_tx.data[head];
+        if (tail > len) return (uint8_t *)buf_cdc_tx.data;
+    }
+
+    return NULL;
+}
+
+// Check if the held data in the cdc buffer should be sent under the flush policy
+uint8_t buf_is_flush_due(void)
+{
+    uint32_t head = buf_cdc_tx.head;
+    uint32_t tail = buf_cdc_tx.tail;
+
+    // Send right away when the head has wrapped around, the ring is getting full
+    if (head < tail) return 1;
+
+    uint32_t pending = head - tail - buf_cdc_tx.send_len;
+    uint16_t elapsed = (uint16_t)((uint16_t)timebase_get_us() - buf_flush_hold_start);
+
+    if (buf_flush_mode == BUF_FLUSH_BYTES)
+    {
+        // Do not hold a reply forever when the traffic stops below the threshold
+        return (pending >= buf_flush_value || elapsed >= BUF_CDC_FLUSH_HOLD_MAX);
+    }
+    else if (buf_flush_mode == BUF_FLUSH_TIME)
+    {
+        return (elapsed >= buf_flush_value || pending >= BUF_CDC_FLUSH_BYTES_MAX);
+    }
+
+    return 1;
 }
 
 // Clear can tx buffer
 void buf_clear_can_buffer(void)
 {
-    buf_can_tx.tail = buf_can_tx.head;
-    buf_can_tx.send = buf_can_tx.head;
-    buf_can_tx.full = 0;
+    buf_can_tx.head = 0;
+    buf_can_tx.send = 0;
+    buf_can_tx.tail = 0;
+    buf_can_tx_dest = NULL;
+    buf_can_tx_batching = 0;
+
+    buf_can_tx_heap_len = 0;
+    for (uint32_t i = 0; i < BUF_CAN_TX_INFLIGHT_LEN; i++)
+        buf_can_tx_inflight[i] = BUF_CAN_TX_INFLIGHT_FREE;
+    buf_can_tx_inflight_next = 0;
+
+    for (uint32_t i = 0; i < BUF_CAN_TX_PRIO_CLASSES; i++)
+    {
+        buf_can_tx_residency_ave_us[i] = 0;
+        buf_can_tx_residency_max_us[i] = 0;
+    }
 }
+
@@ -7,9 +7,15 @@
 #include "buffer.h"
 #include "can.h"
 #include "error.h"
+#ifdef GS_USB
+#include "gs_usb.h"
+#else
+#include "cyclic.h"
+#endif
 #include "led.h"
 #include "slcan.h"
 #include "system.h"
+#include "timebase.h"
 
 // Bit number for each frame type with zero data length
 #define CAN_BIT_NBR_WOD_CBFF            47
@@ -23,27 +29,123 @@
 #define CAN_TIME_CNT_MAX_REWIND         360         /* Max cycle ~120ms X 3 times margin. should be < MIN_BIT_NBR * 9 */
 #define CAN_BUS_LOAD_BUILDUP_PPM        1125000     /* Compensate stuff bits and round down in laod calc */
 
+// Hash set slots, the key is the extended ID or the PGN (ID bits 8-25) with the flag
+#define CAN_FILTER_HASH_USED            (1UL << 31)
+#define CAN_FILTER_HASH_PGN             (1UL << 30)
+#define CAN_FILTER_HASH_PGN_SHIFT       8
+#define CAN_FILTER_HASH_PGN_MASK        0x3FFFF
+
+// Change-only table, the key is the ID with the flags
+#define CAN_CHANGE_USED                 (1UL << 31)
+#define CAN_CHANGE_EXT                  (1UL << 30)
+
+// Longest report of a frame in the cdc buffer
+#ifdef GS_USB
+#define CAN_REPORT_MAX_LEN              GS_USB_HOST_FRAME_MAX_LEN
+#else
+#define CAN_REPORT_MAX_LEN              SLCAN_MTU
+#endif
+
+// RAM rings filled by the interrupt, must be a power of two
+#define CAN_RX_RING_LEN                 32
+#define CAN_TX_EVT_RING_LEN             32
+#define CAN_TX_EVT_RESERVE              6           /* Tx buffers and Tx event FIFO elements of the message RAM */
+
+// Interrupts of each line, line 0 drains the message RAM and line 1 reports bus errors
+#define CAN_IT_LINE0                    (FDCAN_IT_RX_FIFO0_NEW_MESSAGE | FDCAN_IT_RX_FIFO1_NEW_MESSAGE | FDCAN_IT_TX_EVT_FIFO_NEW_DATA)
+#define CAN_IT_LINE1                    (FDCAN_IT_ERROR_WARNING | FDCAN_IT_ERROR_PASSIVE | FDCAN_IT_BUS_OFF | \
+                                         FDCAN_IT_ARB_PROTOCOL_ERROR | FDCAN_IT_DATA_PROTOCOL_ERROR)
+
+// Frames accepted to Rx FIFO0, copied out of the message RAM by the interrupt
+struct can_rx_ring
+{
+    FDCAN_RxHeaderTypeDef header[CAN_RX_RING_LEN];
+    uint8_t data[CAN_RX_RING_LEN][CAN_MAX_DATALEN];
+    uint64_t time_ticks[CAN_RX_RING_LEN];   // Time stamp of the frame extended to 64 bit
+    volatile uint32_t head;     // Written by the interrupt only
+    volatile uint32_t tail;     // Written by can_process only
+};
+
+// Tx events copied out of the message RAM by the interrupt
+struct can_tx_evt_ring
+{
+    FDCAN_TxEventFifoTypeDef event[CAN_TX_EVT_RING_LEN];
+    uint64_t time_ticks[CAN_TX_EVT_RING_LEN];
+    volatile uint32_t head;
+    volatile uint32_t tail;
+};
+
+// Last report of an ID for the change-only reporting
+struct can_change_entry
+{
+    uint32_t key;               // Zero for an empty slot
+    uint32_t hash;              // Payload and format of the last frame reported
+    uint32_t last_ms;
+    uint16_t skipped;           // Frames suppressed since the last report
+};
+
 // Private variables
 static FDCAN_HandleTypeDef can_handle;
 static FDCAN_FilterTypeDef can_std_filter;
 static FDCAN_FilterTypeDef can_ext_filter;
 static FDCAN_FilterTypeDef can_std_pass_all;
 static FDCAN_FilterTypeDef can_ext_pass_all;
+static FDCAN_FilterTypeDef can_std_filter_list[CAN_FILTER_STD_NUM];  // Used in place of the code and mask filter if any is set
+static FDCAN_FilterTypeDef can_ext_filter_list[CAN_FILTER_EXT_NUM];
+static uint32_t can_filter_bitmap[CAN_FILTER_BITMAP_WORDS] = {0};   // Bit n of word m for the standard ID m * 32 + n
+static FunctionalState can_filter_bitmap_state = DISABLE;
+static volatile uint32_t can_filter_bitmap_rejected = 0;        // Frames taken out by the bitmap, counted by the interrupt
+static uint32_t can_filter_hash[CAN_FILTER_HASH_SLOTS] = {0};   // Zero for an empty slot
+static uint32_t can_filter_hash_entries = 0;
+static uint32_t can_filter_hash_pgn_entries = 0;                // The second lookup is skipped without any
+static enum can_filter_hash_mode can_filter_hash_mode = CAN_FILTER_HASH_OFF;
+static volatile uint32_t can_filter_hash_frames = 0;            // Counted by the interrupt
+static volatile uint32_t can_filter_hash_probes = 0;
+static volatile uint32_t can_filter_hash_rejected = 0;
+static struct can_data_filter can_filter_data[CAN_FILTER_DATA_NUM] = {0};
+static uint8_t can_filter_data_mask = 0;                        // Rules in use, no check while zero
+static uint32_t can_filter_data_rejected = 0;
+static struct can_change_entry can_change_table[CAN_CHANGE_SLOTS] = {0};
+static FunctionalState can_change_state = DISABLE;
+static uint16_t can_change_keepalive_ms = 0;                    // Zero for no keep-alive by the time
+static uint16_t can_change_keepalive_frames = 0;                // Zero for no keep-alive by the frames
+static struct can_change_stats can_change_stats = {0};
 static enum can_bus_state can_bus_state;
 static struct can_error_state can_error_state = {0};
 static uint32_t can_mode = FDCAN_MODE_NORMAL;
 static FunctionalState can_auto_retransmit = ENABLE;
+static enum can_tx_order can_tx_order = CAN_TX_ORDER_FIFO;
 static struct can_bitrate_cfg can_bitrate_nominal, can_bitrate_data = {0};
 
 static uint32_t can_cycle_max_time_ns = 0;
 static uint32_t can_cycle_ave_time_ns = 0;
 static uint32_t can_bit_time_ns = 0;
 static uint32_t can_bus_load_ppm = 0;
+static uint32_t can_frames_max_per_pass = 0;
+static uint32_t can_frames_ave_per_pass_x16 = 0;   // 1/16 frames
+
+static struct can_rx_ring can_rx_ring = {0};
+static struct can_tx_evt_ring can_tx_evt_ring = {0};
+static volatile uint8_t can_ring_overflow = 0;      // Frames read out and dropped because a ring was full
+static volatile uint8_t can_rx_not_accepted = 0;    // Frame received in Rx FIFO1
+static volatile uint32_t can_err_irq_flags = 0;     // Bus error flags taken by the line 1 interrupt
+static volatile uint32_t can_bit_cnt_message = 0;   // Bits of all frames on the bus, counted by the interrupt
+static uint16_t can_last_frame_time_cnt = 0;
 
 // Private methods
 static void can_update_bit_time_ns(void);
 static uint16_t can_get_bit_number_in_rx_frame(FDCAN_RxHeaderTypeDef *pRxHeader);
 static uint16_t can_get_bit_number_in_tx_event(FDCAN_TxEventFifoTypeDef *pRxHeader);
+static void can_drain_message_ram(void);
+static void can_clear_rings(void);
+static uint32_t can_config_filter_list(FDCAN_FilterTypeDef *list, uint32_t num, FDCAN_FilterTypeDef *single);
+static uint32_t can_get_filter_list_num(FDCAN_FilterTypeDef *list, uint32_t num);
+static uint32_t can_hash_filter_key(uint32_t key);
+static int32_t can_find_filter_hash_slot(uint32_t key, uint32_t *probes);
+static uint8_t can_is_filter_hash_accepted(uint32_t id);
+static uint8_t can_is_filter_data_accepted(FDCAN_RxHeaderTypeDef *header, uint8_t *data);
+static uint8_t can_is_frame_changed(FDCAN_RxHeaderTypeDef *header, uint8_t *data);
+static void can_clear_change_table(void);
 
 // Initialize CAN peripheral settings, but don't actually start the peripheral
 void can_init(void)
@@ -100,6 +202,17 @@ void can_init(void)
     can_ext_pass_all.FilterID1 = 0x1FFFFFFF;
     can_ext_pass_all.FilterID2 = 0x00000000;
 
+    for (uint8_t i = 0; i < CAN_FILTER_STD_NUM; i++)
+    {
+        can_std_filter_list[i].IdType = FDCAN_STANDARD_ID;
+        can_std_filter_list[i].FilterConfig = FDCAN_FILTER_DISABLE;
+    }
+    for (uint8_t i = 0; i < CAN_FILTER_EXT_NUM; i++)
+    {
+        can_ext_filter_list[i].IdType = FDCAN_EXTENDED_ID;
+        can_ext_filter_list[i].FilterConfig = FDCAN_FILTER_DISABLE;
+    }
+
     // Reset the queue
     //memset(&can_tx_queue, 0, sizeof(can_tx_queue));
 
@@ -108,6 +221,12 @@ void can_init(void)
     can_set_data_bitrate(CAN_DATA_BITRATE_2M);
     can_handle.Instance = FDCAN1;
     can_bus_state = BUS_CLOSED;
+
+    // Higher priority than USB, the Rx FIFOs are only 3 messages deep
+    HAL_NVIC_SetPriority(FDCAN1_IT0_IRQn, 1, 0);
+    HAL_NVIC_EnableIRQ(FDCAN1_IT0_IRQn);
+    HAL_NVIC_SetPriority(FDCAN1_IT1_IRQn, 3, 0);
+    HAL_NVIC_EnableIRQ(FDCAN1_IT1_IRQn);
 }
 
 // Start the CAN peripheral
@@ -138,9 +257,12 @@ HAL_StatusTypeDef can_enable(void)
         can_handle.Init.DataTimeSeg1 = can_bitrate_data.time_seg1;
         can_handle.Init.DataTimeSeg2 = can_bitrate_data.time_seg2;
 
-        can_handle.Init.StdFiltersNbr = 2;
-        can_handle.Init.ExtFiltersNbr = 2;
-        can_handle.Init.TxFifoQueueMode = FDCAN_TX_FIFO_OPERATION;
+        // The pass-all filter to Rx FIFO1 follows the entries in use, the first match wins
+        can_handle.Init.StdFiltersNbr = can_get_filter_list_num(can_std_filter_list, CAN_FILTER_STD_NUM) + 1;
+        can_handle.Init.ExtFiltersNbr = can_get_filter_list_num(can_ext_filter_list, CAN_FILTER_EXT_NUM) + 1;
+        can_std_pass_all.FilterIndex = can_handle.Init.StdFiltersNbr - 1;
+        can_ext_pass_all.FilterIndex = can_handle.Init.ExtFiltersNbr - 1;
+        can_handle.Init.TxFifoQueueMode = (can_tx_order == CAN_TX_ORDER_PRIORITY) ? FDCAN_TX_QUEUE_OPERATION : FDCAN_TX_FIFO_OPERATION;
 
         if (HAL_FDCAN_Init(&can_handle) != HAL_OK) return HAL_ERROR;
 
@@ -158,8 +280,8 @@ HAL_StatusTypeDef can_enable(void)
             HAL_FDCAN_DisableTxDelayCompensation(&can_handle);
         }
 
-        if (HAL_FDCAN_ConfigFilter(&can_handle, &can_std_filter) != HAL_OK) return HAL_ERROR;
-        if (HAL_FDCAN_ConfigFilter(&can_handle, &can_ext_filter) != HAL_OK) return HAL_ERROR;
+        if (can_config_filter_list(can_std_filter_list, CAN_FILTER_STD_NUM, &can_std_filter) == 0) return HAL_ERROR;
+        if (can_config_filter_list(can_ext_filter_list, CAN_FILTER_EXT_NUM, &can_ext_filter) == 0) return HAL_ERROR;
         if (HAL_FDCAN_ConfigFilter(&can_handle, &can_std_pass_all) != HAL_OK) return HAL_ERROR;
         if (HAL_FDCAN_ConfigFilter(&can_handle, &can_ext_pass_all) != HAL_OK) return HAL_ERROR;
         HAL_FDCAN_ConfigGlobalFilter(&can_handle, FDCAN_REJECT, FDCAN_REJECT, FDCAN_FILTER_REMOTE, FDCAN_FILTER_REMOTE);
@@ -168,12 +290,23 @@ HAL_StatusTypeDef can_enable(void)
         // Internal does not work to get time. External use TIM3 as source. See RM0440.
         HAL_FDCAN_EnableTimestampCounter(&can_handle, FDCAN_TIMESTAMP_EXTERNAL);
 
+        can_clear_rings();
+        HAL_FDCAN_ConfigInterruptLines(&can_handle, FDCAN_IT_GROUP_RX_FIFO0 | FDCAN_IT_GROUP_RX_FIFO1 | FDCAN_IT_GROUP_TX_FIFO_ERROR, FDCAN_INTERRUPT_LINE0);
+        HAL_FDCAN_ConfigInterruptLines(&can_handle, FDCAN_IT_GROUP_BIT_LINE_ERROR | FDCAN_IT_GROUP_PROTOCOL_ERROR, FDCAN_INTERRUPT_LINE1);
+        if (HAL_FDCAN_ActivateNotification(&can_handle, CAN_IT_LINE0 | CAN_IT_LINE1, 0) != HAL_OK) return HAL_ERROR;
+
         if (HAL_FDCAN_Start(&can_handle) != HAL_OK) return HAL_ERROR;
 
         buf_clear_can_buffer();
 
         can_update_bit_time_ns();
         can_clear_cycle_time();
+        can_filter_bitmap_rejected = 0;
+        can_filter_hash_frames = 0;
+        can_filter_hash_probes = 0;
+        can_filter_hash_rejected = 0;
+        can_filter_data_rejected = 0;
+        can_clear_change_table();
         can_bus_load_ppm = 0;
         can_error_state.last_err_code = FDCAN_PROTOCOL_ERROR_NONE;
 
@@ -198,6 +331,7 @@ HAL_StatusTypeDef can_disable(void)
         __HAL_RCC_FDCAN_FORCE_RESET();
         __HAL_RCC_FDCAN_RELEASE_RESET();
 
+        can_clear_rings();
         buf_clear_can_buffer();
 
         led_turn_green(LED_ON);
@@ -209,54 +343,95 @@ HAL_StatusTypeDef can_disable(void)
     return HAL_ERROR;
 }
 
-// Process data from CAN tx/rx circular buffers
+// Process frames taken from the message RAM by the interrupt
 void can_process(void)
 {
-    static uint16_t last_frame_time_cnt = 0;
-    static uint32_t bit_cnt_message = 0;
-    FDCAN_TxEventFifoTypeDef tx_event;
-    FDCAN_RxHeaderTypeDef rx_msg_header;
-    uint8_t rx_msg_data[64] = {0};
+    static uint8_t err_state_stale = 1;
 
-    // If message transmitted on bus, parse the frame
-    if (HAL_FDCAN_GetTxEvent(&can_handle, &tx_event) == HAL_OK)
-    {
-        int32_t len = slcan_parse_tx_event(buf_get_cdc_dest(), &tx_event, buf_dequeue_can_tx_data());
-        buf_comit_cdc_dest(len);
+    // Take all entries present now, stop early if the cdc buffer has no room for a report
+    uint32_t tx_evt_head = can_tx_evt_ring.head;
+    uint32_t rx_head = can_rx_ring.head;
+    uint32_t frames = 0;
 
-        if (tx_event.TxTimestamp != last_frame_time_cnt)    // Don't count same frame.
+    while ((can_tx_evt_ring.tail != tx_evt_head || can_rx_ring.tail != rx_head) && buf_has_cdc_dest(CAN_REPORT_MAX_LEN))
+    {
+        // If message transmitted on bus, parse the frame
+        if (can_tx_evt_ring.tail != tx_evt_head)
         {
-            bit_cnt_message += can_get_bit_number_in_tx_event(&tx_event);
-            last_frame_time_cnt = tx_event.TxTimestamp;
+            uint32_t idx = can_tx_evt_ring.tail & (CAN_TX_EVT_RING_LEN - 1);
+            FDCAN_TxEventFifoTypeDef *tx_event = &can_tx_evt_ring.event[idx];
+            uint8_t *tx_data = buf_dequeue_can_tx_data(tx_event, can_tx_evt_ring.time_ticks[idx]);
+
+            // No frame queued for the event, it can not be reported with the data of another one
+            if (tx_data == NULL)
+            {
+                error_assert(ERR_CAN_TXFAIL);
+                can_tx_evt_ring.tail++;
+                continue;
+            }
+#ifdef GS_USB
+            int32_t len = gs_usb_parse_tx_event(buf_reserve_cdc_dest(CAN_REPORT_MAX_LEN), tx_event, tx_data);
+#else
+            cyclic_process_tx_event(tx_event, can_tx_evt_ring.time_ticks[idx]);
+            int32_t len = slcan_parse_tx_event(buf_reserve_cdc_dest(CAN_REPORT_MAX_LEN), tx_event, tx_data, can_tx_evt_ring.time_ticks[idx]);
+#endif
+            buf_comit_cdc_dest(len);
+            can_tx_evt_ring.tail++;
+            frames++;
+
+            led_blink_green();
         }
 
-        led_blink_green();
+        // Message has been accepted, pull it from the ring
+        if (can_rx_ring.tail != rx_head && buf_has_cdc_dest(CAN_REPORT_MAX_LEN))
+        {
+            uint32_t idx = can_rx_ring.tail & (CAN_RX_RING_LEN - 1);
+
+            // Drop the frame before it is formatted if the payload does not match
+            if (can_filter_data_mask != 0 && !can_is_filter_data_accepted(&can_rx_ring.header[idx], can_rx_ring.data[idx]))
+            {
+                can_rx_ring.tail++;
+                can_filter_data_rejected++;
+                can_rx_not_accepted = 1;
+                continue;
+            }
+
+            // Drop the frame if the payload is the same as the last report of the ID
+            if (can_change_state == ENABLE && !can_is_frame_changed(&can_rx_ring.header[idx], can_rx_ring.data[idx]))
+            {
+                can_rx_ring.tail++;
+                led_blink_blue();
+                continue;
+            }
+#ifdef GS_USB
+            int32_t len = gs_usb_parse_rx_frame(buf_reserve_cdc_dest(CAN_REPORT_MAX_LEN), &can_rx_ring.header[idx], can_rx_ring.data[idx]);
+#else
+            int32_t len = slcan_parse_rx_frame(buf_reserve_cdc_dest(CAN_REPORT_MAX_LEN), &can_rx_ring.header[idx], can_rx_ring.data[idx], can_rx_ring.time_ticks[idx]);
+#endif
+            buf_comit_cdc_dest(len);
+            can_rx_ring.tail++;
+            frames++;
+
+            led_blink_blue();
+        }
     }
 
-    // Message has been accepted, pull it from the buffer
-    if (HAL_FDCAN_GetRxMessage(&can_handle, FDCAN_RX_FIFO0, &rx_msg_header, rx_msg_data) == HAL_OK)
+    // Update frames per pass
+    if (frames > 0)
     {
-        int32_t len = slcan_parse_rx_frame(buf_get_cdc_dest(), &rx_msg_header, rx_msg_data);
-        buf_comit_cdc_dest(len);
-
-        if (rx_msg_header.RxTimestamp != last_frame_time_cnt)   // Don't count same frame.
-        {
-            bit_cnt_message += can_get_bit_number_in_rx_frame(&rx_msg_header);
-            last_frame_time_cnt = rx_msg_header.RxTimestamp;
-        }
+        if (can_frames_max_per_pass < frames)
+            can_frames_max_per_pass = frames;
 
-        led_blink_blue();
+        if (can_frames_ave_per_pass_x16 == 0)
+            can_frames_ave_per_pass_x16 = frames * 16;  // First pass after clear
+        else
+            can_frames_ave_per_pass_x16 = (can_frames_ave_per_pass_x16 * 15 + frames * 16) >> 4;
     }
 
-    // Message has been received but not been accepted, pull it from the buffer
-    if (HAL_FDCAN_GetRxMessage(&can_handle, FDCAN_RX_FIFO1, &rx_msg_header, rx_msg_data) == HAL_OK)
+    // Message has been received but not been accepted
+    if (can_rx_not_accepted)
     {
-        if (rx_msg_header.RxTimestamp != last_frame_time_cnt)   // Don't count same frame.
-        {
-            bit_cnt_message += can_get_bit_number_in_rx_frame(&rx_msg_header);
-            last_frame_time_cnt = rx_msg_header.RxTimestamp;
-        }
-
+        can_rx_not_accepted = 0;
         led_blink_blue();
     }
 
@@ -265,10 +440,16 @@ void can_process(void)
     uint32_t tick_now = HAL_GetTick();
     if (100 <= (uint32_t)(tick_now - tick_last))    // Update in every 100ms interval
     {
+        system_irq_disable();
+        uint32_t bit_cnt_message = can_bit_cnt_message;
+        can_bit_cnt_message = 0;
+        system_irq_enable();
+
         uint32_t rate_us_per_ms = (uint32_t)bit_cnt_message * can_bit_time_ns / 1000 / 100;   // MAX: 1000 @ 1Mbps
         can_bus_load_ppm = (can_bus_load_ppm * 7 + (uint32_t)CAN_BUS_LOAD_BUILDUP_PPM * rate_us_per_ms / 1000) >> 3;
-        bit_cnt_message = 0;
         tick_last = tick_now;
+
+        err_state_stale = 1;    // Counters also decrease on successful frames
     }
 
     // Check for message loss
@@ -290,60 +471,64 @@ void can_process(void)
         __HAL_FDCAN_CLEAR_FLAG(&can_handle, FDCAN_FLAG_RX_FIFO1_MESSAGE_LOST);
     }
 
-    // Check for bus state and error counter
-    FDCAN_ProtocolStatusTypeDef sts;
-    FDCAN_ErrorCountersTypeDef cnt;
-
-    HAL_FDCAN_GetProtocolStatus(&can_handle, &sts);
-    HAL_FDCAN_GetErrorCounters(&can_handle, &cnt);
+    if (can_ring_overflow)
+    {
+        can_ring_overflow = 0;
+        error_assert(ERR_CAN_RXFAIL);
+    }
 
-    uint8_t rx_err_cnt = (uint8_t)(cnt.RxErrorPassive ? 128 : cnt.RxErrorCnt);
-    if (rx_err_cnt > can_error_state.rec || cnt.TxErrorCnt > can_error_state.tec) error_assert(ERR_CAN_BUS_ERR);
-    if (sts.BusOff && !can_error_state.bus_off) error_assert(ERR_CAN_BUS_ERR);  // Capture counter increase that caused bus off
+    // Check for bus state and error counter, only after the line 1 interrupt or the periodic update
+    system_irq_disable();
+    uint32_t err_irq_flags = can_err_irq_flags;
+    can_err_irq_flags = 0;
+    system_irq_enable();
 
-    can_error_state.bus_off = (uint8_t)sts.BusOff;
-    can_error_state.err_pssv = (uint8_t)sts.ErrorPassive;
-    can_error_state.tec = (uint8_t)cnt.TxErrorCnt;
-    can_error_state.rec = (uint8_t)rx_err_cnt;
-    if (sts.DataLastErrorCode != FDCAN_PROTOCOL_ERROR_NONE && sts.DataLastErrorCode != FDCAN_PROTOCOL_ERROR_NO_CHANGE)
-        can_error_state.last_err_code = sts.DataLastErrorCode;
-    if (sts.LastErrorCode != FDCAN_PROTOCOL_ERROR_NONE && sts.LastErrorCode != FDCAN_PROTOCOL_ERROR_NO_CHANGE)
-        can_error_state.last_err_code = sts.LastErrorCode;
+    if (err_irq_flags != 0 || err_state_stale)
+    {
+        FDCAN_ProtocolStatusTypeDef sts;
+        FDCAN_ErrorCountersTypeDef cnt;
+
+        HAL_FDCAN_GetProtocolStatus(&can_handle, &sts);
+        HAL_FDCAN_GetErrorCounters(&can_handle, &cnt);
+
+        uint8_t rx_err_cnt = (uint8_t)(cnt.RxErrorPassive ? 128 : cnt.RxErrorCnt);
+        if (rx_err_cnt > can_error_state.rec || cnt.TxErrorCnt > can_error_state.tec) error_assert(ERR_CAN_BUS_ERR);
+        if (sts.BusOff && !can_error_state.bus_off) error_assert(ERR_CAN_BUS_ERR);  // Capture counter increase that caused bus off
+
+        can_error_state.bus_off = (uint8_t)sts.BusOff;
+        can_error_state.err_pssv = (uint8_t)sts.ErrorPassive;
+        can_error_state.tec = (uint8_t)cnt.TxErrorCnt;
+        can_error_state.rec = (uint8_t)rx_err_cnt;
+        if (sts.DataLastErrorCode != FDCAN_PROTOCOL_ERROR_NONE && sts.DataLastErrorCode != FDCAN_PROTOCOL_ERROR_NO_CHANGE)
+            can_error_state.last_err_code = sts.DataLastErrorCode;
+        if (sts.LastErrorCode != FDCAN_PROTOCOL_ERROR_NONE && sts.LastErrorCode != FDCAN_PROTOCOL_ERROR_NO_CHANGE)
+            can_error_state.last_err_code = sts.LastErrorCode;
+
+        err_state_stale = 0;
+    }
 
     // Check for bus error flags
-    if (__HAL_FDCAN_GET_FLAG(&can_handle, FDCAN_FLAG_ERROR_WARNING))
-    {
+    if (err_irq_flags & FDCAN_FLAG_ERROR_WARNING)
         error_assert(ERR_CAN_WARNING);
-        __HAL_FDCAN_CLEAR_FLAG(&can_handle, FDCAN_FLAG_ERROR_WARNING);
-    }
 
-    if (__HAL_FDCAN_GET_FLAG(&can_handle, FDCAN_FLAG_ERROR_PASSIVE))
-    {
+    if (err_irq_flags & FDCAN_FLAG_ERROR_PASSIVE)
         error_assert(ERR_CAN_ERR_PASSIVE);
-        __HAL_FDCAN_CLEAR_FLAG(&can_handle, FDCAN_FLAG_ERROR_PASSIVE);
-    }
 
-    if (__HAL_FDCAN_GET_FLAG(&can_handle, FDCAN_FLAG_BUS_OFF))
-    {
+    if (err_irq_flags & FDCAN_FLAG_BUS_OFF)
         error_assert(ERR_CAN_BUS_OFF);
-        __HAL_FDCAN_CLEAR_FLAG(&can_handle, FDCAN_FLAG_BUS_OFF);
-    }
 
     // Update cycle time
-    static uint32_t last_time_stamp_cnt = 0;
-    uint16_t curr_time_stamp_cnt = HAL_FDCAN_GetTimestampCounter(&can_handle);
-    uint32_t cycle_time_ns;
-    if (last_time_stamp_cnt <= curr_time_stamp_cnt)
-        cycle_time_ns = ((uint32_t)curr_time_stamp_cnt - last_time_stamp_cnt) * 1000;
-    else
-        cycle_time_ns = ((uint32_t)UINT16_MAX - last_time_stamp_cnt + 1 + curr_time_stamp_cnt) * 1000;
+    static uint64_t last_time_ticks = 0;
+    uint64_t curr_time_ticks = timebase_get_ticks();
+    uint64_t elapsed_ns = timebase_ticks_to_ns(curr_time_ticks - last_time_ticks);
+    uint32_t cycle_time_ns = (elapsed_ns < UINT32_MAX) ? (uint32_t)elapsed_ns : UINT32_MAX;
 
     if (can_cycle_max_time_ns < cycle_time_ns)
         can_cycle_max_time_ns = cycle_time_ns;
         
     can_cycle_ave_time_ns = ((uint32_t)can_cycle_ave_time_ns * 15 + cycle_time_ns) >> 4;
     
-    last_time_stamp_cnt = curr_time_stamp_cnt;
+    last_time_ticks = curr_time_ticks;
 
     // Green LED on during bus closed
     if (can_bus_state == BUS_CLOSED)
@@ -595,6 +780,330 @@ uint32_t can_get_filter_ext_mask(void)
     return can_ext_filter.FilterID2 & 0x1FFFFFFF;
 }
 
+// Set an entry of the filter list, the code and mask filter is not used while any entry of the ID type is set
+HAL_StatusTypeDef can_set_filter_entry(uint32_t id_type, uint8_t idx, enum can_filter_type type, uint32_t id1, uint32_t id2)
+{
+    static const uint32_t filter_type[CAN_FILTER_INVALID] = {FDCAN_FILTER_MASK, FDCAN_FILTER_MASK, FDCAN_FILTER_RANGE, FDCAN_FILTER_DUAL};
+    FDCAN_FilterTypeDef *filter;
+    uint32_t id_max;
+
+    if (can_bus_state == BUS_OPENED) return HAL_ERROR;
+    if (id_type == FDCAN_STANDARD_ID && idx < CAN_FILTER_STD_NUM)
+    {
+        filter = &can_std_filter_list[idx];
+        id_max = 0x7FF;
+    }
+    else if (id_type == FDCAN_EXTENDED_ID && idx < CAN_FILTER_EXT_NUM)
+    {
+        filter = &can_ext_filter_list[idx];
+        id_max = 0x1FFFFFFF;
+    }
+    else
+        return HAL_ERROR;
+
+    if (CAN_FILTER_INVALID <= type) return HAL_ERROR;
+    if (id1 > id_max || id2 > id_max) return HAL_ERROR;
+    if (type == CAN_FILTER_RANGE && id1 > id2) return HAL_ERROR;
+
+    filter->FilterType = filter_type[type];
+    filter->FilterConfig = (type == CAN_FILTER_OFF) ? FDCAN_FILTER_DISABLE : FDCAN_FILTER_TO_RXFIFO0;
+    filter->FilterID1 = id1;
+    filter->FilterID2 = id2;
+
+    return HAL_OK;
+}
+
+// Get an entry of the filter list
+HAL_StatusTypeDef can_get_filter_entry(uint32_t id_type, uint8_t idx, enum can_filter_type *type, uint32_t *id1, uint32_t *id2)
+{
+    FDCAN_FilterTypeDef *filter;
+
+    if (id_type == FDCAN_STANDARD_ID && idx < CAN_FILTER_STD_NUM)
+        filter = &can_std_filter_list[idx];
+    else if (id_type == FDCAN_EXTENDED_ID && idx < CAN_FILTER_EXT_NUM)
+        filter = &can_ext_filter_list[idx];
+    else
+        return HAL_ERROR;
+
+    if (filter->FilterConfig == FDCAN_FILTER_DISABLE)
+        *type = CAN_FILTER_OFF;
+    else if (filter->FilterType == FDCAN_FILTER_RANGE)
+        *type = CAN_FILTER_RANGE;
+    else if (filter->FilterType == FDCAN_FILTER_DUAL)
+        *type = CAN_FILTER_DUAL;
+    else
+        *type = CAN_FILTER_MASK;
+    *id1 = filter->FilterID1;
+    *id2 = filter->FilterID2;
+
+    return HAL_OK;
+}
+
+// Get the entries of the filter list in use, bit n for the entry n
+uint32_t can_get_filter_entry_mask(uint32_t id_type)
+{
+    FDCAN_FilterTypeDef *list = (id_type == FDCAN_EXTENDED_ID) ? can_ext_filter_list : can_std_filter_list;
+    uint32_t num = (id_type == FDCAN_EXTENDED_ID) ? CAN_FILTER_EXT_NUM : CAN_FILTER_STD_NUM;
+    uint32_t mask = 0;
+
+    for (uint32_t i = 0; i < num; i++)
+    {
+        if (list[i].FilterConfig != FDCAN_FILTER_DISABLE)
+            mask |= (1UL << i);
+    }
+    return mask;
+}
+
+// Enable or disable the bitmap filter of the standard IDs, also while the channel is open
+HAL_StatusTypeDef can_set_filter_bitmap_state(FunctionalState state)
+{
+    if (state != ENABLE && state != DISABLE) return HAL_ERROR;
+
+    can_filter_bitmap_state = state;
+    can_filter_bitmap_rejected = 0;
+    return HAL_OK;
+}
+
+// Get the state of the bitmap filter
+FunctionalState can_is_filter_bitmap_enabled(void)
+{
+    return can_filter_bitmap_state;
+}
+
+// Accept or reject the standard IDs from one to another in the bitmap filter
+HAL_StatusTypeDef can_set_filter_bitmap_range(uint32_t from, uint32_t to, uint8_t accept)
+{
+    if (from > to || to > 0x7FF) return HAL_ERROR;
+
+    for (uint32_t id = from; id <= to; id++)
+    {
+        if (accept)
+            can_filter_bitmap[id >> 5] |= (1UL << (id & 31));
+        else
+            can_filter_bitmap[id >> 5] &= ~(1UL << (id & 31));
+    }
+    return HAL_OK;
+}
+
+// Set 32 bits of the bitmap filter at once, bit n of the word m for the standard ID m * 32 + n
+HAL_StatusTypeDef can_set_filter_bitmap_word(uint8_t idx, uint32_t word)
+{
+    if (idx >= CAN_FILTER_BITMAP_WORDS) return HAL_ERROR;
+
+    can_filter_bitmap[idx] = word;
+    return HAL_OK;
+}
+
+// Get 32 bits of the bitmap filter
+uint32_t can_get_filter_bitmap_word(uint8_t idx)
+{
+    if (idx >= CAN_FILTER_BITMAP_WORDS) return 0;
+    return can_filter_bitmap[idx];
+}
+
+// Get the number of the standard IDs accepted by the bitmap filter
+uint32_t can_get_filter_bitmap_ids(void)
+{
+    uint32_t ids = 0;
+    for (uint8_t i = 0; i < CAN_FILTER_BITMAP_WORDS; i++)
+        ids += __builtin_popcount(can_filter_bitmap[i]);
+    return ids;
+}
+
+// Get the frames rejected by the bitmap filter since the channel was opened or the filter was enabled
+uint32_t can_get_filter_bitmap_rejected(void)
+{
+    return can_filter_bitmap_rejected;
+}
+
+// Set the use of the hash set of the extended IDs, also while the channel is open
+HAL_StatusTypeDef can_set_filter_hash_mode(enum can_filter_hash_mode mode)
+{
+    if (CAN_FILTER_HASH_INVALID <= mode) return HAL_ERROR;
+
+    can_filter_hash_mode = mode;
+    can_filter_hash_frames = 0;
+    can_filter_hash_probes = 0;
+    can_filter_hash_rejected = 0;
+    return HAL_OK;
+}
+
+// Get the use of the hash set
+enum can_filter_hash_mode can_get_filter_hash_mode(void)
+{
+    return can_filter_hash_mode;
+}
+
+// Add an extended ID to the hash set, or its PGN to match any priority and source address
+HAL_StatusTypeDef can_add_filter_hash_entry(uint32_t id, uint8_t pgn_only)
+{
+    uint32_t key = pgn_only ? (CAN_FILTER_HASH_PGN | (id & CAN_FILTER_HASH_PGN_MASK)) : id;
+    uint32_t probes;
+
+    if (id > (pgn_only ? CAN_FILTER_HASH_PGN_MASK : 0x1FFFFFFF)) return HAL_ERROR;
+    if (can_find_filter_hash_slot(key, &probes) >= 0) return HAL_OK;
+    if (can_filter_hash_entries >= CAN_FILTER_HASH_ENTRIES) return HAL_ERROR;
+
+    // The empty slot at the end of the probe sequence
+    uint32_t slot = (can_hash_filter_key(key) + probes - 1) & (CAN_FILTER_HASH_SLOTS - 1);
+    can_filter_hash[slot] = CAN_FILTER_HASH_USED | key;
+    can_filter_hash_entries++;
+    if (pgn_only) can_filter_hash_pgn_entries++;
+
+    return HAL_OK;
+}
+
+// Remove an extended ID or a PGN from the hash set
+HAL_StatusTypeDef can_remove_filter_hash_entry(uint32_t id, uint8_t pgn_only)
+{
+    uint32_t key = pgn_only ? (CAN_FILTER_HASH_PGN | (id & CAN_FILTER_HASH_PGN_MASK)) : id;
+    uint32_t probes;
+
+    if (id > (pgn_only ? CAN_FILTER_HASH_PGN_MASK : 0x1FFFFFFF)) return HAL_ERROR;
+    int32_t slot = can_find_filter_hash_slot(key, &probes);
+    if (slot < 0) return HAL_ERROR;
+
+    // Move the entries after it back, so no probe sequence is broken by the empty slot
+    // The interrupt would miss an entry while they move.
+    system_irq_disable();
+    uint32_t hole = slot;
+    uint32_t next = (hole + 1) & (CAN_FILTER_HASH_SLOTS - 1);
+    while (can_filter_hash[next] != 0)
+    {
+        uint32_t home = can_hash_filter_key(can_filter_hash[next] & ~CAN_FILTER_HASH_USED);
+        if (((next - home) & (CAN_FILTER_HASH_SLOTS - 1)) >= ((next - hole) & (CAN_FILTER_HASH_SLOTS - 1)))
+        {
+            can_filter_hash[hole] = can_filter_hash[next];
+            hole = next;
+        }
+        next = (next + 1) & (CAN_FILTER_HASH_SLOTS - 1);
+    }
+    can_filter_hash[hole] = 0;
+    system_irq_enable();
+
+    can_filter_hash_entries--;
+    if (pgn_only) can_filter_hash_pgn_entries--;
+
+    return HAL_OK;
+}
+
+// Remove all entries of the hash set
+void can_clear_filter_hash(void)
+{
+    system_irq_disable();
+    for (uint32_t i = 0; i < CAN_FILTER_HASH_SLOTS; i++)
+        can_filter_hash[i] = 0;
+    system_irq_enable();
+    can_filter_hash_entries = 0;
+    can_filter_hash_pgn_entries = 0;
+}
+
+// Get the statistics of the hash set
+struct can_filter_hash_stats can_get_filter_hash_stats(void)
+{
+    struct can_filter_hash_stats stats = {0};
+
+    stats.entries = can_filter_hash_entries;
+    for (uint32_t i = 0; i < CAN_FILTER_HASH_SLOTS; i++)
+    {
+        if (can_filter_hash[i] == 0) continue;
+
+        uint32_t probes = ((i - can_hash_filter_key(can_filter_hash[i] & ~CAN_FILTER_HASH_USED)) & (CAN_FILTER_HASH_SLOTS - 1)) + 1;
+        if (stats.max_probes < probes)
+            stats.max_probes = probes;
+    }
+    stats.frames = can_filter_hash_frames;
+    stats.probes = can_filter_hash_probes;
+    stats.rejected = can_filter_hash_rejected;
+
+    return stats;
+}
+
+// Add or replace a rule of the payload filter, also while the channel is open
+HAL_StatusTypeDef can_set_filter_data_rule(uint8_t idx, struct can_data_filter *rule)
+{
+    uint32_t id_max = (rule->id_type == FDCAN_EXTENDED_ID) ? 0x1FFFFFFF : 0x7FF;
+
+    if (idx >= CAN_FILTER_DATA_NUM) return HAL_ERROR;
+    if (rule->id_type != FDCAN_STANDARD_ID && rule->id_type != FDCAN_EXTENDED_ID) return HAL_ERROR;
+    if (rule->id > id_max || rule->id_mask > id_max) return HAL_ERROR;
+    if (rule->len > CAN_FILTER_DATA_LEN) return HAL_ERROR;
+
+    // The bits out of the mask never match, so they are not kept
+    can_filter_data[idx] = *rule;
+    for (uint8_t i = 0; i < CAN_FILTER_DATA_LEN; i++)
+    {
+        if (i >= rule->len)
+            can_filter_data[idx].mask[i] = 0;
+        can_filter_data[idx].value[i] &= can_filter_data[idx].mask[i];
+    }
+    can_filter_data[idx].id &= rule->id_mask;
+    can_filter_data[idx].active = 1;
+    can_filter_data_mask |= (1 << idx);
+
+    return HAL_OK;
+}
+
+// Remove a rule of the payload filter
+HAL_StatusTypeDef can_remove_filter_data_rule(uint8_t idx)
+{
+    if (idx >= CAN_FILTER_DATA_NUM) return HAL_ERROR;
+    if (!can_filter_data[idx].active) return HAL_ERROR;
+
+    can_filter_data[idx].active = 0;
+    can_filter_data_mask &= ~(1 << idx);
+
+    return HAL_OK;
+}
+
+// Get a rule of the payload filter, NULL if not in use
+const struct can_data_filter *can_get_filter_data_rule(uint8_t idx)
+{
+    if (idx >= CAN_FILTER_DATA_NUM || !can_filter_data[idx].active) return NULL;
+    return &can_filter_data[idx];
+}
+
+// Get the rules in use, bit n for the rule n
+uint8_t can_get_filter_data_mask(void)
+{
+    return can_filter_data_mask;
+}
+
+// Get the frames rejected by the payload filter since the channel was opened
+uint32_t can_get_filter_data_rejected(void)
+{
+    return can_filter_data_rejected;
+}
+
+// Report only the frames with a changed payload, and the unchanged ones after the time or the frames of the keep-alive
+// The first frame of each ID is reported again.
+void can_set_change_only(FunctionalState state, uint16_t keepalive_ms, uint16_t keepalive_frames)
+{
+    can_change_state = state;
+    can_change_keepalive_ms = keepalive_ms;
+    can_change_keepalive_frames = keepalive_frames;
+    can_clear_change_table();
+}
+
+// Get the state of the change-only reporting
+FunctionalState can_is_change_only_enabled(void)
+{
+    return can_change_state;
+}
+
+// Get the keep-alive of the change-only reporting, zero for none
+void can_get_change_only_keepalive(uint16_t *keepalive_ms, uint16_t *keepalive_frames)
+{
+    *keepalive_ms = can_change_keepalive_ms;
+    *keepalive_frames = can_change_keepalive_frames;
+}
+
+// Get the statistics of the change-only reporting
+struct can_change_stats can_get_change_only_stats(void)
+{
+    return can_change_stats;
+}
+
 // Set CAN peripheral to the specific mode
 // normal: FDCAN_MODE_NORMAL
 // silent: FDCAN_MODE_BUS_MONITORING
@@ -625,6 +1134,27 @@ HAL_StatusTypeDef can_set_auto_retransmit(FunctionalState state)
     return HAL_OK;
 }
 
+// Set the order of the frames from the host on the bus
+HAL_StatusTypeDef can_set_tx_order(enum can_tx_order order)
+{
+    if (can_bus_state == BUS_OPENED)
+    {
+        // cannot set order while on bus
+        return HAL_ERROR;
+    }
+    if (order >= CAN_TX_ORDER_INVALID) return HAL_ERROR;
+
+    can_tx_order = order;
+
+    return HAL_OK;
+}
+
+// Return the order of the frames from the host on the bus
+enum can_tx_order can_get_tx_order(void)
+{
+    return can_tx_order;
+}
+
 // Return bus status
 enum can_bus_state can_get_bus_state(void)
 {
@@ -648,6 +1178,21 @@ FunctionalState can_is_tx_enabled(void)
         return ENABLE;
 }
 
+// Return 1 if the controller can not take another frame now
+// The free level of the Tx FIFO reads 0 in the queue operation, the full flag works in both.
+// The Tx event ring keeps room for the events of all frames in the controller, so no event is dropped.
+uint8_t can_is_tx_queue_full(void)
+{
+    if (can_tx_evt_ring.head - can_tx_evt_ring.tail > CAN_TX_EVT_RING_LEN - CAN_TX_EVT_RESERVE) return 1;
+    return ((can_handle.Instance->TXFQS & FDCAN_TXFQS_TFQF) != 0);
+}
+
+// Return 1 if the next frame received is lost as all Rx ring slots wait to be reported
+uint8_t can_is_rx_ring_full(void)
+{
+    return (can_rx_ring.head - can_rx_ring.tail >= CAN_RX_RING_LEN);
+}
+
 // Return CAN bus load in ppm
 uint32_t can_get_bus_load_ppm(void)
 {
@@ -659,6 +1204,8 @@ void can_clear_cycle_time(void)
 {
     can_cycle_max_time_ns = 0;
     can_cycle_ave_time_ns = 0;
+    can_frames_max_per_pass = 0;
+    can_frames_ave_per_pass_x16 = 0;
 }
 
 // Return the maximum cycle time in nano seconds
@@ -673,12 +1220,140 @@ uint32_t can_get_cycle_ave_time_ns(void)
     return can_cycle_ave_time_ns;
 }
 
+// Return the maximum number of frames reported in one pass of can_process
+uint32_t can_get_frames_max_per_pass(void)
+{
+    return can_frames_max_per_pass;
+}
+
+// Return the average number of frames reported in one pass of can_process, only counting passes with frames
+uint32_t can_get_frames_ave_per_pass(void)
+{
+    return (can_frames_ave_per_pass_x16 + 8) >> 4;
+}
+
 // Return reference to CAN handle
 FDCAN_HandleTypeDef *can_get_handle(void)
 {
     return &can_handle;
 }
 
+// Handle FDCAN interrupt line 0: new frames and Tx events
+void can_irq_rx_handler(void)
+{
+    // Clear first so that a message arriving while draining raises the interrupt again
+    __HAL_FDCAN_CLEAR_FLAG(&can_handle, CAN_IT_LINE0);
+    can_drain_message_ram();
+}
+
+// Handle FDCAN interrupt line 1: bus state changes and protocol errors, evaluated by can_process
+void can_irq_err_handler(void)
+{
+    uint32_t flags = can_handle.Instance->IR & CAN_IT_LINE1;
+    __HAL_FDCAN_CLEAR_FLAG(&can_handle, flags);
+    can_err_irq_flags |= flags;
+}
+
+// Copy all Tx events and received frames out of the message RAM while there is room in the rings
+// The 16 bit time stamps are extended here, the frames must not stay in the message RAM for the range of TIM3
+void can_drain_message_ram(void)
+{
+    FDCAN_RxHeaderTypeDef rx_msg_header;
+    uint8_t rx_msg_data[CAN_MAX_DATALEN];
+    FDCAN_TxEventFifoTypeDef tx_msg_event;
+
+    // Tx events first, a frame received in loopback is not older than its Tx event
+    // Nothing is left in the message RAM, the 16 bit time stamp could not be extended after a wrap of the timer.
+    while (1)
+    {
+        uint8_t full = (can_tx_evt_ring.head - can_tx_evt_ring.tail >= CAN_TX_EVT_RING_LEN);
+        uint32_t idx = can_tx_evt_ring.head & (CAN_TX_EVT_RING_LEN - 1);
+        FDCAN_TxEventFifoTypeDef *tx_event = full ? &tx_msg_event : &can_tx_evt_ring.event[idx];
+        if (HAL_FDCAN_GetTxEvent(&can_handle, tx_event) != HAL_OK) break;
+        if (!full)
+            can_tx_evt_ring.time_ticks[idx] = timebase_extend_ticks(tx_event->TxTimestamp);
+
+        if (tx_event->TxTimestamp != can_last_frame_time_cnt)    // Don't count same frame.
+        {
+            can_bit_cnt_message += can_get_bit_number_in_tx_event(tx_event);
+            can_last_frame_time_cnt = tx_event->TxTimestamp;
+        }
+
+        // Not expected as the transmission waits for room in the ring, dropped like a Tx event FIFO overflow
+        if (full)
+        {
+            error_assert(ERR_CAN_TXFAIL);
+            continue;
+        }
+        can_tx_evt_ring.head++;
+    }
+
+    while (1)
+    {
+        uint8_t full = (can_rx_ring.head - can_rx_ring.tail >= CAN_RX_RING_LEN);
+        uint32_t idx = can_rx_ring.head & (CAN_RX_RING_LEN - 1);
+        FDCAN_RxHeaderTypeDef *rx_header = full ? &rx_msg_header : &can_rx_ring.header[idx];
+        if (HAL_FDCAN_GetRxMessage(&can_handle, FDCAN_RX_FIFO0, rx_header, full ? rx_msg_data : can_rx_ring.data[idx]) != HAL_OK) break;
+
+        if (rx_header->RxTimestamp != can_last_frame_time_cnt)   // Don't count same frame.
+        {
+            can_bit_cnt_message += can_get_bit_number_in_rx_frame(rx_header);
+            can_last_frame_time_cnt = rx_header->RxTimestamp;
+        }
+
+        // The slot is used again for the next frame if the ID is not in the bitmap.
+        // Filtered before the ring is checked, a rejected frame is never an overflow.
+        uint32_t id = rx_header->Identifier;
+        if (can_filter_bitmap_state == ENABLE && rx_header->IdType == FDCAN_STANDARD_ID
+            && !(can_filter_bitmap[(id >> 5) & (CAN_FILTER_BITMAP_WORDS - 1)] & (1UL << (id & 31))))
+        {
+            can_filter_bitmap_rejected++;
+            can_rx_not_accepted = 1;
+            continue;
+        }
+        if (can_filter_hash_mode != CAN_FILTER_HASH_OFF && rx_header->IdType == FDCAN_EXTENDED_ID
+            && !can_is_filter_hash_accepted(id))
+        {
+            can_filter_hash_rejected++;
+            can_rx_not_accepted = 1;
+            continue;
+        }
+
+        // Read out and lost like a Rx FIFO overflow, the main loop is behind
+        if (full)
+        {
+            can_ring_overflow = 1;
+            continue;
+        }
+        can_rx_ring.time_ticks[idx] = timebase_extend_ticks(rx_header->RxTimestamp);
+        can_rx_ring.head++;
+    }
+
+    // Frames not accepted only count for the bus load
+    while (HAL_FDCAN_GetRxMessage(&can_handle, FDCAN_RX_FIFO1, &rx_msg_header, rx_msg_data) == HAL_OK)
+    {
+        if (rx_msg_header.RxTimestamp != can_last_frame_time_cnt)   // Don't count same frame.
+        {
+            can_bit_cnt_message += can_get_bit_number_in_rx_frame(&rx_msg_header);
+            can_last_frame_time_cnt = rx_msg_header.RxTimestamp;
+        }
+        can_rx_not_accepted = 1;
+    }
+}
+
+// Empty the rings, only while the peripheral is stopped
+void can_clear_rings(void)
+{
+    can_rx_ring.head = 0;
+    can_rx_ring.tail = 0;
+    can_tx_evt_ring.head = 0;
+    can_tx_evt_ring.tail = 0;
+    can_ring_overflow = 0;
+    can_rx_not_accepted = 0;
+    can_err_irq_flags = 0;
+    can_bit_cnt_message = 0;
+}
+
 // Get the nominal one bit time in nanoseconds
 void can_update_bit_time_ns(void)
 {
@@ -744,6 +1419,167 @@ uint16_t can_get_bit_number_in_rx_frame(FDCAN_RxHeaderTypeDef *pRxHeader)
     return time_msg;
 }
 
+// Write the entries of the filter list in use to the message RAM one after another, or the single filter without any
+// Return the number of the filter elements written, zero on error
+uint32_t can_config_filter_list(FDCAN_FilterTypeDef *list, uint32_t num, FDCAN_FilterTypeDef *single)
+{
+    uint32_t elements = 0;
+
+    for (uint32_t i = 0; i < num; i++)
+    {
+        if (list[i].FilterConfig == FDCAN_FILTER_DISABLE)
+            continue;
+
+        list[i].FilterIndex = elements++;
+        if (HAL_FDCAN_ConfigFilter(&can_handle, &list[i]) != HAL_OK) return 0;
+    }
+
+    if (elements == 0)
+    {
+        single->FilterIndex = elements++;
+        if (HAL_FDCAN_ConfigFilter(&can_handle, single) != HAL_OK) return 0;
+    }
+    return elements;
+}
+
+// Return the number of the filter elements needed for the list, one for the single filter without any entry
+uint32_t can_get_filter_list_num(FDCAN_FilterTypeDef *list, uint32_t num)
+{
+    uint32_t elements = 0;
+
+    for (uint32_t i = 0; i < num; i++)
+    {
+        if (list[i].FilterConfig != FDCAN_FILTER_DISABLE)
+            elements++;
+    }
+    return (elements == 0) ? 1 : elements;
+}
+
+// Check the payload of a frame with the rules of its ID, the frames of the other IDs are accepted
+uint8_t can_is_filter_data_accepted(FDCAN_RxHeaderTypeDef *header, uint8_t *data)
+{
+    uint8_t bytes = (header->RxFrameType == FDCAN_REMOTE_FRAME) ? 0 : hal_dlc_code_to_bytes(header->DataLength);
+    uint8_t matched = 0;
+
+    for (uint8_t i = 0; i < CAN_FILTER_DATA_NUM; i++)
+    {
+        struct can_data_filter *rule = &can_filter_data[i];
+
+        if (!rule->active || rule->id_type != header->IdType || ((header->Identifier ^ rule->id) & rule->id_mask))
+            continue;
+
+        matched = 1;
+        if (bytes < rule->len)
+            continue;
+
+        uint8_t j = 0;
+        while (j < rule->len && (data[j] & rule->mask[j]) == rule->value[j])
+            j++;
+        if (j == rule->len)
+            return 1;
+    }
+
+    return !matched;
+}
+
+// Check a frame with the last report of its ID, and take it as the last report if it is to be reported
+uint8_t can_is_frame_changed(FDCAN_RxHeaderTypeDef *header, uint8_t *data)
+{
+    uint32_t key = CAN_CHANGE_USED | ((header->IdType == FDCAN_EXTENDED_ID) ? CAN_CHANGE_EXT : 0) | header->Identifier;
+    uint8_t bytes = (header->RxFrameType == FDCAN_REMOTE_FRAME) ? 0 : hal_dlc_code_to_bytes(header->DataLength);
+    uint32_t now_ms = HAL_GetTick();
+
+    // FNV-1a of the format bits and the payload, a change of the DLC or the frame type is a change
+    uint32_t hash = (2166136261U ^ (header->DataLength | header->RxFrameType | header->FDFormat | header->BitRateSwitch)) * 16777619U;
+    for (uint8_t i = 0; i < bytes; i++)
+        hash = (hash ^ data[i]) * 16777619U;
+
+    uint32_t slot = (uint32_t)(key * 2654435761U) >> (32 - CAN_CHANGE_BITS);
+    while (can_change_table[slot].key != 0 && can_change_table[slot].key != key)
+        slot = (slot + 1) & (CAN_CHANGE_SLOTS - 1);
+
+    if (can_change_table[slot].key == 0)
+    {
+        // Report all frames of the IDs which have no room in the table
+        if (can_change_stats.ids >= CAN_CHANGE_IDS)
+        {
+            can_change_stats.untracked++;
+            return 1;
+        }
+        can_change_table[slot].key = key;
+        can_change_stats.ids++;
+    }
+    else if (can_change_table[slot].hash == hash)
+    {
+        uint8_t keepalive = (can_change_keepalive_ms != 0 && (uint32_t)(now_ms - can_change_table[slot].last_ms) >= can_change_keepalive_ms)
+                            || (can_change_keepalive_frames != 0 && can_change_table[slot].skipped + 1 >= can_change_keepalive_frames);
+        if (!keepalive)
+        {
+            if (can_change_table[slot].skipped < UINT16_MAX)
+                can_change_table[slot].skipped++;
+            can_change_stats.suppressed++;
+            return 0;
+        }
+        can_change_stats.keepalive++;
+    }
+
+    can_change_table[slot].hash = hash;
+    can_change_table[slot].last_ms = now_ms;
+    can_change_table[slot].skipped = 0;
+    return 1;
+}
+
+// Forget the last reports of all IDs and clear the counters
+void can_clear_change_table(void)
+{
+    for (uint32_t i = 0; i < CAN_CHANGE_SLOTS; i++)
+        can_change_table[i].key = 0;
+    can_change_stats.ids = 0;
+    can_change_stats.suppressed = 0;
+    can_change_stats.keepalive = 0;
+    can_change_stats.untracked = 0;
+}
+
+// Home slot of a key of the hash set, multiplicative hashing by the golden ratio
+uint32_t can_hash_filter_key(uint32_t key)
+{
+    return (uint32_t)(key * 2654435761U) >> (32 - CAN_FILTER_HASH_BITS);
+}
+
+// Find the slot of a key of the hash set, -1 if not found
+// The probes include the empty slot which ends the search.
+int32_t can_find_filter_hash_slot(uint32_t key, uint32_t *probes)
+{
+    uint32_t slot = can_hash_filter_key(key);
+    uint32_t entry = CAN_FILTER_HASH_USED | key;
+
+    for (*probes = 1; *probes <= CAN_FILTER_HASH_SLOTS; (*probes)++)
+    {
+        if (can_filter_hash[slot] == entry) return slot;
+        if (can_filter_hash[slot] == 0) return -1;
+        slot = (slot + 1) & (CAN_FILTER_HASH_SLOTS - 1);
+    }
+    return -1;
+}
+
+// Check an extended ID with the hash set, called from the interrupt
+uint8_t can_is_filter_hash_accepted(uint32_t id)
+{
+    uint32_t probes;
+    uint8_t found = (can_find_filter_hash_slot(id, &probes) >= 0);
+    can_filter_hash_probes += probes;
+
+    // J1939 parameter group number without the priority and the source address
+    if (!found && can_filter_hash_pgn_entries != 0)
+    {
+        found = (can_find_filter_hash_slot(CAN_FILTER_HASH_PGN | ((id >> CAN_FILTER_HASH_PGN_SHIFT) & CAN_FILTER_HASH_PGN_MASK), &probes) >= 0);
+        can_filter_hash_probes += probes;
+    }
+    can_filter_hash_frames++;
+
+    return (can_filter_hash_mode == CAN_FILTER_HASH_ALLOW) ? found : !found;
+}
+
 // Return the duration of the tx event in the nominal bit number
 uint16_t can_get_bit_number_in_tx_event(FDCAN_TxEventFifoTypeDef *pTxEvent)
 {
@@ -0,0 +1,169 @@
+//
+// cyclic: transmits periodic frames from a table on the device
+//
+
+#include <string.h>
+#include "stm32g4xx_hal.h"
+#include "buffer.h"
+#include "can.h"
+#include "cyclic.h"
+#include "slcan.h"
+#include "timebase.h"
+
+// Private variables
+static struct cyclic_entry cyclic_entries[CYCLIC_ENTRY_NUM];
+static uint8_t cyclic_running = 0;      // Set while the transmission is enabled, the schedule starts over when set
+
+// Private prototypes
+static void cyclic_start_entry(struct cyclic_entry *entry, uint32_t now_us);
+
+// Initialize the table with no entry
+void cyclic_init(void)
+{
+    memset(cyclic_entries, 0, sizeof(cyclic_entries));
+    cyclic_running = 0;
+}
+
+// Queue the frames due, called from the main loop
+// The frames take the same path as the ones from the host, so they are not sent from the timer interrupt.
+void cyclic_process(void)
+{
+    uint32_t now_us = (uint32_t)timebase_get_us();
+
+    if (can_is_tx_enabled() != ENABLE)
+    {
+        cyclic_running = 0;
+        return;
+    }
+
+    if (!cyclic_running)
+    {
+        for (uint8_t i = 0; i < CYCLIC_ENTRY_NUM; i++)
+            cyclic_start_entry(&cyclic_entries[i], now_us);
+        cyclic_running = 1;
+    }
+
+    for (uint8_t i = 0; i < CYCLIC_ENTRY_NUM; i++)
+    {
+        struct cyclic_entry *entry = &cyclic_entries[i];
+
+        if (!entry->active || (int32_t)(now_us - entry->next_us) < 0)
+            continue;
+
+        // Keep the frame due until the queue has room again
+        if (!buf_has_can_dest())
+            return;
+
+        FDCAN_TxHeaderTypeDef *frame_header = buf_get_can_dest_header();
+        uint8_t *frame_data = buf_get_can_dest_data();
+        *frame_header = entry->header;
+        memcpy(frame_data, entry->data, hal_dlc_code_to_bytes(entry->header.DataLength));
+        if (buf_comit_can_dest() != HAL_OK)
+            return;
+
+        // Stay on the absolute schedule, the cycles already passed are skipped
+        entry->next_us += entry->period_us;
+        if ((int32_t)(now_us - entry->next_us) >= 0)
+            entry->next_us += ((now_us - entry->next_us) / entry->period_us + 1) * entry->period_us;
+    }
+}
+
+// Measure the period of a frame from the table sent on the bus
+void cyclic_process_tx_event(FDCAN_TxEventFifoTypeDef *tx_event, uint64_t time_ticks)
+{
+    if (tx_event->MessageMarker < CYCLIC_MARKER_BASE || tx_event->MessageMarker >= CYCLIC_MARKER_BASE + CYCLIC_ENTRY_NUM)
+        return;
+
+    struct cyclic_entry *entry = &cyclic_entries[tx_event->MessageMarker - CYCLIC_MARKER_BASE];
+    if (!entry->active)
+        return;
+
+    // The time stamp is taken at the start of the frame
+    uint32_t tx_us = (uint32_t)timebase_ticks_to_us(time_ticks);
+
+    if (entry->timed)
+    {
+        int32_t jitter_us = (int32_t)(tx_us - entry->last_tx_us - entry->period_us);
+        if (entry->periods == 0 || jitter_us < entry->jitter_min_us) entry->jitter_min_us = jitter_us;
+        if (entry->periods == 0 || jitter_us > entry->jitter_max_us) entry->jitter_max_us = jitter_us;
+        entry->periods++;
+    }
+    entry->last_tx_us = tx_us;
+    entry->timed = 1;
+    entry->frames++;
+}
+
+// Add or replace an entry of the table, the first frame is sent after the phase
+HAL_StatusTypeDef cyclic_set_entry(uint8_t idx, FDCAN_TxHeaderTypeDef *header, uint8_t *data, uint32_t period_us, uint32_t phase_us)
+{
+    if (idx >= CYCLIC_ENTRY_NUM) return HAL_ERROR;
+    if (period_us < CYCLIC_PERIOD_MIN_US || CYCLIC_PERIOD_MAX_US < period_us) return HAL_ERROR;
+    if (phase_us >= period_us) return HAL_ERROR;
+
+    struct cyclic_entry *entry = &cyclic_entries[idx];
+    entry->header = *header;
+    entry->header.TxEventFifoControl = FDCAN_STORE_TX_EVENTS;
+    entry->header.MessageMarker = CYCLIC_MARKER_BASE + idx;
+    memcpy(entry->data, data, hal_dlc_code_to_bytes(header->DataLength));
+    entry->period_us = period_us;
+    entry->phase_us = phase_us;
+    entry->frames = 0;
+    entry->periods = 0;
+    entry->jitter_min_us = 0;
+    entry->jitter_max_us = 0;
+    cyclic_start_entry(entry, (uint32_t)timebase_get_us());
+    entry->active = 1;
+
+    return HAL_OK;
+}
+
+// Remove an entry of the table
+HAL_StatusTypeDef cyclic_remove_entry(uint8_t idx)
+{
+    if (idx >= CYCLIC_ENTRY_NUM) return HAL_ERROR;
+    if (!cyclic_entries[idx].active) return HAL_ERROR;
+
+    cyclic_entries[idx].active = 0;
+
+    return HAL_OK;
+}
+
+// Update the data bytes of an entry, the length must stay the same
+HAL_StatusTypeDef cyclic_update_data(uint8_t idx, uint8_t *data, uint8_t len)
+{
+    if (idx >= CYCLIC_ENTRY_NUM) return HAL_ERROR;
+
+    struct cyclic_entry *entry = &cyclic_entries[idx];
+    if (!entry->active || entry->header.TxFrameType == FDCAN_REMOTE_FRAME) return HAL_ERROR;
+    if (len != hal_dlc_code_to_bytes(entry->header.DataLength)) return HAL_ERROR;
+
+    memcpy(entry->data, data, len);
+
+    return HAL_OK;
+}
+
+// Get an entry of the table, NULL if not in use
+const struct cyclic_entry *cyclic_get_entry(uint8_t idx)
+{
+    if (idx >= CYCLIC_ENTRY_NUM || !cyclic_entries[idx].active) return NULL;
+    return &cyclic_entries[idx];
+}
+
+// Get the entries in use, bit n for the entry n
+uint16_t cyclic_get_entry_mask(void)
+{
+    uint16_t mask = 0;
+    for (uint8_t i = 0; i < CYCLIC_ENTRY_NUM; i++)
+    {
+        if (cyclic_entries[i].active)
+            mask |= (1 << i);
+    }
+    return mask;
+}
+
+// Start the schedule of an entry at the time, the jitter is measured again from the next frame
+void cyclic_start_entry(struct cyclic_entry *entry, uint32_t now_us)
+{
+    entry->next_us = now_us + entry->phase_us;
+    entry->timed = 0;
+}
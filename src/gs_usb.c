@@ -0,0 +1,386 @@
+//
+// gs_usb: host frames and control requests of the gs_usb compatible USB class
+//
+
+#include <string.h>
+#include "stm32g4xx_hal.h"
+#include "buffer.h"
+#include "can.h"
+#include "error.h"
+#include "gs_usb.h"
+
+// Device information
+#define GS_USB_SW_VERSION       2
+#define GS_USB_HW_VERSION       1
+#define GS_USB_FCLK_CAN         160000000
+
+// Supported mode flags, accepted in the mode request
+#define GS_USB_MODE_FLAGS       (GS_CAN_MODE_LISTEN_ONLY | GS_CAN_MODE_LOOP_BACK | GS_CAN_MODE_ONE_SHOT | GS_CAN_MODE_FD)
+
+// Advertised features, the mode flags and the requests that are not modes
+#define GS_USB_FEATURES         (GS_USB_MODE_FLAGS | GS_CAN_FEATURE_BT_CONST_EXT | GS_CAN_FEATURE_GET_STATE)
+
+// Private variables
+static const struct gs_device_config gs_usb_device_config = {0, 0, 0, 0, GS_USB_SW_VERSION, GS_USB_HW_VERSION};
+static const struct gs_device_bt_const_ext gs_usb_bt_const_ext =
+{
+    GS_USB_FEATURES,
+    GS_USB_FCLK_CAN,
+    1, 255, 1, 128, 128, 1, 512, 1,     // Nominal, tseg1 limited by struct can_bitrate_cfg
+    1, 32, 1, 16, 16, 1, 32, 1,         // Data
+};
+static const uint8_t gs_usb_dlc_to_bytes[16] = {0, 1, 2, 3, 4, 5, 6, 7, 8, 12, 16, 20, 24, 32, 48, 64};
+static uint32_t gs_usb_rx_frame[(GS_USB_HOST_FRAME_MAX_LEN + 3) / 4];   // Host frame being reassembled
+static uint32_t gs_usb_rx_frame_len = 0;
+
+// Private methods
+static int32_t gs_usb_parse_frame(uint8_t *buf, uint32_t echo_id, FDCAN_RxHeaderTypeDef *frame_header, uint8_t *frame_data);
+static void gs_usb_parse_host_frame(uint8_t *buf, uint32_t len);
+static void gs_usb_reject_host_frame(struct gs_host_frame *host_frame);
+static HAL_StatusTypeDef gs_usb_set_mode(struct gs_device_mode *mode);
+static uint32_t gs_usb_get_state(void);
+
+// Write a CAN frame as a host frame, return the length
+int32_t gs_usb_parse_frame(uint8_t *buf, uint32_t echo_id, FDCAN_RxHeaderTypeDef *frame_header, uint8_t *frame_data)
+{
+    uint32_t can_id = frame_header->Identifier;
+    uint8_t dlc = (uint8_t)(frame_header->DataLength >> 16) & 0xF;    // DLC code 0-F
+    uint8_t flags = 0;
+    int32_t len = GS_USB_HOST_FRAME_CLASSIC_LEN;
+
+    if (frame_header->IdType == FDCAN_EXTENDED_ID)
+        can_id |= GS_CAN_EFF_FLAG;
+
+    uint8_t bytes = gs_usb_dlc_to_bytes[dlc];
+    if (frame_header->RxFrameType == FDCAN_REMOTE_FRAME)
+    {
+        can_id |= GS_CAN_RTR_FLAG;
+        bytes = 0;
+    }
+
+    if (frame_header->FDFormat == FDCAN_FD_CAN)
+    {
+        flags |= GS_CAN_FLAG_FD;
+        if (frame_header->BitRateSwitch == FDCAN_BRS_ON)
+            flags |= GS_CAN_FLAG_BRS;
+        if (frame_header->ErrorStateIndicator == FDCAN_ESI_PASSIVE)
+            flags |= GS_CAN_FLAG_ESI;
+        len = GS_USB_HOST_FRAME_FD_LEN;
+    }
+
+    // The buffer is not aligned, write the header byte by byte
+    memcpy(&buf[0], &echo_id, 4);
+    memcpy(&buf[4], &can_id, 4);
+    buf[8] = dlc;
+    buf[9] = 0;                                             // Channel
+    buf[10] = flags;
+    buf[11] = 0;
+
+    // Classic frames take the fixed size copy, no padding in CANFD with 64 bytes
+    if (len == GS_USB_HOST_FRAME_CLASSIC_LEN && bytes == 8)
+    {
+        memcpy(&buf[GS_USB_HOST_FRAME_HEADER_LEN], frame_data, 8);
+    }
+    else
+    {
+        memcpy(&buf[GS_USB_HOST_FRAME_HEADER_LEN], frame_data, bytes);
+        memset(&buf[GS_USB_HOST_FRAME_HEADER_LEN + bytes], 0, len - GS_USB_HOST_FRAME_HEADER_LEN - bytes);
+    }
+
+    return len;
+}
+
+// Queue a complete host frame for transmission on the CAN bus
+void gs_usb_parse_host_frame(uint8_t *buf, uint32_t len)
+{
+    struct gs_host_frame *host_frame = (struct gs_host_frame *)buf;
+
+    if (len < GS_USB_HOST_FRAME_HEADER_LEN || host_frame->channel != 0 || host_frame->echo_id > 0xFF)
+    {
+        error_assert(ERR_CAN_TXFAIL);
+        return;
+    }
+
+    FDCAN_TxHeaderTypeDef *frame_header = buf_get_can_dest_header();
+    uint8_t *frame_data = buf_get_can_dest_data();
+
+    if (frame_header == NULL || frame_data == NULL)
+    {
+        gs_usb_reject_host_frame(host_frame);
+        return;
+    }
+
+    frame_header->TxFrameType = FDCAN_DATA_FRAME;
+    frame_header->FDFormat = FDCAN_CLASSIC_CAN;
+    frame_header->IdType = FDCAN_STANDARD_ID;
+    frame_header->BitRateSwitch = FDCAN_BRS_OFF;
+    frame_header->ErrorStateIndicator = FDCAN_ESI_ACTIVE;
+    frame_header->TxEventFifoControl = FDCAN_STORE_TX_EVENTS;
+    frame_header->MessageMarker = host_frame->echo_id;           // Returned in the Tx event
+
+    if (host_frame->can_id & GS_CAN_EFF_FLAG)
+    {
+        frame_header->IdType = FDCAN_EXTENDED_ID;
+        frame_header->Identifier = host_frame->can_id & 0x1FFFFFFF;
+    }
+    else
+    {
+        frame_header->Identifier = host_frame->can_id & 0x7FF;
+    }
+
+    if (host_frame->can_id & GS_CAN_RTR_FLAG)
+        frame_header->TxFrameType = FDCAN_REMOTE_FRAME;
+
+    if (host_frame->flags & GS_CAN_FLAG_FD)
+    {
+        frame_header->FDFormat = FDCAN_FD_CAN;
+        if (host_frame->flags & GS_CAN_FLAG_BRS)
+            frame_header->BitRateSwitch = FDCAN_BRS_ON;
+    }
+
+    // Classic data frames up to 8 bytes, no remote frames in CANFD
+    if (host_frame->can_dlc > 0xF ||
+        (frame_header->FDFormat == FDCAN_CLASSIC_CAN && frame_header->TxFrameType == FDCAN_DATA_FRAME && host_frame->can_dlc > 0x8) ||
+        (frame_header->FDFormat == FDCAN_FD_CAN && frame_header->TxFrameType == FDCAN_REMOTE_FRAME))
+    {
+        error_assert(ERR_CAN_TXFAIL);
+        gs_usb_reject_host_frame(host_frame);
+        return;
+    }
+    frame_header->DataLength = (uint32_t)host_frame->can_dlc << 16;
+
+    uint8_t bytes = gs_usb_dlc_to_bytes[host_frame->can_dlc];
+    if (frame_header->TxFrameType == FDCAN_REMOTE_FRAME)
+        bytes = 0;
+
+    if (len < GS_USB_HOST_FRAME_HEADER_LEN + bytes)
+    {
+        error_assert(ERR_CAN_TXFAIL);
+        gs_usb_reject_host_frame(host_frame);
+        return;
+    }
+    memcpy(frame_data, host_frame->data, bytes);
+
+    // The host gets the echo from the Tx event
+    if (buf_comit_can_dest() != HAL_OK)
+        gs_usb_reject_host_frame(host_frame);
+}
+
+// Return the echo of a host frame that is not sent, flagged as overflow
+// The host keeps a context for each echo id until the echo comes back, and stops sending once all are in use.
+void gs_usb_reject_host_frame(struct gs_host_frame *host_frame)
+{
+    uint8_t *buf = buf_reserve_cdc_dest(GS_USB_HOST_FRAME_MAX_LEN);
+    if (buf == NULL)
+        return;
+
+    int32_t len = (host_frame->flags & GS_CAN_FLAG_FD) ? GS_USB_HOST_FRAME_FD_LEN : GS_USB_HOST_FRAME_CLASSIC_LEN;
+
+    // The buffer is not aligned, write the header byte by byte
+    memcpy(&buf[0], &host_frame->echo_id, 4);
+    memcpy(&buf[4], &host_frame->can_id, 4);
+    buf[8] = host_frame->can_dlc;
+    buf[9] = 0;                                             // Channel
+    buf[10] = (host_frame->flags & (GS_CAN_FLAG_FD | GS_CAN_FLAG_BRS | GS_CAN_FLAG_ESI)) | GS_CAN_FLAG_OVERFLOW;
+    buf[11] = 0;
+    memset(&buf[GS_USB_HOST_FRAME_HEADER_LEN], 0, len - GS_USB_HOST_FRAME_HEADER_LEN);
+
+    buf_comit_cdc_dest(len);
+}
+
+
+// Apply the mode request of the host
+HAL_StatusTypeDef gs_usb_set_mode(struct gs_device_mode *mode)
+{
+    if (mode->mode == GS_CAN_MODE_RESET)
+    {
+        can_disable();
+        return HAL_OK;
+    }
+    else if (mode->mode != GS_CAN_MODE_START || (mode->flags & ~GS_USB_MODE_FLAGS))
+    {
+        return HAL_ERROR;
+    }
+
+    // Restart with the new mode
+    can_disable();
+
+    uint32_t can_mode = FDCAN_MODE_NORMAL;
+    if ((mode->flags & GS_CAN_MODE_LOOP_BACK) && (mode->flags & GS_CAN_MODE_LISTEN_ONLY))
+        can_mode = FDCAN_MODE_INTERNAL_LOOPBACK;
+    else if (mode->flags & GS_CAN_MODE_LOOP_BACK)
+        can_mode = FDCAN_MODE_EXTERNAL_LOOPBACK;
+    else if (mode->flags & GS_CAN_MODE_LISTEN_ONLY)
+        can_mode = FDCAN_MODE_BUS_MONITORING;
+
+    if (can_set_mode(can_mode) != HAL_OK) return HAL_ERROR;
+    if (can_set_auto_retransmit((mode->flags & GS_CAN_MODE_ONE_SHOT) ? DISABLE : ENABLE) != HAL_OK) return HAL_ERROR;
+
+    error_clear();
+    can_clear_cycle_time();
+
+    return can_enable();
+}
+
+// Get the CAN state as reported to the host
+uint32_t gs_usb_get_state(void)
+{
+    struct can_error_state err = can_get_error_state();
+
+    if (can_get_bus_state() == BUS_CLOSED)
+        return GS_CAN_STATE_STOPPED;
+    else if (err.bus_off)
+        return GS_CAN_STATE_BUS_OFF;
+    else if (err.err_pssv)
+        return GS_CAN_STATE_ERROR_PASSIVE;
+    else if (err.tec >= 96 || err.rec >= 96)
+        return GS_CAN_STATE_ERROR_WARNING;
+    else
+        return GS_CAN_STATE_ERROR_ACTIVE;
+}
+
+// Parse an incoming CAN frame into an outgoing host frame
+int32_t gs_usb_parse_rx_frame(uint8_t *buf, FDCAN_RxHeaderTypeDef *frame_header, uint8_t *frame_data)
+{
+    if (buf == NULL)
+        return 0;
+
+    return gs_usb_parse_frame(buf, GS_USB_ECHO_ID_RX, frame_header, frame_data);
+}
+
+// Parse an incoming Tx event into an outgoing host frame (echo of the transmitted frame)
+int32_t gs_usb_parse_tx_event(uint8_t *buf, FDCAN_TxEventFifoTypeDef *tx_event, uint8_t *frame_data)
+{
+    if (buf == NULL)
+        return 0;
+
+    FDCAN_RxHeaderTypeDef frame_header;
+    frame_header.Identifier = tx_event->Identifier;
+    frame_header.IdType = tx_event->IdType;
+    frame_header.RxFrameType = tx_event->TxFrameType;
+    frame_header.DataLength = tx_event->DataLength;
+    frame_header.ErrorStateIndicator = tx_event->ErrorStateIndicator;
+    frame_header.BitRateSwitch = tx_event->BitRateSwitch;
+    frame_header.FDFormat = tx_event->FDFormat;
+    frame_header.RxTimestamp = tx_event->TxTimestamp;
+
+    return gs_usb_parse_frame(buf, tx_event->MessageMarker, &frame_header, frame_data);
+}
+
+// Parse a packet from the bulk OUT endpoint. A host frame is one transfer,
+// so it is complete on a short packet.
+void gs_usb_parse_packet(uint8_t *buf, uint32_t len)
+{
+    if (gs_usb_rx_frame_len + len <= GS_USB_HOST_FRAME_MAX_LEN)
+        memcpy((uint8_t *)gs_usb_rx_frame + gs_usb_rx_frame_len, buf, len);
+    gs_usb_rx_frame_len += len;
+
+    if (len < GS_USB_MAX_PACKET_SIZE)
+    {
+        if (gs_usb_rx_frame_len <= GS_USB_HOST_FRAME_MAX_LEN)
+            gs_usb_parse_host_frame((uint8_t *)gs_usb_rx_frame, gs_usb_rx_frame_len);
+        else
+            error_assert(ERR_CAN_TXFAIL);   // Too long, discard the transfer
+
+        gs_usb_rx_frame_len = 0;
+    }
+}
+
+// Get the length of the host frame at the start of the buffer, limited to len
+uint32_t gs_usb_get_frame_len(uint8_t *buf, uint32_t len)
+{
+    uint32_t frame_len = GS_USB_HOST_FRAME_CLASSIC_LEN;
+
+    if (len > 10 && (buf[10] & GS_CAN_FLAG_FD))
+        frame_len = GS_USB_HOST_FRAME_FD_LEN;
+
+    return frame_len < len ? frame_len : len;
+}
+
+// Handle a device to host control request. Return the data length, or -1 to stall.
+int32_t gs_usb_get_ctrl_data(uint8_t breq, uint16_t channel, uint8_t *buf, uint16_t len)
+{
+    struct gs_device_state state;
+    int32_t ret;
+
+    switch (breq)
+    {
+    case GS_USB_BREQ_DEVICE_CONFIG:
+        // Not channel specific
+        ret = sizeof(gs_usb_device_config);
+        if (len < ret) return -1;
+        memcpy(buf, &gs_usb_device_config, ret);
+        return ret;
+    case GS_USB_BREQ_BT_CONST:
+        // The first part of the extended constants
+        ret = sizeof(struct gs_device_bt_const);
+        break;
+    case GS_USB_BREQ_BT_CONST_EXT:
+        ret = sizeof(gs_usb_bt_const_ext);
+        break;
+    case GS_USB_BREQ_GET_STATE:
+        ret = sizeof(state);
+        break;
+    default:
+        return -1;
+    }
+
+    if (channel != 0 || len < ret) return -1;
+
+    if (breq == GS_USB_BREQ_GET_STATE)
+    {
+        struct can_error_state err = can_get_error_state();
+        state.state = gs_usb_get_state();
+        state.rxerr = err.rec;
+        state.txerr = err.tec;
+        memcpy(buf, &state, ret);
+    }
+    else
+    {
+        memcpy(buf, &gs_usb_bt_const_ext, ret);
+    }
+
+    return ret;
+}
+
+// Handle a host to device control request
+HAL_StatusTypeDef gs_usb_set_ctrl_data(uint8_t breq, uint16_t channel, uint8_t *buf, uint16_t len)
+{
+    struct gs_device_bittiming timing;
+    struct gs_device_mode mode;
+    struct can_bitrate_cfg cfg;
+
+    // Byte order of the host, always little endian. Not channel specific.
+    if (breq == GS_USB_BREQ_HOST_FORMAT)
+        return HAL_OK;
+
+    if (channel != 0) return HAL_ERROR;
+
+    switch (breq)
+    {
+    case GS_USB_BREQ_BITTIMING:
+    case GS_USB_BREQ_DATA_BITTIMING:
+        if (len < sizeof(timing)) return HAL_ERROR;
+        memcpy(&timing, buf, sizeof(timing));
+
+        if (timing.prop_seg + timing.phase_seg1 > UINT8_MAX || timing.phase_seg2 > UINT8_MAX ||
+            timing.sjw > UINT8_MAX || timing.brp > UINT16_MAX)
+            return HAL_ERROR;
+
+        cfg.prescaler = (uint16_t)timing.brp;
+        cfg.time_seg1 = (uint8_t)(timing.prop_seg + timing.phase_seg1);
+        cfg.time_seg2 = (uint8_t)timing.phase_seg2;
+        cfg.sjw = (uint8_t)timing.sjw;
+
+        if (breq == GS_USB_BREQ_BITTIMING)
+            return can_set_bitrate_cfg(cfg);
+        else
+            return can_set_data_bitrate_cfg(cfg);
+    case GS_USB_BREQ_MODE:
+        if (len < sizeof(mode)) return HAL_ERROR;
+        memcpy(&mode, buf, sizeof(mode));
+        return gs_usb_set_mode(&mode);
+    default:
+        return HAL_ERROR;
+    }
+}
@@ -6,6 +6,7 @@
 #include "interrupts.h"
 #include "can.h"
 #include "led.h"
+#include "timebase.h"
 
 // Externs
 extern PCD_HandleTypeDef hpcd_USB_FS;
@@ -71,8 +72,20 @@ void SysTick_Handler(void)
   HAL_SYSTICK_IRQHandler();
 }
 
-//// Handle CAN interrupts
-// void CEC_CAN_IRQHandler(void)
-//{
-//     HAL_CAN_IRQHandler(can_get_handle());
-// }
+// Handle TIM3 interrupt: overflow of the time stamp counter
+void TIM3_IRQHandler(void)
+{
+  timebase_irq_handler();
+}
+
+// Handle CAN interrupts: new frames and Tx events
+void FDCAN1_IT0_IRQHandler(void)
+{
+  can_irq_rx_handler();
+}
+
+// Handle CAN interrupts: bus errors
+void FDCAN1_IT1_IRQHandler(void)
+{
+  can_irq_err_handler();
+}
@@ -7,31 +7,45 @@
 #include "usbd_cdc_if.h"
 #include "buffer.h"
 #include "can.h"
+#include "cyclic.h"
 #include "led.h"
 #include "nvm.h"
 #include "printf.h"
 #include "slcan.h"
 #include "system.h"
+#include "timebase.h"
+#include "timesync.h"
 
 int main(void)
 {
     // Initialize peripherals
     system_init();
+    timebase_init();
+    timesync_init();
     led_init();
     buf_init();
     can_init();
     nvm_init();
+    cyclic_init();
+    nvm_apply_flush_policy();
     usb_init();
 
     // Power-on blink sequence
     led_blink_sequence(5);
 
+#ifndef GS_USB
+    // The gs_usb host configures the channel itself
     nvm_apply_startup_cfg();
+#endif
 
     while (1)
     {
         led_process();
         can_process();
+        timesync_process();
+#ifndef GS_USB
+        cyclic_process();
+#endif
         buf_process();
     }
 }
@@ -3,6 +3,7 @@
 //
 
 #include "stm32g4xx_hal.h"
+#include "buffer.h"
 #include "can.h"
 #include "error.h"
 #include "led.h"
@@ -25,6 +26,9 @@ enum nvm_memory_status
 #define NVM_ADDR_STP_DATA_BITRATE (NVM_ADDR_ORIGIN + 0x018UL)
 #define NVM_ADDR_STP_FILTER_STD   (NVM_ADDR_ORIGIN + 0x020UL)
 #define NVM_ADDR_STP_FILTER_EXT   (NVM_ADDR_ORIGIN + 0x028UL)
+#define NVM_ADDR_FLUSH_POLICY     (NVM_ADDR_ORIGIN + 0x030UL)   /* USB flush policy, applied without auto startup */
+#define NVM_ADDR_STP_FILTER_LIST  (NVM_ADDR_ORIGIN + 0x040UL)   /* Standard then extended filter list entries */
+#define NVM_FILTER_LIST_NUM       (CAN_FILTER_STD_NUM + CAN_FILTER_EXT_NUM)
 
 #define NVM_EXTRACT_MEM_STS(val)  ((uint8_t)(((val) >> 60) & 0x0F))
 #define NVM_IS_WRITTEN(val)       (NVM_EXTRACT_MEM_STS(val) == NVM_MEMORY_WRITTEN)
@@ -37,6 +41,8 @@ static uint64_t nvm_stp_nom_bitrate_raw;
 static uint64_t nvm_stp_data_bitrate_raw;
 static uint64_t nvm_stp_filter_std_raw;
 static uint64_t nvm_stp_filter_ext_raw;
+static uint64_t nvm_flush_policy_raw;
+static uint64_t nvm_stp_filter_list_raw[NVM_FILTER_LIST_NUM];
 
 // Private methods
 static HAL_StatusTypeDef nvm_write_to_flash(void);
@@ -51,6 +57,9 @@ void nvm_init(void)
     nvm_stp_data_bitrate_raw =  *(uint64_t *)NVM_ADDR_STP_DATA_BITRATE;
     nvm_stp_filter_std_raw =    *(uint64_t *)NVM_ADDR_STP_FILTER_STD;
     nvm_stp_filter_ext_raw =    *(uint64_t *)NVM_ADDR_STP_FILTER_EXT;
+    nvm_flush_policy_raw =      *(uint64_t *)NVM_ADDR_FLUSH_POLICY;
+    for (uint8_t i = 0; i < NVM_FILTER_LIST_NUM; i++)
+        nvm_stp_filter_list_raw[i] = *(uint64_t *)(NVM_ADDR_STP_FILTER_LIST + i * 8UL);
 
     return;
 }
@@ -85,6 +94,43 @@ HAL_StatusTypeDef nvm_update_serial_number(uint16_t num)
     return HAL_OK;
 }
 
+// Apply USB flush policy
+HAL_StatusTypeDef nvm_apply_flush_policy(void)
+{
+    // Check if the memory is written
+    if (!NVM_IS_WRITTEN(nvm_flush_policy_raw)) return HAL_ERROR;
+
+    uint8_t mode = (uint8_t)(nvm_flush_policy_raw & 0xFF);
+    uint16_t value = (uint16_t)((nvm_flush_policy_raw >> 8) & 0xFFFF);
+
+    return buf_set_flush_policy(mode, value);
+}
+
+// Update USB flush policy
+HAL_StatusTypeDef nvm_update_flush_policy(uint8_t mode, uint16_t value)
+{
+    // Make raw data for flush policy
+    uint64_t flush_policy = 0;
+    flush_policy = (flush_policy | (uint64_t)mode);
+    flush_policy = (flush_policy | ((uint64_t)value << 8));
+    flush_policy = NVM_WRITE_MEM_STS(flush_policy);
+
+    // Check if the policy is the same
+    if (flush_policy == nvm_flush_policy_raw)
+    {
+        return HAL_OK;
+    }
+
+    // Write to the flash
+    nvm_flush_policy_raw = flush_policy;
+    if (nvm_write_to_flash() != HAL_OK)
+    {
+        return HAL_ERROR;
+    }
+
+    return HAL_OK;
+}
+
 // Apply auto startup configuration
 HAL_StatusTypeDef nvm_apply_startup_cfg(void)
 {
@@ -141,6 +187,19 @@ HAL_StatusTypeDef nvm_apply_startup_cfg(void)
     mask = ((nvm_stp_filter_ext_raw >> 29) & 0x1FFFFFFF);
     can_set_filter_ext(state, code, mask);
 
+    // Read and apply filter list, the entries not written by an older firmware are not in use
+    for (uint8_t i = 0; i < NVM_FILTER_LIST_NUM; i++)
+    {
+        uint32_t id_type = (i < CAN_FILTER_STD_NUM) ? FDCAN_STANDARD_ID : FDCAN_EXTENDED_ID;
+        uint8_t idx = (i < CAN_FILTER_STD_NUM) ? i : i - CAN_FILTER_STD_NUM;
+        uint64_t entry = nvm_stp_filter_list_raw[i];
+
+        if (NVM_IS_WRITTEN(entry))
+            can_set_filter_entry(id_type, idx, (enum can_filter_type)((entry >> 58) & 0x3), entry & 0x1FFFFFFF, (entry >> 29) & 0x1FFFFFFF);
+        else
+            can_set_filter_entry(id_type, idx, CAN_FILTER_OFF, 0, 0);
+    }
+
     // Start the CAN peripheral
     if (startup_mode == SLCAN_AUTO_STARTUP_NORMAL)
     {
@@ -220,10 +279,30 @@ HAL_StatusTypeDef nvm_update_startup_cfg(uint8_t mode)
     filter_ext = (filter_ext | ((uint64_t)(can_is_filter_ext_enabled() == ENABLE) << 58));
     filter_ext = NVM_WRITE_MEM_STS(filter_ext);
 
+    // Make raw data for filter list
+    uint64_t filter_list[NVM_FILTER_LIST_NUM];
+    uint8_t filter_list_same = 1;
+    for (uint8_t i = 0; i < NVM_FILTER_LIST_NUM; i++)
+    {
+        uint32_t id_type = (i < CAN_FILTER_STD_NUM) ? FDCAN_STANDARD_ID : FDCAN_EXTENDED_ID;
+        uint8_t idx = (i < CAN_FILTER_STD_NUM) ? i : i - CAN_FILTER_STD_NUM;
+        enum can_filter_type type;
+        uint32_t id1, id2;
+
+        if (can_get_filter_entry(id_type, idx, &type, &id1, &id2) != HAL_OK) return HAL_ERROR;
+        filter_list[i] = 0;
+        filter_list[i] = (filter_list[i] | ((uint64_t)id1 & 0x1FFFFFFF));
+        filter_list[i] = (filter_list[i] | (((uint64_t)id2 & 0x1FFFFFFF) << 29));
+        filter_list[i] = (filter_list[i] | (((uint64_t)type & 0x3) << 58));
+        filter_list[i] = NVM_WRITE_MEM_STS(filter_list[i]);
+        if (filter_list[i] != nvm_stp_filter_list_raw[i])
+            filter_list_same = 0;
+    }
+
     // Check if the configuration is the same
     if (startup_cfg == nvm_stp_config_raw)
         if (nom_bitrate == nvm_stp_nom_bitrate_raw && data_bitrate == nvm_stp_data_bitrate_raw)
-            if (filter_std == nvm_stp_filter_std_raw && filter_ext == nvm_stp_filter_ext_raw)
+            if (filter_std == nvm_stp_filter_std_raw && filter_ext == nvm_stp_filter_ext_raw && filter_list_same)
                 return HAL_OK;
 
     // Update the RAM data
@@ -232,6 +311,8 @@ HAL_StatusTypeDef nvm_update_startup_cfg(uint8_t mode)
     nvm_stp_data_bitrate_raw = data_bitrate;
     nvm_stp_filter_std_raw = filter_std;
     nvm_stp_filter_ext_raw = filter_ext;
+    for (uint8_t i = 0; i < NVM_FILTER_LIST_NUM; i++)
+        nvm_stp_filter_list_raw[i] = filter_list[i];
 
     // Write to the flash
     if (nvm_write_to_flash() != HAL_OK)
@@ -305,6 +386,23 @@ HAL_StatusTypeDef nvm_write_to_flash(void)
         return HAL_ERROR;
     }
 
+    // Write flush policy to flash
+    if (HAL_FLASH_Program(FLASH_TYPEPROGRAM_DOUBLEWORD, NVM_ADDR_FLUSH_POLICY, nvm_flush_policy_raw) != HAL_OK)
+    {
+        HAL_FLASH_Lock();
+        return HAL_ERROR;
+    }
+
+    // Write filter list to flash
+    for (uint8_t i = 0; i < NVM_FILTER_LIST_NUM; i++)
+    {
+        if (HAL_FLASH_Program(FLASH_TYPEPROGRAM_DOUBLEWORD, NVM_ADDR_STP_FILTER_LIST + i * 8UL, nvm_stp_filter_list_raw[i]) != HAL_OK)
+        {
+            HAL_FLASH_Lock();
+            return HAL_ERROR;
+        }
+    }
+
     // Lock the flash
     HAL_FLASH_Lock();
     return HAL_OK;
@@ -7,10 +7,13 @@
 #include "usbd_cdc_if.h"
 #include "buffer.h"
 #include "can.h"
+#include "cyclic.h"
 #include "error.h"
 #include "led.h"
 #include "nvm.h"
 #include "slcan.h"
+#include "timebase.h"
+#include "timesync.h"
 
 // Status flags, value is bit position in the status flags
 enum slcan_status_flag
@@ -33,6 +36,24 @@ enum slcan_report_flag
     //SLCAN_REPORT_ERROR,
     //SLCAN_REPORT_OVRLOAD,
     SLCAN_REPORT_ESI = 4,
+    SLCAN_REPORT_QUIET_TX,      /* No reply to a transmit command accepted, BELL only */
+};
+
+// Binary record type, value is the first byte of the record
+enum slcan_binary_record
+{
+    SLCAN_BINARY_RX_FRAME = 0x80,   /* Bit 7 is never set in ASCII messages */
+    SLCAN_BINARY_TX_EVENT,
+};
+
+// Binary record flag, value is bit position in the flag byte
+enum slcan_binary_flag
+{
+    SLCAN_BINARY_FLAG_IDE = 0,
+    SLCAN_BINARY_FLAG_RTR,
+    SLCAN_BINARY_FLAG_FDF,
+    SLCAN_BINARY_FLAG_BRS,
+    SLCAN_BINARY_FLAG_ESI,
 };
 
 // Filter mode
@@ -50,40 +71,104 @@ enum slcan_filter_mode
 #define SLCAN_RET_ERR   ((uint8_t *)"\x07")
 #define SLCAN_RET_LEN   (1)
 
+#define SLCAN_BINARY_HEADER_LEN (12)    /* type, length, flags, DLC, ID (4), timestamp (4) */
+
+#define SLCAN_TIMESTAMP_MS_RANGE_US (60000000)      /* Milli second timestamp wraps at 60,000ms */
+#define SLCAN_TIMESTAMP_US_RANGE_US (3600000000)    /* Micro second timestamp wraps at 3600,000,000us */
+#define SLCAN_TIMESTAMP_NS_MASK     (0xFFFFFFFFFFFF)  /* Nano second timestamp wraps at 2^48ns (~78 hours) */
+
+#define SLCAN_BITMAP_BLOCK_WORDS    (8)     /* 256 IDs of the bitmap filter in a command */
+#define SLCAN_BITMAP_BLOCK_NUM      (CAN_FILTER_BITMAP_WORDS / SLCAN_BITMAP_BLOCK_WORDS)
+
+// Two ASCII characters of a byte in memory order (little endian), e.g. 0x3A -> "3A"
+#define SLCAN_HEX_CHAR(n)   ((n) < 0xA ? (n) + 0x30 : (n) + 0x37)
+#define SLCAN_HEX_PAIR(b)   ((uint16_t)(SLCAN_HEX_CHAR((b) >> 4) | (SLCAN_HEX_CHAR((b) & 0xF) << 8)))
+#define SLCAN_HEX_ROW(h)    SLCAN_HEX_PAIR(h##0), SLCAN_HEX_PAIR(h##1), SLCAN_HEX_PAIR(h##2), SLCAN_HEX_PAIR(h##3), \
+                            SLCAN_HEX_PAIR(h##4), SLCAN_HEX_PAIR(h##5), SLCAN_HEX_PAIR(h##6), SLCAN_HEX_PAIR(h##7), \
+                            SLCAN_HEX_PAIR(h##8), SLCAN_HEX_PAIR(h##9), SLCAN_HEX_PAIR(h##A), SLCAN_HEX_PAIR(h##B), \
+                            SLCAN_HEX_PAIR(h##C), SLCAN_HEX_PAIR(h##D), SLCAN_HEX_PAIR(h##E), SLCAN_HEX_PAIR(h##F)
+
+// ASCII character to nibble, SLCAN_NIBBLE_INVALID for a non hex character
+#define SLCAN_NIBBLE_INVALID    (0x80)
+#define SLCAN_NIBBLE(c)     (('0' <= (c) && (c) <= '9') ? (c) - '0' : \
+                             ('A' <= (c) && (c) <= 'F') ? (c) - 'A' + 10 : \
+                             ('a' <= (c) && (c) <= 'f') ? (c) - 'a' + 10 : SLCAN_NIBBLE_INVALID)
+#define SLCAN_NIBBLE_ROW(h) SLCAN_NIBBLE(h##0), SLCAN_NIBBLE(h##1), SLCAN_NIBBLE(h##2), SLCAN_NIBBLE(h##3), \
+                            SLCAN_NIBBLE(h##4), SLCAN_NIBBLE(h##5), SLCAN_NIBBLE(h##6), SLCAN_NIBBLE(h##7), \
+                            SLCAN_NIBBLE(h##8), SLCAN_NIBBLE(h##9), SLCAN_NIBBLE(h##A), SLCAN_NIBBLE(h##B), \
+                            SLCAN_NIBBLE(h##C), SLCAN_NIBBLE(h##D), SLCAN_NIBBLE(h##E), SLCAN_NIBBLE(h##F)
+
 // Private variables
 static char *hw_sw_ver = SLCAN_VERSION "\r";
 static char *hw_sw_ver_detail = "v: hardware=\"CANable2.0\", software=\"" GIT_VERSION "\", url=\"" GIT_REMOTE "\"\r";
 static char *can_info = "I30A0\r";
 static char *can_info_detail = "i: protocol=\"ISO-CANFD\", clock_mhz=160, controller=\"STM32G431CB\"\r";
 static enum slcan_timestamp_mode slcan_timestamp_mode = 0;
+static enum slcan_frame_format slcan_frame_format = SLCAN_FORMAT_ASCII;
 static uint16_t slcan_report_reg = 1;   // Default: no timestamp, no ESI, no Tx, but with Rx
+static uint64_t slcan_timestamp_ms_base_us = 0; // Start of the range of the milli second timestamp
+static uint64_t slcan_timestamp_us_base_us = 0; // Start of the range of the micro second timestamp
 static uint32_t slcan_filter_code = 0x00000000;
 static uint32_t slcan_filter_mask = 0xFFFFFFFF;
+static uint8_t slcan_str[SLCAN_BATCH_MTU];  // Start of a command split across packets
+static uint16_t slcan_str_index = 0;
+static uint8_t slcan_str_overflow = 0;      // Set while discarding a too long command until its CR
+static const uint8_t slcan_nibble_to_ascii[16] = {'0', '1', '2', '3', '4', '5', '6', '7',
+                                                  '8', '9', 'A', 'B', 'C', 'D', 'E', 'F'};
+static const uint8_t slcan_ascii_to_nibble[256] = {SLCAN_NIBBLE_ROW(0x0), SLCAN_NIBBLE_ROW(0x1), SLCAN_NIBBLE_ROW(0x2), SLCAN_NIBBLE_ROW(0x3),
+                                                   SLCAN_NIBBLE_ROW(0x4), SLCAN_NIBBLE_ROW(0x5), SLCAN_NIBBLE_ROW(0x6), SLCAN_NIBBLE_ROW(0x7),
+                                                   SLCAN_NIBBLE_ROW(0x8), SLCAN_NIBBLE_ROW(0x9), SLCAN_NIBBLE_ROW(0xA), SLCAN_NIBBLE_ROW(0xB),
+                                                   SLCAN_NIBBLE_ROW(0xC), SLCAN_NIBBLE_ROW(0xD), SLCAN_NIBBLE_ROW(0xE), SLCAN_NIBBLE_ROW(0xF)};
+static const uint16_t slcan_byte_to_ascii[256] = {SLCAN_HEX_ROW(0x0), SLCAN_HEX_ROW(0x1), SLCAN_HEX_ROW(0x2), SLCAN_HEX_ROW(0x3),
+                                                  SLCAN_HEX_ROW(0x4), SLCAN_HEX_ROW(0x5), SLCAN_HEX_ROW(0x6), SLCAN_HEX_ROW(0x7),
+                                                  SLCAN_HEX_ROW(0x8), SLCAN_HEX_ROW(0x9), SLCAN_HEX_ROW(0xA), SLCAN_HEX_ROW(0xB),
+                                                  SLCAN_HEX_ROW(0xC), SLCAN_HEX_ROW(0xD), SLCAN_HEX_ROW(0xE), SLCAN_HEX_ROW(0xF)};
 
 // Private methods
-static int32_t slcan_parse_frame(uint8_t *buf, FDCAN_RxHeaderTypeDef *frame_header, uint8_t *frame_data);
+static int32_t slcan_parse_frame(uint8_t *buf, FDCAN_RxHeaderTypeDef *frame_header, uint8_t *frame_data, uint64_t time_ticks);
+static int32_t slcan_parse_frame_binary(uint8_t *buf, uint8_t type, FDCAN_RxHeaderTypeDef *frame_header, uint8_t *frame_data, uint64_t time_ticks);
+static void slcan_put_hex8(uint8_t *buf, uint8_t val);
+static void slcan_put_hex16(uint8_t *buf, uint16_t val);
+static void slcan_put_hex32(uint8_t *buf, uint32_t val);
+static uint8_t slcan_get_hex8(uint8_t *buf, uint8_t *err);
 static HAL_StatusTypeDef slcan_convert_str_to_number(uint8_t *buf, uint8_t len);
-static uint16_t slcan_get_timestamp_ms(void);
-static uint32_t slcan_get_timestamp_us_from_tim3(uint16_t tim3_us);
+static uint64_t slcan_get_timestamp(uint64_t time_ticks);
+static uint8_t slcan_put_timestamp(uint8_t *buf, uint64_t time_ticks);
+static uint32_t slcan_wrap_time_us(uint64_t time_us, uint64_t *base_us, uint32_t range_us);
+static void slcan_parse_str_transmit(uint8_t *buf, uint8_t len);
+static HAL_StatusTypeDef slcan_parse_str_batch(uint8_t *buf, uint16_t len);
+static uint8_t slcan_get_str_transmit_len(uint8_t *buf, uint16_t len);
+static HAL_StatusTypeDef slcan_decode_str_transmit(uint8_t *buf, uint8_t len, FDCAN_TxHeaderTypeDef *frame_header, uint8_t *frame_data);
+static uint8_t slcan_encode_str_transmit(uint8_t *buf, const FDCAN_TxHeaderTypeDef *frame_header, const uint8_t *frame_data);
 static void slcan_parse_str_open(uint8_t *buf, uint8_t len);
 static void slcan_parse_str_loop(uint8_t *buf, uint8_t len);
 static void slcan_parse_str_close(uint8_t *buf, uint8_t len);
 static void slcan_parse_str_set_bitrate(uint8_t *buf, uint8_t len);
 static void slcan_parse_str_report_mode(uint8_t *buf, uint8_t len);
+static void slcan_parse_str_frame_format(uint8_t *buf, uint8_t len);
 static void slcan_parse_str_filter_mode(uint8_t *buf, uint8_t len);
 static void slcan_parse_str_filter_code(uint8_t *buf, uint8_t len);
 static void slcan_parse_str_filter_mask(uint8_t *buf, uint8_t len);
+static void slcan_parse_str_filter_list(uint8_t *buf, uint8_t len);
+static void slcan_parse_str_filter_bitmap(uint8_t *buf, uint8_t len);
+static void slcan_parse_str_filter_hash(uint8_t *buf, uint8_t len);
+static void slcan_parse_str_filter_data(uint8_t *buf, uint8_t len);
+static void slcan_parse_str_change_only(uint8_t *buf, uint8_t len);
 static void slcan_parse_str_set_auto_retransmit(uint8_t *buf, uint8_t len);
+static void slcan_parse_str_tx_order(uint8_t *buf, uint8_t len);
+static void slcan_parse_str_cyclic(uint8_t *buf, uint8_t len);
 static void slcan_parse_str_version(uint8_t *buf, uint8_t len);
 static void slcan_parse_str_can_info(uint8_t *buf, uint8_t len);
 static void slcan_parse_str_number(uint8_t *buf, uint8_t len);
 static void slcan_parse_str_status(uint8_t *buf, uint8_t len);
 static void slcan_parse_str_auto_startup(uint8_t *buf, uint8_t len);
+static void slcan_parse_str_flush_policy(uint8_t *buf, uint8_t len);
+static void slcan_parse_str_clock_sync(uint8_t *buf, uint8_t len);
 static uint32_t __std_dlc_code_to_hal_dlc_code(uint8_t dlc_code);
 static uint8_t __hal_dlc_code_to_std_dlc_code(uint32_t hal_dlc_code);
 
 // Parse a CAN frame into a slcan message
-int32_t slcan_parse_frame(uint8_t *buf, FDCAN_RxHeaderTypeDef *frame_header, uint8_t *frame_data)
+int32_t slcan_parse_frame(uint8_t *buf, FDCAN_RxHeaderTypeDef *frame_header, uint8_t *frame_data, uint64_t time_ticks)
 {
     // Start building the slcan message string at idx 0 in buf[]
     uint8_t msg_idx = 0;
@@ -118,31 +203,24 @@ int32_t slcan_parse_frame(uint8_t *buf, FDCAN_RxHeaderTypeDef *frame_header, uin
         }
     }
 
-    // Assume standard identifier
-    uint8_t id_len = SLCAN_STD_ID_LEN;
-    uint32_t tmp = frame_header->Identifier;
-
-    // Check if extended
+    // Add identifier to buffer
     if (frame_header->IdType == FDCAN_EXTENDED_ID)
     {
         // Convert first char to upper case for extended frame
-        buf[msg_idx] -= 32;
-        id_len = SLCAN_EXT_ID_LEN;
-        tmp = frame_header->Identifier;
+        buf[msg_idx++] -= 32;
+        slcan_put_hex32(&buf[msg_idx], frame_header->Identifier);
+        msg_idx += SLCAN_EXT_ID_LEN;
     }
-    msg_idx++;
-
-    // Add identifier to buffer
-    for (uint8_t j = id_len; j > 0; j--)
+    else
     {
-        // Add nibble to buffer
-        buf[j] = (tmp & 0xF);
-        tmp = tmp >> 4;
         msg_idx++;
+        buf[msg_idx++] = slcan_nibble_to_ascii[(frame_header->Identifier >> 8) & 0xF];
+        slcan_put_hex8(&buf[msg_idx], frame_header->Identifier & 0xFF);
+        msg_idx += 2;
     }
 
     // Add DLC to buffer
-    buf[msg_idx++] = __hal_dlc_code_to_std_dlc_code(frame_header->DataLength);
+    buf[msg_idx++] = slcan_nibble_to_ascii[__hal_dlc_code_to_std_dlc_code(frame_header->DataLength) & 0xF];
     int8_t bytes = hal_dlc_code_to_bytes(frame_header->DataLength);
 
     // Check bytes value
@@ -151,41 +229,26 @@ int32_t slcan_parse_frame(uint8_t *buf, FDCAN_RxHeaderTypeDef *frame_header, uin
     if (bytes > 64)
         return -1;
 
-    // Add data bytes
+    // Add data bytes, two bytes (four characters) at once
     // Data frame only. No data bytes for a remote frame.
     if (frame_header->RxFrameType != FDCAN_REMOTE_FRAME)
     {
-        for (uint8_t j = 0; j < bytes; j++)
+        uint8_t j = 0;
+        for (; j + 1 < bytes; j += 2)
+        {
+            slcan_put_hex16(&buf[msg_idx], ((uint16_t)frame_data[j] << 8) | frame_data[j + 1]);
+            msg_idx += 4;
+        }
+        if (j < bytes)
         {
-            buf[msg_idx++] = (frame_data[j] >> 4);
-            buf[msg_idx++] = (frame_data[j] & 0x0F);
+            slcan_put_hex8(&buf[msg_idx], frame_data[j]);
+            msg_idx += 2;
         }
     }
 
     // Add time stamp
-    if (slcan_timestamp_mode == SLCAN_TIMESTAMP_MILLI)
-    {
-        uint16_t timestamp_ms = slcan_get_timestamp_ms();
-
-        buf[msg_idx++] = ((timestamp_ms >> 12) & 0xF);
-        buf[msg_idx++] = ((timestamp_ms >> 8) & 0xF);
-        buf[msg_idx++] = ((timestamp_ms >> 4) & 0xF);
-        buf[msg_idx++] = (timestamp_ms & 0xF);
-    }
-    else if (slcan_timestamp_mode == SLCAN_TIMESTAMP_MICRO)
-    {
-        uint32_t timestamp_us = slcan_get_timestamp_us_from_tim3(frame_header->RxTimestamp);
+    msg_idx += slcan_put_timestamp(&buf[msg_idx], time_ticks);
 
-        buf[msg_idx++] = ((timestamp_us >> 28) & 0xF);
-        buf[msg_idx++] = ((timestamp_us >> 24) & 0xF);
-        buf[msg_idx++] = ((timestamp_us >> 20) & 0xF);
-        buf[msg_idx++] = ((timestamp_us >> 16) & 0xF);
-        buf[msg_idx++] = ((timestamp_us >> 12) & 0xF);
-        buf[msg_idx++] = ((timestamp_us >> 8) & 0xF);
-        buf[msg_idx++] = ((timestamp_us >> 4) & 0xF);
-        buf[msg_idx++] = (timestamp_us & 0xF);
-    }
-    
     // Add error state indicator
     // FD frame only. No ESI for a classical frame.
     if ((slcan_report_reg >> SLCAN_REPORT_ESI) & 1)
@@ -193,22 +256,9 @@ int32_t slcan_parse_frame(uint8_t *buf, FDCAN_RxHeaderTypeDef *frame_header, uin
         if (frame_header->FDFormat == FDCAN_FD_CAN)
         {
             if (frame_header->ErrorStateIndicator == FDCAN_ESI_ACTIVE)
-                buf[msg_idx++] = 0;
+                buf[msg_idx++] = '0';
             else
-                buf[msg_idx++] = 1;
-        }
-    }
-
-    // Convert to ASCII (2nd character to end)
-    for (uint8_t j = 1; j < msg_idx; j++)
-    {
-        if (buf[j] < 0xA)
-        {
-            buf[j] += 0x30;
-        }
-        else
-        {
-            buf[j] += 0x37;
+                buf[msg_idx++] = '1';
         }
     }
 
@@ -219,8 +269,77 @@ int32_t slcan_parse_frame(uint8_t *buf, FDCAN_RxHeaderTypeDef *frame_header, uin
     return msg_idx;
 }
 
+// Parse a CAN frame into a binary record
+int32_t slcan_parse_frame_binary(uint8_t *buf, uint8_t type, FDCAN_RxHeaderTypeDef *frame_header, uint8_t *frame_data, uint64_t time_ticks)
+{
+    int8_t bytes = hal_dlc_code_to_bytes(frame_header->DataLength);
+
+    // Check bytes value
+    if (bytes < 0)
+        return -1;
+    if (bytes > 64)
+        return -1;
+
+    // Data frame only. No data bytes for a remote frame.
+    if (frame_header->RxFrameType == FDCAN_REMOTE_FRAME)
+        bytes = 0;
+
+    uint8_t flags = 0;
+    if (frame_header->IdType == FDCAN_EXTENDED_ID) flags |= (1 << SLCAN_BINARY_FLAG_IDE);
+    if (frame_header->RxFrameType == FDCAN_REMOTE_FRAME) flags |= (1 << SLCAN_BINARY_FLAG_RTR);
+    if (frame_header->FDFormat == FDCAN_FD_CAN) flags |= (1 << SLCAN_BINARY_FLAG_FDF);
+    if (frame_header->BitRateSwitch == FDCAN_BRS_ON) flags |= (1 << SLCAN_BINARY_FLAG_BRS);
+    if (frame_header->ErrorStateIndicator == FDCAN_ESI_PASSIVE) flags |= (1 << SLCAN_BINARY_FLAG_ESI);
+
+    // Timestamp in the unit selected by Z or z command, zero if disabled
+    // Lower 32 bits of the nano second and the host clock timestamps
+    uint32_t timestamp = (uint32_t)slcan_get_timestamp(time_ticks);
+
+    // Little endian header followed by the raw data bytes
+    buf[0] = type;
+    buf[1] = SLCAN_BINARY_HEADER_LEN + bytes;
+    buf[2] = flags;
+    buf[3] = __hal_dlc_code_to_std_dlc_code(frame_header->DataLength) & 0xF;
+    memcpy(&buf[4], &frame_header->Identifier, 4);
+    memcpy(&buf[8], &timestamp, 4);
+    memcpy(&buf[SLCAN_BINARY_HEADER_LEN], frame_data, bytes);
+
+    // Return record length
+    return SLCAN_BINARY_HEADER_LEN + bytes;
+}
+
+// Write a byte as 2 ASCII characters
+void slcan_put_hex8(uint8_t *buf, uint8_t val)
+{
+    uint16_t chars = slcan_byte_to_ascii[val];
+    memcpy(buf, &chars, 2);
+}
+
+// Write a 16 bit value as 4 ASCII characters with a single word write
+void slcan_put_hex16(uint8_t *buf, uint16_t val)
+{
+    uint32_t chars = slcan_byte_to_ascii[val >> 8] | ((uint32_t)slcan_byte_to_ascii[val & 0xFF] << 16);
+    memcpy(buf, &chars, 4);
+}
+
+// Write a 32 bit value as 8 ASCII characters
+void slcan_put_hex32(uint8_t *buf, uint32_t val)
+{
+    slcan_put_hex16(&buf[0], val >> 16);
+    slcan_put_hex16(&buf[4], val & 0xFFFF);
+}
+
+// Decode 2 ASCII characters into a byte. Invalid characters set SLCAN_NIBBLE_INVALID in err.
+uint8_t slcan_get_hex8(uint8_t *buf, uint8_t *err)
+{
+    uint8_t hi = slcan_ascii_to_nibble[buf[0]];
+    uint8_t lo = slcan_ascii_to_nibble[buf[1]];
+    *err |= hi | lo;
+    return (hi << 4) | lo;
+}
+
 // Parse an incoming CAN frame into an outgoing slcan message
-int32_t slcan_parse_rx_frame(uint8_t *buf, FDCAN_RxHeaderTypeDef *frame_header, uint8_t *frame_data)
+int32_t slcan_parse_rx_frame(uint8_t *buf, FDCAN_RxHeaderTypeDef *frame_header, uint8_t *frame_data, uint64_t time_ticks)
 {
     // Rx reporting not required
     if (((slcan_report_reg >> SLCAN_REPORT_RX) & 1) == 0)
@@ -229,14 +348,17 @@ int32_t slcan_parse_rx_frame(uint8_t *buf, FDCAN_RxHeaderTypeDef *frame_header,
     if (buf == NULL)
         return 0;
 
-    int32_t msg_idx = slcan_parse_frame(buf, frame_header, frame_data);
+    if (slcan_frame_format == SLCAN_FORMAT_BINARY)
+        return slcan_parse_frame_binary(buf, SLCAN_BINARY_RX_FRAME, frame_header, frame_data, time_ticks);
+
+    int32_t msg_idx = slcan_parse_frame(buf, frame_header, frame_data, time_ticks);
 
     // Return string length
     return msg_idx;
 }
 
 // Parse an incoming Tx event into an outgoing slcan message
-int32_t slcan_parse_tx_event(uint8_t *buf, FDCAN_TxEventFifoTypeDef *tx_event, uint8_t *frame_data)
+int32_t slcan_parse_tx_event(uint8_t *buf, FDCAN_TxEventFifoTypeDef *tx_event, uint8_t *frame_data, uint64_t time_ticks)
 {
     // Tx reporting not required
     if (((slcan_report_reg >> SLCAN_REPORT_TX) & 1) == 0)
@@ -245,11 +367,6 @@ int32_t slcan_parse_tx_event(uint8_t *buf, FDCAN_TxEventFifoTypeDef *tx_event, u
     if (buf == NULL)
         return 0;
 
-    if (tx_event->IdType == FDCAN_STANDARD_ID)
-        buf[0] = 'z';
-    else
-        buf[0] = 'Z';
-
     FDCAN_RxHeaderTypeDef frame_header;
     frame_header.Identifier = tx_event->Identifier;
     frame_header.IdType = tx_event->IdType;
@@ -259,12 +376,90 @@ int32_t slcan_parse_tx_event(uint8_t *buf, FDCAN_TxEventFifoTypeDef *tx_event, u
     frame_header.BitRateSwitch = tx_event->BitRateSwitch;
     frame_header.FDFormat = tx_event->FDFormat;
     frame_header.RxTimestamp = tx_event->TxTimestamp;
-    int32_t msg_idx = slcan_parse_frame(&buf[1], &frame_header, frame_data);
+
+    if (slcan_frame_format == SLCAN_FORMAT_BINARY)
+        return slcan_parse_frame_binary(buf, SLCAN_BINARY_TX_EVENT, &frame_header, frame_data, time_ticks);
+
+    if (tx_event->IdType == FDCAN_STANDARD_ID)
+        buf[0] = 'z';
+    else
+        buf[0] = 'Z';
+
+    int32_t msg_idx = slcan_parse_frame(&buf[1], &frame_header, frame_data, time_ticks);
 
     // Return string length
     return msg_idx + 1;
 }
 
+// Parse the commands in a packet from the USB CDC port, return the number of bytes consumed
+// Commands within the packet are decoded in place, only a command split across packets is copied.
+// Parsing stops before a command when its reply or frame may not fit, the rest is left for the next call.
+uint32_t slcan_parse_packet(uint8_t *buf, uint32_t len)
+{
+    uint32_t pos = 0;
+
+    while (pos < len && buf_has_cdc_dest(SLCAN_MTU))
+    {
+        uint8_t cmd = (slcan_str_index > 0) ? slcan_str[0] : buf[pos];
+        uint32_t mtu = (cmd == 'G') ? SLCAN_BATCH_MTU : SLCAN_MTU;
+
+        uint8_t *end = memchr(&buf[pos], '\r', len - pos);
+        if (end == NULL)
+        {
+            // Keep the start of the command until the rest arrives
+            uint32_t part_len = len - pos;
+            if (slcan_str_overflow || slcan_str_index + part_len > mtu)
+            {
+                slcan_str_overflow = 1;
+            }
+            else
+            {
+                memcpy(&slcan_str[slcan_str_index], &buf[pos], part_len);
+                slcan_str_index += part_len;
+            }
+            return len;
+        }
+
+        // Leave a frame in the packet while the can tx queue is full, the host waits for it
+        if (memchr("rRtTdDbB", cmd, 8) != NULL && buf_wait_can_dest())
+            break;
+
+        uint32_t cmd_len = end - &buf[pos];
+        if (slcan_str_overflow || slcan_str_index + cmd_len > mtu)
+        {
+            // Too long for any command, reply error once for the whole line
+            buf_enqueue_cdc(SLCAN_RET_ERR, SLCAN_RET_LEN);
+        }
+        else if (cmd == 'G')
+        {
+            uint8_t *str = &buf[pos];
+            if (slcan_str_index > 0)
+            {
+                memcpy(&slcan_str[slcan_str_index], &buf[pos], cmd_len);
+                str = slcan_str;
+            }
+
+            // Leave a batch in the packet until all of its frames fit in the can tx queue
+            if (slcan_parse_str_batch(str, slcan_str_index + cmd_len) == HAL_BUSY)
+                break;
+        }
+        else if (slcan_str_index == 0)
+        {
+            slcan_parse_str(&buf[pos], cmd_len);
+        }
+        else
+        {
+            memcpy(&slcan_str[slcan_str_index], &buf[pos], cmd_len);
+            slcan_parse_str(slcan_str, slcan_str_index + cmd_len);
+        }
+        slcan_str_index = 0;
+        slcan_str_overflow = 0;
+        pos += cmd_len + 1;
+    }
+
+    return pos;
+}
+
 // Parse an incoming slcan command from the USB CDC port
 void slcan_parse_str(uint8_t *buf, uint8_t len)
 {
@@ -278,6 +473,29 @@ void slcan_parse_str(uint8_t *buf, uint8_t len)
         return;
     }
 
+    // Transmit commands are validated while decoding
+    switch (buf[0])
+    {
+    case 'r':
+    case 'R':
+    case 't':
+    case 'T':
+    case 'd':
+    case 'D':
+    case 'b':
+    case 'B':
+    case 'X':
+        slcan_parse_str_transmit(buf, len);
+        return;
+    // Cyclic transmit entries hold a transmit command
+    case 'K':
+    case 'k':
+        slcan_parse_str_cyclic(buf, len);
+        return;
+    default:
+        break;
+    }
+
     // Convert an incoming slcan command from ASCII to number (2nd character to end)
     if (slcan_convert_str_to_number(buf, len) != HAL_OK)
     {
@@ -333,6 +551,10 @@ void slcan_parse_str(uint8_t *buf, uint8_t len)
     case 'z':
         slcan_parse_str_report_mode(buf, len);
         return;
+    // Set frame report format
+    case 'H':
+        slcan_parse_str_frame_format(buf, len);
+        return;
     // Set filter mode
     case 'W':
         slcan_parse_str_filter_mode(buf, len);
@@ -345,14 +567,47 @@ void slcan_parse_str(uint8_t *buf, uint8_t len)
     case 'm':
         slcan_parse_str_filter_mask(buf, len);
         return;
+    // Set and get the filter list
+    case 'w':
+        slcan_parse_str_filter_list(buf, len);
+        return;
+    // Set and get the bitmap filter
+    case 'a':
+        slcan_parse_str_filter_bitmap(buf, len);
+        return;
+    // Set and get the hash set of the extended IDs
+    case 'h':
+        slcan_parse_str_filter_hash(buf, len);
+        return;
+    // Set and get the payload filter
+    case 'p':
+        slcan_parse_str_filter_data(buf, len);
+        return;
+    // Set and get the change-only reporting
+    case 'u':
+        slcan_parse_str_change_only(buf, len);
+        return;
     // Set auto retransmit
     case '-':
         slcan_parse_str_set_auto_retransmit(buf, len);
         return;
+    // Set transmit order and get the residency time
+    case 'J':
+    case 'j':
+        slcan_parse_str_tx_order(buf, len);
+        return;
     // Set auto startup mode
     case 'Q':
         slcan_parse_str_auto_startup(buf, len);
         return;
+    // Set USB flush policy
+    case 'E':
+        slcan_parse_str_flush_policy(buf, len);
+        return;
+    // Set and get the host clock
+    case 'c':
+        slcan_parse_str_clock_sync(buf, len);
+        return;
     // Debug function
     case '?':
     {
@@ -368,39 +623,33 @@ void slcan_parse_str(uint8_t *buf, uint8_t len)
 
         uint8_t cycle_ave = (uint8_t)(can_get_cycle_ave_time_ns() >= 255000 ? 255 : can_get_cycle_ave_time_ns() / 1000);
         uint8_t cycle_max = (uint8_t)(can_get_cycle_max_time_ns() >= 255000 ? 255 : can_get_cycle_max_time_ns() / 1000);
-        //char *dbgstr = "?XX-XX\r";
-        uint8_t dbgstr[7];
+        uint8_t frames_ave = (uint8_t)(can_get_frames_ave_per_pass() >= 255 ? 255 : can_get_frames_ave_per_pass());
+        uint8_t frames_max = (uint8_t)(can_get_frames_max_per_pass() >= 255 ? 255 : can_get_frames_max_per_pass());
+        //char *dbgstr = "?XX-XX-XX-XX\r";
+        uint8_t dbgstr[13];
+        uint8_t dbgval[4] = {cycle_ave, cycle_max, frames_ave, frames_max};
         dbgstr[0] = '?';
-        dbgstr[1] = cycle_ave >> 4;
-        dbgstr[2] = cycle_ave & 0xF;
-        for (uint8_t j = 1; j <= 2; j++)
-        {
-            if (dbgstr[j] < 0xA)
-                dbgstr[j] += 0x30;
-            else
-                dbgstr[j] += 0x37;
-        }
-        dbgstr[3] = '-';
-        dbgstr[4] = cycle_max >> 4;
-        dbgstr[5] = cycle_max & 0xF;
-        for (uint8_t j = 4; j <= 5; j++)
+        for (uint8_t j = 0; j < 4; j++)
         {
-            if (dbgstr[j] < 0xA)
-                dbgstr[j] += 0x30;
-            else
-                dbgstr[j] += 0x37;
+            slcan_put_hex8(&dbgstr[j * 3 + 1], dbgval[j]);
+            dbgstr[j * 3 + 3] = '-';
         }
-        dbgstr[6] = '\r';
-        buf_enqueue_cdc((uint8_t *)dbgstr, 7);
+        dbgstr[12] = '\r';
+        buf_enqueue_cdc((uint8_t *)dbgstr, 13);
 
         can_clear_cycle_time();
         return;
     }
+    // Invalid command
     default:
-        break;
+        buf_enqueue_cdc(SLCAN_RET_ERR, SLCAN_RET_LEN);
+        return;
     }
+}
 
-    // Set default header. All values overridden below as needed.
+// Transmit a CAN frame
+void slcan_parse_str_transmit(uint8_t *buf, uint8_t len)
+{
     FDCAN_TxHeaderTypeDef *frame_header = buf_get_can_dest_header();
     uint8_t *frame_data = buf_get_can_dest_data();
 
@@ -410,6 +659,167 @@ void slcan_parse_str(uint8_t *buf, uint8_t len)
         return;
     }
 
+    // Decode straight into the transmit buffer
+    if (slcan_decode_str_transmit(buf, len, frame_header, frame_data) != HAL_OK)
+    {
+        buf_enqueue_cdc(SLCAN_RET_ERR, SLCAN_RET_LEN);
+        return;
+    }
+
+    // Transmit the message
+    if (buf_comit_can_dest() != HAL_OK)
+    {
+        buf_enqueue_cdc(SLCAN_RET_ERR, SLCAN_RET_LEN);
+        return;
+    }
+    
+    // Send ACK
+    if ((slcan_report_reg >> SLCAN_REPORT_QUIET_TX) & 1)
+    {
+        return;
+    }
+    else if (((slcan_report_reg >> SLCAN_REPORT_TX) & 1) == 0)
+    {
+        if (frame_header->IdType == FDCAN_EXTENDED_ID)
+            buf_enqueue_cdc((uint8_t *)"Z\r", 2);
+        else
+            buf_enqueue_cdc((uint8_t *)"z\r", 2);
+    }
+    else
+    {
+        buf_enqueue_cdc(SLCAN_RET_OK, SLCAN_RET_LEN);
+    }
+
+    return;
+}
+
+// Queue the frames of a batch command all or nothing with a single ack, HAL_BUSY to wait for room in the can tx queue
+HAL_StatusTypeDef slcan_parse_str_batch(uint8_t *buf, uint16_t len)
+{
+    HAL_StatusTypeDef status = HAL_OK;
+    uint16_t pos = 1;
+    uint8_t frames = 0;
+
+    // Blink blue LED as slcan rx if bus closed
+    if (can_get_bus_state() == BUS_CLOSED) led_blink_blue();
+
+    // Transmit commands without CR back to back, find their size before decoding
+    uint32_t chars = 0;
+    while (pos < len)
+    {
+        uint8_t frame_len = slcan_get_str_transmit_len(&buf[pos], len - pos);
+        if (frame_len == 0)
+        {
+            buf_enqueue_cdc(SLCAN_RET_ERR, SLCAN_RET_LEN);
+            return HAL_ERROR;
+        }
+        pos += frame_len;
+        chars += frame_len;
+        frames++;
+    }
+    if (frames == 0)
+    {
+        buf_enqueue_cdc(SLCAN_RET_ERR, SLCAN_RET_LEN);
+        return HAL_ERROR;
+    }
+    // Half of the characters is more than the data bytes
+    if (!buf_has_can_batch_dest(frames, chars / 2))
+        status = HAL_BUSY;
+
+    pos = 1;
+    frames = 0;
+    buf_begin_can_batch();
+    while (pos < len && status == HAL_OK)
+    {
+        uint8_t frame_len = slcan_get_str_transmit_len(&buf[pos], len - pos);
+
+        if (!buf_has_can_dest())
+        {
+            status = HAL_BUSY;
+        }
+        else if (slcan_decode_str_transmit(&buf[pos], frame_len, buf_get_can_dest_header(), buf_get_can_dest_data()) != HAL_OK
+                 || buf_comit_can_dest() != HAL_OK)
+        {
+            status = HAL_ERROR;
+        }
+        else
+        {
+            pos += frame_len;
+            frames++;
+        }
+    }
+
+    if (status == HAL_OK)
+    {
+        buf_end_can_batch();
+
+        // Send ACK with the number of frames
+        if ((slcan_report_reg >> SLCAN_REPORT_QUIET_TX) & 1)
+            return HAL_OK;
+        uint8_t *ack = buf_reserve_cdc_dest(4);
+        ack[0] = 'G';
+        slcan_put_hex8(&ack[1], frames);
+        ack[3] = '\r';
+        buf_comit_cdc_dest(4);
+        return HAL_OK;
+    }
+
+    buf_cancel_can_batch();
+
+    // The host waits while the frames in the queue are sent, unless the queue does not move
+    if (status == HAL_BUSY)
+    {
+        if (buf_wait_can_batch())
+            return HAL_BUSY;
+        error_assert(ERR_FULLBUF_CANTX);
+    }
+
+    buf_enqueue_cdc(SLCAN_RET_ERR, SLCAN_RET_LEN);
+    return HAL_ERROR;
+}
+
+// Get the length of the transmit command at the start of a batch, 0 if it is not a transmit command
+uint8_t slcan_get_str_transmit_len(uint8_t *buf, uint16_t len)
+{
+    uint8_t id_len;
+
+    switch (buf[0])
+    {
+    case 'r':
+    case 't':
+    case 'd':
+    case 'b':
+        id_len = SLCAN_STD_ID_LEN;
+        break;
+    case 'R':
+    case 'T':
+    case 'D':
+    case 'B':
+        id_len = SLCAN_EXT_ID_LEN;
+        break;
+    default:
+        return 0;
+    }
+
+    if (len < 1 + id_len + 1)
+        return 0;
+
+    // No data bytes for a remote frame
+    uint8_t dlc_code = slcan_ascii_to_nibble[buf[1 + id_len]];
+    if (dlc_code & SLCAN_NIBBLE_INVALID)
+        return 0;
+    uint8_t bytes = (buf[0] == 'r' || buf[0] == 'R') ? 0 : hal_dlc_code_to_bytes(__std_dlc_code_to_hal_dlc_code(dlc_code));
+
+    if (len < 1 + id_len + 1 + bytes * 2)
+        return 0;
+
+    return 1 + id_len + 1 + bytes * 2;
+}
+
+// Decode a transmit command into a frame
+HAL_StatusTypeDef slcan_decode_str_transmit(uint8_t *buf, uint8_t len, FDCAN_TxHeaderTypeDef *frame_header, uint8_t *frame_data)
+{
+    // Set default header. All values overridden below as needed.
     frame_header->TxFrameType = FDCAN_DATA_FRAME;                // default to data frame
     frame_header->FDFormat = FDCAN_CLASSIC_CAN;                  // default to classic frame
     frame_header->IdType = FDCAN_STANDARD_ID;                    // default to standard ID
@@ -469,16 +879,9 @@ void slcan_parse_str(uint8_t *buf, uint8_t len)
 
     // Invalid command
     default:
-        buf_enqueue_cdc(SLCAN_RET_ERR, SLCAN_RET_LEN);
-        return;
+        return HAL_ERROR;
     }
 
-    // Start parsing at second byte (skip command byte)
-    uint8_t parse_loc = 1;
-
-    // Zero out identifier
-    frame_header->Identifier = 0;
-
     // Default to standard ID
     uint8_t id_len = SLCAN_STD_ID_LEN;
 
@@ -486,46 +889,56 @@ void slcan_parse_str(uint8_t *buf, uint8_t len)
     if (frame_header->IdType == FDCAN_EXTENDED_ID)
         id_len = SLCAN_EXT_ID_LEN;
 
-    // Iterate through ID bytes
-    while (parse_loc <= id_len)
+    // Check command length up to DLC
+    if (len < 1 + id_len + 1)
+    {
+        return HAL_ERROR;
+    }
+
+    // Invalid characters are accumulated and checked once at the end
+    uint8_t err = 0;
+
+    // Decode identifier (2nd character), first nibble then byte by byte
+    uint8_t nibble = slcan_ascii_to_nibble[buf[1]];
+    err |= nibble;
+    uint32_t identifier = nibble;
+    for (uint8_t i = 2; i < id_len; i += 2)
+        identifier = (identifier << 8) | slcan_get_hex8(&buf[i], &err);
+
+    // Standard ID has 3 characters. Extended ID has 8 characters, so one more nibble.
+    if (frame_header->IdType == FDCAN_EXTENDED_ID)
+    {
+        nibble = slcan_ascii_to_nibble[buf[id_len]];
+        err |= nibble;
+        identifier = (identifier << 4) | nibble;
+    }
+    frame_header->Identifier = identifier;
+
+    // Parse DLC
+    uint8_t dlc_code_raw = slcan_ascii_to_nibble[buf[id_len + 1]];
+    err |= dlc_code_raw;
+
+    if (err & SLCAN_NIBBLE_INVALID)
     {
-        frame_header->Identifier *= 16;
-        frame_header->Identifier += buf[parse_loc++];
+        return HAL_ERROR;
     }
 
     // If CAN ID is too large
     if (frame_header->IdType == FDCAN_STANDARD_ID && 0x7FF < frame_header->Identifier)
     {
-        buf_enqueue_cdc(SLCAN_RET_ERR, SLCAN_RET_LEN);
-        return;
+        return HAL_ERROR;
     }
     else if (frame_header->IdType == FDCAN_EXTENDED_ID && 0x1FFFFFFF < frame_header->Identifier)
     {
-        buf_enqueue_cdc(SLCAN_RET_ERR, SLCAN_RET_LEN);
-        return;
-    }    
-
-    // Attempt to parse DLC and check sanity
-    uint8_t dlc_code_raw = buf[parse_loc++];
-
-    // If dlc is too long for an FD frame
-    if (frame_header->FDFormat == FDCAN_FD_CAN && dlc_code_raw > 0xF)
-    {
-        buf_enqueue_cdc(SLCAN_RET_ERR, SLCAN_RET_LEN);
-        return;
+        return HAL_ERROR;
     }
+
     // If dlc is too long for an classical frame
     if (frame_header->FDFormat == FDCAN_CLASSIC_CAN)
     {
         if (frame_header->TxFrameType == FDCAN_DATA_FRAME && dlc_code_raw > 0x8)
         {
-            buf_enqueue_cdc(SLCAN_RET_ERR, SLCAN_RET_LEN);
-            return;
-        }
-        else if  (frame_header->TxFrameType == FDCAN_REMOTE_FRAME && dlc_code_raw > 0xF)
-        {
-            buf_enqueue_cdc(SLCAN_RET_ERR, SLCAN_RET_LEN);
-            return;
+            return HAL_ERROR;
         }
     }
 
@@ -537,51 +950,71 @@ void slcan_parse_str(uint8_t *buf, uint8_t len)
 
     if ((bytes_in_msg < 0) || (bytes_in_msg > 64))
     {
-        buf_enqueue_cdc(SLCAN_RET_ERR, SLCAN_RET_LEN);
-        return;
+        return HAL_ERROR;
     }
 
-    // Parse data
     // Data frame only. No data bytes for a remote frame.
-    if (frame_header->TxFrameType != FDCAN_REMOTE_FRAME)
+    if (frame_header->TxFrameType == FDCAN_REMOTE_FRAME)
+        bytes_in_msg = 0;
+
+    // Check command length before walking through the data
+    if (len != 1 + id_len + 1 + bytes_in_msg * 2)
     {
-        // TODO: Guard against walking off the end of the string!
-        for (uint8_t i = 0; i < bytes_in_msg; i++)
-        {
-            frame_data[i] = (buf[parse_loc] << 4) + buf[parse_loc + 1];
-            parse_loc += 2;
-        }
+        return HAL_ERROR;
     }
 
-    // Check command length
-    // parse_loc is always updated after a byte is parsed
-    if (len != parse_loc)
+    // Decode data bytes
+    uint8_t *data_str = &buf[1 + id_len + 1];
+    for (uint8_t i = 0; i < bytes_in_msg; i++)
+        frame_data[i] = slcan_get_hex8(&data_str[i * 2], &err);
+
+    if (err & SLCAN_NIBBLE_INVALID)
     {
-        buf_enqueue_cdc(SLCAN_RET_ERR, SLCAN_RET_LEN);
-        return;
+        return HAL_ERROR;
     }
 
-    // Transmit the message
-    if (buf_comit_can_dest() != HAL_OK)
+    return HAL_OK;
+}
+
+// Encode a frame into a transmit command without CR, return the length
+uint8_t slcan_encode_str_transmit(uint8_t *buf, const FDCAN_TxHeaderTypeDef *frame_header, const uint8_t *frame_data)
+{
+    uint8_t msg_idx = 0;
+
+    // Add character for frame type
+    if (frame_header->FDFormat == FDCAN_CLASSIC_CAN)
+        buf[msg_idx] = (frame_header->TxFrameType == FDCAN_REMOTE_FRAME) ? 'r' : 't';
+    else
+        buf[msg_idx] = (frame_header->BitRateSwitch == FDCAN_BRS_ON) ? 'b' : 'd';
+
+    // Add identifier, upper case for extended frame
+    if (frame_header->IdType == FDCAN_EXTENDED_ID)
     {
-        buf_enqueue_cdc(SLCAN_RET_ERR, SLCAN_RET_LEN);
-        return;
+        buf[msg_idx++] -= 32;
+        slcan_put_hex32(&buf[msg_idx], frame_header->Identifier);
+        msg_idx += SLCAN_EXT_ID_LEN;
     }
-    
-    // Send ACK
-    if (((slcan_report_reg >> SLCAN_REPORT_TX) & 1) == 0)
+    else
     {
-        if (frame_header->IdType == FDCAN_EXTENDED_ID)
-            buf_enqueue_cdc((uint8_t *)"Z\r", 2);
-        else
-            buf_enqueue_cdc((uint8_t *)"z\r", 2);
+        msg_idx++;
+        buf[msg_idx++] = slcan_nibble_to_ascii[(frame_header->Identifier >> 8) & 0xF];
+        slcan_put_hex8(&buf[msg_idx], frame_header->Identifier & 0xFF);
+        msg_idx += 2;
     }
-    else
+
+    // Add DLC and data bytes, no data bytes for a remote frame
+    buf[msg_idx++] = slcan_nibble_to_ascii[__hal_dlc_code_to_std_dlc_code(frame_header->DataLength) & 0xF];
+    if (frame_header->TxFrameType != FDCAN_REMOTE_FRAME)
     {
-        buf_enqueue_cdc(SLCAN_RET_OK, SLCAN_RET_LEN);
+        int8_t bytes = hal_dlc_code_to_bytes(frame_header->DataLength);
+        for (uint8_t i = 0; i < bytes; i++)
+        {
+            slcan_put_hex8(&buf[msg_idx], frame_data[i]);
+            msg_idx += 2;
+        }
     }
 
-    return;
+    return msg_idx;
 }
 
 // Convert from ASCII to number (2nd character to end)
@@ -606,58 +1039,65 @@ HAL_StatusTypeDef slcan_convert_str_to_number(uint8_t *buf, uint8_t len)
     return HAL_OK;
 }
 
-// Gets milli second timestamp (2bytes, MAX 60,000ms)
-uint16_t slcan_get_timestamp_ms(void)
+// Gets the timestamp of a time in the unit selected by Z or z command, zero if disabled
+uint64_t slcan_get_timestamp(uint64_t time_ticks)
 {
-    static uint16_t slcan_last_timestamp_ms = 0;
-    static uint32_t slcan_last_time_ms = 0;
-
-    uint32_t current_time_ms = HAL_GetTick();
-    uint32_t time_diff_ms;
-
-    time_diff_ms = (uint32_t)(current_time_ms - slcan_last_time_ms);
-
-    slcan_last_timestamp_ms = (uint16_t)(((uint32_t)slcan_last_timestamp_ms + time_diff_ms % 60000) % 60000);
-    slcan_last_time_ms = current_time_ms;
-
-    return slcan_last_timestamp_ms;
+    if (slcan_timestamp_mode == SLCAN_TIMESTAMP_MILLI)
+    {
+        // The wrapped time is below 6e7, a 32 bit division by the constant is a multiply, no 64 bit division by libgcc
+        uint32_t wrapped_us = slcan_wrap_time_us(timebase_ticks_to_us(time_ticks), &slcan_timestamp_ms_base_us, SLCAN_TIMESTAMP_MS_RANGE_US);
+        return (uint32_t)(wrapped_us / 1000U);
+    }
+    else if (slcan_timestamp_mode == SLCAN_TIMESTAMP_MICRO)
+        return slcan_wrap_time_us(timebase_ticks_to_us(time_ticks), &slcan_timestamp_us_base_us, SLCAN_TIMESTAMP_US_RANGE_US);
+    else if (slcan_timestamp_mode == SLCAN_TIMESTAMP_NANO)
+        return timebase_ticks_to_ns(time_ticks) & SLCAN_TIMESTAMP_NS_MASK;
+    else if (slcan_timestamp_mode == SLCAN_TIMESTAMP_SYNC)
+        return timesync_ticks_to_us(time_ticks);
+    else
+        return 0;
 }
 
-// Gets micro second timestamp (4bytes, MAX 3600,000,000us)
-uint32_t slcan_get_timestamp_us_from_tim3(uint16_t tim3_us)
+// Write the timestamp of a time in hex, return the number of characters
+uint8_t slcan_put_timestamp(uint8_t *buf, uint64_t time_ticks)
 {
-    static uint32_t slcan_last_timestamp_us = 0;
-    static uint32_t slcan_last_time_ms = 0;
-    static uint16_t slcan_last_time_us = 0;
-
-    uint32_t current_time_ms = HAL_GetTick();
-    uint16_t current_time_us = tim3_us; // MAX 0xFFFF
-    uint32_t time_diff_ms;
-    uint64_t time_diff_us;
-    uint64_t n_comp;
+    uint64_t timestamp = slcan_get_timestamp(time_ticks);
 
-    time_diff_ms = (uint32_t)(current_time_ms - slcan_last_time_ms);
-    time_diff_us = (uint64_t)((uint16_t)(current_time_us - slcan_last_time_us));
-
-    if (time_diff_ms <= 1 && time_diff_us > UINT16_MAX / 2)
+    if (slcan_timestamp_mode == SLCAN_TIMESTAMP_MILLI)
     {
-        // Assume tim3 was sampled before the last timestamp
-        // The amount of reversal should be close to the main loop (~100us) 
-        time_diff_us = (uint64_t)3600000000 - (uint16_t)(slcan_last_time_us - current_time_us);
+        slcan_put_hex16(buf, (uint16_t)timestamp);
+        return 4;
     }
-    else
+    else if (slcan_timestamp_mode == SLCAN_TIMESTAMP_MICRO)
     {
-        // Compensate overflow of micro second counter
-        n_comp = ((uint64_t)UINT16_MAX / 2 + time_diff_ms * 1000 - time_diff_us);   // MAX 0x10000, 0xFFFFFFFF * 1000, 0xFFFF
-        n_comp = n_comp / ((uint64_t)UINT16_MAX + 1);                               // MAX 0xFFFF * 1000 + ?
-        time_diff_us = time_diff_us + n_comp * ((uint64_t)UINT16_MAX + 1);          // MAX 0xFFFF * 1000 * 0x10000
+        slcan_put_hex32(buf, (uint32_t)timestamp);
+        return 8;
     }
+    else if (slcan_timestamp_mode == SLCAN_TIMESTAMP_NANO)
+    {
+        slcan_put_hex16(&buf[0], (uint16_t)(timestamp >> 32));
+        slcan_put_hex32(&buf[4], (uint32_t)timestamp);
+        return 12;
+    }
+    else if (slcan_timestamp_mode == SLCAN_TIMESTAMP_SYNC)
+    {
+        slcan_put_hex32(&buf[0], (uint32_t)(timestamp >> 32));
+        slcan_put_hex32(&buf[8], (uint32_t)timestamp);
+        return 16;
+    }
+    return 0;
+}
 
-    slcan_last_timestamp_us = (uint32_t)(((uint64_t)slcan_last_timestamp_us + time_diff_us) % 3600000000);
-    slcan_last_time_ms = current_time_ms;
-    slcan_last_time_us = current_time_us;
+// Gets the time from the start of its range, the base moves by whole ranges as the time goes on
+// The times of the frames are close to each other, so the loops run at most once instead of a 64 bit division.
+uint32_t slcan_wrap_time_us(uint64_t time_us, uint64_t *base_us, uint32_t range_us)
+{
+    while (time_us < *base_us)
+        *base_us -= range_us;
+    while (time_us - *base_us >= range_us)
+        *base_us += range_us;
 
-    return slcan_last_timestamp_us;
+    return (uint32_t)(time_us - *base_us);
 }
 
 // Open channel
@@ -818,18 +1258,13 @@ void slcan_parse_str_report_mode(uint8_t *buf, uint8_t len)
     if (buf[0] == 'Z' && len == 1)
     {
         // Check timestamp mode
-        if (slcan_timestamp_mode == SLCAN_TIMESTAMP_MILLI)
-        {
-            char* tmsstr = (char*)buf_get_cdc_dest();
-            snprintf(tmsstr, SLCAN_MTU - 1, "Z%04X\r", slcan_get_timestamp_ms());
-            buf_comit_cdc_dest(6);
-        }
-        else if (slcan_timestamp_mode == SLCAN_TIMESTAMP_MICRO)
+        if (slcan_timestamp_mode != SLCAN_TIMESTAMP_OFF)
         {
-            char* tmsstr = (char*)buf_get_cdc_dest();
-            uint32_t tms_us = slcan_get_timestamp_us_from_tim3(TIM3->CNT);
-            snprintf(tmsstr, SLCAN_MTU - 1, "Z%04X%04X\r", (uint16_t)((tms_us>>16)&0xFFFF), (uint16_t)(tms_us&0xFFFF));
-            buf_comit_cdc_dest(10);
+            uint8_t *tmsstr = buf_reserve_cdc_dest(SLCAN_MTU);
+            uint8_t tms_len = slcan_put_timestamp(&tmsstr[1], timebase_get_ticks());
+            tmsstr[0] = 'Z';
+            tmsstr[tms_len + 1] = '\r';
+            buf_comit_cdc_dest(tms_len + 2);
         }
         else
         {
@@ -850,7 +1285,7 @@ void slcan_parse_str_report_mode(uint8_t *buf, uint8_t len)
                 return;
             }
 
-            slcan_timestamp_mode = buf[1];
+            slcan_set_timestamp_mode(buf[1]);
             slcan_report_reg = 1;   // Default: no timestamp, no ESI, no Tx, but with Rx
             buf_enqueue_cdc(SLCAN_RET_OK, SLCAN_RET_LEN);
             return;
@@ -864,7 +1299,7 @@ void slcan_parse_str_report_mode(uint8_t *buf, uint8_t len)
                 return;
             }
 
-            slcan_timestamp_mode = buf[1];
+            slcan_set_timestamp_mode(buf[1]);
             slcan_report_reg = (buf[3] << 4) + buf[4];
             buf_enqueue_cdc(SLCAN_RET_OK, SLCAN_RET_LEN);
             return;
@@ -878,6 +1313,31 @@ void slcan_parse_str_report_mode(uint8_t *buf, uint8_t len)
     }
 }
 
+// Set frame report format
+void slcan_parse_str_frame_format(uint8_t *buf, uint8_t len)
+{
+    // Set frame report format
+    if (can_get_bus_state() == BUS_CLOSED)
+    {
+        // Check for valid command
+        if (len != 2 || SLCAN_FORMAT_INVALID <= buf[1])
+        {
+            buf_enqueue_cdc(SLCAN_RET_ERR, SLCAN_RET_LEN);
+            return;
+        }
+
+        slcan_frame_format = buf[1];
+        buf_enqueue_cdc(SLCAN_RET_OK, SLCAN_RET_LEN);
+        return;
+    }
+    // This command is only active if the CAN channel is closed.
+    else
+    {
+        buf_enqueue_cdc(SLCAN_RET_ERR, SLCAN_RET_LEN);
+        return;
+    }
+}
+
 // Set filter mode
 void slcan_parse_str_filter_mode(uint8_t *buf, uint8_t len)
 {
@@ -1048,6 +1508,182 @@ static void slcan_parse_str_set_auto_retransmit(uint8_t *buf, uint8_t len)
 }
 
 
+// Set transmit order and get the residency time of each priority class
+static void slcan_parse_str_tx_order(uint8_t *buf, uint8_t len)
+{
+    if (buf[0] == 'j')
+    {
+        // Check command length
+        if (len != 1)
+        {
+            buf_enqueue_cdc(SLCAN_RET_ERR, SLCAN_RET_LEN);
+            return;
+        }
+
+        char* ordstr = (char*)buf_reserve_cdc_dest(SLCAN_MTU);
+        int32_t ordlen = snprintf(ordstr, SLCAN_MTU - 1, "j: tx_order=%s, residency_ave_us=[%05u, %05u, %05u, %05u], residency_max_us=[%05u, %05u, %05u, %05u]\r",
+                                    (can_get_tx_order() == CAN_TX_ORDER_PRIORITY ? "PRIO" : "FIFO"),
+                                    (unsigned)buf_get_can_tx_residency_ave_us(0), (unsigned)buf_get_can_tx_residency_ave_us(1),
+                                    (unsigned)buf_get_can_tx_residency_ave_us(2), (unsigned)buf_get_can_tx_residency_ave_us(3),
+                                    (unsigned)buf_get_can_tx_residency_max_us(0), (unsigned)buf_get_can_tx_residency_max_us(1),
+                                    (unsigned)buf_get_can_tx_residency_max_us(2), (unsigned)buf_get_can_tx_residency_max_us(3));
+        buf_comit_cdc_dest(ordlen);
+        return;
+    }
+
+    if (len == 1)
+    {
+        // Report transmit order
+        char* ordstr = (char*)buf_reserve_cdc_dest(SLCAN_MTU);
+        snprintf(ordstr, SLCAN_MTU - 1, "J%01X\r", can_get_tx_order());
+        buf_comit_cdc_dest(3);
+        return;
+    }
+
+    // Set transmit order, only if the device is initiated but not open.
+    if (len != 2 || can_get_bus_state() != BUS_CLOSED)
+    {
+        buf_enqueue_cdc(SLCAN_RET_ERR, SLCAN_RET_LEN);
+        return;
+    }
+
+    if (can_set_tx_order(buf[1]) != HAL_OK)
+        buf_enqueue_cdc(SLCAN_RET_ERR, SLCAN_RET_LEN);
+    else
+        buf_enqueue_cdc(SLCAN_RET_OK, SLCAN_RET_LEN);
+}
+
+// Set and get the entries of the cyclic transmit table
+static void slcan_parse_str_cyclic(uint8_t *buf, uint8_t len)
+{
+    // Report the entries in use
+    if (buf[0] == 'K' && len == 1)
+    {
+        char* maskstr = (char*)buf_reserve_cdc_dest(SLCAN_MTU);
+        snprintf(maskstr, SLCAN_MTU - 1, "K%04X\r", cyclic_get_entry_mask());
+        buf_comit_cdc_dest(6);
+        return;
+    }
+
+    // Check the entry number
+    uint8_t idx = (len < 2) ? SLCAN_NIBBLE_INVALID : slcan_ascii_to_nibble[buf[1]];
+    if ((idx & SLCAN_NIBBLE_INVALID) || CYCLIC_ENTRY_NUM <= idx)
+    {
+        buf_enqueue_cdc(SLCAN_RET_ERR, SLCAN_RET_LEN);
+        return;
+    }
+
+    const struct cyclic_entry *entry = cyclic_get_entry(idx);
+    uint8_t err = 0;
+
+    if (buf[0] == 'k')
+    {
+        if (len == 2)
+        {
+            // Report the frames sent and the jitter of the period
+            if (entry == NULL)
+            {
+                buf_enqueue_cdc(SLCAN_RET_ERR, SLCAN_RET_LEN);
+                return;
+            }
+
+            char* cycstr = (char*)buf_reserve_cdc_dest(SLCAN_MTU);
+            int32_t cyclen = snprintf(cycstr, SLCAN_MTU - 1, "k: entry=%X, frames=%u, jitter_us=[%d, %d]\r",
+                                        idx, (unsigned)entry->frames, (int)entry->jitter_min_us, (int)entry->jitter_max_us);
+            buf_comit_cdc_dest(cyclen);
+            return;
+        }
+
+        // Update the data bytes
+        uint8_t data[64];
+        uint8_t bytes = (len - 2) / 2;
+        if ((len - 2) % 2 != 0 || bytes > 64)
+        {
+            buf_enqueue_cdc(SLCAN_RET_ERR, SLCAN_RET_LEN);
+            return;
+        }
+        for (uint8_t i = 0; i < bytes; i++)
+            data[i] = slcan_get_hex8(&buf[2 + i * 2], &err);
+
+        if ((err & SLCAN_NIBBLE_INVALID) || cyclic_update_data(idx, data, bytes) != HAL_OK)
+            buf_enqueue_cdc(SLCAN_RET_ERR, SLCAN_RET_LEN);
+        else
+            buf_enqueue_cdc(SLCAN_RET_OK, SLCAN_RET_LEN);
+        return;
+    }
+
+    if (len == 2)
+    {
+        // Report the definition of the entry
+        if (entry == NULL)
+        {
+            buf_enqueue_cdc(SLCAN_RET_ERR, SLCAN_RET_LEN);
+            return;
+        }
+
+        uint8_t *defstr = buf_reserve_cdc_dest(SLCAN_MTU);
+        uint8_t deflen = 0;
+        defstr[deflen++] = 'K';
+        defstr[deflen++] = slcan_nibble_to_ascii[idx];
+        slcan_put_hex32(&defstr[deflen], entry->period_us);
+        deflen += 8;
+        slcan_put_hex32(&defstr[deflen], entry->phase_us);
+        deflen += 8;
+        deflen += slcan_encode_str_transmit(&defstr[deflen], &entry->header, entry->data);
+        defstr[deflen++] = '\r';
+        buf_comit_cdc_dest(deflen);
+        return;
+    }
+
+    // Period in us, 8 characters
+    if (len < 10)
+    {
+        buf_enqueue_cdc(SLCAN_RET_ERR, SLCAN_RET_LEN);
+        return;
+    }
+    uint32_t period_us = 0;
+    for (uint8_t i = 2; i < 10; i += 2)
+        period_us = (period_us << 8) | slcan_get_hex8(&buf[i], &err);
+
+    if (err & SLCAN_NIBBLE_INVALID)
+    {
+        buf_enqueue_cdc(SLCAN_RET_ERR, SLCAN_RET_LEN);
+        return;
+    }
+
+    // Remove the entry with zero period
+    if (len == 10)
+    {
+        if (period_us != 0 || cyclic_remove_entry(idx) != HAL_OK)
+            buf_enqueue_cdc(SLCAN_RET_ERR, SLCAN_RET_LEN);
+        else
+            buf_enqueue_cdc(SLCAN_RET_OK, SLCAN_RET_LEN);
+        return;
+    }
+
+    // Phase in us, 8 characters, then a transmit command
+    if (len < 18 || buf[18] == 'X')
+    {
+        buf_enqueue_cdc(SLCAN_RET_ERR, SLCAN_RET_LEN);
+        return;
+    }
+    uint32_t phase_us = 0;
+    for (uint8_t i = 10; i < 18; i += 2)
+        phase_us = (phase_us << 8) | slcan_get_hex8(&buf[i], &err);
+
+    FDCAN_TxHeaderTypeDef frame_header;
+    uint8_t frame_data[64];
+    if ((err & SLCAN_NIBBLE_INVALID)
+        || slcan_decode_str_transmit(&buf[18], len - 18, &frame_header, frame_data) != HAL_OK
+        || cyclic_set_entry(idx, &frame_header, frame_data, period_us, phase_us) != HAL_OK)
+    {
+        buf_enqueue_cdc(SLCAN_RET_ERR, SLCAN_RET_LEN);
+        return;
+    }
+
+    buf_enqueue_cdc(SLCAN_RET_OK, SLCAN_RET_LEN);
+}
+
 // Get version number in standard + detailed style
 void slcan_parse_str_version(uint8_t *buf, uint8_t len)
 {
@@ -1091,7 +1727,7 @@ void slcan_parse_str_number(uint8_t *buf, uint8_t len)
     {
         // Report serial number
         uint16_t serial;
-        char* numstr = (char*)buf_get_cdc_dest();
+        char* numstr = (char*)buf_reserve_cdc_dest(SLCAN_MTU);
         if (nvm_get_serial_number(&serial) == HAL_OK)
         {
             snprintf(numstr, SLCAN_MTU - 1, "N%04X\r", serial);
@@ -1141,13 +1777,12 @@ void slcan_parse_str_status(uint8_t *buf, uint8_t len)
             status = ((err_reg >> ERR_CAN_RXFAIL) & 1) ? (status | (1 << SLCAN_STS_DATA_OVERRUN)) : status;
             status = ((err_reg >> ERR_CAN_TXFAIL) & 1) ? (status | (1 << SLCAN_STS_DATA_OVERRUN)) : status;
             status = ((err_reg >> ERR_FULLBUF_CANTX) & 1) ? (status | (1 << SLCAN_STS_CAN_TX_FIFO_FULL)) : status;
-            status = ((err_reg >> ERR_FULLBUF_USBRX) & 1) ? (status | (1 << SLCAN_STS_CAN_TX_FIFO_FULL)) : status;
             status = ((err_reg >> ERR_FULLBUF_USBTX) & 1) ? (status | (1 << SLCAN_STS_CAN_RX_FIFO_FULL)) : status;
             status = ((err_reg >> ERR_CAN_BUS_ERR) & 1) ? (status | (1 << SLCAN_STS_BUS_ERROR)) : status;
             status = ((err_reg >> ERR_CAN_WARNING) & 1) ? (status | (1 << SLCAN_STS_ERROR_WARNING)) : status;
             status = ((err_reg >> ERR_CAN_ERR_PASSIVE) & 1) ? (status | (1 << SLCAN_STS_ERROR_PASSIVE)) : status;
 
-            char* stsstr = (char*)buf_get_cdc_dest();
+            char* stsstr = (char*)buf_reserve_cdc_dest(SLCAN_MTU);
             snprintf(stsstr, SLCAN_MTU - 1, "F%02X\r", status);
             buf_comit_cdc_dest(4);
 
@@ -1156,7 +1791,7 @@ void slcan_parse_str_status(uint8_t *buf, uint8_t len)
         }
         else if (buf[0] == 'f')
         {
-            char* stsstr = (char*)buf_get_cdc_dest();
+            char* stsstr = (char*)buf_reserve_cdc_dest(SLCAN_MTU);
 
             struct can_error_state err = can_get_error_state();
 
@@ -1216,11 +1851,412 @@ void slcan_parse_str_auto_startup(uint8_t *buf, uint8_t len)
     }
 }
 
-// Set the timestamp mode
+// Set USB flush policy
+void slcan_parse_str_flush_policy(uint8_t *buf, uint8_t len)
+{
+    if (len == 1)
+    {
+        // Report flush policy
+        char* flsstr = (char*)buf_reserve_cdc_dest(SLCAN_MTU);
+        snprintf(flsstr, SLCAN_MTU - 1, "E%01X%04X\r", buf_get_flush_mode(), buf_get_flush_value());
+        buf_comit_cdc_dest(7);
+        return;
+    }
+    else if (len == 2 || len == 6)
+    {
+        // Set and store flush policy, the threshold is needed except for the immediate mode
+        uint16_t value = 0;
+        if (len == 6)
+            value = ((uint16_t)buf[2] << 12) + ((uint16_t)buf[3] << 8) + ((uint16_t)buf[4] << 4) + buf[5];
+        else if (buf[1] != BUF_FLUSH_IMMEDIATE)
+        {
+            buf_enqueue_cdc(SLCAN_RET_ERR, SLCAN_RET_LEN);
+            return;
+        }
+
+        if (buf_set_flush_policy(buf[1], value) != HAL_OK)
+            buf_enqueue_cdc(SLCAN_RET_ERR, SLCAN_RET_LEN);
+        else if (nvm_update_flush_policy(buf_get_flush_mode(), buf_get_flush_value()) != HAL_OK)
+            buf_enqueue_cdc(SLCAN_RET_ERR, SLCAN_RET_LEN);
+        else
+            buf_enqueue_cdc(SLCAN_RET_OK, SLCAN_RET_LEN);
+        return;
+    }
+    else
+    {
+        buf_enqueue_cdc(SLCAN_RET_ERR, SLCAN_RET_LEN);
+        return;
+    }
+}
+
+// Set and get the entries of the filter list
+void slcan_parse_str_filter_list(uint8_t *buf, uint8_t len)
+{
+    enum can_filter_type type;
+    uint32_t id1, id2;
+
+    // Report the entries in use
+    if (len == 1)
+    {
+        uint8_t *maskstr = buf_reserve_cdc_dest(SLCAN_MTU);
+        maskstr[0] = 'w';
+        slcan_put_hex32(&maskstr[1], can_get_filter_entry_mask(FDCAN_STANDARD_ID));
+        maskstr[9] = '-';
+        slcan_put_hex8(&maskstr[10], (uint8_t)can_get_filter_entry_mask(FDCAN_EXTENDED_ID));
+        maskstr[12] = '\r';
+        buf_comit_cdc_dest(13);
+        return;
+    }
+
+    // ID type (0: standard, 1: extended) and entry number
+    if (len < 4 || 1 < buf[1])
+    {
+        buf_enqueue_cdc(SLCAN_RET_ERR, SLCAN_RET_LEN);
+        return;
+    }
+    uint32_t id_type = buf[1] ? FDCAN_EXTENDED_ID : FDCAN_STANDARD_ID;
+    uint8_t idx = (buf[2] << 4) + buf[3];
+
+    if (len == 4)
+    {
+        // Report the entry in the same format as it is set
+        if (can_get_filter_entry(id_type, idx, &type, &id1, &id2) != HAL_OK || type == CAN_FILTER_OFF)
+        {
+            buf_enqueue_cdc(SLCAN_RET_ERR, SLCAN_RET_LEN);
+            return;
+        }
+        uint8_t *entstr = buf_reserve_cdc_dest(SLCAN_MTU);
+        entstr[0] = 'w';
+        entstr[1] = slcan_nibble_to_ascii[buf[1]];
+        slcan_put_hex8(&entstr[2], idx);
+        entstr[4] = slcan_nibble_to_ascii[type];
+        slcan_put_hex32(&entstr[5], id1);
+        slcan_put_hex32(&entstr[13], id2);
+        entstr[21] = '\r';
+        buf_comit_cdc_dest(22);
+        return;
+    }
+
+    // Remove the entry with type 0 or set it with two IDs, only while the channel is closed
+    type = buf[4];
+    id1 = 0;
+    id2 = 0;
+    if (len == 21 && type != CAN_FILTER_OFF)
+    {
+        for (uint8_t i = 5; i < 13; i++)
+            id1 = (id1 << 4) + buf[i];
+        for (uint8_t i = 13; i < 21; i++)
+            id2 = (id2 << 4) + buf[i];
+    }
+    else if (len != 5 || type != CAN_FILTER_OFF)
+    {
+        buf_enqueue_cdc(SLCAN_RET_ERR, SLCAN_RET_LEN);
+        return;
+    }
+
+    if (can_set_filter_entry(id_type, idx, type, id1, id2) != HAL_OK)
+        buf_enqueue_cdc(SLCAN_RET_ERR, SLCAN_RET_LEN);
+    else
+        buf_enqueue_cdc(SLCAN_RET_OK, SLCAN_RET_LEN);
+}
+
+// Set and get the bitmap filter of the standard IDs
+void slcan_parse_str_filter_bitmap(uint8_t *buf, uint8_t len)
+{
+    if (len == 1)
+    {
+        // Report the state, the IDs accepted and the frames rejected
+        char* bmpstr = (char*)buf_reserve_cdc_dest(SLCAN_MTU);
+        int32_t bmplen = snprintf(bmpstr, SLCAN_MTU - 1, "a: enabled=%u, ids=%u, rejected=%u\r",
+                                  (unsigned)(can_is_filter_bitmap_enabled() == ENABLE), (unsigned)can_get_filter_bitmap_ids(),
+                                  (unsigned)can_get_filter_bitmap_rejected());
+        buf_comit_cdc_dest(bmplen);
+        return;
+    }
+    else if (len == 2 && buf[1] <= 1)
+    {
+        // Enable or disable the filter
+        if (can_set_filter_bitmap_state(buf[1] ? ENABLE : DISABLE) != HAL_OK)
+            buf_enqueue_cdc(SLCAN_RET_ERR, SLCAN_RET_LEN);
+        else
+            buf_enqueue_cdc(SLCAN_RET_OK, SLCAN_RET_LEN);
+        return;
+    }
+    else if (len == 8 && buf[1] <= 1)
+    {
+        // Accept or reject a range of the IDs
+        uint32_t from = ((uint32_t)buf[2] << 8) + ((uint32_t)buf[3] << 4) + buf[4];
+        uint32_t to = ((uint32_t)buf[5] << 8) + ((uint32_t)buf[6] << 4) + buf[7];
+        if (can_set_filter_bitmap_range(from, to, buf[1]) != HAL_OK)
+            buf_enqueue_cdc(SLCAN_RET_ERR, SLCAN_RET_LEN);
+        else
+            buf_enqueue_cdc(SLCAN_RET_OK, SLCAN_RET_LEN);
+        return;
+    }
+    else if ((len == 3 || len == 3 + SLCAN_BITMAP_BLOCK_WORDS * 8) && buf[1] == 2 && buf[2] < SLCAN_BITMAP_BLOCK_NUM)
+    {
+        uint8_t word_idx = buf[2] * SLCAN_BITMAP_BLOCK_WORDS;
+
+        // Report a block of 256 IDs
+        if (len == 3)
+        {
+            uint8_t *blkstr = buf_reserve_cdc_dest(SLCAN_MTU);
+            blkstr[0] = 'a';
+            blkstr[1] = '2';
+            blkstr[2] = slcan_nibble_to_ascii[buf[2]];
+            for (uint8_t i = 0; i < SLCAN_BITMAP_BLOCK_WORDS; i++)
+                slcan_put_hex32(&blkstr[3 + i * 8], can_get_filter_bitmap_word(word_idx + i));
+            blkstr[3 + SLCAN_BITMAP_BLOCK_WORDS * 8] = '\r';
+            buf_comit_cdc_dest(4 + SLCAN_BITMAP_BLOCK_WORDS * 8);
+            return;
+        }
+
+        // Load a block of 256 IDs, 32 bits in 8 characters each
+        for (uint8_t i = 0; i < SLCAN_BITMAP_BLOCK_WORDS; i++)
+        {
+            uint32_t word = 0;
+            for (uint8_t j = 0; j < 8; j++)
+                word = (word << 4) + buf[3 + i * 8 + j];
+            can_set_filter_bitmap_word(word_idx + i, word);
+        }
+        buf_enqueue_cdc(SLCAN_RET_OK, SLCAN_RET_LEN);
+        return;
+    }
+    else
+    {
+        buf_enqueue_cdc(SLCAN_RET_ERR, SLCAN_RET_LEN);
+        return;
+    }
+}
+
+// Set and get the hash set of the extended IDs
+void slcan_parse_str_filter_hash(uint8_t *buf, uint8_t len)
+{
+    if (len == 1)
+    {
+        // Report the mode, the load of the table and the lookups
+        struct can_filter_hash_stats stats = can_get_filter_hash_stats();
+        char* hshstr = (char*)buf_reserve_cdc_dest(SLCAN_MTU);
+        int32_t hshlen = snprintf(hshstr, SLCAN_MTU - 1, "h: mode=%u, entries=%u/%u, max_probes=%u, frames=%u, probes=%u, rejected=%u\r",
+                                  (unsigned)can_get_filter_hash_mode(), (unsigned)stats.entries, (unsigned)CAN_FILTER_HASH_ENTRIES,
+                                  (unsigned)stats.max_probes, (unsigned)stats.frames, (unsigned)stats.probes,
+                                  (unsigned)stats.rejected);
+        buf_comit_cdc_dest(hshlen);
+        return;
+    }
+    else if (len == 2 && buf[1] < CAN_FILTER_HASH_INVALID)
+    {
+        // Turn off or use as an allow or a deny list
+        if (can_set_filter_hash_mode(buf[1]) != HAL_OK)
+            buf_enqueue_cdc(SLCAN_RET_ERR, SLCAN_RET_LEN);
+        else
+            buf_enqueue_cdc(SLCAN_RET_OK, SLCAN_RET_LEN);
+        return;
+    }
+    else if (len == 2 && buf[1] == CAN_FILTER_HASH_INVALID)
+    {
+        // Remove all entries
+        can_clear_filter_hash();
+        buf_enqueue_cdc(SLCAN_RET_OK, SLCAN_RET_LEN);
+        return;
+    }
+    else if (len == 10 && buf[1] <= 3)
+    {
+        // Remove or add an ID (0, 1) or a PGN (2, 3)
+        uint32_t id = 0;
+        for (uint8_t i = 2; i < 10; i++)
+            id = (id << 4) + buf[i];
+
+        HAL_StatusTypeDef ret;
+        if (buf[1] & 1)
+            ret = can_add_filter_hash_entry(id, buf[1] >> 1);
+        else
+            ret = can_remove_filter_hash_entry(id, buf[1] >> 1);
+
+        if (ret != HAL_OK)
+            buf_enqueue_cdc(SLCAN_RET_ERR, SLCAN_RET_LEN);
+        else
+            buf_enqueue_cdc(SLCAN_RET_OK, SLCAN_RET_LEN);
+        return;
+    }
+    else
+    {
+        buf_enqueue_cdc(SLCAN_RET_ERR, SLCAN_RET_LEN);
+        return;
+    }
+}
+
+// Set and get the rules of the payload filter
+void slcan_parse_str_filter_data(uint8_t *buf, uint8_t len)
+{
+    struct can_data_filter rule = {0};
+
+    if (len == 1)
+    {
+        // Report the rules in use and the frames rejected
+        char* datstr = (char*)buf_reserve_cdc_dest(SLCAN_MTU);
+        int32_t datlen = snprintf(datstr, SLCAN_MTU - 1, "p: rules=%02X, rejected=%u\r",
+                                  can_get_filter_data_mask(), (unsigned)can_get_filter_data_rejected());
+        buf_comit_cdc_dest(datlen);
+        return;
+    }
+    else if (len == 2 && buf[1] < CAN_FILTER_DATA_NUM)
+    {
+        // Report the rule in the same format as it is set
+        const struct can_data_filter *entry = can_get_filter_data_rule(buf[1]);
+        if (entry == NULL)
+        {
+            buf_enqueue_cdc(SLCAN_RET_ERR, SLCAN_RET_LEN);
+            return;
+        }
+        uint8_t *rulstr = buf_reserve_cdc_dest(SLCAN_MTU);
+        rulstr[0] = 'p';
+        rulstr[1] = slcan_nibble_to_ascii[buf[1]];
+        rulstr[2] = (entry->id_type == FDCAN_EXTENDED_ID) ? '2' : '1';
+        slcan_put_hex32(&rulstr[3], entry->id);
+        slcan_put_hex32(&rulstr[11], entry->id_mask);
+        rulstr[19] = slcan_nibble_to_ascii[entry->len];
+        for (uint8_t i = 0; i < entry->len; i++)
+        {
+            slcan_put_hex8(&rulstr[20 + i * 2], entry->mask[i]);
+            slcan_put_hex8(&rulstr[20 + entry->len * 2 + i * 2], entry->value[i]);
+        }
+        rulstr[20 + entry->len * 4] = '\r';
+        buf_comit_cdc_dest(21 + entry->len * 4);
+        return;
+    }
+    else if (len == 3 && buf[1] < CAN_FILTER_DATA_NUM && buf[2] == 0)
+    {
+        // Remove the rule with type 0
+        if (can_remove_filter_data_rule(buf[1]) != HAL_OK)
+            buf_enqueue_cdc(SLCAN_RET_ERR, SLCAN_RET_LEN);
+        else
+            buf_enqueue_cdc(SLCAN_RET_OK, SLCAN_RET_LEN);
+        return;
+    }
+    else if (len >= 20 && buf[1] < CAN_FILTER_DATA_NUM && (buf[2] == 1 || buf[2] == 2)
+             && buf[19] <= CAN_FILTER_DATA_LEN && len == 20 + buf[19] * 4)
+    {
+        // Set the rule with the ID type (1: standard, 2: extended), the ID and its mask, and the bytes to compare
+        rule.id_type = (buf[2] == 2) ? FDCAN_EXTENDED_ID : FDCAN_STANDARD_ID;
+        for (uint8_t i = 3; i < 11; i++)
+            rule.id = (rule.id << 4) + buf[i];
+        for (uint8_t i = 11; i < 19; i++)
+            rule.id_mask = (rule.id_mask << 4) + buf[i];
+        rule.len = buf[19];
+        for (uint8_t i = 0; i < rule.len; i++)
+        {
+            rule.mask[i] = (buf[20 + i * 2] << 4) + buf[21 + i * 2];
+            rule.value[i] = (buf[20 + rule.len * 2 + i * 2] << 4) + buf[21 + rule.len * 2 + i * 2];
+        }
+
+        if (can_set_filter_data_rule(buf[1], &rule) != HAL_OK)
+            buf_enqueue_cdc(SLCAN_RET_ERR, SLCAN_RET_LEN);
+        else
+            buf_enqueue_cdc(SLCAN_RET_OK, SLCAN_RET_LEN);
+        return;
+    }
+    else
+    {
+        buf_enqueue_cdc(SLCAN_RET_ERR, SLCAN_RET_LEN);
+        return;
+    }
+}
+
+// Set and get the change-only reporting of the received frames
+void slcan_parse_str_change_only(uint8_t *buf, uint8_t len)
+{
+    uint16_t keepalive_ms = 0;
+    uint16_t keepalive_frames = 0;
+
+    if (len == 1)
+    {
+        // Report the keep-alive, the IDs tracked and the frames suppressed
+        struct can_change_stats stats = can_get_change_only_stats();
+        can_get_change_only_keepalive(&keepalive_ms, &keepalive_frames);
+        char* chgstr = (char*)buf_reserve_cdc_dest(SLCAN_MTU);
+        int32_t chglen = snprintf(chgstr, SLCAN_MTU - 1, "u: enabled=%u, keepalive=%04X%04X, ids=%u/%u, suppressed=%u, kept=%u, untracked=%u\r",
+                                  (unsigned)(can_is_change_only_enabled() == ENABLE), keepalive_ms, keepalive_frames,
+                                  (unsigned)stats.ids, (unsigned)CAN_CHANGE_IDS, (unsigned)stats.suppressed,
+                                  (unsigned)stats.keepalive, (unsigned)stats.untracked);
+        buf_comit_cdc_dest(chglen);
+        return;
+    }
+    else if ((len == 2 && buf[1] <= 1) || (len == 10 && buf[1] == 1))
+    {
+        // Keep-alive by the time in ms and by the frames, zero for none
+        for (uint8_t i = 2; i < len && i < 6; i++)
+            keepalive_ms = (keepalive_ms << 4) + buf[i];
+        for (uint8_t i = 6; i < len; i++)
+            keepalive_frames = (keepalive_frames << 4) + buf[i];
+
+        can_set_change_only(buf[1] ? ENABLE : DISABLE, keepalive_ms, keepalive_frames);
+        buf_enqueue_cdc(SLCAN_RET_OK, SLCAN_RET_LEN);
+        return;
+    }
+    else
+    {
+        buf_enqueue_cdc(SLCAN_RET_ERR, SLCAN_RET_LEN);
+        return;
+    }
+}
+
+// Set the epoch of the host clock and get it at the last USB start of frame
+void slcan_parse_str_clock_sync(uint8_t *buf, uint8_t len)
+{
+    uint16_t frame;
+    uint64_t sync_us;
+
+    if (len == 1)
+    {
+        // Report the frame number, the host time and the drift
+        if (timesync_get_sof(&frame, &sync_us) != HAL_OK)
+        {
+            buf_enqueue_cdc(SLCAN_RET_ERR, SLCAN_RET_LEN);
+            return;
+        }
+        uint8_t *syncstr = buf_reserve_cdc_dest(SLCAN_MTU);
+        syncstr[0] = 'c';
+        syncstr[1] = slcan_nibble_to_ascii[frame >> 8];
+        slcan_put_hex8(&syncstr[2], frame & 0xFF);
+        syncstr[4] = '-';
+        slcan_put_hex32(&syncstr[5], (uint32_t)(sync_us >> 32));
+        slcan_put_hex32(&syncstr[13], (uint32_t)sync_us);
+        syncstr[21] = '-';
+        slcan_put_hex32(&syncstr[22], (uint32_t)timesync_get_drift_ppb());
+        syncstr[30] = '\r';
+        buf_comit_cdc_dest(31);
+        return;
+    }
+    else if (len == 20)
+    {
+        // Set the host time in micro seconds at the start of a frame
+        frame = ((uint16_t)buf[1] << 8) + ((uint16_t)buf[2] << 4) + buf[3];
+        sync_us = 0;
+        for (uint8_t i = 4; i < 20; i++)
+            sync_us = (sync_us << 4) + buf[i];
+
+        if (timesync_set_epoch(frame, sync_us) != HAL_OK)
+            buf_enqueue_cdc(SLCAN_RET_ERR, SLCAN_RET_LEN);
+        else
+            buf_enqueue_cdc(SLCAN_RET_OK, SLCAN_RET_LEN);
+        return;
+    }
+    else
+    {
+        buf_enqueue_cdc(SLCAN_RET_ERR, SLCAN_RET_LEN);
+        return;
+    }
+}
+
+// Set the timestamp mode, the nano second timestamp runs the time stamp counter faster
 void slcan_set_timestamp_mode(enum slcan_timestamp_mode mode)
 {
     if (mode < SLCAN_TIMESTAMP_INVALID)
+    {
         slcan_timestamp_mode = mode;
+        timebase_set_resolution(mode == SLCAN_TIMESTAMP_NANO ? TIMEBASE_RES_SUB_MICRO : TIMEBASE_RES_MICRO);
+    }
     return;
 }
 
@@ -0,0 +1,119 @@
+//
+// timebase: 64 bit time extended from TIM3 by its overflow interrupt
+//
+
+#include "stm32g4xx_hal.h"
+#include "system.h"
+#include "timebase.h"
+
+// Ticks per micro second as a power of two, so the conversions need no division
+#define TIMEBASE_SHIFT_MICRO        (0)
+#define TIMEBASE_SHIFT_SUB_MICRO    (4)
+#define TIMEBASE_TIM3_CLOCK_MHZ     (160)
+
+// Private variables
+static volatile uint32_t timebase_overflows = 0;   // Counted by the TIM3 update interrupt
+static uint64_t timebase_ticks_base = 0;            // Ticks at the last change of the resolution
+static uint8_t timebase_shift = TIMEBASE_SHIFT_MICRO;
+
+// Count the overflows of TIM3, started with its update interrupt in system_init()
+void timebase_init(void)
+{
+    // The update event generated by the timer init is not an overflow
+    TIM3->SR = (uint32_t)~TIM_SR_UIF;
+    timebase_overflows = 0;
+    timebase_ticks_base = 0;
+    timebase_shift = TIMEBASE_SHIFT_MICRO;
+
+    HAL_NVIC_SetPriority(TIM3_IRQn, 0, 0);
+    HAL_NVIC_EnableIRQ(TIM3_IRQn);
+}
+
+// Handle the TIM3 update interrupt
+void timebase_irq_handler(void)
+{
+    if (TIM3->SR & TIM_SR_UIF)
+    {
+        TIM3->SR = (uint32_t)~TIM_SR_UIF;
+        timebase_overflows++;
+    }
+}
+
+// Change the clock of TIM3, only while the CAN channel is closed as the time stamps in flight change their unit
+// The time goes on from the same value in micro seconds.
+HAL_StatusTypeDef timebase_set_resolution(enum timebase_resolution res)
+{
+    if (TIMEBASE_RES_INVALID <= res) return HAL_ERROR;
+
+    uint8_t shift = (res == TIMEBASE_RES_SUB_MICRO) ? TIMEBASE_SHIFT_SUB_MICRO : TIMEBASE_SHIFT_MICRO;
+    if (shift == timebase_shift) return HAL_OK;
+
+    system_irq_disable();
+    uint64_t now_us = timebase_get_us();
+
+    // The prescaler is loaded by the update event, which also clears the count
+    TIM3->PSC = (TIMEBASE_TIM3_CLOCK_MHZ >> shift) - 1;
+    TIM3->EGR = TIM_EGR_UG;
+    TIM3->CNT = 0;
+    TIM3->SR = (uint32_t)~TIM_SR_UIF;
+
+    timebase_overflows = 0;
+    timebase_ticks_base = now_us << shift;
+    timebase_shift = shift;
+    system_irq_enable();
+
+    return HAL_OK;
+}
+
+// Get the resolution of TIM3
+enum timebase_resolution timebase_get_resolution(void)
+{
+    return (timebase_shift == TIMEBASE_SHIFT_SUB_MICRO) ? TIMEBASE_RES_SUB_MICRO : TIMEBASE_RES_MICRO;
+}
+
+// Get the time in ticks of TIM3 since the start, from any context
+uint64_t timebase_get_ticks(void)
+{
+    uint32_t overflows;
+    uint16_t cnt;
+    uint32_t pending;
+
+    // Read again if the interrupt came in between
+    do
+    {
+        overflows = timebase_overflows;
+        cnt = (uint16_t)TIM3->CNT;
+        pending = TIM3->SR & TIM_SR_UIF;
+    } while (overflows != timebase_overflows);
+
+    // The overflow is not counted yet if called with the interrupt masked
+    if (pending && cnt < 0x8000)
+        overflows++;
+
+    return timebase_ticks_base + (((uint64_t)overflows << 16) | cnt);
+}
+
+// Extend a TIM3 count captured within the 16 bit range (e.g. the FDCAN time stamp) to the 64 bit time in ticks
+uint64_t timebase_extend_ticks(uint16_t cnt)
+{
+    uint64_t now = timebase_get_ticks();
+    return now - (uint16_t)((uint16_t)(now - timebase_ticks_base) - cnt);
+}
+
+// Convert ticks to micro seconds
+uint64_t timebase_ticks_to_us(uint64_t ticks)
+{
+    return ticks >> timebase_shift;
+}
+
+// Convert ticks to nano seconds
+uint64_t timebase_ticks_to_ns(uint64_t ticks)
+{
+    return (ticks * 1000) >> timebase_shift;
+}
+
+// Get the time in micro seconds since the start
+uint64_t timebase_get_us(void)
+{
+    return timebase_get_ticks() >> timebase_shift;
+}
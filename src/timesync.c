@@ -0,0 +1,172 @@
+//
+// timesync: host clock from the USB start of frame packets
+//
+// The host sends a start of frame every 1ms of its own clock, the same packet to every device on the bus.
+// The device time at each of them gives the drift of the device clock against the host, and the frame
+// number gives the host a point in time which the devices agree on to set the epoch.
+//
+
+#include "stm32g4xx_hal.h"
+#include "system.h"
+#include "timebase.h"
+#include "timesync.h"
+
+#define TIMESYNC_FRAME_NS       (1000000)   /* Interval of the start of frame on full speed */
+#define TIMESYNC_WINDOW_FRAMES  (1000)      /* Frames between the drift measurements */
+#define TIMESYNC_FILTER_SHIFT   (3)         /* A new measurement moves the drift by 1/8 of its difference */
+#define TIMESYNC_RATE_MAX       (1LL << 27) /* 3% in 2^-32, more than the tolerance of HSI, a longer gap otherwise */
+#define TIMESYNC_ANCHOR_MAX_US  (1ULL << 30) /* Keeps the scaled difference from the anchor within 64 bits */
+
+// Private variables
+static volatile uint32_t timesync_sof_count = 0;    // Start of frames received, zero until the first one
+static volatile uint16_t timesync_sof_frame = 0;    // Frame number of the last start of frame
+static volatile uint64_t timesync_sof_ns = 0;       // Device time of the last start of frame
+static uint32_t timesync_window_count = 0;          // Start of the drift measurement
+static uint64_t timesync_window_ns = 0;
+static int64_t timesync_rate = 0;                   // Host time minus device time per device time in 2^-32
+static uint8_t timesync_rate_valid = 0;
+static uint64_t timesync_anchor_dev_us = 0;         // Device time where the host time below was fixed
+static uint64_t timesync_anchor_host_us = 0;
+
+// Private prototypes
+static void timesync_get_sof_capture(uint32_t *count, uint16_t *frame, uint64_t *dev_ns);
+static uint64_t timesync_dev_to_host_us(uint64_t dev_us);
+static void timesync_move_anchor(uint64_t dev_us);
+
+// Start with the host time equal to the device time until an epoch is set
+void timesync_init(void)
+{
+    timesync_sof_count = 0;
+    timesync_sof_frame = 0;
+    timesync_sof_ns = 0;
+    timesync_window_count = 0;
+    timesync_window_ns = 0;
+    timesync_rate = 0;
+    timesync_rate_valid = 0;
+    timesync_anchor_dev_us = 0;
+    timesync_anchor_host_us = 0;
+}
+
+// Capture the device time of a start of frame, called from the USB interrupt
+void timesync_irq_sof_handler(uint16_t frame)
+{
+    timesync_sof_ns = timebase_ticks_to_ns(timebase_get_ticks());
+    timesync_sof_frame = frame & (TIMESYNC_FRAME_NUM - 1);
+    timesync_sof_count++;
+}
+
+// Update the drift estimate once per window, called from the main loop
+void timesync_process(void)
+{
+    uint32_t count;
+    uint16_t frame;
+    uint64_t dev_ns;
+    timesync_get_sof_capture(&count, &frame, &dev_ns);
+
+    // Keep the device time close to the anchor also without the host
+    uint64_t now_us = timebase_get_us();
+    if (now_us - timesync_anchor_dev_us >= TIMESYNC_ANCHOR_MAX_US)
+        timesync_move_anchor(now_us);
+
+    if (count == 0)
+        return;
+
+    uint32_t frames = count - timesync_window_count;
+    if (timesync_window_count != 0 && frames < TIMESYNC_WINDOW_FRAMES)
+        return;
+
+    if (timesync_window_count != 0)
+    {
+        // The host time passed is given by the number of frames, the division runs once per window
+        int64_t measured_ns = (int64_t)(dev_ns - timesync_window_ns);
+        int64_t expected_ns = (int64_t)frames * TIMESYNC_FRAME_NS;
+        int64_t rate = (int64_t)((uint64_t)(expected_ns - measured_ns) << 32) / measured_ns;
+
+        // Skip a window over a suspend or a change of the time stamp counter
+        if (measured_ns > 0 && -TIMESYNC_RATE_MAX < rate && rate < TIMESYNC_RATE_MAX)
+        {
+            // The host time goes on from the same value with the new rate
+            timesync_move_anchor(dev_ns / 1000);
+            if (timesync_rate_valid)
+                timesync_rate += (rate - timesync_rate) >> TIMESYNC_FILTER_SHIFT;
+            else
+                timesync_rate = rate;
+            timesync_rate_valid = 1;
+        }
+    }
+
+    timesync_window_count = count;
+    timesync_window_ns = dev_ns;
+}
+
+// Set the host time in micro seconds at the start of a frame, within 1s before or after the last one
+HAL_StatusTypeDef timesync_set_epoch(uint16_t frame, uint64_t host_us)
+{
+    uint32_t count;
+    uint16_t sof_frame;
+    uint64_t dev_ns;
+    timesync_get_sof_capture(&count, &sof_frame, &dev_ns);
+
+    if (count == 0 || frame >= TIMESYNC_FRAME_NUM) return HAL_ERROR;
+
+    // Frames from the last one, signed in 11 bits
+    int32_t frames = (frame - sof_frame) & (TIMESYNC_FRAME_NUM - 1);
+    if (frames >= TIMESYNC_FRAME_NUM / 2)
+        frames -= TIMESYNC_FRAME_NUM;
+
+    // A frame is a little shorter in the device time if the device clock is slow
+    int64_t frame_ns = TIMESYNC_FRAME_NS - ((TIMESYNC_FRAME_NS * timesync_rate) >> 32);
+    timesync_anchor_dev_us = (dev_ns + frames * frame_ns) / 1000;
+    timesync_anchor_host_us = host_us;
+
+    return HAL_OK;
+}
+
+// Get the frame number and the host time in micro seconds of the last start of frame
+HAL_StatusTypeDef timesync_get_sof(uint16_t *frame, uint64_t *sync_us)
+{
+    uint32_t count;
+    uint64_t dev_ns;
+    timesync_get_sof_capture(&count, frame, &dev_ns);
+
+    if (count == 0) return HAL_ERROR;
+
+    *sync_us = timesync_dev_to_host_us(dev_ns / 1000);
+    return HAL_OK;
+}
+
+// Get the drift of the device clock against the host in ppb, positive if the device runs fast
+int32_t timesync_get_drift_ppb(void)
+{
+    return (int32_t)((-timesync_rate * 1000000000) >> 32);
+}
+
+// Convert a time in ticks of TIM3 to the host time in micro seconds
+uint64_t timesync_ticks_to_us(uint64_t ticks)
+{
+    return timesync_dev_to_host_us(timebase_ticks_to_us(ticks));
+}
+
+// Read the last start of frame, the interrupt updates it in several steps
+void timesync_get_sof_capture(uint32_t *count, uint16_t *frame, uint64_t *dev_ns)
+{
+    system_irq_disable();
+    *count = timesync_sof_count;
+    *frame = timesync_sof_frame;
+    *dev_ns = timesync_sof_ns;
+    system_irq_enable();
+}
+
+// Scale the device time from the anchor by the drift, also for times before the anchor
+uint64_t timesync_dev_to_host_us(uint64_t dev_us)
+{
+    int64_t delta_us = (int64_t)(dev_us - timesync_anchor_dev_us);
+    return timesync_anchor_host_us + delta_us + ((delta_us * timesync_rate) >> 32);
+}
+
+// Move the anchor to a device time without a step in the host time
+void timesync_move_anchor(uint64_t dev_us)
+{
+    timesync_anchor_host_us = timesync_dev_to_host_us(dev_us);
+    timesync_anchor_dev_us = dev_us;
+}
@@ -1,8 +1,12 @@
 #include "usb_device.h"
 #include "usbd_core.h"
 #include "usbd_desc.h"
+#ifdef GS_USB
+#include "usbd_gs_usb.h"
+#else
 #include "usbd_cdc.h"
 #include "usbd_cdc_if.h"
+#endif
 
 
 /* USB Device Core handle declaration. */
@@ -25,12 +29,18 @@ void usb_init(void)
     //Error_Handler();
 	  while(1);
   }
+#ifdef GS_USB
+  if (USBD_RegisterClass(&hUsbDeviceFS, &USBD_GS_USB) != USBD_OK) {
+	  while(1);
+  }
+#else
   if (USBD_RegisterClass(&hUsbDeviceFS, &USBD_CDC) != USBD_OK) {
 	  while(1);
   }
   if (USBD_CDC_RegisterInterface(&hUsbDeviceFS, &USBD_Interface_fops_FS) != USBD_OK) {
 	  while(1);
   }
+#endif
   if (USBD_Start(&hUsbDeviceFS) != USBD_OK) {
 	  while(1);
   }
@@ -5,6 +5,7 @@
 #include "system.h"
 
 // Private variables
+static uint8_t cdc_rx_stopped = 0;    // Set while the host gets NAK on a full receive buffer
 
 // Externs
 extern USBD_HandleTypeDef hUsbDeviceFS;
@@ -27,7 +28,8 @@ USBD_CDC_ItfTypeDef USBD_Interface_fops_FS =
 // Initializes the CDC media low layer over the FS USB IP
 static int8_t CDC_Init_FS(void)
 {
-    USBD_CDC_SetTxBuffer(&hUsbDeviceFS, (uint8_t *)buf_cdc_tx.data[buf_cdc_tx.tail], 0);
+    cdc_rx_stopped = 0;
+    USBD_CDC_SetTxBuffer(&hUsbDeviceFS, (uint8_t *)&buf_cdc_tx.data[buf_cdc_tx.tail], 0);
     USBD_CDC_SetRxBuffer(&hUsbDeviceFS, (uint8_t *)buf_cdc_rx.data[buf_cdc_rx.head]);
     return (USBD_OK);
 }
@@ -137,27 +139,34 @@ static int8_t CDC_Control_FS(uint8_t cmd, uint8_t* pbuf, uint16_t length)
 
 static int8_t CDC_Receive_FS(uint8_t* Buf, uint32_t *Len)
 {
-    // Check for overflow!
-    uint32_t new_head = (buf_cdc_rx.head + 1) % BUF_CDC_RX_NUM_BUFS;
-    if (new_head == buf_cdc_rx.tail)
-    {
-        error_assert(ERR_FULLBUF_USBRX);
+    // Save off length. Always room here, the endpoint is stopped before the buffer gets full.
+    buf_cdc_rx.msglen[buf_cdc_rx.head] = *Len;
+    buf_cdc_rx.head = (buf_cdc_rx.head + 1) % BUF_CDC_RX_NUM_BUFS;
 
-        // Listen again on the same buffer. Old data will be overwritten.
+    // Start listening on next buffer. Previous buffer will be processed in main loop.
+    // Otherwise the single buffered endpoint NAKs the host until the main loop makes room.
+    if (buf_get_cdc_rx_free() > 0)
+    {
         USBD_CDC_SetRxBuffer(&hUsbDeviceFS, (uint8_t *)buf_cdc_rx.data[buf_cdc_rx.head]);
         USBD_CDC_ReceivePacket(&hUsbDeviceFS);
-        return HAL_ERROR;
     }
     else
     {
-        // Save off length
-        buf_cdc_rx.msglen[buf_cdc_rx.head] = *Len;
-        buf_cdc_rx.head = new_head;
+        cdc_rx_stopped = 1;
+    }
+
+    return (USBD_OK);
+}
 
-        // Start listening on next buffer. Previous buffer will be processed in main loop.
+// Listen to the host again once there is room after the endpoint was stopped by CDC_Receive_FS()
+// Call with interrupts disabled.
+void CDC_Resume_Receive_FS(void)
+{
+    if (cdc_rx_stopped && buf_get_cdc_rx_free() > 0)
+    {
+        cdc_rx_stopped = 0;
         USBD_CDC_SetRxBuffer(&hUsbDeviceFS, (uint8_t *)buf_cdc_rx.data[buf_cdc_rx.head]);
         USBD_CDC_ReceivePacket(&hUsbDeviceFS);
-        return (USBD_OK);
     }
 }
 
@@ -175,3 +184,12 @@ uint8_t CDC_Transmit_FS(uint8_t* Buf, uint16_t Len)
     return result;
 }
 
+// Check if the previous transfer is still in progress
+uint8_t CDC_Transmit_Busy_FS(void)
+{
+    USBD_CDC_HandleTypeDef *hcdc = (USBD_CDC_HandleTypeDef*)hUsbDeviceFS.pClassData;
+    if (hcdc == NULL)
+        return 0;
+    return (hcdc->TxState != 0);
+}
+
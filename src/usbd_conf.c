@@ -3,14 +3,35 @@
 #include "usbd_def.h"
 #include "usbd_core.h"
 #include "usbd_cdc.h"
+#include "timesync.h"
 
 
 PCD_HandleTypeDef hpcd_USB_FS;
 
+#ifndef GS_USB
+// The double buffered data IN endpoint takes both halves of EP1R,
+// so the data OUT endpoint 0x01 is served by EP3R
+#define CDC_OUT_EP_REG 0x03U
+#endif
+
+
+// Private variables
+#ifndef GS_USB
+static uint8_t *usbd_db_in_buf;     // Next bytes of the transfer on the double buffered IN endpoint
+static uint32_t usbd_db_in_len;     // Bytes not written to the packet memory yet
+static uint8_t usbd_db_in_fill;     // The buffer of the application holds the next packet
+#endif
+
 
 // Private methods
 static USBD_StatusTypeDef USBD_Get_USB_Status(HAL_StatusTypeDef hal_status);
 static void SystemClockConfig_Resume(void);
+static uint8_t USBD_LL_MapEP(uint8_t ep_addr);
+#ifndef GS_USB
+static void USBD_LL_DB_Fill(PCD_HandleTypeDef *hpcd, PCD_EPTypeDef *ep, uint16_t pmabuffer);
+static void USBD_LL_DB_TransmitStart(PCD_HandleTypeDef *hpcd, PCD_EPTypeDef *ep, uint8_t *pbuf, uint32_t len);
+static uint8_t USBD_LL_DB_TransmitNext(PCD_HandleTypeDef *hpcd, PCD_EPTypeDef *ep);
+#endif
 
 // Externs
 extern void SystemClock_Config(void);
@@ -100,7 +121,13 @@ void HAL_PCD_DataOutStageCallback(PCD_HandleTypeDef *hpcd, uint8_t epnum)
 #endif /* USE_HAL_PCD_REGISTER_CALLBACKS */
 {
   /* USER CODE BEGIN HAL_PCD_DataOutStageCallback_PreTreatment */
-  
+#ifndef GS_USB
+  if (epnum == CDC_OUT_EP_REG)
+  {
+    USBD_LL_DataOutStage((USBD_HandleTypeDef*)hpcd->pData, CDC_OUT_EP, hpcd->OUT_ep[epnum].xfer_buff);
+    return;
+  }
+#endif
   /* USER CODE END HAL_PCD_DataOutStageCallback_PreTreatment */
   USBD_LL_DataOutStage((USBD_HandleTypeDef*)hpcd->pData, epnum, hpcd->OUT_ep[epnum].xfer_buff);  
   /* USER CODE BEGIN HAL_PCD_DataOutStageCallback_PostTreatment */
@@ -121,7 +148,12 @@ void HAL_PCD_DataInStageCallback(PCD_HandleTypeDef *hpcd, uint8_t epnum)
 #endif /* USE_HAL_PCD_REGISTER_CALLBACKS */
 {
   /* USER CODE BEGIN HAL_PCD_DataInStageCallback_PreTreatment */
-  
+#ifndef GS_USB
+  if (epnum == (CDC_IN_EP & EP_ADDR_MSK) && USBD_LL_DB_TransmitNext(hpcd, &hpcd->IN_ep[epnum]) != 0U)
+  {
+    return;
+  }
+#endif
   /* USER CODE END HAL_PCD_DataInStageCallback_PreTreatment */  
   USBD_LL_DataInStage((USBD_HandleTypeDef*)hpcd->pData, epnum, hpcd->IN_ep[epnum].xfer_buff);  
   /* USER CODE BEGIN HAL_PCD_DataInStageCallback_PostTreatment  */
@@ -141,7 +173,7 @@ void HAL_PCD_SOFCallback(PCD_HandleTypeDef *hpcd)
 #endif /* USE_HAL_PCD_REGISTER_CALLBACKS */
 {
   /* USER CODE BEGIN HAL_PCD_SOFCallback_PreTreatment */
-  
+  timesync_irq_sof_handler(hpcd->Instance->FNR & USB_FNR_FN);
   /* USER CODE END HAL_PCD_SOFCallback_PreTreatment */  
   USBD_LL_SOF((USBD_HandleTypeDef*)hpcd->pData);  
   /* USER CODE BEGIN HAL_PCD_SOFCallback_PostTreatment */
@@ -385,13 +417,21 @@ USBD_StatusTypeDef USBD_LL_Init(USBD_HandleTypeDef *pdev)
   /* USER CODE END RegisterCallBackSecondPart */
 #endif /* USE_HAL_PCD_REGISTER_CALLBACKS */
   /* USER CODE BEGIN EndPoint_Configuration */
-  HAL_PCDEx_PMAConfig((PCD_HandleTypeDef*)pdev->pData , 0x00 , PCD_SNG_BUF, 0x18);
-  HAL_PCDEx_PMAConfig((PCD_HandleTypeDef*)pdev->pData , 0x80 , PCD_SNG_BUF, 0x58);
+  /* The buffer table takes 8 bytes per endpoint (EP0-EP3) from 0x00 */
+  HAL_PCDEx_PMAConfig((PCD_HandleTypeDef*)pdev->pData , 0x00 , PCD_SNG_BUF, 0x20);
+  HAL_PCDEx_PMAConfig((PCD_HandleTypeDef*)pdev->pData , 0x80 , PCD_SNG_BUF, 0x60);
   /* USER CODE END EndPoint_Configuration */
   /* USER CODE BEGIN EndPoint_Configuration_CDC */
+#ifdef GS_USB
   HAL_PCDEx_PMAConfig((PCD_HandleTypeDef*)pdev->pData , 0x81 , PCD_SNG_BUF, 0xC0);
-  HAL_PCDEx_PMAConfig((PCD_HandleTypeDef*)pdev->pData , 0x01 , PCD_SNG_BUF, 0x110);
-  HAL_PCDEx_PMAConfig((PCD_HandleTypeDef*)pdev->pData , 0x82 , PCD_SNG_BUF, 0x100);
+  HAL_PCDEx_PMAConfig((PCD_HandleTypeDef*)pdev->pData , 0x02 , PCD_SNG_BUF, 0x110);
+#else
+  /* The data IN endpoint is double buffered (buffer 0 in the low half word, buffer 1 in the high half word).
+     It takes both directions of EP1R, so data OUT is configured on EP3R, see USBD_LL_MapEP() */
+  HAL_PCDEx_PMAConfig((PCD_HandleTypeDef*)pdev->pData , 0x82 , PCD_SNG_BUF, 0xA0);
+  HAL_PCDEx_PMAConfig((PCD_HandleTypeDef*)pdev->pData , CDC_IN_EP , PCD_DBL_BUF, 0x00C0 | (0x0100 << 16));
+  HAL_PCDEx_PMAConfig((PCD_HandleTypeDef*)pdev->pData , CDC_OUT_EP_REG , PCD_SNG_BUF, 0x140);
+#endif
   /* USER CODE END EndPoint_Configuration_CDC */
   return USBD_OK;
 }
@@ -460,7 +500,23 @@ USBD_StatusTypeDef USBD_LL_OpenEP(USBD_HandleTypeDef *pdev, uint8_t ep_addr, uin
   HAL_StatusTypeDef hal_status = HAL_OK;
   USBD_StatusTypeDef usb_status = USBD_OK;
 
-  hal_status = HAL_PCD_EP_Open(pdev->pData, ep_addr, ep_mps, ep_type);
+  hal_status = HAL_PCD_EP_Open(pdev->pData, USBD_LL_MapEP(ep_addr), ep_mps, ep_type);
+
+#ifndef GS_USB
+  PCD_HandleTypeDef *hpcd = (PCD_HandleTypeDef*) pdev->pData;
+
+  if (ep_addr == CDC_OUT_EP)
+  {
+    /* EP3R answers the host on endpoint address 1 */
+    PCD_SET_EP_ADDRESS(hpcd->Instance, CDC_OUT_EP_REG, CDC_OUT_EP & EP_ADDR_MSK);
+  }
+  else if (ep_addr == CDC_IN_EP)
+  {
+    /* The HAL hands buffer 0 to the peripheral on activation, keep it
+       until USBD_LL_DB_TransmitStart() has written the first packet */
+    PCD_FreeUserBuffer(hpcd->Instance, ep_addr & EP_ADDR_MSK, 1U);
+  }
+#endif
 
   usb_status =  USBD_Get_USB_Status(hal_status);
  
@@ -478,7 +534,7 @@ USBD_StatusTypeDef USBD_LL_CloseEP(USBD_HandleTypeDef *pdev, uint8_t ep_addr)
   HAL_StatusTypeDef hal_status = HAL_OK;
   USBD_StatusTypeDef usb_status = USBD_OK;
   
-  hal_status = HAL_PCD_EP_Close(pdev->pData, ep_addr);
+  hal_status = HAL_PCD_EP_Close(pdev->pData, USBD_LL_MapEP(ep_addr));
       
   usb_status =  USBD_Get_USB_Status(hal_status);
 
@@ -496,7 +552,7 @@ USBD_StatusTypeDef USBD_LL_FlushEP(USBD_HandleTypeDef *pdev, uint8_t ep_addr)
   HAL_StatusTypeDef hal_status = HAL_OK;
   USBD_StatusTypeDef usb_status = USBD_OK;
   
-  hal_status = HAL_PCD_EP_Flush(pdev->pData, ep_addr);
+  hal_status = HAL_PCD_EP_Flush(pdev->pData, USBD_LL_MapEP(ep_addr));
       
   usb_status =  USBD_Get_USB_Status(hal_status);
   
@@ -514,7 +570,7 @@ USBD_StatusTypeDef USBD_LL_StallEP(USBD_HandleTypeDef *pdev, uint8_t ep_addr)
   HAL_StatusTypeDef hal_status = HAL_OK;
   USBD_StatusTypeDef usb_status = USBD_OK;
   
-  hal_status = HAL_PCD_EP_SetStall(pdev->pData, ep_addr);
+  hal_status = HAL_PCD_EP_SetStall(pdev->pData, USBD_LL_MapEP(ep_addr));
 
   usb_status =  USBD_Get_USB_Status(hal_status);
  
@@ -532,7 +588,7 @@ USBD_StatusTypeDef USBD_LL_ClearStallEP(USBD_HandleTypeDef *pdev, uint8_t ep_add
   HAL_StatusTypeDef hal_status = HAL_OK;
   USBD_StatusTypeDef usb_status = USBD_OK;
   
-  hal_status = HAL_PCD_EP_ClrStall(pdev->pData, ep_addr);  
+  hal_status = HAL_PCD_EP_ClrStall(pdev->pData, USBD_LL_MapEP(ep_addr));  
      
   usb_status =  USBD_Get_USB_Status(hal_status);
 
@@ -548,7 +604,8 @@ USBD_StatusTypeDef USBD_LL_ClearStallEP(USBD_HandleTypeDef *pdev, uint8_t ep_add
 uint8_t USBD_LL_IsStallEP(USBD_HandleTypeDef *pdev, uint8_t ep_addr)
 {
   PCD_HandleTypeDef *hpcd = (PCD_HandleTypeDef*) pdev->pData;
-  
+
+  ep_addr = USBD_LL_MapEP(ep_addr);
   if((ep_addr & 0x80) == 0x80)
   {
     return hpcd->IN_ep[ep_addr & 0x7F].is_stall; 
@@ -590,6 +647,16 @@ USBD_StatusTypeDef USBD_LL_Transmit(USBD_HandleTypeDef *pdev, uint8_t ep_addr, u
   HAL_StatusTypeDef hal_status = HAL_OK;
   USBD_StatusTypeDef usb_status = USBD_OK;
 
+#ifndef GS_USB
+  if (ep_addr == CDC_IN_EP)
+  {
+    PCD_HandleTypeDef *hpcd = (PCD_HandleTypeDef*) pdev->pData;
+
+    USBD_LL_DB_TransmitStart(hpcd, &hpcd->IN_ep[ep_addr & EP_ADDR_MSK], pbuf, size);
+    return USBD_OK;
+  }
+#endif
+
   hal_status = HAL_PCD_EP_Transmit(pdev->pData, ep_addr, pbuf, size);
      
   usb_status =  USBD_Get_USB_Status(hal_status);
@@ -610,7 +677,7 @@ USBD_StatusTypeDef USBD_LL_PrepareReceive(USBD_HandleTypeDef *pdev, uint8_t ep_a
   HAL_StatusTypeDef hal_status = HAL_OK;
   USBD_StatusTypeDef usb_status = USBD_OK;
 
-  hal_status = HAL_PCD_EP_Receive(pdev->pData, ep_addr, pbuf, size);
+  hal_status = HAL_PCD_EP_Receive(pdev->pData, USBD_LL_MapEP(ep_addr), pbuf, size);
      
   usb_status =  USBD_Get_USB_Status(hal_status);
   	
@@ -625,8 +692,133 @@ USBD_StatusTypeDef USBD_LL_PrepareReceive(USBD_HandleTypeDef *pdev, uint8_t ep_a
   */
 uint32_t USBD_LL_GetRxDataSize(USBD_HandleTypeDef *pdev, uint8_t ep_addr)
 {
-  return HAL_PCD_EP_GetRxCount((PCD_HandleTypeDef*) pdev->pData, ep_addr);
+  return HAL_PCD_EP_GetRxCount((PCD_HandleTypeDef*) pdev->pData, USBD_LL_MapEP(ep_addr));
+}
+
+/**
+  * @brief  Returns the endpoint of the PCD driver that serves an endpoint address.
+  * @param  ep_addr: Endpoint number
+  * @retval PCD endpoint number
+  */
+uint8_t USBD_LL_MapEP(uint8_t ep_addr)
+{
+#ifndef GS_USB
+  if (ep_addr == CDC_OUT_EP)
+  {
+    return CDC_OUT_EP_REG;
+  }
+#endif
+  return ep_addr;
+}
+
+#ifndef GS_USB
+/**
+  * @brief  Writes the next packet of the double buffered IN transfer to one buffer.
+  * @param  hpcd: PCD handle
+  * @param  ep: Endpoint
+  * @param  pmabuffer: Packet memory address of the buffer
+  * @retval None
+  */
+void USBD_LL_DB_Fill(PCD_HandleTypeDef *hpcd, PCD_EPTypeDef *ep, uint16_t pmabuffer)
+{
+  uint32_t len = MIN(usbd_db_in_len, ep->maxpacket);
+
+  if (pmabuffer == ep->pmaaddr0)
+  {
+    PCD_SET_EP_DBUF0_CNT(hpcd->Instance, ep->num, 1U, len);
+  }
+  else
+  {
+    PCD_SET_EP_DBUF1_CNT(hpcd->Instance, ep->num, 1U, len);
+  }
+  USB_WritePMA(hpcd->Instance, usbd_db_in_buf, pmabuffer, (uint16_t)len);
+  usbd_db_in_buf += len;
+  usbd_db_in_len -= len;
+}
+
+/**
+  * @brief  Starts a transfer on the double buffered IN endpoint. The first packet is
+  *         handed to the peripheral and the second one is written to the other buffer
+  *         while the first one is sent.
+  * @param  hpcd: PCD handle
+  * @param  ep: Endpoint
+  * @param  pbuf: Pointer to data to be sent
+  * @param  len: Data size
+  * @retval None
+  */
+void USBD_LL_DB_TransmitStart(PCD_HandleTypeDef *hpcd, PCD_EPTypeDef *ep, uint8_t *pbuf, uint32_t len)
+{
+  uint16_t pmabuffer = ep->pmaaddr0;
+  uint16_t pmanext = ep->pmaaddr1;
+
+  /* Left at 0, so the interrupt handler of the HAL passes every packet to HAL_PCD_DataInStageCallback() */
+  ep->xfer_buff = pbuf;
+  ep->xfer_len = 0U;
+  ep->xfer_count = 0U;
+
+  usbd_db_in_buf = pbuf;
+  usbd_db_in_len = len;
+  usbd_db_in_fill = 0U;
+
+  /* The peripheral sends the buffer selected by DTOG_TX next */
+  if ((PCD_GET_ENDPOINT(hpcd->Instance, ep->num) & USB_EP_DTOG_TX) != 0U)
+  {
+    pmabuffer = ep->pmaaddr1;
+    pmanext = ep->pmaaddr0;
+  }
+  USBD_LL_DB_Fill(hpcd, ep, pmabuffer);
+  PCD_FreeUserBuffer(hpcd->Instance, ep->num, 1U);
+
+  if (usbd_db_in_len > 0U)
+  {
+    USBD_LL_DB_Fill(hpcd, ep, pmanext);
+    usbd_db_in_fill = 1U;
+  }
+
+  PCD_SET_EP_TX_STATUS(hpcd->Instance, ep->num, USB_EP_TX_VALID);
+}
+
+/**
+  * @brief  Continues the double buffered IN transfer after a packet was sent. The buffer
+  *         filled while that packet was on the bus is handed over to the peripheral, then
+  *         the buffer just sent is filled with the next packet.
+  * @param  hpcd: PCD handle
+  * @param  ep: Endpoint
+  * @retval 1 while the transfer goes on, 0 once it is complete
+  */
+uint8_t USBD_LL_DB_TransmitNext(PCD_HandleTypeDef *hpcd, PCD_EPTypeDef *ep)
+{
+  uint16_t pmabuffer;
+
+  if (usbd_db_in_fill == 0U)
+  {
+    return 0U;
+  }
+
+  /* DTOG_TX has toggled, the packet was sent from the other buffer. The peripheral
+     NAKs until SW_BUF is toggled, so DTOG_TX does not move before that. */
+  if ((PCD_GET_ENDPOINT(hpcd->Instance, ep->num) & USB_EP_DTOG_TX) != 0U)
+  {
+    pmabuffer = ep->pmaaddr0;
+  }
+  else
+  {
+    pmabuffer = ep->pmaaddr1;
+  }
+
+  PCD_FreeUserBuffer(hpcd->Instance, ep->num, 1U);
+  PCD_SET_EP_TX_STATUS(hpcd->Instance, ep->num, USB_EP_TX_VALID);
+  usbd_db_in_fill = 0U;
+
+  if (usbd_db_in_len > 0U)
+  {
+    USBD_LL_DB_Fill(hpcd, ep, pmabuffer);
+    usbd_db_in_fill = 1U;
+  }
+
+  return 1U;
 }
+#endif
 
 /**
   * @brief  Send LPM message to user layer
@@ -2,13 +2,30 @@
 #include "usbd_desc.h"
 #include "usbd_conf.h"
 
+#ifdef GS_USB
+#define USBD_VID			0x1d50
+#else
 #define USBD_VID			0x16d0
+#endif
 #define USBD_LANGID_STRING		1033
 #define USBD_MANUFACTURER_STRING	"Openlight Labs"
+#ifdef GS_USB
+#define USBD_PID			0x606f
+#else
 #define USBD_PID			0x117e
+#endif
 #define USBD_PRODUCT_STRING		"CANable2" " " GIT_VERSION " " GIT_REMOTE
+#ifdef GS_USB
+#define USBD_CONFIGURATION_STRING    "gs_usb Config"
+#define USBD_INTERFACE_STRING	"gs_usb Interface"
+#define USBD_DEVICE_CLASS		0x00
+#define USBD_DEVICE_SUBCLASS		0x00
+#else
 #define USBD_CONFIGURATION_STRING    "CDC Config"
 #define USBD_INTERFACE_STRING	"CDC Interface"
+#define USBD_DEVICE_CLASS		0x02
+#define USBD_DEVICE_SUBCLASS		0x02
+#endif
 
 
 // Private methods
@@ -47,8 +64,8 @@ __ALIGN_BEGIN uint8_t USBD_CDC_DeviceDesc[USB_LEN_DEV_DESC] __ALIGN_END =
   USB_DESC_TYPE_DEVICE,       /*bDescriptorType*/
   0x00,                       /*bcdUSB */
   0x02,
-  0x02,                       /*bDeviceClass*/
-  0x02,                       /*bDeviceSubClass*/
+  USBD_DEVICE_CLASS,          /*bDeviceClass*/
+  USBD_DEVICE_SUBCLASS,       /*bDeviceSubClass*/
   0x00,                       /*bDeviceProtocol*/
   USB_MAX_EP0_SIZE,           /*bMaxPacketSize*/
   LOBYTE(USBD_VID),           /*idVendor*/
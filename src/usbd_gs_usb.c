@@ -0,0 +1,306 @@
+//
+// usbd_gs_usb: gs_usb compatible USB vendor class, used instead of CDC when built with GS_USB=1
+//
+
+#include "usbd_gs_usb.h"
+#include "usbd_ctlreq.h"
+#include "buffer.h"
+#include "error.h"
+
+// Externs
+extern USBD_HandleTypeDef hUsbDeviceFS;
+
+// Private variables
+static USBD_GS_USB_HandleTypeDef usbd_gs_usb_handle;
+
+// Configuration descriptor: one vendor specific interface with two bulk endpoints
+__ALIGN_BEGIN static uint8_t USBD_GS_USB_CfgFSDesc[USB_GS_USB_CONFIG_DESC_SIZ] __ALIGN_END =
+{
+    // Configuration Descriptor
+    0x09,                                   // bLength
+    USB_DESC_TYPE_CONFIGURATION,            // bDescriptorType
+    USB_GS_USB_CONFIG_DESC_SIZ,             // wTotalLength
+    0x00,
+    0x01,                                   // bNumInterfaces
+    0x01,                                   // bConfigurationValue
+    0x00,                                   // iConfiguration
+    0x80,                                   // bmAttributes: bus powered
+    0xFA,                                   // MaxPower 500 mA
+
+    // Interface Descriptor
+    0x09,                                   // bLength
+    USB_DESC_TYPE_INTERFACE,                // bDescriptorType
+    0x00,                                   // bInterfaceNumber
+    0x00,                                   // bAlternateSetting
+    0x02,                                   // bNumEndpoints
+    0xFF,                                   // bInterfaceClass: vendor specific
+    0xFF,                                   // bInterfaceSubClass
+    0xFF,                                   // bInterfaceProtocol
+    0x00,                                   // iInterface
+
+    // Endpoint IN Descriptor
+    0x07,                                   // bLength
+    USB_DESC_TYPE_ENDPOINT,                 // bDescriptorType
+    GS_USB_IN_EP,                           // bEndpointAddress
+    0x02,                                   // bmAttributes: bulk
+    LOBYTE(GS_USB_MAX_PACKET_SIZE),         // wMaxPacketSize
+    HIBYTE(GS_USB_MAX_PACKET_SIZE),
+    0x00,                                   // bInterval
+
+    // Endpoint OUT Descriptor
+    0x07,                                   // bLength
+    USB_DESC_TYPE_ENDPOINT,                 // bDescriptorType
+    GS_USB_OUT_EP,                          // bEndpointAddress
+    0x02,                                   // bmAttributes: bulk
+    LOBYTE(GS_USB_MAX_PACKET_SIZE),         // wMaxPacketSize
+    HIBYTE(GS_USB_MAX_PACKET_SIZE),
+    0x00,                                   // bInterval
+};
+
+__ALIGN_BEGIN static uint8_t USBD_GS_USB_DeviceQualifierDesc[USB_LEN_DEV_QUALIFIER_DESC] __ALIGN_END =
+{
+    USB_LEN_DEV_QUALIFIER_DESC,
+    USB_DESC_TYPE_DEVICE_QUALIFIER,
+    0x00,
+    0x02,
+    0x00,
+    0x00,
+    0x00,
+    0x40,
+    0x01,
+    0x00,
+};
+
+// Private methods
+static uint8_t USBD_GS_USB_Init(USBD_HandleTypeDef *pdev, uint8_t cfgidx);
+static uint8_t USBD_GS_USB_DeInit(USBD_HandleTypeDef *pdev, uint8_t cfgidx);
+static uint8_t USBD_GS_USB_Setup(USBD_HandleTypeDef *pdev, USBD_SetupReqTypedef *req);
+static uint8_t USBD_GS_USB_EP0_RxReady(USBD_HandleTypeDef *pdev);
+static uint8_t USBD_GS_USB_DataIn(USBD_HandleTypeDef *pdev, uint8_t epnum);
+static uint8_t USBD_GS_USB_DataOut(USBD_HandleTypeDef *pdev, uint8_t epnum);
+static uint8_t *USBD_GS_USB_GetCfgDesc(uint16_t *length);
+static uint8_t *USBD_GS_USB_GetDeviceQualifierDesc(uint16_t *length);
+static void USBD_GS_USB_TransmitFrame(USBD_HandleTypeDef *pdev, USBD_GS_USB_HandleTypeDef *hgs);
+
+USBD_ClassTypeDef USBD_GS_USB =
+{
+    USBD_GS_USB_Init,
+    USBD_GS_USB_DeInit,
+    USBD_GS_USB_Setup,
+    NULL,                   // EP0_TxSent
+    USBD_GS_USB_EP0_RxReady,
+    USBD_GS_USB_DataIn,
+    USBD_GS_USB_DataOut,
+    NULL,                   // SOF
+    NULL,
+    NULL,
+    USBD_GS_USB_GetCfgDesc,
+    USBD_GS_USB_GetCfgDesc,
+    USBD_GS_USB_GetCfgDesc,
+    USBD_GS_USB_GetDeviceQualifierDesc,
+};
+
+// Open the endpoints and start receiving host frames
+uint8_t USBD_GS_USB_Init(USBD_HandleTypeDef *pdev, uint8_t cfgidx)
+{
+    USBD_GS_USB_HandleTypeDef *hgs = &usbd_gs_usb_handle;
+
+    USBD_LL_OpenEP(pdev, GS_USB_IN_EP, USBD_EP_TYPE_BULK, GS_USB_MAX_PACKET_SIZE);
+    pdev->ep_in[GS_USB_IN_EP & 0xFU].is_used = 1U;
+    USBD_LL_OpenEP(pdev, GS_USB_OUT_EP, USBD_EP_TYPE_BULK, GS_USB_MAX_PACKET_SIZE);
+    pdev->ep_out[GS_USB_OUT_EP & 0xFU].is_used = 1U;
+
+    hgs->ctrl_breq = 0xFF;
+    hgs->tx_len = 0;
+    hgs->tx_state = 0;
+    hgs->rx_stopped = 0;
+    hgs->rx_buf = (uint8_t *)buf_cdc_rx.data[buf_cdc_rx.head];
+    pdev->pClassData = hgs;
+
+    USBD_LL_PrepareReceive(pdev, GS_USB_OUT_EP, hgs->rx_buf, GS_USB_MAX_PACKET_SIZE);
+
+    return USBD_OK;
+}
+
+// Close the endpoints
+uint8_t USBD_GS_USB_DeInit(USBD_HandleTypeDef *pdev, uint8_t cfgidx)
+{
+    USBD_LL_CloseEP(pdev, GS_USB_IN_EP);
+    pdev->ep_in[GS_USB_IN_EP & 0xFU].is_used = 0U;
+    USBD_LL_CloseEP(pdev, GS_USB_OUT_EP);
+    pdev->ep_out[GS_USB_OUT_EP & 0xFU].is_used = 0U;
+
+    pdev->pClassData = NULL;
+
+    return USBD_OK;
+}
+
+// Handle vendor requests of the gs_usb driver and standard interface requests
+uint8_t USBD_GS_USB_Setup(USBD_HandleTypeDef *pdev, USBD_SetupReqTypedef *req)
+{
+    USBD_GS_USB_HandleTypeDef *hgs = (USBD_GS_USB_HandleTypeDef *)pdev->pClassData;
+    uint8_t ifalt = 0U;
+    uint16_t status_info = 0U;
+
+    switch (req->bmRequest & USB_REQ_TYPE_MASK)
+    {
+    case USB_REQ_TYPE_VENDOR:
+        if (req->bmRequest & 0x80U)
+        {
+            int32_t len = gs_usb_get_ctrl_data(req->bRequest, req->wValue, (uint8_t *)hgs->ctrl_data, sizeof(hgs->ctrl_data));
+            if (len < 0) break;
+            USBD_CtlSendData(pdev, (uint8_t *)hgs->ctrl_data, MIN((uint16_t)len, req->wLength));
+            return USBD_OK;
+        }
+        else if (req->wLength)
+        {
+            // Handled when the data stage is complete
+            if (req->wLength > sizeof(hgs->ctrl_data)) break;
+            hgs->ctrl_breq = req->bRequest;
+            hgs->ctrl_channel = req->wValue;
+            hgs->ctrl_len = req->wLength;
+            USBD_CtlPrepareRx(pdev, (uint8_t *)hgs->ctrl_data, req->wLength);
+            return USBD_OK;
+        }
+        else
+        {
+            if (gs_usb_set_ctrl_data(req->bRequest, req->wValue, NULL, 0) != HAL_OK) break;
+            return USBD_OK;
+        }
+    case USB_REQ_TYPE_STANDARD:
+        switch (req->bRequest)
+        {
+        case USB_REQ_GET_STATUS:
+            if (pdev->dev_state != USBD_STATE_CONFIGURED) break;
+            USBD_CtlSendData(pdev, (uint8_t *)&status_info, 2U);
+            return USBD_OK;
+        case USB_REQ_GET_INTERFACE:
+            if (pdev->dev_state != USBD_STATE_CONFIGURED) break;
+            USBD_CtlSendData(pdev, &ifalt, 1U);
+            return USBD_OK;
+        case USB_REQ_SET_INTERFACE:
+            if (pdev->dev_state != USBD_STATE_CONFIGURED) break;
+            return USBD_OK;
+        default:
+            break;
+        }
+        break;
+    default:
+        break;
+    }
+
+    USBD_CtlError(pdev, req);
+    return USBD_FAIL;
+}
+
+// Data stage of a host to device request is complete. The status stage
+// follows immediately, so a rejected request can not be stalled anymore.
+uint8_t USBD_GS_USB_EP0_RxReady(USBD_HandleTypeDef *pdev)
+{
+    USBD_GS_USB_HandleTypeDef *hgs = (USBD_GS_USB_HandleTypeDef *)pdev->pClassData;
+
+    if (hgs != NULL && hgs->ctrl_breq != 0xFF)
+    {
+        gs_usb_set_ctrl_data(hgs->ctrl_breq, hgs->ctrl_channel, (uint8_t *)hgs->ctrl_data, hgs->ctrl_len);
+        hgs->ctrl_breq = 0xFF;
+    }
+
+    return USBD_OK;
+}
+
+// Host frame sent, continue with the next one
+uint8_t USBD_GS_USB_DataIn(USBD_HandleTypeDef *pdev, uint8_t epnum)
+{
+    USBD_GS_USB_HandleTypeDef *hgs = (USBD_GS_USB_HandleTypeDef *)pdev->pClassData;
+
+    if (hgs == NULL) return USBD_FAIL;
+
+    if (hgs->tx_len > 0)
+        USBD_GS_USB_TransmitFrame(pdev, hgs);
+    else
+        hgs->tx_state = 0;
+
+    return USBD_OK;
+}
+
+// Packet received, store it for the main loop like CDC_Receive_FS()
+uint8_t USBD_GS_USB_DataOut(USBD_HandleTypeDef *pdev, uint8_t epnum)
+{
+    USBD_GS_USB_HandleTypeDef *hgs = (USBD_GS_USB_HandleTypeDef *)pdev->pClassData;
+
+    if (hgs == NULL) return USBD_FAIL;
+
+    // Save off length. Always room here, the endpoint is stopped before the buffer gets full.
+    buf_cdc_rx.msglen[buf_cdc_rx.head] = USBD_LL_GetRxDataSize(pdev, epnum);
+    buf_cdc_rx.head = (buf_cdc_rx.head + 1) % BUF_CDC_RX_NUM_BUFS;
+    hgs->rx_buf = (uint8_t *)buf_cdc_rx.data[buf_cdc_rx.head];
+
+    // Start listening on next buffer. Otherwise the single buffered endpoint NAKs the host until the main loop makes room.
+    if (buf_get_cdc_rx_free() > 0)
+        USBD_LL_PrepareReceive(pdev, GS_USB_OUT_EP, hgs->rx_buf, GS_USB_MAX_PACKET_SIZE);
+    else
+        hgs->rx_stopped = 1;
+
+    return USBD_OK;
+}
+
+uint8_t *USBD_GS_USB_GetCfgDesc(uint16_t *length)
+{
+    *length = sizeof(USBD_GS_USB_CfgFSDesc);
+    return USBD_GS_USB_CfgFSDesc;
+}
+
+uint8_t *USBD_GS_USB_GetDeviceQualifierDesc(uint16_t *length)
+{
+    *length = sizeof(USBD_GS_USB_DeviceQualifierDesc);
+    return USBD_GS_USB_DeviceQualifierDesc;
+}
+
+// Send the next host frame as its own transfer. The frame sizes are never a
+// multiple of the packet size, so the transfer ends with a short packet.
+void USBD_GS_USB_TransmitFrame(USBD_HandleTypeDef *pdev, USBD_GS_USB_HandleTypeDef *hgs)
+{
+    uint32_t len = gs_usb_get_frame_len(hgs->tx_buf, hgs->tx_len);
+    uint8_t *buf = hgs->tx_buf;
+
+    hgs->tx_buf += len;
+    hgs->tx_len -= len;
+    USBD_LL_Transmit(pdev, GS_USB_IN_EP, buf, len);
+}
+
+// Send host frames to the host, one transfer per frame
+uint8_t GS_USB_Transmit_FS(uint8_t* Buf, uint16_t Len)
+{
+    USBD_GS_USB_HandleTypeDef *hgs = (USBD_GS_USB_HandleTypeDef *)hUsbDeviceFS.pClassData;
+
+    if (hgs == NULL) return USBD_FAIL;
+    if (hgs->tx_state != 0) return USBD_BUSY;
+
+    hgs->tx_state = 1;
+    hgs->tx_buf = Buf;
+    hgs->tx_len = Len;
+    USBD_GS_USB_TransmitFrame(&hUsbDeviceFS, hgs);
+
+    return USBD_OK;
+}
+
+// Check if frames of the previous transfer are still being sent
+uint8_t GS_USB_Transmit_Busy_FS(void)
+{
+    USBD_GS_USB_HandleTypeDef *hgs = (USBD_GS_USB_HandleTypeDef *)hUsbDeviceFS.pClassData;
+
+    if (hgs == NULL) return 0;
+    return (hgs->tx_state != 0);
+}
+
+// Listen to the host again once there is room after the endpoint was stopped by USBD_GS_USB_DataOut()
+// Call with interrupts disabled.
+void GS_USB_Resume_Receive_FS(void)
+{
+    USBD_GS_USB_HandleTypeDef *hgs = (USBD_GS_USB_HandleTypeDef *)hUsbDeviceFS.pClassData;
+
+    if (hgs == NULL || !hgs->rx_stopped || buf_get_cdc_rx_free() == 0) return;
+
+    hgs->rx_stopped = 0;
+    USBD_LL_PrepareReceive(&hUsbDeviceFS, GS_USB_OUT_EP, hgs->rx_buf, GS_USB_MAX_PACKET_SIZE);
+}
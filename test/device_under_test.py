@@ -33,6 +33,8 @@ class DeviceUnderTest:
         self.receive()
         self.send(b"Z0\r")
         self.receive()
+        self.send(b"H0\r")
+        self.receive()
         self.send(b"W2\r")
         self.receive()
         self.send(b"M00000000\r")
@@ -151,19 +151,35 @@ class ErrorTestCase(unittest.TestCase):
         self.dut.send(b"F\r")
         self.assertEqual(self.dut.receive(), b"F00\r")
 
-        # send a lot of command without receiving data (amount depends on PC env.)
+        # send a lot of command without receiving data
         for i in range(0, 400):
             self.dut.send(b"v\r")
             time.sleep(0.001)
 
-        # recieve all reply
+        # recieve all reply, commands wait in the device (NAK) until their replies fit
         rx_data = self.dut.receive()
+        self.assertEqual(rx_data.count(b"\r"), 400)
 
-        # check error
+        # confirm no error
         self.dut.send(b"F\r")
-        self.assertEqual(self.dut.receive(), b"F01\r")  # CAN Rx Full (because this overflow is caused typically by too many can frame)
+        self.assertEqual(self.dut.receive(), b"F00\r")
 
-        # check error clear
+        self.dut.send(b"C\r")
+        self.assertEqual(self.dut.receive(), b"\r")
+
+
+    def test_can_tx_flow_control(self):
+        # check response in CAN loopback mode
+        self.dut.send(b"=\r")
+        self.assertEqual(self.dut.receive(), b"\r")
+
+        # send more frames than the buffer can store at once, the host waits (NAK) for room
+        self.dut.send(b"t03F0\r" * 200)
+        rx_data = self.dut.receive()
+        self.assertEqual(rx_data.count(b"z\r"), 200)
+        self.assertEqual(rx_data.count(b"\a"), 0)
+
+        # confirm no error
         self.dut.send(b"F\r")
         self.assertEqual(self.dut.receive(), b"F00\r")
 
@@ -232,10 +248,9 @@ class ErrorTestCase(unittest.TestCase):
         self.dut.send(b"F\r")
         self.assertEqual(self.dut.receive(), b"FA4\r")  # BEI & EPI & EI
 
-        # the buffer can not store additional 64 messages
-        for i in range(0, 64):
-            self.dut.send(b"t03F0\r")
-            self.dut.receive()
+        # the buffer can not store additional 800 messages without data bytes
+        self.dut.send(b"t03F0\r" * 800)
+        self.dut.receive()
 
         # check error
         self.dut.send(b"F\r")
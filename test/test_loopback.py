@@ -345,6 +345,60 @@ class LoopbackTestCase(unittest.TestCase):
         self.assertEqual(self.dut.receive(), b"\r")
 
 
+    def test_timestamp_same_stamp_milli(self):
+        #self.dut.print_on = True
+
+        # check milli second timestamp is also taken at the start of the frame
+        self.dut.send(b"z1003\r")
+        self.assertEqual(self.dut.receive(), b"\r")
+        self.dut.send(b"=\r")
+        self.assertEqual(self.dut.receive(), b"\r")
+        self.dut.send(b"t03F0\r")
+        rx_data = self.dut.receive()
+        self.assertEqual(len(rx_data), len(b"\r" + b"zt03F0TTTT\r" + b"t03F0TTTT\r"))
+        if rx_data[1] == b"z"[0]:
+            tx_timestamp = rx_data[len(b"\rzt03F0"):len(b"\rzt03F0") + 4]
+            rx_timestamp = rx_data[len(b"\rzt03F0TTTT\rt03F0"):len(b"\rzt03F0TTTT\rt03F0") + 4]
+        else:
+            tx_timestamp = rx_data[len(b"\rt03F0TTTT\rzt03F0"):len(b"\rt03F0TTTT\rzt03F0") + 4]
+            rx_timestamp = rx_data[len(b"\rt03F0"):len(b"\rt03F0") + 4]
+        self.assertEqual(tx_timestamp, rx_timestamp)
+        self.dut.send(b"C\r")
+        self.assertEqual(self.dut.receive(), b"\r")
+
+
+    def test_timestamp_nano(self):
+        #self.dut.print_on = True
+
+        # check nano second timestamp of the current time
+        self.dut.send(b"Z3\r")
+        self.assertEqual(self.dut.receive(), b"\r")
+        self.dut.send(b"Z\r")
+        rx_data = self.dut.receive()
+        self.assertEqual(len(rx_data), len(b"ZTTTTTTTTTTTT\r"))
+        self.assertEqual(rx_data[0], b"Z"[0])
+
+        # check two frames sent back to back have different timestamps
+        self.dut.send(b"z3001\r")
+        self.assertEqual(self.dut.receive(), b"\r")
+        self.dut.send(b"=\r")
+        self.assertEqual(self.dut.receive(), b"\r")
+        self.dut.send(b"t03F0\rt03F0\r")
+        rx_data = self.dut.receive()
+        while len(rx_data) < len(b"z\rz\r" + b"t03F0TTTTTTTTTTTT\r" * 2):
+            rx_data += self.dut.receive()
+        self.assertEqual(rx_data[:len(b"z\rz\r")], b"z\rz\r")
+        first_time_ns = int(rx_data[len(b"z\rz\rt03F0"):len(b"z\rz\rt03F0") + 12].decode(), 16)
+        second_time_ns = int(rx_data[len(b"z\rz\rt03F0TTTTTTTTTTTT\rt03F0"):len(b"z\rz\rt03F0TTTTTTTTTTTT\rt03F0") + 12].decode(), 16)
+        diff_time_ns = second_time_ns - first_time_ns
+
+        # A frame with no data takes at least 44 bits on the bus, the gap is much shorter than 1ms
+        self.assertGreater(diff_time_ns, 0)
+        self.assertLess(diff_time_ns, 1000000)
+        self.dut.send(b"C\r")
+        self.assertEqual(self.dut.receive(), b"\r")
+
+
     def test_timestamp_consistency(self):
         #self.dut.print_on = True
 
@@ -607,6 +661,92 @@ class LoopbackTestCase(unittest.TestCase):
         self.assertEqual(self.dut.receive(), b"\r")
 
 
+    def test_quiet_tx(self):
+        cmd_send_std = (b"r", b"t", b"d", b"b")
+        cmd_send_ext = (b"R", b"T", b"D", b"B")
+
+        # check no ack to transmit commands in CAN loopback mode
+        self.dut.send(b"z0021\r")
+        self.assertEqual(self.dut.receive(), b"\r")
+        self.dut.send(b"=\r")
+        self.assertEqual(self.dut.receive(), b"\r")
+        for cmd in cmd_send_std:
+            self.dut.send(cmd + b"03F0\r")
+            self.assertEqual(self.dut.receive(), cmd + b"03F0\r")
+        for cmd in cmd_send_ext:
+            self.dut.send(cmd + b"0137FEC80\r")
+            self.assertEqual(self.dut.receive(), cmd + b"0137FEC80\r")
+        self.dut.send(b"Gt03F0T0137FEC80\r")
+        self.assertEqual(self.dut.receive(), b"t03F0\rT0137FEC80\r")
+
+        # check errors are still reported
+        self.dut.send(b"t03F9\r")
+        self.assertEqual(self.dut.receive(), b"\a")
+        self.dut.send(b"Gt03F0t03F9\r")
+        self.assertEqual(self.dut.receive(), b"\a")
+        self.dut.send(b"C\r")
+        self.assertEqual(self.dut.receive(), b"\r")
+
+        # check tx event without ack
+        self.dut.send(b"z0022\r")
+        self.assertEqual(self.dut.receive(), b"\r")
+        self.dut.send(b"=\r")
+        self.assertEqual(self.dut.receive(), b"\r")
+        self.dut.send(b"t03F0\r")
+        self.assertEqual(self.dut.receive(), b"zt03F0\r")
+        self.dut.send(b"C\r")
+        self.assertEqual(self.dut.receive(), b"\r")
+
+
+    def test_binary_format(self):
+        # check rx frame and tx event in binary format in CAN loopback mode
+        self.dut.send(b"z0003\r")
+        self.assertEqual(self.dut.receive(), b"\r")
+        self.dut.send(b"H1\r")
+        self.assertEqual(self.dut.receive(), b"\r")
+        self.dut.send(b"=\r")
+        self.assertEqual(self.dut.receive(), b"\r")
+
+        self.dut.send(b"t03F80011223344556677\r")
+        rx_frame = bytes.fromhex("80 14 00 08 3F 00 00 00 00 00 00 00 00 11 22 33 44 55 66 77")
+        tx_event = bytes.fromhex("81 14 00 08 3F 00 00 00 00 00 00 00 00 11 22 33 44 55 66 77")
+        rx_data = self.dut.receive()
+        self.assertEqual(len(rx_data), len(b"\r" + tx_event + rx_frame))
+        self.assertEqual(rx_data[0:1], b"\r")
+        self.assertIn(tx_event, rx_data)
+        self.assertIn(rx_frame, rx_data)
+
+        self.dut.send(b"R0137FEC8F\r")
+        rx_frame = bytes.fromhex("80 0C 03 0F C8 FE 37 01 00 00 00 00")
+        tx_event = bytes.fromhex("81 0C 03 0F C8 FE 37 01 00 00 00 00")
+        rx_data = self.dut.receive()
+        self.assertEqual(len(rx_data), len(b"\r" + tx_event + rx_frame))
+        self.assertIn(tx_event, rx_data)
+        self.assertIn(rx_frame, rx_data)
+
+        self.dut.send(b"B0137FEC8F" + b"A5" * 64 + b"\r")
+        rx_frame = bytes.fromhex("80 4C 0D 0F C8 FE 37 01 00 00 00 00") + b"\xA5" * 64
+        tx_event = bytes.fromhex("81 4C 0D 0F C8 FE 37 01 00 00 00 00") + b"\xA5" * 64
+        rx_data = self.dut.receive()
+        self.assertEqual(len(rx_data), len(b"\r" + tx_event + rx_frame))
+        self.assertIn(tx_event, rx_data)
+        self.assertIn(rx_frame, rx_data)
+
+        self.dut.send(b"C\r")
+        self.assertEqual(self.dut.receive(), b"\r")
+
+        # check return to ascii format
+        self.dut.send(b"H0\r")
+        self.assertEqual(self.dut.receive(), b"\r")
+        self.dut.send(b"=\r")
+        self.assertEqual(self.dut.receive(), b"\r")
+        self.dut.send(b"t03F0\r")
+        rx_data = self.dut.receive()
+        self.assertEqual(len(rx_data), len(b"\r" + b"zt03F0\r" + b"t03F0\r"))
+        self.dut.send(b"C\r")
+        self.assertEqual(self.dut.receive(), b"\r")
+
+
     def test_filter_basic(self):
         cmd_send_std = (b"r", b"t", b"d", b"b")
         cmd_send_ext = (b"R", b"T", b"D", b"B")
@@ -734,6 +874,149 @@ class LoopbackTestCase(unittest.TestCase):
         self.assertEqual(self.dut.receive(), b"\r")
         
 
+    def test_filter_list(self):
+        # check pass 0x100-0x10F, 0x200, 0x300 and EXT ID 0x18DB0000-0x18DBFFFF in CAN loopback mode
+        for cmd in (b"w000100000100000007F0\r", b"w00130000020000000300\r", b"w100118DB00001FFF0000\r"):
+            self.dut.send(cmd)
+            self.assertEqual(self.dut.receive(), b"\r")
+        self.dut.send(b"=\r")
+        self.assertEqual(self.dut.receive(), b"\r")
+        for cmd, ret in ((b"t1000", True), (b"t10F0", True), (b"t1100", False), (b"t2000", True),
+                         (b"t3000", True), (b"t3010", False), (b"T18DB12340", True), (b"T18DC00000", False),
+                         (b"T000001000", False)):
+            self.dut.send(cmd + b"\r")
+            pre = b"z\r" if cmd[0:1] == b"t" else b"Z\r"
+            self.assertEqual(self.dut.receive(), pre + (cmd + b"\r" if ret else b""))
+        self.dut.send(b"C\r")
+        self.assertEqual(self.dut.receive(), b"\r")
+
+        # check the code and mask filter is used again without entry
+        for cmd in (b"w0000\r", b"w0010\r", b"w1000\r"):
+            self.dut.send(cmd)
+            self.assertEqual(self.dut.receive(), b"\r")
+        self.dut.send(b"=\r")
+        self.assertEqual(self.dut.receive(), b"\r")
+        self.dut.send(b"t1100\r")
+        self.assertEqual(self.dut.receive(), b"z\rt1100\r")
+        self.dut.send(b"C\r")
+        self.assertEqual(self.dut.receive(), b"\r")
+
+
+    def test_filter_bitmap(self):
+        # check pass STD ID 0x100 and 0x200-0x2FF in CAN loopback mode
+        for cmd in (b"a1100100\r", b"a12002FF\r", b"a1\r"):
+            self.dut.send(cmd)
+            self.assertEqual(self.dut.receive(), b"\r")
+        self.dut.send(b"=\r")
+        self.assertEqual(self.dut.receive(), b"\r")
+        for cmd, ret in ((b"t1000", True), (b"t1010", False), (b"t2000", True), (b"t2FF0", True),
+                         (b"t3000", False), (b"T000001010", True)):
+            self.dut.send(cmd + b"\r")
+            pre = b"z\r" if cmd[0:1] == b"t" else b"Z\r"
+            self.assertEqual(self.dut.receive(), pre + (cmd + b"\r" if ret else b""))
+        self.dut.send(b"a\r")
+        self.assertEqual(self.dut.receive(), b"a: enabled=1, ids=257, rejected=2\r")
+        self.dut.send(b"C\r")
+        self.assertEqual(self.dut.receive(), b"\r")
+
+        # restore default
+        for cmd in (b"a0\r", b"a00007FF\r"):
+            self.dut.send(cmd)
+            self.assertEqual(self.dut.receive(), b"\r")
+
+
+    def test_filter_hash(self):
+        # check pass EXT ID 0x18FEF100 and PGN 0xFECA in CAN loopback mode
+        for cmd in (b"h118FEF100\r", b"h30000FECA\r", b"h1\r"):
+            self.dut.send(cmd)
+            self.assertEqual(self.dut.receive(), b"\r")
+        self.dut.send(b"=\r")
+        self.assertEqual(self.dut.receive(), b"\r")
+        for cmd, ret in ((b"T18FEF1000", True), (b"T18FEF1010", False), (b"T0CFECA050", True),
+                         (b"T18FECB050", False), (b"t1000", True)):
+            self.dut.send(cmd + b"\r")
+            pre = b"z\r" if cmd[0:1] == b"t" else b"Z\r"
+            self.assertEqual(self.dut.receive(), pre + (cmd + b"\r" if ret else b""))
+        self.dut.send(b"h\r")
+        self.assertEqual(self.dut.receive(), b"h: mode=1, entries=2/256, max_probes=1, frames=4, probes=7, rejected=2\r")
+        self.dut.send(b"C\r")
+        self.assertEqual(self.dut.receive(), b"\r")
+
+        # check deny list
+        self.dut.send(b"h2\r")
+        self.assertEqual(self.dut.receive(), b"\r")
+        self.dut.send(b"=\r")
+        self.assertEqual(self.dut.receive(), b"\r")
+        for cmd, ret in ((b"T18FEF1000", False), (b"T18FEF1010", True), (b"T0CFECA050", False)):
+            self.dut.send(cmd + b"\r")
+            self.assertEqual(self.dut.receive(), b"Z\r" + (cmd + b"\r" if ret else b""))
+        self.dut.send(b"C\r")
+        self.assertEqual(self.dut.receive(), b"\r")
+
+        # restore default
+        for cmd in (b"h0\r", b"h3\r"):
+            self.dut.send(cmd)
+            self.assertEqual(self.dut.receive(), b"\r")
+
+
+    def test_filter_data(self):
+        # check pass STD ID 0x123 with byte 0 of 0x02 or 0x05 and 0x7E8 with byte 1 of 0x62 in CAN loopback mode
+        for cmd in (b"p0100000123000007FF1FF02\r", b"p1100000123000007FF1FF05\r", b"p21000007E8000007FF200FF0062\r"):
+            self.dut.send(cmd)
+            self.assertEqual(self.dut.receive(), b"\r")
+        self.dut.send(b"=\r")
+        self.assertEqual(self.dut.receive(), b"\r")
+        for cmd, ret in ((b"t123102", True), (b"t123105", True), (b"t123103", False), (b"t1230", False),
+                         (b"r1231", False), (b"t124103", True), (b"t7E83036255", True), (b"t7E83036055", False),
+                         (b"T000001231FF", True)):
+            self.dut.send(cmd + b"\r")
+            pre = b"z\r" if cmd[0:1] in (b"t", b"r") else b"Z\r"
+            self.assertEqual(self.dut.receive(), pre + (cmd + b"\r" if ret else b""))
+        self.dut.send(b"p\r")
+        self.assertEqual(self.dut.receive(), b"p: rules=07, rejected=4\r")
+        self.dut.send(b"C\r")
+        self.assertEqual(self.dut.receive(), b"\r")
+
+        # restore default
+        for cmd in (b"p00\r", b"p10\r", b"p20\r"):
+            self.dut.send(cmd)
+            self.assertEqual(self.dut.receive(), b"\r")
+
+
+    def test_change_only(self):
+        # check report of changed frames in CAN loopback mode
+        self.dut.send(b"u1\r")
+        self.assertEqual(self.dut.receive(), b"\r")
+        self.dut.send(b"=\r")
+        self.assertEqual(self.dut.receive(), b"\r")
+        for cmd, ret in ((b"t1231AA", True), (b"t1231AA", False), (b"t1231AB", True), (b"t1232AB00", True),
+                         (b"t1232AB00", False), (b"r1232", True), (b"T000001232AB00", True), (b"t1232AB00", True)):
+            self.dut.send(cmd + b"\r")
+            pre = b"z\r" if cmd[0:1] in (b"t", b"r") else b"Z\r"
+            self.assertEqual(self.dut.receive(), pre + (cmd + b"\r" if ret else b""))
+        self.dut.send(b"u\r")
+        self.assertEqual(self.dut.receive(), b"u: enabled=1, keepalive=00000000, ids=2/96, suppressed=2, kept=0, untracked=0\r")
+        self.dut.send(b"C\r")
+        self.assertEqual(self.dut.receive(), b"\r")
+
+        # check keep-alive every 3 frames
+        self.dut.send(b"u100000003\r")
+        self.assertEqual(self.dut.receive(), b"\r")
+        self.dut.send(b"=\r")
+        self.assertEqual(self.dut.receive(), b"\r")
+        for idx in range(0, 7):
+            self.dut.send(b"t1231AA\r")
+            self.assertEqual(self.dut.receive(), b"z\r" + (b"t1231AA\r" if idx % 3 == 0 else b""))
+        self.dut.send(b"u\r")
+        self.assertEqual(self.dut.receive(), b"u: enabled=1, keepalive=00000003, ids=1/96, suppressed=4, kept=2, untracked=0\r")
+        self.dut.send(b"C\r")
+        self.assertEqual(self.dut.receive(), b"\r")
+
+        # restore default
+        self.dut.send(b"u0\r")
+        self.assertEqual(self.dut.receive(), b"\r")
+
+
     def test_filter_every_bits(self):
         # receive std
         self.dut.send(b"M80000000\r")
@@ -36,6 +36,20 @@ class SlcanTestCase(unittest.TestCase):
         self.assertEqual(self.dut.receive(), b"\a")
 
 
+    def test_long_command(self):
+        # check response to a command split across usb packets
+        self.dut.send(b"\r" * 63 + b"O\r")
+        self.assertEqual(self.dut.receive(), b"\r" * 64)
+        self.dut.send(b"C\r")
+        self.assertEqual(self.dut.receive(), b"\r")
+
+        # check response to a command longer than the buffer
+        self.dut.send(b"t" + b"0" * 200 + b"\r")
+        self.assertEqual(self.dut.receive(), b"\a")
+        self.dut.send(b"\r")
+        self.assertEqual(self.dut.receive(), b"\r")
+
+
     def test_V_command(self):
         # check response to V
         self.dut.send(b"V\r")
@@ -353,7 +367,7 @@ class SlcanTestCase(unittest.TestCase):
         for idx in range(0, 10):
             cmd = "Z" + str(idx) + "\r"
             self.dut.send(cmd.encode())
-            if idx in range(0, 3):
+            if idx in range(0, 5):
                 self.assertEqual(self.dut.receive(), b"\r")
             else:
                 self.assertEqual(self.dut.receive(), b"\a")
@@ -390,7 +404,7 @@ class SlcanTestCase(unittest.TestCase):
         for idx in range(0, 10):
             cmd = "z" + str(idx) + "000\r"
             self.dut.send(cmd.encode())
-            if idx in range(0, 3):
+            if idx in range(0, 5):
                 self.assertEqual(self.dut.receive(), b"\r")
             else:
                 self.assertEqual(self.dut.receive(), b"\a")
@@ -424,6 +438,35 @@ class SlcanTestCase(unittest.TestCase):
         self.assertEqual(self.dut.receive(), b"\a")
 
 
+    def test_H_command(self):
+        # check response with CAN port closed
+        for idx in range(0, 10):
+            cmd = "H" + str(idx) + "\r"
+            self.dut.send(cmd.encode())
+            if idx in range(0, 2):
+                self.assertEqual(self.dut.receive(), b"\r")
+            else:
+                self.assertEqual(self.dut.receive(), b"\a")
+
+        # check response in CAN normal mode
+        self.dut.send(b"O\r")
+        self.assertEqual(self.dut.receive(), b"\r")
+        for idx in range(0, 10):
+            cmd = "H" + str(idx) + "\r"
+            self.dut.send(cmd.encode())
+            self.assertEqual(self.dut.receive(), b"\a")
+        self.dut.send(b"C\r")
+        self.assertEqual(self.dut.receive(), b"\r")
+
+        # invalid format
+        self.dut.send(b"H\r")
+        self.assertEqual(self.dut.receive(), b"\a")
+        self.dut.send(b"H00\r")
+        self.assertEqual(self.dut.receive(), b"\a")
+        self.dut.send(b"HG\r")
+        self.assertEqual(self.dut.receive(), b"\a")
+
+
     def test_F_command(self):
         # check response with CAN port closed
         self.dut.send(b"F\r")
@@ -599,6 +642,217 @@ class SlcanTestCase(unittest.TestCase):
         self.assertEqual(self.dut.receive(), b"\a")
 
 
+    def test_w_command(self):
+        # check no entry by default
+        self.dut.send(b"w\r")
+        self.assertEqual(self.dut.receive(), b"w00000000-00\r")
+
+        # check response with CAN port closed
+        for cmd, ret in ((b"w000100000100000007F0\r", b"\r"), (b"w01A30000000100000200\r", b"\r"),
+                         (b"w10020000000000001000\r", b"\r"), (b"w01B100000100000007F0\r", b"\a"),
+                         (b"w10720000000000001000\r", b"\a"), (b"w20020000000000001000\r", b"\a"),
+                         (b"w00120000020000000100\r", b"\a"), (b"w00110000080000000000\r", b"\a"),
+                         (b"w00140000010000000200\r", b"\a")):
+            self.dut.send(cmd)
+            self.assertEqual(self.dut.receive(), ret)
+        self.dut.send(b"w\r")
+        self.assertEqual(self.dut.receive(), b"w04000001-01\r")
+        self.dut.send(b"w000\r")
+        self.assertEqual(self.dut.receive(), b"w000100000100000007F0\r")
+        self.dut.send(b"w100\r")
+        self.assertEqual(self.dut.receive(), b"w10020000000000001000\r")
+        self.dut.send(b"w001\r")
+        self.assertEqual(self.dut.receive(), b"\a")
+
+        # check response in CAN normal mode
+        self.dut.send(b"O\r")
+        self.assertEqual(self.dut.receive(), b"\r")
+        self.dut.send(b"w0000\r")
+        self.assertEqual(self.dut.receive(), b"\a")
+        self.dut.send(b"w000\r")
+        self.assertEqual(self.dut.receive(), b"w000100000100000007F0\r")
+        self.dut.send(b"C\r")
+        self.assertEqual(self.dut.receive(), b"\r")
+
+        # invalid format
+        self.dut.send(b"w00\r")
+        self.assertEqual(self.dut.receive(), b"\a")
+        self.dut.send(b"w000100000100000007F\r")
+        self.assertEqual(self.dut.receive(), b"\a")
+        self.dut.send(b"w000G\r")
+        self.assertEqual(self.dut.receive(), b"\a")
+
+        # restore default
+        for cmd in (b"w0000\r", b"w01A0\r", b"w1000\r"):
+            self.dut.send(cmd)
+            self.assertEqual(self.dut.receive(), b"\r")
+        self.dut.send(b"w\r")
+        self.assertEqual(self.dut.receive(), b"w00000000-00\r")
+
+
+    def test_a_command(self):
+        # check default state
+        self.dut.send(b"a\r")
+        self.assertEqual(self.dut.receive(), b"a: enabled=0, ids=0, rejected=0\r")
+
+        # check response to ranges and blocks
+        block = b"00000000FFFFFFFF" + b"0" * 40 + b"00000001"
+        for cmd, ret in ((b"a11231FF\r", b"\r"), (b"a0130140\r", b"\r"), (b"a21" + block + b"\r", b"\r"),
+                         (b"a11FF123\r", b"\a"), (b"a1000800\r", b"\a"), (b"a2123100\r", b"\a"),
+                         (b"a28\r", b"\a"), (b"a21" + block[1:] + b"\r", b"\a")):
+            self.dut.send(cmd)
+            self.assertEqual(self.dut.receive(), ret)
+        self.dut.send(b"a21\r")
+        self.assertEqual(self.dut.receive(), b"a21" + block + b"\r")
+        self.dut.send(b"a\r")
+        self.assertEqual(self.dut.receive(), b"a: enabled=0, ids=33, rejected=0\r")
+
+        # check response to enable in CAN normal mode
+        self.dut.send(b"O\r")
+        self.assertEqual(self.dut.receive(), b"\r")
+        self.dut.send(b"a1\r")
+        self.assertEqual(self.dut.receive(), b"\r")
+        self.dut.send(b"a\r")
+        self.assertEqual(self.dut.receive(), b"a: enabled=1, ids=33, rejected=0\r")
+        self.dut.send(b"C\r")
+        self.assertEqual(self.dut.receive(), b"\r")
+
+        # invalid format
+        self.dut.send(b"a3\r")
+        self.assertEqual(self.dut.receive(), b"\a")
+        self.dut.send(b"a000\r")
+        self.assertEqual(self.dut.receive(), b"\a")
+        self.dut.send(b"aG\r")
+        self.assertEqual(self.dut.receive(), b"\a")
+
+        # restore default
+        for cmd in (b"a0\r", b"a00007FF\r"):
+            self.dut.send(cmd)
+            self.assertEqual(self.dut.receive(), b"\r")
+
+
+    def test_h_command(self):
+        # check default state
+        self.dut.send(b"h\r")
+        self.assertEqual(self.dut.receive(), b"h: mode=0, entries=0/256, max_probes=0, frames=0, probes=0, rejected=0\r")
+
+        # check response to entries
+        for cmd, ret in ((b"h118FEF100\r", b"\r"), (b"h118FEF100\r", b"\r"), (b"h30000FECA\r", b"\r"),
+                         (b"h120000000\r", b"\a"), (b"h300040000\r", b"\a"), (b"h01FFFFFFF\r", b"\a"),
+                         (b"h418FEF100\r", b"\a")):
+            self.dut.send(cmd)
+            self.assertEqual(self.dut.receive(), ret)
+        self.dut.send(b"h\r")
+        self.assertEqual(self.dut.receive(), b"h: mode=0, entries=2/256, max_probes=1, frames=0, probes=0, rejected=0\r")
+
+        # check response to modes in CAN normal mode
+        self.dut.send(b"O\r")
+        self.assertEqual(self.dut.receive(), b"\r")
+        for mode in range(0, 3):
+            self.dut.send(b"h" + str(mode).encode() + b"\r")
+            self.assertEqual(self.dut.receive(), b"\r")
+        self.dut.send(b"h\r")
+        self.assertEqual(self.dut.receive(), b"h: mode=2, entries=2/256, max_probes=1, frames=0, probes=0, rejected=0\r")
+        self.dut.send(b"C\r")
+        self.assertEqual(self.dut.receive(), b"\r")
+
+        # check table full
+        self.dut.send(b"h3\r")
+        self.assertEqual(self.dut.receive(), b"\r")
+        for idx in range(0, 256):
+            self.dut.send(b"h1" + (f'{(idx << 16):08X}').encode() + b"\r")
+            self.assertEqual(self.dut.receive(), b"\r")
+        self.dut.send(b"h118FEF101\r")
+        self.assertEqual(self.dut.receive(), b"\a")
+
+        # invalid format
+        self.dut.send(b"h4\r")
+        self.assertEqual(self.dut.receive(), b"\a")
+        self.dut.send(b"h118FEF1\r")
+        self.assertEqual(self.dut.receive(), b"\a")
+        self.dut.send(b"hG\r")
+        self.assertEqual(self.dut.receive(), b"\a")
+
+        # restore default
+        for cmd in (b"h0\r", b"h3\r"):
+            self.dut.send(cmd)
+            self.assertEqual(self.dut.receive(), b"\r")
+
+
+    def test_p_command(self):
+        # check default state
+        self.dut.send(b"p\r")
+        self.assertEqual(self.dut.receive(), b"p: rules=00, rejected=0\r")
+
+        # check response to rules
+        rule0 = b"p0100000123000007FF1FF02"
+        rule7 = b"p7218FEF1001FFFFF008" + b"FF" * 8 + b"0102030405060708"
+        for cmd, ret in ((rule0 + b"\r", b"\r"), (rule7 + b"\r", b"\r"),
+                         (b"p1100000800000007FF1FF02\r", b"\a"), (b"p11000001230000FFFF1FF02\r", b"\a"),
+                         (b"p3300000123000007FF1FF02\r", b"\a"), (b"p810000012300000\r", b"\a"),
+                         (b"p1100000123000007FF9" + b"0" * 36 + b"\r", b"\a"), (rule0[:-1] + b"\r", b"\a")):
+            self.dut.send(cmd)
+            self.assertEqual(self.dut.receive(), ret)
+        for cmd, ret in ((b"p0\r", rule0 + b"\r"), (b"p7\r", rule7 + b"\r"), (b"p1\r", b"\a")):
+            self.dut.send(cmd)
+            self.assertEqual(self.dut.receive(), ret)
+        self.dut.send(b"p\r")
+        self.assertEqual(self.dut.receive(), b"p: rules=81, rejected=0\r")
+
+        # check response to rules in CAN normal mode
+        self.dut.send(b"O\r")
+        self.assertEqual(self.dut.receive(), b"\r")
+        self.dut.send(b"p1100000124000007FF0\r")
+        self.assertEqual(self.dut.receive(), b"\r")
+        self.dut.send(b"p10\r")
+        self.assertEqual(self.dut.receive(), b"\r")
+        self.dut.send(b"C\r")
+        self.assertEqual(self.dut.receive(), b"\r")
+
+        # invalid format
+        self.dut.send(b"p8\r")
+        self.assertEqual(self.dut.receive(), b"\a")
+        self.dut.send(b"p10\r")
+        self.assertEqual(self.dut.receive(), b"\a")
+        self.dut.send(b"pG\r")
+        self.assertEqual(self.dut.receive(), b"\a")
+
+        # restore default
+        for cmd in (b"p00\r", b"p70\r"):
+            self.dut.send(cmd)
+            self.assertEqual(self.dut.receive(), b"\r")
+
+
+    def test_u_command(self):
+        # check default state
+        self.dut.send(b"u\r")
+        self.assertEqual(self.dut.receive(), b"u: enabled=0, keepalive=00000000, ids=0/96, suppressed=0, kept=0, untracked=0\r")
+
+        # check response to modes
+        for cmd, ret in ((b"u1\r", b"\r"), (b"u103E8000A\r", b"\r"), (b"u0\r", b"\r"),
+                         (b"u2\r", b"\a"), (b"u003E8000A\r", b"\a"), (b"u103E800\r", b"\a")):
+            self.dut.send(cmd)
+            self.assertEqual(self.dut.receive(), ret)
+
+        # check response to enable in CAN normal mode
+        self.dut.send(b"O\r")
+        self.assertEqual(self.dut.receive(), b"\r")
+        self.dut.send(b"u103E8000A\r")
+        self.assertEqual(self.dut.receive(), b"\r")
+        self.dut.send(b"u\r")
+        self.assertEqual(self.dut.receive(), b"u: enabled=1, keepalive=03E8000A, ids=0/96, suppressed=0, kept=0, untracked=0\r")
+        self.dut.send(b"C\r")
+        self.assertEqual(self.dut.receive(), b"\r")
+
+        # invalid format
+        self.dut.send(b"uG\r")
+        self.assertEqual(self.dut.receive(), b"\a")
+
+        # restore default
+        self.dut.send(b"u0\r")
+        self.assertEqual(self.dut.receive(), b"\r")
+
+
     def test_Q_command(self):
         # check response to Q with CAN port closed
         for idx in range(0, 10):
@@ -645,6 +899,231 @@ class SlcanTestCase(unittest.TestCase):
         self.assertEqual(self.dut.receive(), b"\r")
 
 
+    def test_E_command(self):
+        # check default flush policy
+        self.dut.send(b"E\r")
+        self.assertEqual(self.dut.receive(), b"E00000\r")
+
+        # check response to E
+        for cmd, ret in ((b"E0\r", b"\r"), (b"E1\r", b"\a"), (b"E3\r", b"\a"),
+                         (b"E10000\r", b"\a"), (b"E10801\r", b"\a"), (b"E10040\r", b"\r"),
+                         (b"E20000\r", b"\a"), (b"E2C351\r", b"\a"), (b"E203E8\r", b"\r")):
+            self.dut.send(cmd)
+            self.assertEqual(self.dut.receive(), ret)
+        self.dut.send(b"E\r")
+        self.assertEqual(self.dut.receive(), b"E203E8\r")
+
+        # check frames are reported with flush policy
+        self.dut.send(b"=\r")
+        self.assertEqual(self.dut.receive(), b"\r")
+        self.dut.send(b"t03F0\r")
+        self.assertEqual(self.dut.receive(), b"z\rt03F0\r")
+        self.dut.send(b"C\r")
+        self.assertEqual(self.dut.receive(), b"\r")
+
+        # invalid format
+        self.dut.send(b"E00\r")
+        self.assertEqual(self.dut.receive(), b"\a")
+        self.dut.send(b"EG\r")
+        self.assertEqual(self.dut.receive(), b"\a")
+
+        # restore default
+        self.dut.send(b"E0\r")
+        self.assertEqual(self.dut.receive(), b"\r")
+
+
+    def test_c_command(self):
+        # check response to c
+        self.dut.send(b"c\r")
+        rx_data = self.dut.receive()
+        self.assertEqual(len(rx_data), len(b"cfff-xxxxxxxxxxxxxxxx-dddddddd\r"))
+        self.assertEqual(rx_data[0], b"c"[0])
+        frame = int(rx_data[1:4], 16)
+
+        # check the host clock goes on from the epoch
+        cmd = "c" + format(frame, "03X") + format(4000000, "016X") + "\r"
+        self.dut.send(cmd.encode())
+        self.assertEqual(self.dut.receive(), b"\r")
+        time.sleep(0.1)
+        self.dut.send(b"c\r")
+        rx_data = self.dut.receive()
+        elapsed = (int(rx_data[1:4], 16) - frame) % 2048
+        self.assertAlmostEqual(int(rx_data[5:21], 16), 4000000 + elapsed * 1000, delta=100)
+
+        # check the frames are reported with the host clock
+        self.dut.send(b"Z4\r")
+        self.assertEqual(self.dut.receive(), b"\r")
+        self.dut.send(b"Z\r")
+        rx_data = self.dut.receive()
+        self.assertEqual(len(rx_data), len(b"Zxxxxxxxxxxxxxxxx\r"))
+        self.assertGreater(int(rx_data[1:17], 16), 4000000)
+
+        # invalid format
+        self.dut.send(b"c000\r")
+        self.assertEqual(self.dut.receive(), b"\a")
+        self.dut.send(b"c8000000000000000000\r")
+        self.assertEqual(self.dut.receive(), b"\a")
+        self.dut.send(b"cG\r")
+        self.assertEqual(self.dut.receive(), b"\a")
+
+        # restore default
+        self.dut.send(b"Z0\r")
+        self.assertEqual(self.dut.receive(), b"\r")
+
+
+    def test_J_command(self):
+        # check default transmit order
+        self.dut.send(b"J\r")
+        self.assertEqual(self.dut.receive(), b"J0\r")
+
+        # check response with CAN port closed
+        for idx in range(0, 10):
+            cmd = "J" + str(idx) + "\r"
+            self.dut.send(cmd.encode())
+            if idx in range(0, 2):
+                self.assertEqual(self.dut.receive(), b"\r")
+            else:
+                self.assertEqual(self.dut.receive(), b"\a")
+        self.dut.send(b"J\r")
+        self.assertEqual(self.dut.receive(), b"J1\r")
+
+        # check frames are sent in priority order in CAN loopback mode
+        self.dut.send(b"z0002\r")
+        self.assertEqual(self.dut.receive(), b"\r")
+        self.dut.send(b"=\r")
+        self.assertEqual(self.dut.receive(), b"\r")
+        self.dut.send(b"J0\r")
+        self.assertEqual(self.dut.receive(), b"\a")
+        self.dut.send(b"t7001AA\rt7001BB\rT000000001CC\rt0001DD\r")
+        self.assertEqual(self.dut.receive(), b"\r\r\r\rzt0001DD\rZT000000001CC\rzt7001AA\rzt7001BB\r")
+
+        # check format of residency time
+        self.dut.send(b"j\r")
+        rx_data = self.dut.receive()
+        self.assertEqual(len(rx_data), len(b"j: tx_order=PRIO, residency_ave_us=[00000, 00000, 00000, 00000], residency_max_us=[00000, 00000, 00000, 00000]\r"))
+        self.assertEqual(rx_data[:17], b"j: tx_order=PRIO,")
+        self.dut.send(b"C\r")
+        self.assertEqual(self.dut.receive(), b"\r")
+
+        # invalid format
+        self.dut.send(b"J00\r")
+        self.assertEqual(self.dut.receive(), b"\a")
+        self.dut.send(b"JG\r")
+        self.assertEqual(self.dut.receive(), b"\a")
+        self.dut.send(b"j0\r")
+        self.assertEqual(self.dut.receive(), b"\a")
+
+        # restore default
+        self.dut.send(b"J0\r")
+        self.assertEqual(self.dut.receive(), b"\r")
+        self.dut.send(b"z0001\r")
+        self.assertEqual(self.dut.receive(), b"\r")
+
+
+    def test_K_command(self):
+        # check no entry by default
+        self.dut.send(b"K\r")
+        self.assertEqual(self.dut.receive(), b"K0000\r")
+        self.dut.send(b"K0\r")
+        self.assertEqual(self.dut.receive(), b"\a")
+
+        # check entry with 1s period
+        self.dut.send(b"K0000F424000000000t1232AABB\r")
+        self.assertEqual(self.dut.receive(), b"\r")
+        self.dut.send(b"K0\r")
+        self.assertEqual(self.dut.receive(), b"K0000F424000000000t1232AABB\r")
+        self.dut.send(b"K\r")
+        self.assertEqual(self.dut.receive(), b"K0001\r")
+
+        # check frames are sent with the period in CAN loopback mode
+        self.dut.send(b"=\r")
+        self.assertEqual(self.dut.receive(), b"\rt1232AABB\r")
+        self.dut.send(b"k0CCDD\r")
+        self.assertEqual(self.dut.receive(), b"\r")
+        time.sleep(1)
+        self.assertEqual(self.dut.receive(), b"t1232CCDD\r")
+
+        # check format of jitter
+        self.dut.send(b"k0\r")
+        rx_data = self.dut.receive()
+        self.assertEqual(rx_data[:33], b"k: entry=0, frames=2, jitter_us=[")
+        self.dut.send(b"C\r")
+        self.assertEqual(self.dut.receive(), b"\r")
+
+        # invalid format
+        self.dut.send(b"K0000F4240000F4240t1232AABB\r")    # phase not shorter than period
+        self.assertEqual(self.dut.receive(), b"\a")
+        self.dut.send(b"K00000006300000000t1232AABB\r")    # period too short
+        self.assertEqual(self.dut.receive(), b"\a")
+        self.dut.send(b"K0000F424000000000t1232AA\r")
+        self.assertEqual(self.dut.receive(), b"\a")
+        self.dut.send(b"KG000F424000000000t1232AABB\r")
+        self.assertEqual(self.dut.receive(), b"\a")
+        self.dut.send(b"k0CC\r")
+        self.assertEqual(self.dut.receive(), b"\a")
+        self.dut.send(b"k1\r")
+        self.assertEqual(self.dut.receive(), b"\a")
+
+        # remove entry
+        self.dut.send(b"K000000000\r")
+        self.assertEqual(self.dut.receive(), b"\r")
+        self.dut.send(b"K000000000\r")
+        self.assertEqual(self.dut.receive(), b"\a")
+        self.dut.send(b"K\r")
+        self.assertEqual(self.dut.receive(), b"K0000\r")
+
+
+    def test_G_command(self):
+        # check response with CAN port closed
+        self.dut.send(b"Gt1232AABB\r")
+        self.assertEqual(self.dut.receive(), b"\a")
+
+        # check single ack with the number of frames in CAN loopback mode
+        self.dut.send(b"=\r")
+        self.assertEqual(self.dut.receive(), b"\r")
+        self.dut.send(b"Gt1232AABBT000000011CCr1230d1239001122334455667788990011\r")
+        self.assertEqual(self.dut.receive(), b"G04\rt1232AABB\rT000000011CC\rr1230\rd1239001122334455667788990011\r")
+
+        # check batch across USB packets
+        self.dut.send(b"G" + b"t12380011223344556677" * 24 + b"\r")
+        self.assertEqual(self.dut.receive(), b"G18\r" + b"t12380011223344556677\r" * 24)
+
+        # check no frame is sent from an invalid batch
+        self.dut.send(b"Gt1232AABBt1239AABB\r")
+        self.assertEqual(self.dut.receive(), b"\a")
+        self.dut.send(b"Gt1232AABBt123\r")
+        self.assertEqual(self.dut.receive(), b"\a")
+        self.dut.send(b"Gt1232AABBX\r")
+        self.assertEqual(self.dut.receive(), b"\a")
+        self.dut.send(b"G\r")
+        self.assertEqual(self.dut.receive(), b"\a")
+        self.dut.send(b"G" + b"t12380011223344556677" * 25 + b"\r")
+        self.assertEqual(self.dut.receive(), b"\a")
+
+        self.dut.send(b"C\r")
+        self.assertEqual(self.dut.receive(), b"\r")
+
+
+    def test_debug_command(self):
+        # check format of cycle time and frames per pass
+        self.dut.send(b"?\r")
+        rx_data = self.dut.receive()
+        self.assertEqual(len(rx_data), len(b"?00-00-00-00\r"))
+        self.assertEqual(rx_data[0], b"?\r"[0])
+
+        # check frames are counted in CAN loopback mode
+        self.dut.send(b"=\r")
+        self.assertEqual(self.dut.receive(), b"\r")
+        self.dut.send(b"t03F0\r")
+        self.dut.receive()
+        self.dut.send(b"?\r")
+        rx_data = self.dut.receive()
+        self.assertEqual(len(rx_data), len(b"?00-00-00-00\r"))
+        self.assertGreaterEqual(int(rx_data[10:12], 16), 1)
+        self.dut.send(b"C\r")
+        self.assertEqual(self.dut.receive(), b"\r")
+
+
     def test_send_command(self):
         cmd_send_std = (b"r", b"t", b"d", b"b")
         cmd_send_ext = (b"R", b"T", b"D", b"B")